@@ -9,7 +9,7 @@ REM 检查 g++ (MinGW)
 where g++ >nul 2>&1
 if %ERRORLEVEL% == 0 (
     echo Found MinGW g++, compiling...
-    g++ -O2 -Wall -o mouse_monitor.exe mouse_monitor.cpp -luser32 -static
+    g++ -O2 -std=c++17 -Wall -o mouse_monitor.exe mouse_monitor.cpp -luser32 -static
     goto :check_result
 )
 
@@ -17,7 +17,7 @@ REM 尝试使用 Visual Studio 2022
 if exist "C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build\vcvars64.bat" (
     echo Found VS2022, compiling...
     call "C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build\vcvars64.bat" >nul 2>&1
-    cl /EHsc /O2 /W3 mouse_monitor.cpp /link user32.lib /out:mouse_monitor.exe
+    cl /EHsc /O2 /W3 /std:c++17 mouse_monitor.cpp /link user32.lib /out:mouse_monitor.exe
     del mouse_monitor.obj 2>nul
     goto :check_result
 )
@@ -26,7 +26,7 @@ REM 尝试使用 Visual Studio 2019
 if exist "C:\Program Files (x86)\Microsoft Visual Studio\2019\Community\VC\Auxiliary\Build\vcvars64.bat" (
     echo Found VS2019, compiling...
     call "C:\Program Files (x86)\Microsoft Visual Studio\2019\Community\VC\Auxiliary\Build\vcvars64.bat" >nul 2>&1
-    cl /EHsc /O2 /W3 mouse_monitor.cpp /link user32.lib /out:mouse_monitor.exe
+    cl /EHsc /O2 /W3 /std:c++17 mouse_monitor.cpp /link user32.lib /out:mouse_monitor.exe
     del mouse_monitor.obj 2>nul
     goto :check_result
 )
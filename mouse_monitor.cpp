@@ -10,46 +10,183 @@
  * - 检测到鼠标移动时自动按下左键，停止移动时松开
  *
  * 编译：
- *   cl /EHsc /O2 mouse_monitor.cpp /link user32.lib /out:mouse_monitor.exe
+ *   cl /EHsc /O2 /std:c++17 mouse_monitor.cpp /link user32.lib /out:mouse_monitor.exe
+ *   g++ -O2 -std=c++17 -pthread -o mouse_monitor mouse_monitor.cpp    (Linux，evdev 输入，仅用于回放/profiling)
+ *
+ * 命令行参数：
+ *   --ipc                 供 GUI 使用的 stdin/stdout 行协议
+ *   --ipc=binary          同上，改用带长度前缀的版本化二进制帧（格式见 AppendFrameHeader）
+ *   --ipc-dump            把 stdin 上的二进制事件帧转成文本行输出（核对两种编码）
+ *   --ipc-bench <n>       文本命令解析基准：循环 n 轮，输出每条命令耗时与堆分配次数（分配计数需以
+ *                         -DIPC_BENCH_ALLOC_COUNT 编译，默认构建不替换全局 operator new）；
+ *                         并核对各 stdin 编码（UTF-8/UTF-16LE/BE，有无 BOM）的解码结果与吞吐
+ *   --lock-bench <n>      锁定状态机：两个触发器上 n 个随机事件，各自与参考模型逐步比对，再测每事件耗时；不一致时返回 1
+ *   --output-rate <r>     光标输出节奏：passthrough（默认，每批送出）| refresh（显示器刷新率）| 频率 Hz；
+ *                         其间的移动累加后按精确定时送出，按键变化不受影响
+ *   --inject-bench <sec>  按 1/4/8 kHz 模拟 sec 秒输入，比较逐包 SetCursorPos、每批 SendInput 与 1 kHz 输出节奏的注入调用次数
+ *   --scan-min <counts>   自动注册：领先设备至少移动这么多计数才可提前判定（默认 400）
+ *   --scan-confidence <p> 自动注册：领先设备占全部扫描移动的比例达到 p 即判定（默认 0.8，0 = 只按 2000 计数的总量）
+ *   --scan-bench <file>   用录制的 trace 比较两种注册判定规则的耗时后退出
+ *   --settings <path>     指定 settings.json 路径
+ *   --settings-bench <n>  生成含 n 个 profile / 设备的 settings.json，测结构索引与一次灵敏度变更的拼接耗时后退出
+ *   --writer-timeout <ms> writer.exe 单次最长等待（默认 5000），超时即结束该进程
+ *   --writer-retries <n>  writer.exe 失败或超时后的重试次数（默认 0，最多 5）；期间有更新的目标则不再重试
+ *   --writer-helper <exe> 改用常驻 helper（以 "<exe> --writer-serve" 启动）经管道应用配置，起不来时退回 writer.exe；
+ *                         不接受 self：替身只校验 JSON、不接触驱动，仅供 --writer-bench 内部使用
+ *   --writer-serve        helper 替身：在 stdin/stdout 上按 helper 协议应答，只校验 JSON；
+ *                         真正的 helper 须实现的协议见“writer 后端”一节（TAURI_GUI.md 亦有说明）
+ *   --writer-apply <file> 单次替身：校验 file 后退出，用法同 writer.exe
+ *   --writer-bench <n>    以替身比较每次启动与常驻 helper（路径/全文请求）的应用耗时，并验证崩溃后重启
+ *   --startup-trace       启动后向 stderr 输出各启动阶段（settings / devices / input_open）及到 INPUT_READY 的耗时
+ *   --trigger <hwid>[=s]  额外的触发鼠标（最多 3 个，可重复）：各自一台锁定状态机，灵敏度 s 写入专属 profile
+ *   --ignore <hwid>       忽略该设备的所有输入（不算“其他鼠标”，也不参与注册）；可重复
+ *   --no-raw-batch        关闭 GetRawInputBuffer 批量读取
+ *   --record <file>       把收到的鼠标包录制为二进制 trace
+ *   --replay <file>       用 trace 代替真实鼠标输入（不注入光标/按键）
+ *   --replay-realtime     回放时按原始时间间隔（默认尽快回放，状态机按录制时间戳的虚拟时钟运行）
+ *   --evdev <path>        (Linux) 指定输入设备 /dev/input/eventN，或录制的 input_event 文件；可重复
+ *   --metrics <file>      定期把各阶段延迟分位数与每设备包速率写入 JSON 文件
+ *   --metrics-interval <ms>  指标文件写入间隔（默认 1000）
+ *   --sched <profile>     输入线程调度：default | games | proaudio | fifo[:prio] | nice[:value]
+ *   --cpu <n>             输入线程绑定到 CPU n
+ *   --mlock               锁定内存（Linux mlockall；Windows 提高最小工作集）
+ *   --sched-probe <sec>   满载下对比默认调度与 --sched 配置的唤醒延迟后退出
  *
  * 使用前提：
  *   需要在 settings.json 中添加 "setExtraInfo": true
  */
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
-#include <stdio.h>
 #include <conio.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+#include <stdio.h>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <sstream>
 #include <cctype>
 #include <cerrno>
+#include <charconv>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cmath>
+#include <initializer_list>
 #include <iostream>
+#include <memory>
+#include <new>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
+#include <system_error>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#ifndef _WIN32
+// ========== POSIX 兼容层 ==========
+// 核心逻辑沿用 Win32 的类型和少量 API 名称；Linux 构建在这里给出等价实现，
+// 使注册扫描/状态机/settings 处理与 Windows 版共用同一份代码。
+typedef uint32_t DWORD;
+typedef long LONG;
+typedef unsigned long ULONG;
+typedef unsigned short USHORT;
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef long long LONGLONG;
+typedef void* HANDLE;
+typedef union { LONGLONG QuadPart; } LARGE_INTEGER;
+
+const USHORT MOUSE_MOVE_ABSOLUTE = 0x01;
+#ifndef MAX_PATH
+#define MAX_PATH 4096
+#endif
+
+// 高精度计数器：纳秒（与 evdev 的 CLOCK_MONOTONIC 时间戳同一时基）
+static inline int QueryPerformanceFrequency(LARGE_INTEGER* freq) {
+    freq->QuadPart = 1000000000LL;
+    return 1;
+}
+
+static inline int QueryPerformanceCounter(LARGE_INTEGER* counter) {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    counter->QuadPart = static_cast<LONGLONG>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+    return 1;
+}
+
+static inline void Sleep(DWORD ms) {
+    timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = static_cast<long>(ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+static inline UINT GetDoubleClickTime() { return 500; }
+
+extern char** environ;
+
+static inline int DeleteFileA(const char* path) { return unlink(path) == 0; }
+
+template <size_t N>
+static inline void wcscpy_s(wchar_t (&dst)[N], const wchar_t* src) {
+    wcsncpy(dst, src, N - 1);
+    dst[N - 1] = L'\0';
+}
+#endif
+
 // ========== 全局变量 ==========
+#ifdef _WIN32
 HWND g_hWnd = NULL;
+#endif
 
 // 状态机定义
 enum class LockState { IDLE, LOCKED, UNLOCKABLE };
 
+// 其他线程交给状态机所有者（输入线程）的命令，见 SendLockCommand
+enum LockCommand : uint8_t {
+    LOCK_CMD_TIMER,    // 主循环定时器到期：检查 LOCKED → UNLOCKABLE
+    LOCK_CMD_DISABLE,  // 关闭功能：松开左键并进入冷却
+    LOCK_CMD_RESET,    // 完整重置：松开左键，清除冷却与移动记录
+};
+
 // 线程安全的原子变量
 std::atomic<bool> g_running(true);
 std::atomic<bool> g_ipcMode(false);
 std::atomic<bool> g_powerEnabled(false);
 std::atomic<bool> g_featureEnabled(false);
-std::atomic<bool> g_isMouseDown(false);
-std::atomic<DWORD> g_lastRegisteredMoveTime(0);  // 注册鼠标最后移动时间
-std::atomic<DWORD> g_cooldownUntil(0);           // 冷却期结束时间
-std::atomic<LockState> g_lockState(LockState::IDLE);
 std::atomic<bool> g_otherMouseActive(false);     // 其他鼠标是否活跃
 
 LONG g_moveCount = 0;
@@ -63,39 +200,169 @@ std::atomic<HANDLE> g_pendingDevice(nullptr);
 std::atomic<bool> g_registrationMode(true);
 wchar_t g_pendingDevicePath[512];
 wchar_t g_registeredDevicePath[512];
+// 注册鼠标的硬件ID：注册判定（IPC 为输入线程，CLI 为主线程）写入、重置时清空，输入线程归类新句柄时读取。
+// 只经 RegisteredHardwareId / SetRegisteredHardwareId 在锁内整体复制，读者拿到的是完整快照
+std::mutex g_registeredHardwareIdMutex;
 std::string g_registeredHardwareId;
-double g_currentSensitivity = 1.0;
+
+static std::string RegisteredHardwareId() {
+    std::lock_guard<std::mutex> lock(g_registeredHardwareIdMutex);
+    return g_registeredHardwareId;
+}
+
+static void SetRegisteredHardwareId(const std::string& id) {
+    std::lock_guard<std::mutex> lock(g_registeredHardwareIdMutex);
+    g_registeredHardwareId = id;
+}
+
+std::atomic<double> g_currentSensitivity(1.0);  // 主线程读写；控制台修改由应用线程在生效后写入
+
+// 多设备：0 号触发器是注册鼠标，其余由 --trigger 配置；--ignore 的设备整包丢弃，其他设备都是观察者
+enum DeviceRole : uint8_t {
+    DEVICE_ROLE_OBSERVER,  // “其他鼠标”：移动可释放 UNLOCKABLE 的触发器
+    DEVICE_ROLE_TRIGGER,   // 驱动自己的锁定状态机
+    DEVICE_ROLE_IGNORED,   // 噪声设备
+    DEVICE_ROLE_UNKNOWN,   // 尚未按硬件 ID 归类（新句柄或已拔出的句柄）
+};
+
+const unsigned kMaxTriggers = 4;
+
+struct ConfiguredDevice {
+    std::string hardwareId;    // 启动时按硬件 ID 解析为设备句柄
+    double sensitivity = 1.0;  // 仅触发器使用
+};
+
+std::vector<ConfiguredDevice> g_extraTriggers;  // 触发器 1..kMaxTriggers-1
+std::vector<ConfiguredDevice> g_ignoredDevices;
 std::string g_settingsPath;
 std::string g_statePath;
 
+// IPC wire encoding: text lines (default) or length-prefixed binary frames (--ipc=binary).
+enum class IpcEncoding { TEXT, BINARY };
+IpcEncoding g_ipcEncoding = IpcEncoding::TEXT;
+
+// Parsed IPC command. The numeric values are also the binary frame type codes (append only).
+enum IpcCommandKind : uint8_t {
+    CMD_UNKNOWN = 0,
+    CMD_PING = 1,
+    CMD_POWER = 2,
+    CMD_FEATURE = 3,
+    CMD_SET_SENS = 4,
+    CMD_RESET = 5,
+    CMD_QUIT = 6,
+    CMD_STATS = 7,
+};
+
+struct IpcCommand {
+    IpcCommandKind kind;
+    bool hasArg;       // POWER/FEATURE: argument was ON or OFF; SET_SENS: value parsed
+    bool on;
+    double value;
+};
+
 // IPC queues (used in --ipc mode)
 std::mutex g_cmdMutex;
-std::queue<std::string> g_cmdQueue;
-std::mutex g_evtMutex;
-std::queue<std::string> g_evtQueue;
+std::queue<IpcCommand> g_cmdQueue;
+
+// IPC events. Each producer thread owns a preallocated SPSC ring of POD records, so
+// reporting an event never allocates or locks (see QueueEvent). Text is formatted only
+// in FlushEvents. Priority inversion: the input thread flushes with TryFlushEvents and
+// never waits on a normal-priority thread that is writing to the stdout pipe.
+// The numeric values are also the binary frame type codes (append only); the GUI decodes
+// them through EVENT_SPECS in src-tauri/src/main.rs, which must list every kind.
+enum EventKind : uint8_t {
+    EVENT_READY,
+    EVENT_PONG,
+    EVENT_EXITING,
+    EVENT_EXITED,
+    EVENT_RESET,
+    EVENT_INPUT_READY,
+    EVENT_POWER_ON,
+    EVENT_POWER_OFF,
+    EVENT_POWER_APPLIED_ON,
+    EVENT_POWER_APPLIED_OFF,
+    EVENT_FEATURE_ON,
+    EVENT_FEATURE_OFF,
+    EVENT_FIRING_ON,
+    EVENT_FIRING_OFF,
+    EVENT_SCAN_PROGRESS,     // values[0] = percent
+    EVENT_SENS_APPLIED,      // values[0] = multiplier
+    EVENT_REGISTERED,        // text = hardware id
+    EVENT_NOTIFY,            // text = "ERR:..." / "FS:..."
+    EVENT_INPUT_BACKLOG,     // values = backlog, max batch, batches, packets
+    EVENT_REPLAY_DONE,       // values = packets, seconds, rate
+    EVENT_STATS,             // text = stage, values = count, p50, p99, p99.9, max (us)
+    EVENT_STATS_DEVICE,      // text = device id, values = packets, rate
+    EVENT_STATS_END,
+    EVENT_HOOK_LAG,          // values = near-timeout callbacks (total), max lag since last report (ms)
+    EVENT_SCAN_DECIDED,      // values = time to register (ms), scan packets, devices seen, winner share
+    EVENT_STATS_SETTINGS,    // values = settings writes, writes skipped, writer runs, writer runs skipped, generation
+};
 
 // settings.json / writer.exe serialization
-// Avoid concurrent read-modify-write between threads (main thread vs WM_INPUT thread).
+// Avoid concurrent read-modify-write between threads (main thread, WM_INPUT thread, settings apply thread).
 std::mutex g_settingsMutex;
 
+// 内容没变时省掉的写文件与 writer.exe 调用（STATS 上报）；generation 为 settings.json 内容的版本号
+struct SettingsWriteCounters {
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> writesSkipped{0};
+    std::atomic<uint64_t> writerRuns{0};
+    std::atomic<uint64_t> writerRunsSkipped{0};
+    std::atomic<uint64_t> generation{0};
+    std::atomic<uint64_t> applySuperseded{0};  // 应用线程上被更新目标取代的请求
+    std::atomic<uint64_t> helperStarts{0};     // 常驻 writer helper 的启动次数（含崩溃后重启）
+    std::atomic<uint64_t> writerFallbacks{0};  // helper 不可用、改为启动一次 writer 的次数
+};
+
+SettingsWriteCounters g_settingsCounters;
+
+// writer.exe 单次最长等待与失败后的重试次数（--writer-timeout / --writer-retries）；超时即结束进程
+DWORD g_writerTimeoutMs = 5000;
+unsigned g_writerRetries = 0;
+std::string g_writerHelperProgram;  // --writer-helper：常驻 helper 程序，空 = 每次启动 writer
+
 // Deferred settings maintenance (avoid file I/O inside WM_INPUT handler).
 std::mutex g_settingsWorkMutex;
 std::string g_pendingSettingsCleanupHardwareId;
 bool g_hasPendingSettingsCleanup = false;
 
-// Registration scan accumulator (IPC mode auto-register)
-std::mutex g_scanMutex;
-std::unordered_map<HANDLE, float> g_scanAccum;
-float g_scanTotalAccum = 0.0f;
-std::atomic<HANDLE> g_lastScanEmitDevice(nullptr);
-std::atomic<DWORD> g_lastScanEmitTick(0);
+// Registration scan (IPC mode auto-register). The accumulator is owned by the input thread;
+// PerformFullReset only bumps the generation and the input thread clears it on the next packet.
+std::atomic<uint32_t> g_scanResetGeneration(0);
+float g_scanMinCounts = 400.0f;   // --scan-min: counts the leading device needs before an early decision
+float g_scanConfidence = 0.8f;    // --scan-confidence: leader's share of all scan movement (0 = flat threshold only)
+
+// Raw input 批量读取（GetRawInputBuffer）及队列积压统计
+std::atomic<bool> g_rawBatchEnabled(true);
+std::atomic<uint64_t> g_rawBatchCount(0);    // 处理过的批次数（每个 WM_INPUT 一批）
+std::atomic<uint64_t> g_rawPacketCount(0);   // 处理过的鼠标包总数
+std::atomic<uint64_t> g_rawBacklogCount(0);  // 批次中队列仍有积压（>1 包）的次数
+std::atomic<unsigned> g_rawMaxBatch(0);      // 单批最大包数
+
+// 原始鼠标包录制/回放（--record / --replay）
+std::string g_recordPath;
+std::string g_replayPath;
+bool g_replayRealtime = false;                // 回放按原始时间间隔（默认尽快回放）
+std::atomic<bool> g_replayMode(false);
+std::atomic<bool> g_injectOutput(true);       // 是否向系统注入光标移动/按键（回放时关闭）
+
+// Linux evdev 输入设备（--evdev，可重复；为空时自动枚举 /dev/input/event*）
+std::vector<std::string> g_evdevPaths;
 
 // 低级鼠标钩子
+#ifdef _WIN32
 HHOOK g_mouseHook = NULL;
-std::atomic<bool> g_blockingMouse(false);  // 是否正在阻止鼠标移动
+#endif
+std::atomic<bool> g_blockingMouse(false);  // 是否正在阻止鼠标移动（状态机发布，钩子读取）
+std::atomic<uint64_t> g_lockDeadlineUs(0); // LOCKED 触发器中最早的 UNLOCK 截止时刻（状态机发布，主循环读取；0 = 无）
+
+// 主循环唤醒（见 WaitMainLoop）
+std::atomic<bool> g_mainWakePending(false);  // 已请求唤醒、主循环尚未取走
+std::atomic<bool> g_housekeepingIdle(false); // 无输入时统计定时已停，输入线程下一批需唤醒主循环
 
 // 常量
-const DWORD STOP_TO_UNLOCK_MS = 50;     // 停止后进入 UNLOCKABLE 的阈值
+const uint64_t STOP_TO_UNLOCK_US = 50000;  // 停止后进入 UNLOCKABLE 的阈值
 const LONG DEADZONE_THRESHOLD = 3;      // 其他鼠标死区阈值 |dx|+|dy|
 const char* SETTINGS_FILE = "settings.json";
 const char* SENS_PROFILE_NAME = "sens_registered_mouse";
@@ -103,1810 +370,7626 @@ const char* SENS_PROFILE_NAME = "sens_registered_mouse";
 // ========== 函数声明 ==========
 void MouseLeftDown();
 void MouseLeftUp();
-void QueueEvent(const std::string& line);
+void QueueEvent(EventKind kind);
+void QueueEventValue(EventKind kind, double value);
+void QueueEventText(EventKind kind, const char* text, const char* suffix = nullptr);
+void QueueEventValues(EventKind kind, const char* text, std::initializer_list<double> values);
+void QueueNotifyError(const char* detail);
 void FlushEvents();
+void WakeMainLoop();
 void StartIpcStdinThread();
 void ProcessIpcCommands();
-void HandleIpcCommand(const std::string& line);
-bool ApplySensitivityMultiplier(double multiplier, std::string& errorMsg);
-bool RestoreDefaultSensitivity(std::string& errorMsg);
+void HandleIpcCommand(const IpcCommand& command);
 std::string TrimString(const std::string& s);
-std::string NormalizeIpcLine(const std::string& line);
 void DecodeExtraInfo(ULONG extraInfo, short* rawX, short* rawY);
 void SetCursorVisible(bool visible);
 void GetDeviceHidPath(HANDLE device, wchar_t* path, size_t pathSize);
 std::string DevicePathToHardwareId(const wchar_t* devicePath);
+std::string CachedHardwareId(HANDLE device);
+void CachedDevicePath(HANDLE device, wchar_t* path, size_t pathSize);
 std::string WideToAnsi(const std::wstring& ws);
 bool ReadFileContent(const char* path, std::string& content);
 bool WriteFileContent(const char* path, const std::string& content);
+bool WriteFileAtomic(const std::string& path, const std::string& content);
 bool SaveLastRegisteredHardwareId(const std::string& hardwareId);
 bool LoadLastRegisteredHardwareId(std::string& hardwareId);
 void ClearLastRegisteredHardwareId();
 bool TryRestoreLastRegisteredMouse();
-bool UpdateSettingsForDevice(const std::string& hardwareId, double sensitivity, std::string& errorMsg);
-bool RunWriterExe();
+// settings.json 中一个触发器的映射：设备 → 专属 profile（Output DPI = 灵敏度 * 1000）
+struct SensDeviceMapping {
+    std::string hardwareId;
+    std::string profileName;
+    std::string deviceName;
+    double sensitivity;
+};
+std::vector<SensDeviceMapping> CollectSensMappings(double registeredSensitivity);
+std::vector<std::string> SensMappedHardwareIds(const std::string& registeredHardwareId);
+bool UpdateSettingsForDevices(const std::vector<SensDeviceMapping>& mappings, std::string& errorMsg);
+// settings 应用线程上的一个目标（见 SubmitSettingsApply）
+enum SettingsApplyTarget {
+    APPLY_NOTHING,      // 不改配置，只在此前的请求处理完后发完成事件
+    APPLY_SENSITIVITY,  // 写入 mappings 并运行 writer.exe
+    APPLY_DEFAULT,      // 清除设备映射（恢复默认灵敏度）并运行 writer.exe
+};
+enum SettingsApplyOrigin { APPLY_FROM_IPC, APPLY_FROM_CONSOLE, APPLY_FROM_RESET, APPLY_FROM_EXIT };  // 决定控制台输出
+struct SettingsApplyRequest {
+    SettingsApplyTarget target = APPLY_NOTHING;
+    SettingsApplyOrigin origin = APPLY_FROM_IPC;
+    std::vector<SensDeviceMapping> mappings;  // APPLY_SENSITIVITY：提交时的触发器快照
+    bool reportSens = false;                  // 生效后发 EVT SENS_APPLIED sensValue
+    double sensValue = 1.0;
+    int reportPower = -1;                     // 处理完后发 POWER_APPLIED ON(1) / OFF(0)
+};
+bool PrepareSensitivityApply(double multiplier, SettingsApplyRequest& request, std::string& errorMsg);
+void SubmitSettingsApply(SettingsApplyRequest request);
+bool WaitSettingsApplyIdle(DWORD timeoutMs);
+DWORD SettingsApplyBudgetMs();
+void StopSettingsApplier();
+bool RunWriterExe(const std::string* content);
+bool SettingsWriterNeeded(uint64_t& generation);
+void NoteSettingsWriterApplied(uint64_t generation);
 void HandleSensitivityInput();
-LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam);
-DWORD WINAPI MessageLoopThread(LPVOID lpParam);
+std::string GetExecutablePath();
+std::string GetExecutableDir();
+bool ConsoleKeyAvailable();
+int ConsoleReadKey();
+void ConsoleSetRawKeys(bool enable);
 
 // 新增函数声明
 bool IsOtherMouseMovementSignificant(LONG dx, LONG dy);
-void MoveCursorBy(LONG dx, LONG dy);
-DWORD GetCooldownDuration();
-void EnterLockedState();
-void EnterUnlockableState();
-void ReleaseToIdle();
+void MoveCursorBy(LONG dx, LONG dy, uint64_t sourceTicks = 0);
+uint64_t GetCooldownDurationUs();
+class InputSource;
+void WakeInputSource(InputSource* source);
+bool SendLockCommand(LockCommand cmd, DWORD timeoutMs = 100);
+void ProcessLockInbox();
+uint64_t AdvanceLockTimers(uint64_t nowUs);
+#ifdef _WIN32
 LRESULT CALLBACK LowLevelMouseProc(int nCode, WPARAM wParam, LPARAM lParam);
-bool InstallMouseHook();
+#endif
+bool StartMouseHookThread();
+void StopMouseHookThread();
+void UpdateMouseHookDemand();
 void UninstallMouseHook();
 void FailsafeCleanup();
 void PerformFullReset();
-bool RemoveOldSensDeviceMappings(std::string& content, const std::string& currentHardwareId);
+struct SettingsModel;
+SettingsModel* AcquireSettingsModel();
+bool CommitSettingsModel(SettingsModel& model);
+bool RemoveOldSensDeviceMappings(SettingsModel& model, const std::vector<std::string>& keepHardwareIds);
+void StartSettingsWatcher();
+void StopSettingsWatcher();
+
+// ========== 延迟统计 ==========
+
+// 各阶段耗时直方图（纳秒）。每个线程写自己的一份，读取方（主线程）合并，热路径无锁。
+enum LatencyStage {
+    STAGE_DECODE = 0,     // 包到达 → 进入 HandleMousePacket（raw input 读取/解析）
+    STAGE_STATE,          // HandleMousePacket 单包处理（注册扫描/状态机，含注入）
+    STAGE_INJECT,         // SendInput（每批一次）/ SetCursorPos
+    STAGE_END_TO_END,     // 包到达 → 光标注入完成
+    STAGE_FLUSH,          // FlushEvents（有事件时）
+    STAGE_SETTINGS,       // UpdateSettingsForDevices
+    STAGE_WRITER,         // RunWriterExe
+    STAGE_HOOK,           // 低级鼠标钩子回调（钩子线程）
+    STAGE_COUNT
+};
+
+const char* const kLatencyStageNames[STAGE_COUNT] = {
+    "decode", "state", "inject", "e2e", "flush", "settings", "writer", "hook",
+};
+
+// HDR 风格对数-线性分桶：每个 2 的幂区间再分 32 个子桶（相对误差约 3%），覆盖 0 ~ 2^36 ns
+struct LatencyHistogram {
+    static const unsigned kSubBits = 5;
+    static const unsigned kSubCount = 1u << kSubBits;
+    static const unsigned kMaxExp = 36;
+    static const unsigned kBuckets = (kMaxExp - kSubBits + 1) * kSubCount;
+
+    // 只有所属线程写入（load + store，不用 RMW），其他线程可随时读取
+    std::atomic<uint64_t> counts[kBuckets];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> maxNs;
+};
+
+struct ThreadLatencyStats {
+    LatencyHistogram stages[STAGE_COUNT];
+    std::atomic<bool> owned{false};  // 有线程在写；线程退出时释放，直方图保留，由后来的线程接着累加
+};
+
+const unsigned kMaxStatsThreads = 8;
+ThreadLatencyStats g_threadStats[kMaxStatsThreads];
+std::atomic<unsigned> g_threadStatsUsed(0);  // 曾被占用过的最高槽位 + 1（读取方合并这么多份）
+
+// 每设备包计数（仅输入线程写入，槽位一经占用不再改变）
+struct DevicePacketCounter {
+    std::atomic<HANDLE> device;
+    std::atomic<uint64_t> packets;
+};
+
+const unsigned kMaxCountedDevices = 16;
+DevicePacketCounter g_devicePackets[kMaxCountedDevices];
+
+// 指标文件（--metrics）
+std::string g_metricsPath;
+DWORD g_metricsIntervalMs = 1000;
+
+static inline uint64_t StatsNowTicks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return static_cast<uint64_t>(now.QuadPart);
+}
 
-// 模拟鼠标左键按下
-void MouseLeftDown() {
-    INPUT input = {};
-    input.type = INPUT_MOUSE;
-    input.mi.dwFlags = MOUSEEVENTF_LEFTDOWN;
-    SendInput(1, &input, sizeof(INPUT));
+static inline uint64_t TicksToNs(uint64_t ticks) {
+    static const double s_nsPerTick = []() {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        return 1e9 / static_cast<double>(freq.QuadPart);
+    }();
+    return static_cast<uint64_t>(static_cast<double>(ticks) * s_nsPerTick);
 }
 
-// 模拟鼠标左键抬起
-void MouseLeftUp() {
-    INPUT input = {};
-    input.type = INPUT_MOUSE;
-    input.mi.dwFlags = MOUSEEVENTF_LEFTUP;
-    SendInput(1, &input, sizeof(INPUT));
+static inline unsigned HighestSetBit(uint64_t v) {
+    unsigned bit = 0;
+    if (v >> 32) { v >>= 32; bit += 32; }
+    if (v >> 16) { v >>= 16; bit += 16; }
+    if (v >> 8) { v >>= 8; bit += 8; }
+    if (v >> 4) { v >>= 4; bit += 4; }
+    if (v >> 2) { v >>= 2; bit += 2; }
+    if (v >> 1) { bit += 1; }
+    return bit;
 }
 
-void QueueEvent(const std::string& line) {
-    if (!g_ipcMode.load()) return;
-    std::lock_guard<std::mutex> lock(g_evtMutex);
-    g_evtQueue.push(line);
+static inline unsigned LatencyBucketIndex(uint64_t ns) {
+    const unsigned sub = LatencyHistogram::kSubBits;
+    if (ns < LatencyHistogram::kSubCount) return static_cast<unsigned>(ns);
+    if (ns >= (1ull << LatencyHistogram::kMaxExp)) ns = (1ull << LatencyHistogram::kMaxExp) - 1;
+    const unsigned exp = HighestSetBit(ns);
+    const unsigned group = exp - sub + 1;
+    return group * LatencyHistogram::kSubCount + static_cast<unsigned>((ns >> (exp - sub)) & (LatencyHistogram::kSubCount - 1));
 }
 
-void FlushEvents() {
-    if (!g_ipcMode.load()) return;
+// 桶内最大值（与 HDR histogram 的 highestEquivalentValue 一致，分位数偏保守）
+static uint64_t LatencyBucketUpperNs(unsigned index) {
+    const unsigned group = index / LatencyHistogram::kSubCount;
+    const uint64_t offset = index % LatencyHistogram::kSubCount;
+    if (group == 0) return offset;
+    const unsigned shift = group - 1;
+    return (((LatencyHistogram::kSubCount + offset) << shift) + (1ull << shift)) - 1;
+}
 
-    std::queue<std::string> local;
-    {
-        std::lock_guard<std::mutex> lock(g_evtMutex);
-        std::swap(local, g_evtQueue);
+// 线程第一次记录时占用一个空闲槽位，线程退出时（TLS 析构）归还：启动、基准等短命线程不会把槽位耗尽
+struct ThreadStatsLease {
+    ThreadLatencyStats* stats = nullptr;
+    bool claimed = false;
+    ~ThreadStatsLease() {
+        if (stats) stats->owned.store(false, std::memory_order_release);
     }
-
-    while (!local.empty()) {
-        printf("%s\n", local.front().c_str());
-        local.pop();
+};
+
+static ThreadLatencyStats* CurrentThreadStats() {
+    thread_local ThreadStatsLease s_lease;
+    if (!s_lease.claimed) {
+        s_lease.claimed = true;
+        for (unsigned i = 0; i < kMaxStatsThreads; ++i) {
+            bool expected = false;
+            if (!g_threadStats[i].owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) continue;
+            s_lease.stats = &g_threadStats[i];
+            unsigned used = g_threadStatsUsed.load();
+            while (used < i + 1 && !g_threadStatsUsed.compare_exchange_weak(used, i + 1)) {
+            }
+            break;
+        }
     }
-    fflush(stdout);
+    return s_lease.stats;
 }
 
-static void RequestSettingsCleanupForRegisteredMouse(const std::string& hardwareId) {
-    if (hardwareId.empty()) return;
-    std::lock_guard<std::mutex> lock(g_settingsWorkMutex);
-    g_pendingSettingsCleanupHardwareId = hardwareId;
-    g_hasPendingSettingsCleanup = true;
+static void RecordLatency(LatencyStage stage, uint64_t ns) {
+    ThreadLatencyStats* stats = CurrentThreadStats();
+    if (!stats) return;
+    LatencyHistogram& h = stats->stages[stage];
+    std::atomic<uint64_t>& bucket = h.counts[LatencyBucketIndex(ns)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h.total.store(h.total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (ns > h.maxNs.load(std::memory_order_relaxed)) {
+        h.maxNs.store(ns, std::memory_order_relaxed);
+    }
 }
 
-static void ProcessPendingSettingsWork() {
-    std::string hardwareId;
-    {
-        std::lock_guard<std::mutex> lock(g_settingsWorkMutex);
-        if (!g_hasPendingSettingsCleanup) return;
-        hardwareId = g_pendingSettingsCleanupHardwareId;
-        g_pendingSettingsCleanupHardwareId.clear();
-        g_hasPendingSettingsCleanup = false;
+// 作用域计时：析构时记录本阶段耗时
+struct ScopedLatency {
+    LatencyStage stage;
+    uint64_t start;
+    explicit ScopedLatency(LatencyStage s) : stage(s), start(StatsNowTicks()) {}
+    ~ScopedLatency() { RecordLatency(stage, TicksToNs(StatsNowTicks() - start)); }
+};
+
+static void CountDevicePacket(HANDLE device) {
+    for (unsigned i = 0; i < kMaxCountedDevices; ++i) {
+        DevicePacketCounter& slot = g_devicePackets[i];
+        HANDLE current = slot.device.load(std::memory_order_relaxed);
+        if (current == nullptr) {
+            slot.device.store(device, std::memory_order_release);
+            current = device;
+        }
+        if (current == device) {
+            slot.packets.store(slot.packets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
     }
-
-    if (hardwareId.empty()) return;
-    if (g_settingsPath.empty()) return;
-
-    std::lock_guard<std::mutex> lock(g_settingsMutex);
-    std::string content;
-    if (!ReadFileContent(g_settingsPath.c_str(), content)) return;
-    if (!RemoveOldSensDeviceMappings(content, hardwareId)) return;
-    WriteFileContent(g_settingsPath.c_str(), content);
 }
 
-static std::string ToUpperAscii(std::string s) {
-    for (char& c : s) {
-        c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+struct LatencySummary {
+    uint64_t count;
+    double p50Us;
+    double p99Us;
+    double p999Us;
+    double maxUs;
+};
+
+// 合并所有线程的直方图并计算分位数
+static LatencySummary SummarizeLatency(LatencyStage stage) {
+    static uint64_t s_merged[LatencyHistogram::kBuckets];
+    LatencySummary summary = {};
+    uint64_t maxNs = 0;
+
+    memset(s_merged, 0, sizeof(s_merged));
+    const unsigned used = std::min(g_threadStatsUsed.load(), kMaxStatsThreads);
+    for (unsigned t = 0; t < used; ++t) {
+        const LatencyHistogram& h = g_threadStats[t].stages[stage];
+        for (unsigned i = 0; i < LatencyHistogram::kBuckets; ++i) {
+            const uint64_t c = h.counts[i].load(std::memory_order_relaxed);
+            s_merged[i] += c;
+            summary.count += c;
+        }
+        maxNs = std::max(maxNs, h.maxNs.load(std::memory_order_relaxed));
+    }
+    if (summary.count == 0) return summary;
+
+    const double quantiles[3] = {0.50, 0.99, 0.999};
+    double* outputs[3] = {&summary.p50Us, &summary.p99Us, &summary.p999Us};
+    uint64_t seen = 0;
+    int q = 0;
+    for (unsigned i = 0; i < LatencyHistogram::kBuckets && q < 3; ++i) {
+        seen += s_merged[i];
+        while (q < 3 && static_cast<double>(seen) >= quantiles[q] * static_cast<double>(summary.count)) {
+            *outputs[q] = static_cast<double>(std::min(LatencyBucketUpperNs(i), maxNs)) / 1000.0;
+            ++q;
+        }
     }
-    return s;
+    summary.maxUs = static_cast<double>(maxNs) / 1000.0;
+    return summary;
 }
 
-void StartIpcStdinThread() {
-    if (!g_ipcMode.load()) return;
-
-    std::thread([]() {
-        std::string line;
-        while (g_running.load() && std::getline(std::cin, line)) {
-            std::lock_guard<std::mutex> lock(g_cmdMutex);
-            g_cmdQueue.push(line);
+// 每设备包速率（主线程每秒采样一次）
+struct DeviceRateSample {
+    uint64_t lastPackets;
+    double rate;
+    std::string name;
+};
+
+DeviceRateSample g_deviceRates[kMaxCountedDevices];
+
+static const std::string& DeviceStatsName(unsigned slot, HANDLE device) {
+    DeviceRateSample& sample = g_deviceRates[slot];
+    if (sample.name.empty()) {
+        sample.name = CachedHardwareId(device);
+        if (sample.name.empty()) {
+            char buf[32] = {0};
+            snprintf(buf, sizeof(buf), "0x%llx", static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(device)));
+            sample.name = buf;
         }
-    }).detach();
+    }
+    return sample.name;
 }
 
-void ProcessIpcCommands() {
-    if (!g_ipcMode.load()) return;
-
-    std::queue<std::string> local;
-    {
-        std::lock_guard<std::mutex> lock(g_cmdMutex);
-        std::swap(local, g_cmdQueue);
+static void SampleDeviceRates(double elapsedSeconds) {
+    for (unsigned i = 0; i < kMaxCountedDevices; ++i) {
+        if (g_devicePackets[i].device.load(std::memory_order_acquire) == nullptr) break;
+        const uint64_t packets = g_devicePackets[i].packets.load(std::memory_order_relaxed);
+        DeviceRateSample& sample = g_deviceRates[i];
+        sample.rate = elapsedSeconds > 0.0 ? static_cast<double>(packets - sample.lastPackets) / elapsedSeconds : 0.0;
+        sample.lastPackets = packets;
     }
+}
 
-    while (!local.empty()) {
-        HandleIpcCommand(local.front());
-        local.pop();
+static std::string JsonEscape(const std::string& s) {
+    std::string out;
+    out.reserve(s.size() + 8);
+    for (char c : s) {
+        if (c == '\\' || c == '"') out += '\\';
+        out += c;
     }
+    return out;
 }
 
-bool ApplySensitivityMultiplier(double multiplier, std::string& errorMsg) {
-    if (g_registeredDevice.load() == NULL) {
-        errorMsg = "no mouse registered";
-        return false;
+static void WriteMetricsFile() {
+    std::string json = "{\n  \"stages\": {";
+    char buf[256] = {0};
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        const LatencySummary sum = SummarizeLatency(static_cast<LatencyStage>(s));
+        snprintf(buf, sizeof(buf),
+                 "%s\n    \"%s\": {\"count\": %llu, \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f}",
+                 s == 0 ? "" : ",", kLatencyStageNames[s], static_cast<unsigned long long>(sum.count),
+                 sum.p50Us, sum.p99Us, sum.p999Us, sum.maxUs);
+        json += buf;
     }
-    if (g_registeredHardwareId.empty()) {
-        errorMsg = "hardware id not available";
-        return false;
+    json += "\n  },\n  \"devices\": [";
+    for (unsigned i = 0; i < kMaxCountedDevices; ++i) {
+        HANDLE device = g_devicePackets[i].device.load(std::memory_order_acquire);
+        if (device == nullptr) break;
+        snprintf(buf, sizeof(buf), "%s\n    {\"id\": \"%s\", \"packets\": %llu, \"rate\": %.1f}",
+                 i == 0 ? "" : ",", JsonEscape(DeviceStatsName(i, device)).c_str(),
+                 static_cast<unsigned long long>(g_devicePackets[i].packets.load(std::memory_order_relaxed)),
+                 g_deviceRates[i].rate);
+        json += buf;
     }
+    const SettingsWriteCounters& c = g_settingsCounters;
+    snprintf(buf, sizeof(buf),
+             "\n  ],\n  \"settings\": {\"writes\": %llu, \"writes_skipped\": %llu, \"writer_runs\": %llu, "
+             "\"writer_runs_skipped\": %llu, \"generation\": %llu, \"apply_superseded\": %llu, "
+             "\"writer_helper_starts\": %llu, \"writer_fallbacks\": %llu}",
+             static_cast<unsigned long long>(c.writes.load()), static_cast<unsigned long long>(c.writesSkipped.load()),
+             static_cast<unsigned long long>(c.writerRuns.load()), static_cast<unsigned long long>(c.writerRunsSkipped.load()),
+             static_cast<unsigned long long>(c.generation.load()), static_cast<unsigned long long>(c.applySuperseded.load()),
+             static_cast<unsigned long long>(c.helperStarts.load()), static_cast<unsigned long long>(c.writerFallbacks.load()));
+    json += buf;
+    json += "\n}\n";
+
+    // 先写临时文件再替换，监控端不会读到半个文件
+    const std::string tmpPath = g_metricsPath + ".tmp";
+    if (!WriteFileContent(tmpPath.c_str(), json)) return;
+#ifdef _WIN32
+    MoveFileExA(tmpPath.c_str(), g_metricsPath.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    rename(tmpPath.c_str(), g_metricsPath.c_str());
+#endif
+}
 
-    {
-        std::lock_guard<std::mutex> lock(g_settingsMutex);
+// 主循环调用（统计截止时间到期时）：按距上次采样的实际间隔计算设备速率
+static void UpdateLatencyStats() {
+    static uint64_t s_lastSampleNs = 0;
+    const uint64_t now = TicksToNs(StatsNowTicks());
 
-        std::string updateErr;
-        if (!UpdateSettingsForDevice(g_registeredHardwareId, multiplier, updateErr)) {
-            errorMsg = updateErr;
-            return false;
-        }
+    if (s_lastSampleNs != 0 && now != s_lastSampleNs) {
+        SampleDeviceRates(static_cast<double>(now - s_lastSampleNs) / 1e9);
+    }
+    s_lastSampleNs = now;
+}
 
-        if (!RunWriterExe()) {
-            errorMsg = "writer.exe failed";
-            return false;
+// STATS 命令 / CLI 的 S 键
+static void ReportLatencyStats() {
+    if (!g_ipcMode.load()) {
+        printf("\n[STATS] %-9s %10s %10s %10s %10s %10s\n", "stage", "count", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+    }
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        const LatencySummary sum = SummarizeLatency(static_cast<LatencyStage>(s));
+        if (g_ipcMode.load()) {
+            QueueEventValues(EVENT_STATS, kLatencyStageNames[s],
+                             {static_cast<double>(sum.count), sum.p50Us, sum.p99Us, sum.p999Us, sum.maxUs});
+        } else {
+            printf("[STATS] %-9s %10llu %10.1f %10.1f %10.1f %10.1f\n", kLatencyStageNames[s],
+                   static_cast<unsigned long long>(sum.count), sum.p50Us, sum.p99Us, sum.p999Us, sum.maxUs);
         }
     }
-
-    g_currentSensitivity = multiplier;
-    return true;
+    for (unsigned i = 0; i < kMaxCountedDevices; ++i) {
+        HANDLE device = g_devicePackets[i].device.load(std::memory_order_acquire);
+        if (device == nullptr) break;
+        const unsigned long long packets = g_devicePackets[i].packets.load(std::memory_order_relaxed);
+        if (g_ipcMode.load()) {
+            QueueEventValues(EVENT_STATS_DEVICE, DeviceStatsName(i, device).c_str(),
+                             {static_cast<double>(packets), g_deviceRates[i].rate});
+        } else {
+            printf("[STATS] device %s: %llu packets, %.1f/s\n", DeviceStatsName(i, device).c_str(), packets, g_deviceRates[i].rate);
+        }
+    }
+    const SettingsWriteCounters& c = g_settingsCounters;
+    const double writes = static_cast<double>(c.writes.load());
+    const double writesSkipped = static_cast<double>(c.writesSkipped.load());
+    const double writerRuns = static_cast<double>(c.writerRuns.load());
+    const double writerRunsSkipped = static_cast<double>(c.writerRunsSkipped.load());
+    const double generation = static_cast<double>(c.generation.load());
+    if (g_ipcMode.load()) {
+        QueueEventValues(EVENT_STATS_SETTINGS, nullptr, {writes, writesSkipped, writerRuns, writerRunsSkipped, generation});
+        QueueEvent(EVENT_STATS_END);
+    } else {
+        printf("[STATS] settings: %.0f writes (%.0f unchanged skipped), %.0f writer runs (%.0f skipped), generation %.0f, "
+               "%llu applies superseded, %llu helper starts (%llu fallbacks)\n",
+               writes, writesSkipped, writerRuns, writerRunsSkipped, generation,
+               static_cast<unsigned long long>(c.applySuperseded.load()),
+               static_cast<unsigned long long>(c.helperStarts.load()), static_cast<unsigned long long>(c.writerFallbacks.load()));
+        fflush(stdout);
+    }
 }
 
-bool RestoreDefaultSensitivity(std::string& errorMsg) {
-    if (g_settingsPath.empty()) {
-        errorMsg = "settings path not set";
-        return false;
+// ========== 状态机时钟 ==========
+// 状态机的所有时间判断（停止阈值、冷却期、扫描节流）使用 64 位微秒单调时间，不回绕、
+// 不受 GetTickCount 10~16ms 节拍影响。实时运行用系统时钟；尽快回放时换成虚拟时钟，
+// 由录制时间戳推进，到期转换也在回放线程按模拟时间触发，结果与回放速度无关。
+
+class MonotonicClock {
+public:
+    virtual ~MonotonicClock() {}
+    virtual uint64_t NowUs() const = 0;
+};
+
+// QueryPerformanceCounter / clock_gettime(CLOCK_MONOTONIC)
+class SystemClock : public MonotonicClock {
+public:
+    uint64_t NowUs() const override { return TicksToNs(StatsNowTicks()) / 1000; }
+};
+
+class VirtualClock : public MonotonicClock {
+public:
+    // 从非零时刻开始，0 在各时间戳里表示“无”
+    static const uint64_t kEpochUs = 1000000;
+
+    uint64_t NowUs() const override { return nowUs_.load(std::memory_order_acquire); }
+
+    // 只前进不后退
+    void AdvanceTo(uint64_t us) {
+        if (us > nowUs_.load(std::memory_order_relaxed)) nowUs_.store(us, std::memory_order_release);
     }
 
-    std::lock_guard<std::mutex> lock(g_settingsMutex);
+private:
+    std::atomic<uint64_t> nowUs_{kEpochUs};
+};
 
-    std::string content;
-    if (!ReadFileContent(g_settingsPath.c_str(), content)) {
-        errorMsg = "failed to read settings.json";
-        return false;
-    }
+SystemClock g_systemClock;
+VirtualClock g_virtualClock;
+MonotonicClock* g_clock = &g_systemClock;  // 启动输入线程前选定，之后不再改变
 
-    if (!RemoveOldSensDeviceMappings(content, std::string())) {
-        errorMsg = "failed to clear device mappings";
-        return false;
-    }
+static inline uint64_t ClockNowUs() {
+    return g_clock->NowUs();
+}
 
-    if (!WriteFileContent(g_settingsPath.c_str(), content)) {
-        errorMsg = "failed to write settings.json";
-        return false;
-    }
+static inline bool UsingVirtualClock() {
+    return g_clock == &g_virtualClock;
+}
 
-    if (!RunWriterExe()) {
-        errorMsg = "writer.exe failed";
-        return false;
+// ========== 光标/按键注入 ==========
+// 输入线程处理一批包期间，光标移动与左键按下/抬起按发生顺序攒在数组里，批末一次 SendInput 送出；
+// 相邻的移动合并为一条相对 MOUSEEVENTF_MOVE，注入事件经过低级钩子的次数也随之降到每批一次。
+// 相对移动会被系统指针速度缩放，这里按速度档位反向缩放并保留小数余量，长时间累计不丢计数。
+// 开启“提高指针精确度”时相对移动无法反算，退回逐包 GetCursorPos + SetCursorPos。
+// --output-rate 设定输出节奏时，批末只在周期到点才送出移动，其间的移动累加；按键变化仍在本批送出，
+// 剩余的移动由输入源的定时器（PendingInjectDueUs / FlushDueInject）按时补发。
+// Linux 构建只用于回放/profiling，不向系统注入输出（仍计数，供 --inject-bench 使用）
+
+#ifdef _WIN32
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+typedef HANDLE (WINAPI *CreateWaitableTimerExWFn)(void*, LPCWSTR, DWORD, DWORD);
+
+// 自动复位的可等待定时器：高精度定时器（Win10 1803+）不受系统时钟节拍影响；旧系统退回普通定时器
+static HANDLE CreatePreciseTimer() {
+    HANDLE timer = NULL;
+    HMODULE kernel = GetModuleHandleA("kernel32.dll");
+    CreateWaitableTimerExWFn createEx = kernel
+        ? reinterpret_cast<CreateWaitableTimerExWFn>(reinterpret_cast<void*>(GetProcAddress(kernel, "CreateWaitableTimerExW")))
+        : nullptr;
+    if (createEx) {
+        timer = createEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
     }
+    if (!timer) {
+        timer = CreateWaitableTimerA(NULL, FALSE, NULL);
+    }
+    return timer;
+}
+#endif
+
+enum class InjectMode { SEND_INPUT, SET_CURSOR_POS };
+
+enum InjectKind : uint8_t { INJECT_MOVE, INJECT_LEFT_DOWN, INJECT_LEFT_UP };
+
+struct InjectEntry {
+    InjectKind kind;
+    LONG dx;
+    LONG dy;
+};
+
+struct InjectBatch {
+    static const size_t kCapacity = 64;
+    InjectEntry entries[kCapacity];
+    size_t count = 0;
+    bool active = false;           // BeginInjectBatch 之后、FlushInjectBatch 之前
+    double remX = 0.0;             // 缩放后尚未送出的小数部分
+    double remY = 0.0;
+    uint64_t sourceTicks = 0;      // 待送移动中最早的包时间（STAGE_END_TO_END，0 = 无）
+    int64_t sentX = 0;             // 累计送出的相对计数
+    int64_t sentY = 0;
+    bool hasButton = false;        // 待送内容含按键变化（不等输出节奏）
+    uint64_t nextFlushUs = 0;      // 输出节奏下一次可送出移动的时刻（ClockNowUs）
+};
+
+const int kOutputRateRefresh = -1;
+int g_outputRateHz = 0;                    // --output-rate：0 = passthrough（每批送出），kOutputRateRefresh = 显示器刷新率
+uint64_t g_outputPeriodUs = 0;             // 解析后的输出周期（InitCursorOutput，0 = 每批送出）
+
+std::atomic<InjectMode> g_injectMode(InjectMode::SEND_INPUT);
+double g_injectScale = 1.0;                // 相对移动的反向速度缩放（输入线程，InitCursorOutput）
+std::atomic<uint64_t> g_injectCalls(0);    // 注入用的 win32k 调用次数
+thread_local InjectBatch g_injectBatch;
+
+#ifdef _WIN32
+// 指针速度档位 1..20 对应的倍率（未开启提高指针精确度）
+static double PointerSpeedFactor(int speed) {
+    static const double kFactors[20] = {
+        0.03125, 0.0625, 0.125, 0.25, 0.375, 0.5, 0.625, 0.75, 0.875, 1.0,
+        1.25, 1.5, 1.75, 2.0, 2.25, 2.5, 2.75, 3.0, 3.25, 3.5,
+    };
+    if (speed < 1 || speed > 20) return 1.0;
+    return kFactors[speed - 1];
+}
+#endif
 
+// 解析 --output-rate 的值：passthrough | refresh | 频率（Hz）
+static bool ParseOutputRate(const char* value, int& rateHz) {
+    if (strcmp(value, "passthrough") == 0) {
+        rateHz = 0;
+        return true;
+    }
+    if (strcmp(value, "refresh") == 0) {
+        rateHz = kOutputRateRefresh;
+        return true;
+    }
+    char* end = nullptr;
+    const long hz = std::strtol(value, &end, 10);
+    if (end == value || *end != '\0' || hz <= 0 || hz > 100000) return false;
+    rateHz = static_cast<int>(hz);
     return true;
 }
 
-void HandleIpcCommand(const std::string& line) {
-    std::string trimmed = TrimString(NormalizeIpcLine(line));
-    if (trimmed.empty()) return;
-
-    std::istringstream iss(trimmed);
-    std::string cmd;
-    iss >> cmd;
-    cmd = ToUpperAscii(cmd);
-
-    if (cmd == "PING") {
-        QueueEvent("EVT PONG");
-        return;
+// 按系统鼠标设置选择注入方式、解析输出节奏（输入线程打开输入源后调用）
+void InitCursorOutput() {
+    int rateHz = g_outputRateHz;
+    if (rateHz == kOutputRateRefresh) {
+        rateHz = 0;
+#ifdef _WIN32
+        DEVMODEA mode = {};
+        mode.dmSize = sizeof(mode);
+        if (EnumDisplaySettingsA(NULL, ENUM_CURRENT_SETTINGS, &mode) && mode.dmDisplayFrequency > 1) {
+            rateHz = static_cast<int>(mode.dmDisplayFrequency);
+        }
+#endif
+        if (rateHz == 0 && !g_ipcMode.load()) {
+            printf("[WARN] Display refresh rate unavailable; cursor output is passthrough\n");
+        }
     }
-
-    if (cmd == "QUIT") {
-        QueueEvent("EVT EXITING");
-        FlushEvents();
-        FailsafeCleanup();
-        QueueEvent("EVT EXITED");
-        FlushEvents();
-        g_running.store(false);
-        return;
+    g_outputPeriodUs = rateHz > 0 ? 1000000ull / static_cast<uint64_t>(rateHz) : 0;
+    if (rateHz > 0 && !g_ipcMode.load()) {
+        printf("[OK] Cursor output cadence: %d Hz\n", rateHz);
     }
 
-    if (cmd == "RESET") {
-        PerformFullReset();
+#ifdef _WIN32
+    int mouse[3] = {};  // 阈值 1、阈值 2、加速开关
+    int speed = 10;
+    SystemParametersInfoA(SPI_GETMOUSE, 0, mouse, 0);
+    SystemParametersInfoA(SPI_GETMOUSESPEED, 0, &speed, 0);
+    if (mouse[2] != 0) {
+        g_injectMode.store(InjectMode::SET_CURSOR_POS);
+        if (!g_ipcMode.load()) {
+            printf("[WARN] Enhance pointer precision is on; cursor output uses SetCursorPos\n");
+        }
         return;
     }
+    g_injectMode.store(InjectMode::SEND_INPUT);
+    g_injectScale = 1.0 / PointerSpeedFactor(speed);
+    if (!g_ipcMode.load()) {
+        printf("[OK] Cursor output: relative SendInput (pointer speed %d, scale %.3f)\n", speed, g_injectScale);
+    }
+#endif
+}
 
-    if (cmd == "POWER") {
-        std::string arg;
-        iss >> arg;
-        arg = ToUpperAscii(arg);
-
-        if (arg == "ON") {
-            g_powerEnabled.store(true);
-            QueueEvent("EVT POWER ON");
-
-            if (!g_registeredHardwareId.empty()) {
-                std::string err;
-                if (!ApplySensitivityMultiplier(g_currentSensitivity, err)) {
-                    QueueEvent(std::string("EVT NOTIFY ERR:") + err);
-                }
+// 送出已攒的注入（一次 SendInput）
+static void SendInjectEntries(InjectBatch& batch) {
+    if (batch.count == 0) return;
+    g_injectCalls.fetch_add(1, std::memory_order_relaxed);
+#ifdef _WIN32
+    if (g_injectOutput.load(std::memory_order_relaxed)) {
+        ScopedLatency timing(STAGE_INJECT);
+        INPUT inputs[InjectBatch::kCapacity] = {};
+        for (size_t i = 0; i < batch.count; ++i) {
+            const InjectEntry& entry = batch.entries[i];
+            inputs[i].type = INPUT_MOUSE;
+            if (entry.kind == INJECT_MOVE) {
+                inputs[i].mi.dx = entry.dx;
+                inputs[i].mi.dy = entry.dy;
+                inputs[i].mi.dwFlags = MOUSEEVENTF_MOVE;
             } else {
-                QueueEvent("EVT NOTIFY ERR:NO MOUSE REGISTERED");
+                inputs[i].mi.dwFlags = entry.kind == INJECT_LEFT_DOWN ? MOUSEEVENTF_LEFTDOWN : MOUSEEVENTF_LEFTUP;
             }
-
-            QueueEvent("EVT POWER_APPLIED ON");
-            return;
         }
+        SendInput(static_cast<UINT>(batch.count), inputs, sizeof(INPUT));
+    }
+#endif
+    batch.count = 0;
+    batch.hasButton = false;
+    if (batch.sourceTicks != 0) {
+        RecordLatency(STAGE_END_TO_END, TicksToNs(StatsNowTicks() - batch.sourceTicks));
+        batch.sourceTicks = 0;
+    }
+}
 
-        if (arg == "OFF") {
-            g_powerEnabled.store(false);
-            g_featureEnabled.store(false);
-            ReleaseToIdle();
-            QueueEvent("EVT POWER OFF");
-            QueueEvent("EVT FEATURE OFF");
-
-            std::string err;
-            if (!RestoreDefaultSensitivity(err)) {
-                QueueEvent(std::string("EVT NOTIFY ERR:") + err);
-            }
+static void AppendInject(InjectKind kind, LONG dx, LONG dy) {
+    InjectBatch& batch = g_injectBatch;
+    if (kind == INJECT_MOVE && batch.count > 0 && batch.entries[batch.count - 1].kind == INJECT_MOVE) {
+        batch.entries[batch.count - 1].dx += dx;
+        batch.entries[batch.count - 1].dy += dy;
+    } else {
+        if (batch.count == InjectBatch::kCapacity) SendInjectEntries(batch);
+        batch.entries[batch.count++] = InjectEntry{kind, dx, dy};
+        if (kind != INJECT_MOVE) batch.hasButton = true;
+    }
+    // 批外调用（命令处理、退出清理）或逐包模式下立即送出
+    if (!batch.active || g_injectMode.load(std::memory_order_relaxed) == InjectMode::SET_CURSOR_POS) {
+        SendInjectEntries(batch);
+    }
+}
 
-            QueueEvent("EVT POWER_APPLIED OFF");
-            return;
-        }
+void BeginInjectBatch() {
+    g_injectBatch.active = true;
+}
 
-        QueueEvent("EVT NOTIFY ERR:INVALID PARAMETER");
-        return;
+// 批末调用：按输出节奏决定本批的移动是立即送出还是留给定时器
+void FlushInjectBatch() {
+    InjectBatch& batch = g_injectBatch;
+    batch.active = false;
+    if (batch.count == 0) return;
+    const uint64_t period = g_outputPeriodUs;
+    if (period != 0 && !batch.hasButton) {
+        const uint64_t nowUs = ClockNowUs();
+        if (nowUs < batch.nextFlushUs) return;
+        batch.nextFlushUs = nowUs + period;
     }
+    SendInjectEntries(batch);
+}
 
-    if (cmd == "FEATURE") {
-        std::string arg;
-        iss >> arg;
-        arg = ToUpperAscii(arg);
-
-        if (arg == "ON") {
-            if (!g_powerEnabled.load()) {
-                QueueEvent("EVT NOTIFY ERR:POWER OFF");
-                return;
-            }
-            g_featureEnabled.store(true);
-            QueueEvent("EVT FEATURE ON");
-            return;
-        }
+// 按输出节奏推迟的移动的送出时刻（ClockNowUs，0 = 无待送）
+uint64_t PendingInjectDueUs() {
+    const InjectBatch& batch = g_injectBatch;
+    return batch.count != 0 ? batch.nextFlushUs : 0;
+}
 
-        if (arg == "OFF") {
-            g_featureEnabled.store(false);
-            ReleaseToIdle();
-            QueueEvent("EVT FEATURE OFF");
-            return;
-        }
+// 输入源的输出定时器到期时调用；force 用于输入结束时送出剩余移动
+void FlushDueInject(bool force) {
+    InjectBatch& batch = g_injectBatch;
+    if (batch.count == 0) return;
+    const uint64_t nowUs = ClockNowUs();
+    if (!force && nowUs < batch.nextFlushUs) return;
+    batch.nextFlushUs = nowUs + g_outputPeriodUs;
+    SendInjectEntries(batch);
+}
 
-        QueueEvent("EVT NOTIFY ERR:INVALID PARAMETER");
-        return;
-    }
+// 模拟鼠标左键按下
+void MouseLeftDown() {
+    AppendInject(INJECT_LEFT_DOWN, 0, 0);
+}
 
-    if (cmd == "SET_SENS") {
-        double value = 0.0;
-        if (!(iss >> value)) {
-            QueueEvent("EVT NOTIFY ERR:INVALID PARAMETER");
-            return;
-        }
+// 模拟鼠标左键抬起
+void MouseLeftUp() {
+    AppendInject(INJECT_LEFT_UP, 0, 0);
+}
 
-        if (value < 0.001) value = 0.001;
-        if (value > 100.0) value = 100.0;
-        g_currentSensitivity = value;
+// 手动移动光标（用于注册鼠标控制光标）；sourceTicks 为对应包的到达时间，用于端到端延迟
+void MoveCursorBy(LONG dx, LONG dy, uint64_t sourceTicks) {
+    if (dx == 0 && dy == 0) return;
 
-        if (g_powerEnabled.load() && !g_registeredHardwareId.empty()) {
-            std::string err;
-            if (!ApplySensitivityMultiplier(value, err)) {
-                QueueEvent(std::string("EVT NOTIFY ERR:") + err);
-            }
+    if (g_injectMode.load(std::memory_order_relaxed) == InjectMode::SET_CURSOR_POS) {
+        g_injectCalls.fetch_add(2, std::memory_order_relaxed);
+#ifdef _WIN32
+        if (g_injectOutput.load(std::memory_order_relaxed)) {
+            ScopedLatency timing(STAGE_INJECT);
+            POINT pt;
+            if (!GetCursorPos(&pt)) return;
+
+            pt.x += dx;
+            pt.y += dy;
+            SetCursorPos(pt.x, pt.y);
         }
-
-        {
-            char buf[64] = {0};
-            snprintf(buf, sizeof(buf), "EVT SENS_APPLIED %.3f", value);
-            QueueEvent(buf);
+#endif
+        if (sourceTicks != 0) {
+            RecordLatency(STAGE_END_TO_END, TicksToNs(StatsNowTicks() - sourceTicks));
         }
         return;
     }
 
-    QueueEvent("EVT NOTIFY ERR:UNKNOWN COMMAND");
+    InjectBatch& batch = g_injectBatch;
+    LONG outX = dx;
+    LONG outY = dy;
+    const double scale = g_injectScale;
+    if (scale != 1.0) {
+        batch.remX += static_cast<double>(dx) * scale;
+        batch.remY += static_cast<double>(dy) * scale;
+        outX = static_cast<LONG>(batch.remX);
+        outY = static_cast<LONG>(batch.remY);
+        batch.remX -= outX;
+        batch.remY -= outY;
+        if (outX == 0 && outY == 0) return;
+    }
+    batch.sentX += outX;
+    batch.sentY += outY;
+    if (sourceTicks != 0 && batch.sourceTicks == 0) batch.sourceTicks = sourceTicks;
+    AppendInject(INJECT_MOVE, outX, outY);
 }
 
-// ========== 状态机辅助函数 ==========
-
-// 判断其他鼠标的移动是否超过死区（用于过滤抖动）
-bool IsOtherMouseMovementSignificant(LONG dx, LONG dy) {
-    return (std::abs(dx) + std::abs(dy)) >= DEADZONE_THRESHOLD;
+// --inject-bench：按 1/4/8 kHz 的注册鼠标包（每包一批，即输入线程跟得上的情况）比较逐包 SetCursorPos、
+// 每批 SendInput 与 1 kHz 输出节奏的注入调用次数，并检查非整数缩放下的小数累计。
+// 只计数不注入，时间用虚拟时钟；Windows 上另测一次零位移调用的实际开销
+static int RunInjectBench(long seconds) {
+    g_injectOutput.store(false);
+    g_clock = &g_virtualClock;
+    const unsigned kRates[] = {1000, 4000, 8000};
+    struct BenchPath {
+        InjectMode mode;
+        uint64_t periodUs;
+    };
+    const BenchPath kPaths[] = {
+        {InjectMode::SET_CURSOR_POS, 0},
+        {InjectMode::SEND_INPUT, 0},
+        {InjectMode::SEND_INPUT, 1000},
+    };
+    const int kPathCount = sizeof(kPaths) / sizeof(kPaths[0]);
+
+    for (unsigned rate : kRates) {
+        const uint64_t packets = static_cast<uint64_t>(rate) * static_cast<uint64_t>(seconds);
+        const uint64_t intervalUs = 1000000ull / rate;
+        const uint64_t cycle = rate / 4;  // 每 250ms 按下一次，200ms 后抬起
+        double callsPerSec[kPathCount] = {};
+        double nsPerPacket[kPathCount] = {};
+        for (int m = 0; m < kPathCount; ++m) {
+            g_injectMode.store(kPaths[m].mode);
+            g_outputPeriodUs = kPaths[m].periodUs;
+            g_injectScale = 1.0;
+            g_injectBatch = InjectBatch();
+            uint64_t nowUs = g_virtualClock.NowUs();
+            const uint64_t callsBefore = g_injectCalls.load();
+            const uint64_t start = StatsNowTicks();
+            for (uint64_t k = 0; k < packets; ++k) {
+                nowUs += intervalUs;
+                g_virtualClock.AdvanceTo(nowUs);
+                FlushDueInject(false);  // 输出定时器
+                BeginInjectBatch();
+                if (k % cycle == 0) MouseLeftDown();
+                else if (k % cycle == cycle * 4 / 5) MouseLeftUp();
+                MoveCursorBy(1, -1);
+                FlushInjectBatch();
+            }
+            FlushDueInject(true);
+            const uint64_t elapsedNs = TicksToNs(StatsNowTicks() - start);
+            callsPerSec[m] = static_cast<double>(g_injectCalls.load() - callsBefore) / static_cast<double>(seconds);
+            nsPerPacket[m] = static_cast<double>(elapsedNs) / static_cast<double>(packets);
+        }
+        printf("INJECT_BENCH rate=%u calls_per_sec setcursorpos=%.0f sendinput=%.0f sendinput@1kHz=%.0f "
+               "build_ns_per_packet=%.1f/%.1f/%.1f\n",
+               rate, callsPerSec[0], callsPerSec[1], callsPerSec[2], nsPerPacket[0], nsPerPacket[1], nsPerPacket[2]);
+    }
+    g_outputPeriodUs = 0;
+
+    // 小数累计：速度 1.5x 时每 3 个计数送出 2 个，总量不丢
+    g_injectMode.store(InjectMode::SEND_INPUT);
+    g_injectScale = 1.0 / 1.5;
+    g_injectBatch = InjectBatch();
+    const long kMoves = 300000;
+    for (long n = 0; n < kMoves; ++n) {
+        BeginInjectBatch();
+        MoveCursorBy(1, -3);
+        FlushInjectBatch();
+    }
+    const int64_t expectX = static_cast<int64_t>(kMoves / 1.5);
+    const int64_t expectY = -static_cast<int64_t>(kMoves * 3 / 1.5);
+    const bool remainderOk = std::llabs(g_injectBatch.sentX - expectX) <= 1 && std::llabs(g_injectBatch.sentY - expectY) <= 1;
+    printf("INJECT_BENCH remainder sent=(%lld,%lld) expected=(%lld,%lld) %s\n",
+           static_cast<long long>(g_injectBatch.sentX), static_cast<long long>(g_injectBatch.sentY),
+           static_cast<long long>(expectX), static_cast<long long>(expectY), remainderOk ? "ok" : "FAIL");
+
+#ifdef _WIN32
+    // 实际调用开销：SetCursorPos 回到原位，SendInput 零位移，都不移动光标
+    const int kCalls = 1000;
+    POINT pt = {};
+    uint64_t start = StatsNowTicks();
+    for (int n = 0; n < kCalls; ++n) {
+        if (GetCursorPos(&pt)) SetCursorPos(pt.x, pt.y);
+    }
+    const double legacyNs = static_cast<double>(TicksToNs(StatsNowTicks() - start)) / kCalls;
+    INPUT input = {};
+    input.type = INPUT_MOUSE;
+    input.mi.dwFlags = MOUSEEVENTF_MOVE;
+    start = StatsNowTicks();
+    for (int n = 0; n < kCalls; ++n) {
+        SendInput(1, &input, sizeof(INPUT));
+    }
+    const double sendInputNs = static_cast<double>(TicksToNs(StatsNowTicks() - start)) / kCalls;
+    printf("INJECT_BENCH cost getcursorpos+setcursorpos_ns=%.0f sendinput_ns=%.0f\n", legacyNs, sendInputNs);
+#endif
+    return remainderOk ? 0 : 1;
 }
 
-// 手动移动光标（用于注册鼠标控制光标）
-void MoveCursorBy(LONG dx, LONG dy) {
-    if (dx == 0 && dy == 0) return;
-
-    POINT pt;
-    if (!GetCursorPos(&pt)) return;
-
-    pt.x += dx;
-    pt.y += dy;
-    SetCursorPos(pt.x, pt.y);
+// ========== IPC 事件队列 ==========
+
+// 事件记录：定长 POD，生产者只填字段，文本在 FlushEvents 中统一格式化
+struct EventRecord {
+    uint64_t seq;          // 全局序号，合并多个生产者时恢复发出顺序
+    double values[5];
+    EventKind kind;
+    uint8_t valueCount;
+    char text[86];
+};
+
+// 事件分两条通道：
+//  - 有序通道（EventRing + 溢出队列）：FIRING / REGISTERED / POWER_APPLIED 等状态事件，按序全部送达
+//  - 合并槽（CoalescingSlot）：SCAN_PROGRESS / INPUT_BACKLOG 等进度/遥测，只保留最新值
+// 进度刷屏不再占用有序通道，GUI 读取变慢时也只会积压状态事件，而不会收到过期进度。
+
+// 合并槽：生产者覆盖写入最新值，seq 为最后一次发布的全局序号。每个环各有一组，只由环的所属线程写，
+// 写入从不等待；version 为顺序锁，写入期间为奇数，读者在奇数或前后不一致时重读，不会取到拼接的多值记录
+struct CoalescingSlot {
+    std::atomic<uint32_t> version;
+    std::atomic<uint64_t> seq;               // 0 表示从未发布
+    std::atomic<uint64_t> valueBits[5];
+    std::atomic<uint8_t> valueCount;
+};
+
+const EventKind kCoalescedKinds[] = {EVENT_SCAN_PROGRESS, EVENT_INPUT_BACKLOG};
+const size_t kCoalescedKindCount = sizeof(kCoalescedKinds) / sizeof(kCoalescedKinds[0]);
+
+// 单生产者/单消费者环形缓冲（生产者：所属线程；消费者：持有 g_evtFlushMutex 的线程）
+struct EventRing {
+    static const uint64_t kCapacity = 512;   // 2 的幂
+
+    alignas(64) std::atomic<uint64_t> head;  // 生产者写
+    std::atomic<uint64_t> reserved;          // 生产者正在入队的记录序号下界，0 表示空闲
+    std::atomic<bool> owned;                 // 有线程占用；线程退出时归还，未取走的记录留给后来的线程接着写
+    CoalescingSlot slots[kCoalescedKindCount];
+    alignas(64) std::atomic<uint64_t> tail;  // 消费者写
+    alignas(64) EventRecord records[kCapacity];
+};
+
+uint64_t g_coalescedEmittedSeq[kCoalescedKindCount];  // 消费者已输出的各合并事件序号
+
+// 生产事件的线程：主线程、输入线程、钩子线程、IPC stdin 读取线程、设置应用线程、启动时的设置线程，
+// 再留出余量给基准/临时线程
+const unsigned kMaxEventProducers = 8;
+EventRing g_eventRings[kMaxEventProducers];
+std::atomic<unsigned> g_eventRingsUsed(0);  // 曾被占用过的最高环位 + 1（消费者遍历这么多个）
+std::atomic<uint64_t> g_eventSeq(1);
+
+// 冷路径：超出生产者数量的线程、环已满或放不进 inline 文本的事件，放在堆上并加锁入队（不丢弃）
+struct OverflowEvent {
+    EventRecord record;
+    std::string text;
+};
+
+std::mutex g_evtOverflowMutex;
+std::vector<OverflowEvent> g_evtOverflow;
+
+std::mutex g_evtFlushMutex;  // 仅消费者之间互斥（主线程 / 输入线程都可能 flush）
+
+static const char* EventKindName(EventKind kind) {
+    switch (kind) {
+        case EVENT_READY: return "READY";
+        case EVENT_PONG: return "PONG";
+        case EVENT_EXITING: return "EXITING";
+        case EVENT_EXITED: return "EXITED";
+        case EVENT_RESET: return "RESET";
+        case EVENT_INPUT_READY: return "INPUT_READY";
+        case EVENT_POWER_ON: return "POWER ON";
+        case EVENT_POWER_OFF: return "POWER OFF";
+        case EVENT_POWER_APPLIED_ON: return "POWER_APPLIED ON";
+        case EVENT_POWER_APPLIED_OFF: return "POWER_APPLIED OFF";
+        case EVENT_FEATURE_ON: return "FEATURE ON";
+        case EVENT_FEATURE_OFF: return "FEATURE OFF";
+        case EVENT_FIRING_ON: return "FIRING ON";
+        case EVENT_FIRING_OFF: return "FIRING OFF";
+        case EVENT_SCAN_PROGRESS: return "SCAN_PROGRESS";
+        case EVENT_SENS_APPLIED: return "SENS_APPLIED";
+        case EVENT_REGISTERED: return "REGISTERED";
+        case EVENT_NOTIFY: return "NOTIFY";
+        case EVENT_INPUT_BACKLOG: return "INPUT_BACKLOG";
+        case EVENT_REPLAY_DONE: return "REPLAY_DONE";
+        case EVENT_STATS: return "STATS";
+        case EVENT_STATS_DEVICE: return "STATS_DEVICE";
+        case EVENT_STATS_END: return "STATS_END";
+        case EVENT_HOOK_LAG: return "HOOK_LAG";
+        case EVENT_SCAN_DECIDED: return "SCAN_DECIDED";
+        case EVENT_STATS_SETTINGS: return "STATS_SETTINGS";
+        default: return "UNKNOWN";
+    }
 }
 
-// 获取冷却期时长（使用系统双击时间）
-DWORD GetCooldownDuration() {
-    DWORD cooldown = GetDoubleClickTime();
-    if (cooldown == 0) cooldown = 500;
-    return cooldown;
+// 把一条记录格式化为协议文本行（不含换行），返回写入长度；text 通常为 r.text
+static int FormatEventRecord(const EventRecord& r, const char* text, char* out, size_t size) {
+    const char* name = EventKindName(r.kind);
+    const double* v = r.values;
+    int n = 0;
+    switch (r.kind) {
+        case EVENT_SCAN_PROGRESS:
+            n = snprintf(out, size, "EVT %s %.2f", name, v[0]);
+            break;
+        case EVENT_SENS_APPLIED:
+            n = snprintf(out, size, "EVT %s %.3f", name, v[0]);
+            break;
+        case EVENT_REGISTERED:
+        case EVENT_NOTIFY:
+            n = snprintf(out, size, "EVT %s %s", name, text);
+            break;
+        case EVENT_INPUT_BACKLOG:
+            n = snprintf(out, size, "EVT %s %.0f %.0f %.0f %.0f", name, v[0], v[1], v[2], v[3]);
+            break;
+        case EVENT_REPLAY_DONE:
+            n = snprintf(out, size, "EVT %s %.0f %.6f %.0f", name, v[0], v[1], v[2]);
+            break;
+        case EVENT_STATS:
+            n = snprintf(out, size, "EVT %s %s %.0f %.2f %.2f %.2f %.2f", name, text, v[0], v[1], v[2], v[3], v[4]);
+            break;
+        case EVENT_STATS_DEVICE:
+            n = snprintf(out, size, "EVT %s %s %.0f %.1f", name, text, v[0], v[1]);
+            break;
+        case EVENT_HOOK_LAG:
+            n = snprintf(out, size, "EVT %s %.0f %.0f", name, v[0], v[1]);
+            break;
+        case EVENT_SCAN_DECIDED:
+            n = snprintf(out, size, "EVT %s %.1f %.0f %.0f %.2f", name, v[0], v[1], v[2], v[3]);
+            break;
+        case EVENT_STATS_SETTINGS:
+            n = snprintf(out, size, "EVT %s %.0f %.0f %.0f %.0f %.0f", name, v[0], v[1], v[2], v[3], v[4]);
+            break;
+        default:
+            n = snprintf(out, size, "EVT %s", name);
+            break;
+    }
+    if (n < 0) return 0;
+    return n < static_cast<int>(size) ? n : static_cast<int>(size) - 1;
 }
 
-// 进入 LOCKED 状态：按下左键，开始阻止其他鼠标
-void EnterLockedState() {
-    bool wasDown = g_isMouseDown.exchange(true);
-    if (!wasDown) {
-        MouseLeftDown();
-        QueueEvent("EVT FIRING ON");
+// 事件由谁写出：主线程每轮 flush；输入线程在批次结束时 flush 本批入队的事件；
+// 其它线程（以及输入线程在批次之外）入队后唤醒主线程代为输出
+struct EventProducerState {
+    bool mainThread = false;
+    bool inMouseBatch = false;
+    bool batchEvents = false;
+};
+
+thread_local EventProducerState g_eventProducer;
+
+// 线程第一次入队时占用一个空闲的环，线程退出时（TLS 析构）归还
+struct EventRingLease {
+    EventRing* ring = nullptr;
+    bool claimed = false;
+    ~EventRingLease() {
+        if (ring) ring->owned.store(false, std::memory_order_release);
+    }
+};
+
+static EventRing* CurrentEventRing() {
+    thread_local EventRingLease s_lease;
+    if (!s_lease.claimed) {
+        s_lease.claimed = true;
+        for (unsigned i = 0; i < kMaxEventProducers; ++i) {
+            bool expected = false;
+            if (!g_eventRings[i].owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) continue;
+            s_lease.ring = &g_eventRings[i];
+            unsigned used = g_eventRingsUsed.load();
+            while (used < i + 1 && !g_eventRingsUsed.compare_exchange_weak(used, i + 1)) {
+            }
+            break;
+        }
     }
-    g_lastRegisteredMoveTime.store(GetTickCount());
-    g_lockState.store(LockState::LOCKED);
-    g_blockingMouse.store(true);
+    return s_lease.ring;
 }
 
-// 进入 UNLOCKABLE 状态：等待其他鼠标移动来触发释放
-void EnterUnlockableState() {
-    if (g_lockState.load() == LockState::LOCKED) {
-        g_lockState.store(LockState::UNLOCKABLE);
+// 合并事件在 kCoalescedKinds 中的下标；有序事件返回 -1
+static int CoalescedKindIndex(EventKind kind) {
+    for (size_t i = 0; i < kCoalescedKindCount; ++i) {
+        if (kCoalescedKinds[i] == kind) return static_cast<int>(i);
     }
+    return -1;
 }
 
-// 释放到 IDLE 状态：抬起左键，停止阻止，设置冷却期
-void ReleaseToIdle() {
-    bool wasDown = g_isMouseDown.exchange(false);
-    if (wasDown) {
-        MouseLeftUp();
-        QueueEvent("EVT FIRING OFF");
-    }
-    g_lockState.store(LockState::IDLE);
-    g_blockingMouse.store(false);
-    g_cooldownUntil.store(GetTickCount() + GetCooldownDuration());
+static void StoreOverflowEvent(EventRing* ring, uint64_t seq, EventKind kind, const char* text, const char* suffix,
+                               const double* values, size_t valueCount) {
+    OverflowEvent slow;
+    slow.record = EventRecord();
+    slow.record.kind = kind;
+    slow.record.valueCount = static_cast<uint8_t>(valueCount);
+    for (size_t i = 0; i < valueCount; ++i) slow.record.values[i] = values[i];
+    slow.text = std::string(text ? text : "") + (suffix ? suffix : "");
+    std::lock_guard<std::mutex> lock(g_evtOverflowMutex);
+    // 没有环的线程在锁内取序号：消费者在同一把锁内读取序号水位，取到的序号与入队对消费者是原子的
+    slow.record.seq = ring ? seq : g_eventSeq.fetch_add(1);
+    g_evtOverflow.push_back(std::move(slow));
 }
 
-// 安全清理：确保程序退出时不会留下按住的左键
-void FailsafeCleanup() {
-    static std::atomic<bool> s_cleanupRan{false};
-    if (s_cleanupRan.exchange(true)) {
+// 热路径入队：不分配、不加锁、不等待。进度类事件覆盖本线程环上的合并槽；其余进入本线程的有序环；
+// 没有环的线程走加锁的溢出队列（进度类事件也按序送达）。
+// 序号在写入记录之前取得，别的线程可能先发布了更大的序号；入队期间在环上登记序号下界，
+// 消费者只输出低于所有登记值的记录，其余留到下一轮（见 DrainEventsLocked）
+static void StoreEventRecord(EventKind kind, const char* text, const char* suffix, const double* values, size_t valueCount) {
+    EventRing* ring = CurrentEventRing();
+    if (!ring) {
+        StoreOverflowEvent(nullptr, 0, kind, text, suffix, values, valueCount);
         return;
     }
 
-    // Ensure the auto-click feature is fully disabled before restoring sensitivity.
-    g_featureEnabled.store(false);
-    g_powerEnabled.store(false);
-    ReleaseToIdle();
+    ring->reserved.store(g_eventSeq.load(), std::memory_order_seq_cst);
+    const uint64_t seq = g_eventSeq.fetch_add(1, std::memory_order_seq_cst);
+
+    const int coalesced = CoalescedKindIndex(kind);
+    if (coalesced >= 0) {
+        CoalescingSlot& slot = ring->slots[coalesced];
+        const uint32_t version = slot.version.load(std::memory_order_relaxed);
+        slot.version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < valueCount; ++i) {
+            uint64_t bits = 0;
+            memcpy(&bits, &values[i], sizeof(bits));
+            slot.valueBits[i].store(bits, std::memory_order_relaxed);
+        }
+        slot.valueCount.store(static_cast<uint8_t>(valueCount), std::memory_order_relaxed);
+        slot.seq.store(seq, std::memory_order_relaxed);
+        slot.version.store(version + 2, std::memory_order_release);
+        ring->reserved.store(0, std::memory_order_release);
+        return;
+    }
 
-    bool wasDown = g_isMouseDown.exchange(false);
-    if (wasDown) {
-        MouseLeftUp();
-        QueueEvent("EVT FIRING OFF");
+    const size_t textLen = text ? strlen(text) : 0;
+    const size_t suffixLen = suffix ? strlen(suffix) : 0;
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const bool ringFull = head - ring->tail.load(std::memory_order_acquire) >= EventRing::kCapacity;
+
+    if (ringFull || textLen + suffixLen >= sizeof(EventRecord::text)) {
+        StoreOverflowEvent(ring, seq, kind, text, suffix, values, valueCount);
+        ring->reserved.store(0, std::memory_order_release);
+        return;
     }
-    g_blockingMouse.store(false);
-    g_lockState.store(LockState::IDLE);
-    UninstallMouseHook();
 
-    // 退出时恢复鼠标灵敏度：清理 settings.json 中的设备映射
-    std::lock_guard<std::mutex> lock(g_settingsMutex);
-    std::string content;
-    if (ReadFileContent(g_settingsPath.c_str(), content)) {
-        if (RemoveOldSensDeviceMappings(content, std::string())) {
-            if (WriteFileContent(g_settingsPath.c_str(), content)) {
-                if (!g_ipcMode.load()) {
-                    printf("\n[EXIT] Restored mouse sensitivity (cleared device mappings)\n");
-                }
-                RunWriterExe();  // 应用配置
-            }
-        }
+    EventRecord& r = ring->records[head & (EventRing::kCapacity - 1)];
+    r.seq = seq;
+    r.kind = kind;
+    r.valueCount = static_cast<uint8_t>(valueCount);
+    for (size_t i = 0; i < valueCount; ++i) r.values[i] = values[i];
+    if (textLen) memcpy(r.text, text, textLen);
+    if (suffixLen) memcpy(r.text + textLen, suffix, suffixLen);
+    r.text[textLen + suffixLen] = '\0';
+    ring->head.store(head + 1, std::memory_order_release);
+    ring->reserved.store(0, std::memory_order_release);
+}
+
+// 请求输出已入队的事件：批次内留到批次结束时 flush，其它非主线程唤醒主线程
+static void RequestEventFlush() {
+    EventProducerState& producer = g_eventProducer;
+    if (producer.inMouseBatch) {
+        producer.batchEvents = true;
+    } else if (!producer.mainThread) {
+        WakeMainLoop();
     }
 }
 
-// 双击 Caps Lock 触发的完整重置：
-// - 恢复灵敏度为 1.0（如有已注册设备则同步 settings.json 并尝试 writer.exe 应用）
-// - 关闭自动按左键功能并释放按键
-// - 取消注册设备，回到注册模式
-void PerformFullReset() {
-    const bool ipc = g_ipcMode.load();
+static void PushEventRecord(EventKind kind, const char* text, const char* suffix, const double* values, size_t valueCount) {
+    if (!g_ipcMode.load(std::memory_order_relaxed)) return;
 
-    if (!ipc) {
-        printf("\n[RESET] Full reset triggered (Caps Lock double-press)\n");
-        fflush(stdout);
-    }
+    StoreEventRecord(kind, text, suffix, values, valueCount);
+    // 合并槽的值随下一次 flush 带出；何时主动请求 flush 由生产者自己节流（见 QueueEventValueThrottled）
+    if (CoalescedKindIndex(kind) < 0) RequestEventFlush();
+}
 
-    if (ipc) {
-        g_powerEnabled.store(false);
+void QueueEvent(EventKind kind) {
+    PushEventRecord(kind, nullptr, nullptr, nullptr, 0);
+}
+
+void QueueEventValue(EventKind kind, double value) {
+    PushEventRecord(kind, nullptr, nullptr, &value, 1);
+}
+
+// 合并槽事件：总是更新最新值，flush 为 true 时才请求输出
+static void QueueEventValueThrottled(EventKind kind, double value, bool flush) {
+    PushEventRecord(kind, nullptr, nullptr, &value, 1);
+    if (flush && g_ipcMode.load(std::memory_order_relaxed)) RequestEventFlush();
+}
+
+void QueueEventText(EventKind kind, const char* text, const char* suffix) {
+    PushEventRecord(kind, text, suffix, nullptr, 0);
+}
+
+void QueueEventValues(EventKind kind, const char* text, std::initializer_list<double> values) {
+    PushEventRecord(kind, text, nullptr, values.begin(), std::min<size_t>(values.size(), 5));
+}
+
+void QueueNotifyError(const char* detail) {
+    PushEventRecord(EVENT_NOTIFY, "ERR:", detail, nullptr, 0);
+}
+
+// 二进制帧（--ipc=binary）：小端，所有命令与事件共用同一帧头
+//   u32 length（其后字节数） | u8 version | u8 type | payload
+// 事件 payload：u8 valueCount | f64 * valueCount | u16 textLength | text
+// 命令 payload：POWER/FEATURE 为 u8（1=ON，0=OFF）；SET_SENS 为 f64；其余为空
+const uint8_t kIpcFrameVersion = 1;
+const uint32_t kIpcMaxFrameLength = 4096;
+
+static void AppendLE(std::string& out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) {
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
     }
+}
 
-    // 关闭自动按键功能并确保释放
-    g_featureEnabled.store(false);
-    ReleaseToIdle();
+static uint64_t ReadLE(const uint8_t* p, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(p[i]) << (8 * i);
+    }
+    return value;
+}
 
-    // 恢复灵敏为 1.0（程序内状态）
-    g_currentSensitivity = 1.0;
+static void AppendF64(std::string& out, double value) {
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    AppendLE(out, bits, 8);
+}
 
-    // IPC 模式：先切回注册/SCAN 状态并立即发 EVT，避免 reset 的耗时操作阻塞首次进度上报
-    if (ipc) {
-        // 取消注册并回到注册模式
-        g_registeredDevice.store(NULL);
-        g_pendingDevice.store(NULL);
-        g_registrationMode.store(true);
-        g_pendingDevicePath[0] = L'\0';
-        g_registeredDevicePath[0] = L'\0';
-        g_registeredHardwareId.clear();
-        ClearLastRegisteredHardwareId();
+static double ReadF64(const uint8_t* p) {
+    const uint64_t bits = ReadLE(p, 8);
+    double value = 0.0;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
 
-        // 重置状态机/统计相关状态
-        g_lastRegisteredMoveTime.store(0);
-        g_cooldownUntil.store(0);
-        g_lockState.store(LockState::IDLE);
-        g_blockingMouse.store(false);
-        g_otherMouseActive.store(false);
-        g_extraInfoValid.store(false);
-        g_moveCount = 0;
-        g_lastRawX = 0;
-        g_lastRawY = 0;
+static void AppendFrameHeader(std::string& out, uint32_t payloadLength, uint8_t type) {
+    AppendLE(out, payloadLength + 2, 4);
+    out += static_cast<char>(kIpcFrameVersion);
+    out += static_cast<char>(type);
+}
 
-        {
-            std::lock_guard<std::mutex> lock(g_scanMutex);
-            g_scanAccum.clear();
-            g_scanTotalAccum = 0.0f;
-            g_lastScanEmitDevice.store(nullptr);
-            g_lastScanEmitTick.store(0);
-        }
+// 按当前 IPC 编码追加一条事件（文本行或二进制帧）
+static void AppendEventOutput(std::string& out, const EventRecord& r, const char* text) {
+    if (g_ipcEncoding == IpcEncoding::BINARY) {
+        const size_t textLen = std::min<size_t>(strlen(text), 0xFFFF);
+        AppendFrameHeader(out, static_cast<uint32_t>(1 + r.valueCount * 8 + 2 + textLen), static_cast<uint8_t>(r.kind));
+        out += static_cast<char>(r.valueCount);
+        for (uint8_t i = 0; i < r.valueCount; ++i) AppendF64(out, r.values[i]);
+        AppendLE(out, textLen, 2);
+        out.append(text, textLen);
+        return;
+    }
 
-        QueueEvent("EVT SCAN_PROGRESS 0.0");
-        QueueEvent("EVT SENS_APPLIED 1.0");
-        QueueEvent("EVT RESET");
-        QueueEvent("EVT POWER OFF");
-        QueueEvent("EVT FEATURE OFF");
-        FlushEvents();
+    char line[256];
+    const size_t needed = strlen(text) + 160;
+    if (needed <= sizeof(line)) {
+        out.append(line, static_cast<size_t>(FormatEventRecord(r, text, line, sizeof(line))));
+    } else {
+        std::string longLine(needed, '\0');
+        out.append(longLine.data(), static_cast<size_t>(FormatEventRecord(r, text, &longLine[0], longLine.size())));
     }
+    out += '\n';
+}
 
-    // 清理 settings.json 中映射到 sens_registered_mouse 的设备，避免残留映射影响其他鼠标
+// 取出所有环中的记录，按序号合并后一次性写出（调用方持有 g_evtFlushMutex）。
+// 只输出序号低于水位的记录：水位取本轮开始时的全局序号与各环登记的入队中序号的最小值，
+// 低于水位的序号都已发布；高于水位的记录留在 s_pending / s_overflow，由其生产者入队后触发的下一轮输出
+static void DrainEventsLocked() {
+    static std::vector<EventRecord> s_pending;
+    static std::vector<OverflowEvent> s_overflow;
+    static std::string s_out;
+
+    // 先取溢出队列再取环：同一生产者溢出前写入环的记录一定能在本轮取到，保证有序通道不乱序
+    uint64_t watermark = 0;
     {
-        std::lock_guard<std::mutex> lock(g_settingsMutex);
-        std::string content;
-        if (ReadFileContent(g_settingsPath.c_str(), content)) {
-            if (RemoveOldSensDeviceMappings(content, std::string())) {
-                if (!WriteFileContent(g_settingsPath.c_str(), content)) {
-                    if (!ipc) {
-                        printf("[RESET] [WARN] Failed to write settings.json while clearing device mappings.\n");
-                    }
-                } else {
-                    if (!ipc) {
-                        printf("[RESET] Cleared device mappings for profile: %s\n", SENS_PROFILE_NAME);
-                        printf("[RESET] Running writer.exe to apply configuration...\n");
-                    }
-                    if (!RunWriterExe()) {
-                        if (!ipc) {
-                            printf("[RESET] [WARN] writer.exe may have failed. Check if RawAccel is running.\n");
-                        }
-                    }
-                }
-            } else {
-                if (!ipc) {
-                    printf("[RESET] [WARN] Failed to clear device mappings (devices array parse failed).\n");
+        std::lock_guard<std::mutex> lock(g_evtOverflowMutex);
+        watermark = g_eventSeq.load(std::memory_order_seq_cst);
+        s_overflow.reserve(s_overflow.size() + g_evtOverflow.size());
+        for (OverflowEvent& e : g_evtOverflow) s_overflow.push_back(std::move(e));
+        g_evtOverflow.clear();
+    }
+
+    const unsigned used = std::min(g_eventRingsUsed.load(), kMaxEventProducers);
+    for (unsigned i = 0; i < used; ++i) {
+        const uint64_t reserved = g_eventRings[i].reserved.load(std::memory_order_seq_cst);
+        if (reserved != 0) watermark = std::min(watermark, reserved);
+    }
+    for (unsigned i = 0; i < used; ++i) {
+        EventRing& ring = g_eventRings[i];
+        const uint64_t head = ring.head.load(std::memory_order_acquire);
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        for (; tail != head; ++tail) {
+            s_pending.push_back(ring.records[tail & (EventRing::kCapacity - 1)]);
+        }
+        ring.tail.store(tail, std::memory_order_release);
+    }
+
+    // 合并槽：各环中取序号最新的值，自上次输出后有更新才输出一次，按发布序号插入有序事件之间。
+    // 写者正写到一半（被抢占）时不等它：重读几次仍不一致就跳过该槽，并唤醒主线程稍后再取
+    bool slotBusy = false;
+    for (size_t i = 0; i < kCoalescedKindCount; ++i) {
+        EventRecord latest = EventRecord();
+        for (unsigned ringIndex = 0; ringIndex < used; ++ringIndex) {
+            CoalescingSlot& slot = g_eventRings[ringIndex].slots[i];
+            const uint64_t published = slot.seq.load(std::memory_order_acquire);
+            if (published <= std::max(g_coalescedEmittedSeq[i], latest.seq)) continue;
+            EventRecord r = EventRecord();
+            bool consistent = false;
+            for (int attempt = 0; attempt < 4 && !consistent; ++attempt) {
+                const uint32_t version = slot.version.load(std::memory_order_acquire);
+                if ((version & 1) != 0) continue;
+                r.seq = slot.seq.load(std::memory_order_relaxed);
+                r.valueCount = std::min<uint8_t>(slot.valueCount.load(std::memory_order_relaxed), 5);
+                for (uint8_t v = 0; v < r.valueCount; ++v) {
+                    const uint64_t bits = slot.valueBits[v].load(std::memory_order_relaxed);
+                    memcpy(&r.values[v], &bits, sizeof(bits));
                 }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                consistent = version == slot.version.load(std::memory_order_relaxed);
             }
-        } else {
-            if (!ipc) {
-                printf("[RESET] [WARN] Failed to read settings.json while clearing device mappings.\n");
+            if (!consistent) {
+                slotBusy = true;
+                continue;
             }
+            if (r.seq > latest.seq) latest = r;
         }
-        if (!ipc) {
-            fflush(stdout);
+        if (latest.seq <= g_coalescedEmittedSeq[i]) continue;
+        latest.kind = kCoalescedKinds[i];
+        g_coalescedEmittedSeq[i] = latest.seq;
+        s_pending.push_back(latest);
+    }
+    if (slotBusy) WakeMainLoop();
+    if (s_pending.empty() && s_overflow.empty()) return;
+
+    ScopedLatency timing(STAGE_FLUSH);
+    std::sort(s_pending.begin(), s_pending.end(),
+              [](const EventRecord& a, const EventRecord& b) { return a.seq < b.seq; });
+    std::sort(s_overflow.begin(), s_overflow.end(),
+              [](const OverflowEvent& a, const OverflowEvent& b) { return a.record.seq < b.record.seq; });
+    const size_t pendingReady = static_cast<size_t>(
+        std::lower_bound(s_pending.begin(), s_pending.end(), watermark,
+                         [](const EventRecord& r, uint64_t seq) { return r.seq < seq; }) - s_pending.begin());
+    const size_t overflowReady = static_cast<size_t>(
+        std::lower_bound(s_overflow.begin(), s_overflow.end(), watermark,
+                         [](const OverflowEvent& e, uint64_t seq) { return e.record.seq < seq; }) - s_overflow.begin());
+
+    s_out.clear();
+    size_t next = 0;
+    for (size_t i = 0; i < pendingReady; ++i) {
+        const EventRecord& r = s_pending[i];
+        while (next < overflowReady && s_overflow[next].record.seq < r.seq) {
+            AppendEventOutput(s_out, s_overflow[next].record, s_overflow[next].text.c_str());
+            ++next;
         }
+        AppendEventOutput(s_out, r, r.text);
+    }
+    for (; next < overflowReady; ++next) {
+        AppendEventOutput(s_out, s_overflow[next].record, s_overflow[next].text.c_str());
     }
+    s_pending.erase(s_pending.begin(), s_pending.begin() + pendingReady);
+    s_overflow.erase(s_overflow.begin(), s_overflow.begin() + overflowReady);
+    if (s_out.empty()) return;
 
-    if (!ipc) {
-        // 取消注册并回到注册模式
-        g_registeredDevice.store(NULL);
-        g_pendingDevice.store(NULL);
-        g_registrationMode.store(true);
-        g_pendingDevicePath[0] = L'\0';
-        g_registeredDevicePath[0] = L'\0';
-        g_registeredHardwareId.clear();
-        ClearLastRegisteredHardwareId();
+    fwrite(s_out.data(), 1, s_out.size(), stdout);
+    fflush(stdout);
+}
 
-        // 重置状态机/统计相关状态
-        g_lastRegisteredMoveTime.store(0);
-        g_cooldownUntil.store(0);
-        g_lockState.store(LockState::IDLE);
-        g_blockingMouse.store(false);
-        g_otherMouseActive.store(false);
-        g_extraInfoValid.store(false);
-        g_moveCount = 0;
-        g_lastRawX = 0;
-        g_lastRawY = 0;
+void FlushEvents() {
+    if (!g_ipcMode.load()) return;
+    std::lock_guard<std::mutex> lock(g_evtFlushMutex);
+    DrainEventsLocked();
+}
+
+// 输入线程使用：其他线程正在输出时直接返回 false，由调用方唤醒主线程补写
+static bool TryFlushEvents() {
+    if (!g_ipcMode.load()) return true;
+    std::unique_lock<std::mutex> lock(g_evtFlushMutex, std::try_to_lock);
+    if (!lock.owns_lock()) return false;
+    DrainEventsLocked();
+    return true;
+}
+
+// --ipc-dump：把 stdin 上的二进制事件帧还原成文本协议行，用于核对两种编码的事件序列
+static int RunIpcDump() {
+    uint8_t frame[kIpcMaxFrameLength];
+    uint8_t lengthBytes[4];
+    while (fread(lengthBytes, 1, sizeof(lengthBytes), stdin) == sizeof(lengthBytes)) {
+        const uint32_t length = static_cast<uint32_t>(ReadLE(lengthBytes, 4));
+        if (length < 3 || length > kIpcMaxFrameLength || fread(frame, 1, length, stdin) != length) {
+            fprintf(stderr, "invalid frame\n");
+            return 1;
+        }
+        if (frame[0] != kIpcFrameVersion) {
+            fprintf(stderr, "unsupported frame version %u\n", frame[0]);
+            return 1;
+        }
 
-        {
-            std::lock_guard<std::mutex> lock(g_scanMutex);
-            g_scanAccum.clear();
-            g_scanTotalAccum = 0.0f;
-            g_lastScanEmitDevice.store(nullptr);
-            g_lastScanEmitTick.store(0);
+        EventRecord r = EventRecord();
+        r.kind = static_cast<EventKind>(frame[1]);
+        r.valueCount = std::min<uint8_t>(frame[2], 5);
+        size_t offset = 3;
+        for (uint8_t i = 0; i < frame[2] && offset + 8 <= length; ++i, offset += 8) {
+            if (i < r.valueCount) r.values[i] = ReadF64(frame + offset);
+        }
+        if (offset + 2 > length) {
+            fprintf(stderr, "truncated frame\n");
+            return 1;
         }
-        QueueEvent("EVT SCAN_PROGRESS 0.0");
-        QueueEvent("EVT SENS_APPLIED 1.0");
-        QueueEvent("EVT RESET");
-        QueueEvent("EVT POWER OFF");
-        QueueEvent("EVT FEATURE OFF");
+        const size_t textLength = std::min<size_t>(static_cast<size_t>(ReadLE(frame + offset, 2)), length - offset - 2);
+        const std::string text(reinterpret_cast<const char*>(frame + offset + 2), textLength);
 
-        printf("[REGISTER] Move the mouse you want to register...\n\n");
-        fflush(stdout);
+        std::string line;
+        const IpcEncoding saved = g_ipcEncoding;
+        g_ipcEncoding = IpcEncoding::TEXT;
+        AppendEventOutput(line, r, text.c_str());
+        g_ipcEncoding = saved;
+        fwrite(line.data(), 1, line.size(), stdout);
     }
+    return 0;
 }
 
-// ========== 低级鼠标钩子 ==========
+static void RequestSettingsCleanupForRegisteredMouse(const std::string& hardwareId) {
+    if (hardwareId.empty()) return;
+    if (g_replayMode.load()) return;
+    std::lock_guard<std::mutex> lock(g_settingsWorkMutex);
+    g_pendingSettingsCleanupHardwareId = hardwareId;
+    g_hasPendingSettingsCleanup = true;
+    WakeMainLoop();
+}
 
-// 低级鼠标钩子回调：阻止物理鼠标移动，放行注入事件
-LRESULT CALLBACK LowLevelMouseProc(int nCode, WPARAM wParam, LPARAM lParam) {
-    if (nCode < 0) {
-        return CallNextHookEx(NULL, nCode, wParam, lParam);
+static void ProcessPendingSettingsWork() {
+    std::string hardwareId;
+    {
+        std::lock_guard<std::mutex> lock(g_settingsWorkMutex);
+        if (!g_hasPendingSettingsCleanup) return;
+        hardwareId = g_pendingSettingsCleanupHardwareId;
+        g_pendingSettingsCleanupHardwareId.clear();
+        g_hasPendingSettingsCleanup = false;
     }
 
-    // 只处理鼠标移动事件
-    if (wParam != WM_MOUSEMOVE) {
-        return CallNextHookEx(NULL, nCode, wParam, lParam);
-    }
+    if (hardwareId.empty()) return;
+    if (g_settingsPath.empty()) return;
 
-    // 如果没有启用阻止，直接放行
-    if (!g_blockingMouse.load()) {
-        return CallNextHookEx(NULL, nCode, wParam, lParam);
-    }
+    std::lock_guard<std::mutex> lock(g_settingsMutex);
+    SettingsModel* model = AcquireSettingsModel();
+    if (!model) return;
+    if (!RemoveOldSensDeviceMappings(*model, SensMappedHardwareIds(hardwareId))) return;
+    CommitSettingsModel(*model);
+}
 
-    const MSLLHOOKSTRUCT* info = reinterpret_cast<const MSLLHOOKSTRUCT*>(lParam);
-    if (!info) {
-        return CallNextHookEx(NULL, nCode, wParam, lParam);
+// ----- 文本命令解析（string_view 分词，不分配内存，不依赖 locale） -----
+
+static constexpr char AsciiUpper(char c) {
+    return (c >= 'a' && c <= 'z') ? static_cast<char>(c - 'a' + 'A') : c;
+}
+
+static constexpr bool IsIpcSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// 命令名 → IpcCommandKind 的编译期完美哈希表：hash = (长度 + 首字符 + 2 * 末字符) & 15（按大写计算）
+const size_t kIpcCommandTableSize = 16;
+
+static constexpr size_t IpcCommandHash(std::string_view name) {
+    return (name.size() + static_cast<unsigned char>(AsciiUpper(name.front())) +
+            2u * static_cast<unsigned char>(AsciiUpper(name.back()))) & (kIpcCommandTableSize - 1);
+}
+
+struct IpcCommandName {
+    std::string_view name;
+    IpcCommandKind kind;
+};
+
+constexpr IpcCommandName kIpcCommandNames[] = {
+    {"PING", CMD_PING}, {"POWER", CMD_POWER}, {"FEATURE", CMD_FEATURE}, {"SET_SENS", CMD_SET_SENS},
+    {"RESET", CMD_RESET}, {"QUIT", CMD_QUIT}, {"STATS", CMD_STATS},
+};
+
+struct IpcCommandTable {
+    IpcCommandName slots[kIpcCommandTableSize];
+    bool perfect;
+};
+
+static constexpr IpcCommandTable BuildIpcCommandTable() {
+    IpcCommandTable table = {};
+    table.perfect = true;
+    for (const IpcCommandName& entry : kIpcCommandNames) {
+        IpcCommandName& slot = table.slots[IpcCommandHash(entry.name)];
+        if (!slot.name.empty()) table.perfect = false;
+        slot = entry;
     }
+    return table;
+}
 
-    // 放行注入的事件（包括我们的 SetCursorPos）
-    if (info->flags & LLMHF_INJECTED) {
-        return CallNextHookEx(NULL, nCode, wParam, lParam);
+constexpr IpcCommandTable kIpcCommandTable = BuildIpcCommandTable();
+static_assert(kIpcCommandTable.perfect, "IPC command names collide in IpcCommandHash");
+
+static bool EqualsIgnoreCase(std::string_view token, std::string_view upper) {
+    if (token.size() != upper.size()) return false;
+    for (size_t i = 0; i < token.size(); ++i) {
+        if (AsciiUpper(token[i]) != upper[i]) return false;
     }
+    return true;
+}
 
-    // 阻止物理鼠标的移动
-    return 1;
+static IpcCommandKind LookupIpcCommand(std::string_view token) {
+    if (token.empty()) return CMD_UNKNOWN;
+    const IpcCommandName& slot = kIpcCommandTable.slots[IpcCommandHash(token)];
+    return EqualsIgnoreCase(token, slot.name) ? slot.kind : CMD_UNKNOWN;
 }
 
-// 安装低级鼠标钩子
-bool InstallMouseHook() {
-    if (g_mouseHook != NULL) return true;
-    g_mouseHook = SetWindowsHookEx(WH_MOUSE_LL, LowLevelMouseProc, GetModuleHandle(NULL), 0);
-    return g_mouseHook != NULL;
+// 取下一个以空白分隔的词，rest 前移到该词之后
+static std::string_view NextIpcToken(std::string_view& rest) {
+    size_t begin = 0;
+    while (begin < rest.size() && IsIpcSpace(rest[begin])) ++begin;
+    size_t end = begin;
+    while (end < rest.size() && !IsIpcSpace(rest[end])) ++end;
+    std::string_view token = rest.substr(begin, end - begin);
+    rest.remove_prefix(end);
+    return token;
 }
 
-// 卸载低级鼠标钩子
-void UninstallMouseHook() {
-    if (g_mouseHook) {
-        UnhookWindowsHookEx(g_mouseHook);
-        g_mouseHook = NULL;
+// 接受前导 '+'；整个词须是一个有限的十进制数。nan / inf / "1e" 之类与原先 istream >> double 一样拒绝
+// （from_chars 与 strtod 都接受 nan / inf，NaN 会绕过灵敏度的范围限制写进 settings.json）
+static bool ParseIpcDouble(std::string_view token, double& value) {
+    if (!token.empty() && token.front() == '+') token.remove_prefix(1);
+    if (token.empty()) return false;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    const std::from_chars_result result = std::from_chars(token.data(), token.data() + token.size(), value);
+    if (result.ec != std::errc() || result.ptr != token.data() + token.size()) return false;
+#else
+    // 旧标准库没有浮点 from_chars：复制到栈上用 strtod
+    char buf[64];
+    if (token.size() >= sizeof(buf)) return false;
+    memcpy(buf, token.data(), token.size());
+    buf[token.size()] = '\0';
+    char* endPtr = nullptr;
+    value = std::strtod(buf, &endPtr);
+    if (endPtr != buf + token.size()) return false;
+#endif
+    return std::isfinite(value);
+}
+
+// 解析文本命令行；空行返回 false。编码由 IpcStreamDecoder 在流开头处理，这里只原地跳过行首的
+// UTF-8 BOM（--ipc-bench 等直接喂行的调用方），不复制
+static bool ParseIpcCommandLine(std::string_view line, IpcCommand& command) {
+    std::string_view rest = line;
+    if (rest.size() >= 3 && rest.compare(0, 3, "\xEF\xBB\xBF") == 0) rest.remove_prefix(3);
+    const std::string_view cmd = NextIpcToken(rest);
+    if (cmd.empty()) return false;
+
+    command = IpcCommand();
+    command.kind = LookupIpcCommand(cmd);
+    if (command.kind == CMD_POWER || command.kind == CMD_FEATURE) {
+        const std::string_view arg = NextIpcToken(rest);
+        command.on = EqualsIgnoreCase(arg, "ON");
+        command.hasArg = command.on || EqualsIgnoreCase(arg, "OFF");
+    } else if (command.kind == CMD_SET_SENS) {
+        command.hasArg = ParseIpcDouble(NextIpcToken(rest), command.value);
     }
+    return true;
 }
 
-// 解码 ExtraInformation 获取原始移动量
-// rawaccel 驱动将原始 X,Y 编码为: 低16位=X, 高16位=Y
-void DecodeExtraInfo(ULONG extraInfo, short* rawX, short* rawY) {
-    *rawX = (short)(extraInfo & 0xFFFF);
-    *rawY = (short)((extraInfo >> 16) & 0xFFFF);
+// ----- 文本命令流解码（整段读取 stdin，编码只在流开头判定一次） -----
+// PowerShell 可能把 UTF-16LE/BE 写进本地程序的 stdin，其它工具可能带 UTF-8 BOM。
+// 按行读取会在 UTF-16 的 0x0A 字节处切断码元，所以先按块收窄成 ASCII，再按解码后的换行切分。
+
+enum class IpcStreamEncoding { UNKNOWN, UTF8, UTF16LE, UTF16BE };
+
+const size_t kIpcReadChunk = 16384;
+const size_t kIpcProbeBytes = 64;      // 无 BOM 时用开头这么多字节判断 NUL 的奇偶分布
+const size_t kIpcMaxLineLength = 4096; // 超长行直接丢弃，与二进制帧上限一致
+
+struct IpcStreamDecoder {
+    IpcStreamEncoding encoding = IpcStreamEncoding::UNKNOWN;
+    std::string probe;      // 判定编码前缓存的开头字节
+    std::string line;       // 跨块的未完成行
+    bool lineOverflow = false;
+    bool hasOddByte = false; // UTF-16 码元被块边界切开时留下的半个字节
+    unsigned char oddByte = 0;
+    char decoded[kIpcReadChunk / 2 + 1];
+};
+
+static IpcStreamEncoding DetectIpcStreamEncoding(const std::string& head, size_t& bomLength) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(head.data());
+    bomLength = 0;
+    if (head.size() >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF) {
+        bomLength = 3;
+        return IpcStreamEncoding::UTF8;
+    }
+    if (head.size() >= 2 && p[0] == 0xFF && p[1] == 0xFE) {
+        bomLength = 2;
+        return IpcStreamEncoding::UTF16LE;
+    }
+    if (head.size() >= 2 && p[0] == 0xFE && p[1] == 0xFF) {
+        bomLength = 2;
+        return IpcStreamEncoding::UTF16BE;
+    }
+    // 无 BOM：ASCII 的 UTF-16LE 在奇数位置是 NUL，UTF-16BE 在偶数位置
+    size_t zerosEven = 0;
+    size_t zerosOdd = 0;
+    for (size_t i = 0; i < head.size(); ++i) {
+        if (p[i] == 0) {
+            if ((i & 1) == 0) zerosEven++;
+            else zerosOdd++;
+        }
+    }
+    if (zerosEven == 0 && zerosOdd == 0) return IpcStreamEncoding::UTF8;
+    return zerosOdd >= zerosEven ? IpcStreamEncoding::UTF16LE : IpcStreamEncoding::UTF16BE;
 }
 
-// 设置控制台光标可见性
-void SetCursorVisible(bool visible) {
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (hConsole == INVALID_HANDLE_VALUE) return;
+// 把连续的 1..0x7F 码元收窄成 ASCII，遇到 NUL / 非 ASCII 码元即停，返回已处理的码元数
+static size_t NarrowUtf16AsciiRun(const unsigned char* src, size_t units, bool littleEndian, char* dst) {
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i highBits = _mm_set1_epi16(static_cast<short>(0xFF80));
+    for (; i + 8 <= units; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+        if (!littleEndian) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        const __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, highBits), zero);
+        const __m128i nul = _mm_cmpeq_epi16(v, zero);
+        if (_mm_movemask_epi8(_mm_andnot_si128(nul, ascii)) != 0xFFFF) break;
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(v, v));
+    }
+#endif
+    for (; i < units; ++i) {
+        const unsigned short u = littleEndian ? static_cast<unsigned short>(src[i * 2] | (src[i * 2 + 1] << 8))
+                                              : static_cast<unsigned short>(src[i * 2 + 1] | (src[i * 2] << 8));
+        if (u == 0 || u > 0x7F) break;
+        dst[i] = static_cast<char>(u);
+    }
+    return i;
+}
 
-    CONSOLE_CURSOR_INFO cursorInfo;
-    if (GetConsoleCursorInfo(hConsole, &cursorInfo)) {
-        cursorInfo.bVisible = visible;
-        SetConsoleCursorInfo(hConsole, &cursorInfo);
+// UTF-16 → ASCII：NUL 与 BOM 码元丢弃，其它非 ASCII 码元记为 '?'；返回写入 dst 的字节数
+static size_t DecodeUtf16Units(const unsigned char* src, size_t units, bool littleEndian, char* dst) {
+    size_t out = 0;
+    size_t i = 0;
+    while (i < units) {
+        const size_t run = NarrowUtf16AsciiRun(src + i * 2, units - i, littleEndian, dst + out);
+        out += run;
+        i += run;
+        if (i == units) break;
+        const unsigned short u = littleEndian ? static_cast<unsigned short>(src[i * 2] | (src[i * 2 + 1] << 8))
+                                              : static_cast<unsigned short>(src[i * 2 + 1] | (src[i * 2] << 8));
+        if (u != 0 && u != 0xFEFF) dst[out++] = '?';
+        ++i;
     }
+    return out;
 }
 
-// 获取设备的 HID 路径
-void GetDeviceHidPath(HANDLE device, wchar_t* path, size_t pathSize) {
-    path[0] = L'\0';
-    UINT size = 0;
+// 按 '\n' 切分已解码的字节；整行落在本块内时直接回调，不复制
+template <typename OnLine>
+static void SplitIpcLines(IpcStreamDecoder& dec, const char* data, size_t size, OnLine& onLine) {
+    const char* end = data + size;
+    while (data < end) {
+        const char* nl = static_cast<const char*>(memchr(data, '\n', static_cast<size_t>(end - data)));
+        const char* stop = nl ? nl : end;
+        const size_t length = static_cast<size_t>(stop - data);
+        if (dec.lineOverflow || dec.line.size() + length > kIpcMaxLineLength) {
+            dec.lineOverflow = true;
+            dec.line.clear();
+        } else if (nl && dec.line.empty()) {
+            onLine(std::string_view(data, length));
+        } else {
+            dec.line.append(data, length);
+            if (nl) onLine(std::string_view(dec.line));
+        }
+        if (!nl) break;
+        if (!dec.line.empty()) dec.line.clear();
+        dec.lineOverflow = false;
+        data = nl + 1;
+    }
+}
 
-    // 首先获取需要的缓冲区大小
-    GetRawInputDeviceInfoW(device, RIDI_DEVICENAME, NULL, &size);
-    if (size == 0 || size > pathSize) return;
+template <typename OnLine>
+static void DecodeIpcBytes(IpcStreamDecoder& dec, const char* data, size_t size, OnLine& onLine) {
+    if (dec.encoding == IpcStreamEncoding::UTF8) {
+        SplitIpcLines(dec, data, size, onLine);
+        return;
+    }
 
-    // 获取设备名称（HID 路径）
-    GetRawInputDeviceInfoW(device, RIDI_DEVICENAME, path, &size);
+    const bool littleEndian = (dec.encoding == IpcStreamEncoding::UTF16LE);
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    size_t remaining = size;
+    if (dec.hasOddByte && remaining > 0) {
+        const unsigned char unit[2] = {dec.oddByte, p[0]};
+        const size_t n = DecodeUtf16Units(unit, 1, littleEndian, dec.decoded);
+        SplitIpcLines(dec, dec.decoded, n, onLine);
+        dec.hasOddByte = false;
+        ++p;
+        --remaining;
+    }
+    const size_t maxUnits = sizeof(dec.decoded);
+    while (remaining >= 2) {
+        size_t units = remaining / 2;
+        if (units > maxUnits) units = maxUnits;
+        const size_t n = DecodeUtf16Units(p, units, littleEndian, dec.decoded);
+        SplitIpcLines(dec, dec.decoded, n, onLine);
+        p += units * 2;
+        remaining -= units * 2;
+    }
+    if (remaining == 1) {
+        dec.oddByte = *p;
+        dec.hasOddByte = true;
+    }
 }
 
-// ========== 灵敏度调整相关函数 ==========
+// 送入一块原始字节；每得到一行（不含 '\n'）调用一次 onLine
+template <typename OnLine>
+static void FeedIpcStream(IpcStreamDecoder& dec, const char* data, size_t size, OnLine& onLine) {
+    if (dec.encoding == IpcStreamEncoding::UNKNOWN) {
+        // 凑够判定所需的字节（或已经出现换行）再定编码
+        dec.probe.append(data, size);
+        if (dec.probe.size() < kIpcProbeBytes && !memchr(dec.probe.data(), '\n', dec.probe.size())) return;
+        size_t bomLength = 0;
+        dec.encoding = DetectIpcStreamEncoding(dec.probe, bomLength);
+        std::string head;
+        head.swap(dec.probe);
+        DecodeIpcBytes(dec, head.data() + bomLength, head.size() - bomLength, onLine);
+        return;
+    }
+    DecodeIpcBytes(dec, data, size, onLine);
+}
 
-// 宽字符转ANSI
-std::string WideToAnsi(const std::wstring& ws) {
-    if (ws.empty()) return std::string();
-    int required = WideCharToMultiByte(CP_ACP, 0, ws.c_str(), -1, NULL, 0, NULL, NULL);
-    if (required <= 0) return std::string();
-    std::string result(static_cast<size_t>(required) - 1, '\0');
-    WideCharToMultiByte(CP_ACP, 0, ws.c_str(), -1, &result[0], required, NULL, NULL);
-    return result;
+// 流结束：判定剩余的开头字节，并交出最后一行（没有结尾换行时）
+template <typename OnLine>
+static void FinishIpcStream(IpcStreamDecoder& dec, OnLine& onLine) {
+    if (dec.encoding == IpcStreamEncoding::UNKNOWN && !dec.probe.empty()) {
+        size_t bomLength = 0;
+        dec.encoding = DetectIpcStreamEncoding(dec.probe, bomLength);
+        std::string head;
+        head.swap(dec.probe);
+        DecodeIpcBytes(dec, head.data() + bomLength, head.size() - bomLength, onLine);
+    }
+    if (!dec.line.empty() && !dec.lineOverflow) onLine(std::string_view(dec.line));
+    dec.line.clear();
+    dec.lineOverflow = false;
+    dec.hasOddByte = false;
 }
 
-// 将 RawInput 的设备路径转换为 RawAccel 驱动使用的硬件ID格式
-// 输入: \\?\HID#VID_1532&PID_0067&MI_00#8&12345678&0&0000#{...GUID...}
-// 输出: HID\VID_1532&PID_0067&MI_00
-std::string DevicePathToHardwareId(const wchar_t* devicePath) {
-    if (!devicePath || devicePath[0] == L'\0') return std::string();
+// 读取 stdin 当前可用的数据（管道上不会为凑满缓冲区而阻塞）；EOF 或出错返回 0
+static size_t ReadStdinChunk(char* buffer, size_t size) {
+#ifdef _WIN32
+    DWORD read = 0;
+    if (!ReadFile(GetStdHandle(STD_INPUT_HANDLE), buffer, static_cast<DWORD>(size), &read, NULL)) return 0;
+    return read;
+#else
+    for (;;) {
+        const ssize_t n = read(STDIN_FILENO, buffer, size);
+        if (n >= 0) return static_cast<size_t>(n);
+        if (errno != EINTR) return 0;
+    }
+#endif
+}
 
-    std::wstring path(devicePath);
+// 解析二进制命令帧（已去掉 length 字段）；版本不符返回 false
+static bool DecodeIpcCommandFrame(const uint8_t* frame, size_t length, IpcCommand& command) {
+    if (length < 2 || frame[0] != kIpcFrameVersion) return false;
+    const uint8_t* payload = frame + 2;
+    const size_t payloadLength = length - 2;
+
+    command = IpcCommand();
+    command.kind = static_cast<IpcCommandKind>(frame[1]);
+    switch (command.kind) {
+        case CMD_PING:
+        case CMD_QUIT:
+        case CMD_RESET:
+        case CMD_STATS:
+            break;
+        case CMD_POWER:
+        case CMD_FEATURE:
+            command.hasArg = (payloadLength == 1 && payload[0] <= 1);
+            command.on = command.hasArg && payload[0] == 1;
+            break;
+        case CMD_SET_SENS:
+            // 与文本路径一致：NaN / Inf 按缺少参数处理，回 INVALID PARAMETER
+            if (payloadLength == 8) command.value = ReadF64(payload);
+            command.hasArg = (payloadLength == 8 && std::isfinite(command.value));
+            break;
+        default:
+            command.kind = CMD_UNKNOWN;
+            break;
+    }
+    return true;
+}
 
-    // 跳过 \\?\ 或 \\??\ 前缀
-    const std::wstring prefixWin32 = L"\\\\?\\";
-    const std::wstring prefixNt = L"\\\\??\\";
-    size_t start = 0;
+static void PushIpcCommand(const IpcCommand& command) {
+    {
+        std::lock_guard<std::mutex> lock(g_cmdMutex);
+        g_cmdQueue.push(command);
+    }
+    WakeMainLoop();
+}
+
+static void ReadTextCommands() {
+    IpcStreamDecoder decoder;
+    IpcCommand command;
+    auto onLine = [&](std::string_view line) {
+        if (ParseIpcCommandLine(line, command)) {
+            PushIpcCommand(command);
+        }
+    };
+    char chunk[kIpcReadChunk];
+    while (g_running.load()) {
+        const size_t n = ReadStdinChunk(chunk, sizeof(chunk));
+        if (n == 0) break;
+        FeedIpcStream(decoder, chunk, n, onLine);
+    }
+    FinishIpcStream(decoder, onLine);
+}
+
+static void ReadBinaryCommands() {
+    uint8_t frame[kIpcMaxFrameLength];
+    IpcCommand command;
+    while (g_running.load()) {
+        uint8_t lengthBytes[4];
+        if (fread(lengthBytes, 1, sizeof(lengthBytes), stdin) != sizeof(lengthBytes)) break;
+        const uint32_t length = static_cast<uint32_t>(ReadLE(lengthBytes, 4));
+        if (length > kIpcMaxFrameLength) {
+            // 帧边界已无法恢复，停止读取
+            QueueNotifyError("INVALID FRAME");
+            break;
+        }
+        if (fread(frame, 1, length, stdin) != length) break;
+        if (!DecodeIpcCommandFrame(frame, length, command)) {
+            QueueNotifyError("UNSUPPORTED FRAME VERSION");
+            continue;
+        }
+        PushIpcCommand(command);
+    }
+}
+
+void StartIpcStdinThread() {
+    if (!g_ipcMode.load()) return;
+
+    std::thread([]() {
+        if (g_ipcEncoding == IpcEncoding::BINARY) {
+            ReadBinaryCommands();
+        } else {
+            ReadTextCommands();
+        }
+    }).detach();
+}
+
+// ----- 命令解析基准（--ipc-bench） -----
+
+#ifdef IPC_BENCH_ALLOC_COUNT
+// 进程内堆分配计数，只给 --ipc-bench 统计“每条命令分配次数”用；替换全局 operator new 后
+// 每次分配多一次原子加，所以只在基准构建中打开
+static std::atomic<uint64_t> g_allocCount(0);
+
+void* operator new(size_t size) {
+    g_allocCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+static uint64_t AllocCount() {
+    return g_allocCount.load(std::memory_order_relaxed);
+}
+#endif
+
+static std::string EncodeUtf16Ascii(const std::string& ascii, bool littleEndian, bool bom) {
+    std::string out;
+    out.reserve(ascii.size() * 2 + 2);
+    if (bom) out += littleEndian ? "\xFF\xFE" : "\xFE\xFF";
+    for (char c : ascii) {
+        if (littleEndian) {
+            out.push_back(c);
+            out.push_back('\0');
+        } else {
+            out.push_back('\0');
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+static bool SameIpcCommand(const IpcCommand& a, const IpcCommand& b) {
+    return a.kind == b.kind && a.hasArg == b.hasArg && a.on == b.on && (!a.hasArg || a.value == b.value);
+}
+
+// 各种 stdin 编码下解码结果必须与直接解析文本一致（含 UTF-16 码元被块边界切开的情况），并测吞吐
+static bool BenchIpcDecoder(long iterations) {
+    static const char kScript[] =
+        "PING\nPOWER ON\nSET_SENS 1.25\nfeature off\nSTATS\nRESET\nSET_SENS 0.5\nQUIT";
+    const std::string script = kScript;
+    std::string crlfScript;
+    for (char c : script) {
+        if (c == '\n') crlfScript.push_back('\r');
+        crlfScript.push_back(c);
+    }
+
+    // 后续重复不带 BOM，只接一个换行
+    const std::string utf8Repeat = "\n" + script;
+    const std::string leRepeat = EncodeUtf16Ascii("\r\n" + crlfScript, true, false);
+    const std::string beRepeat = EncodeUtf16Ascii("\r\n" + crlfScript, false, false);
+
+    struct Case {
+        const char* name;
+        std::string bytes;
+        const std::string* repeat;
+    };
+    const Case cases[] = {
+        {"utf8", script, &utf8Repeat},
+        {"utf8-bom", "\xEF\xBB\xBF" + script, &utf8Repeat},
+        {"utf16le-bom", EncodeUtf16Ascii(crlfScript, true, true), &leRepeat},
+        {"utf16le", EncodeUtf16Ascii(crlfScript, true, false), &leRepeat},
+        {"utf16be-bom", EncodeUtf16Ascii(crlfScript, false, true), &beRepeat},
+        {"utf16be", EncodeUtf16Ascii(crlfScript, false, false), &beRepeat},
+    };
+
+    std::vector<IpcCommand> expected;
+    {
+        std::istringstream iss(script);
+        std::string line;
+        IpcCommand command;
+        while (std::getline(iss, line)) {
+            if (ParseIpcCommandLine(line, command)) expected.push_back(command);
+        }
+    }
+
+    bool allOk = true;
+    for (const Case& c : cases) {
+        bool ok = true;
+        const size_t chunkSizes[] = {1, 3, 7, 64, c.bytes.size()};
+        for (size_t chunk : chunkSizes) {
+            std::vector<IpcCommand> got;
+            IpcCommand command;
+            auto onLine = [&](std::string_view line) {
+                if (ParseIpcCommandLine(line, command)) got.push_back(command);
+            };
+            IpcStreamDecoder dec;
+            for (size_t pos = 0; pos < c.bytes.size(); pos += chunk) {
+                const size_t n = std::min(chunk, c.bytes.size() - pos);
+                FeedIpcStream(dec, c.bytes.data() + pos, n, onLine);
+            }
+            FinishIpcStream(dec, onLine);
+            ok = ok && got.size() == expected.size() &&
+                 std::equal(got.begin(), got.end(), expected.begin(), SameIpcCommand);
+        }
+
+        // 吞吐：脚本重复 iterations 次，按 kIpcReadChunk 分块送入
+        std::string bulk;
+        bulk.reserve(c.bytes.size() + c.repeat->size() * static_cast<size_t>(iterations));
+        bulk += c.bytes;
+        for (long n = 1; n < iterations; ++n) bulk += *c.repeat;
+
+        uint64_t lines = 0;
+        auto countLine = [&](std::string_view line) {
+            IpcCommand command;
+            if (ParseIpcCommandLine(line, command)) ++lines;
+        };
+        IpcStreamDecoder dec;
+        const uint64_t start = StatsNowTicks();
+        for (size_t pos = 0; pos < bulk.size(); pos += kIpcReadChunk) {
+            FeedIpcStream(dec, bulk.data() + pos, std::min(kIpcReadChunk, bulk.size() - pos), countLine);
+        }
+        FinishIpcStream(dec, countLine);
+        const uint64_t elapsedNs = TicksToNs(StatsNowTicks() - start);
+        ok = ok && lines == expected.size() * static_cast<uint64_t>(iterations);
+
+        printf("IPC_DECODE %-12s %s bytes=%llu lines=%llu MB_per_s=%.1f\n", c.name, ok ? "ok  " : "FAIL",
+               static_cast<unsigned long long>(bulk.size()), static_cast<unsigned long long>(lines),
+               elapsedNs > 0 ? static_cast<double>(bulk.size()) * 1000.0 / static_cast<double>(elapsedNs) : 0.0);
+        allOk = allOk && ok;
+    }
+    return allOk;
+}
+
+static int RunIpcBench(long iterations) {
+    static const char* const kLines[] = {
+        "PING", "power on", "FEATURE OFF", "SET_SENS 1.25", "set_sens +0.5\r", "STATS",
+        "  RESET  ", "POWER maybe", "SET_SENS abc", "UNKNOWN_CMD 1", "feature on", "QUIT",
+    };
+    const size_t lineCount = sizeof(kLines) / sizeof(kLines[0]);
+    std::string_view lines[sizeof(kLines) / sizeof(kLines[0])];
+    for (size_t i = 0; i < lineCount; ++i) lines[i] = kLines[i];
+
+    IpcCommand command;
+    uint64_t checksum = 0;
+#ifdef IPC_BENCH_ALLOC_COUNT
+    const uint64_t allocBefore = AllocCount();
+#endif
+    const uint64_t start = StatsNowTicks();
+    for (long n = 0; n < iterations; ++n) {
+        for (size_t i = 0; i < lineCount; ++i) {
+            if (ParseIpcCommandLine(lines[i], command)) {
+                checksum += command.kind + (command.hasArg ? 16 : 0) + (command.on ? 32 : 0);
+            }
+        }
+    }
+    const uint64_t elapsedNs = TicksToNs(StatsNowTicks() - start);
+
+    const double total = static_cast<double>(iterations) * static_cast<double>(lineCount);
+    char allocText[32] = "n/a";
+#ifdef IPC_BENCH_ALLOC_COUNT
+    const uint64_t allocs = AllocCount() - allocBefore;
+    snprintf(allocText, sizeof(allocText), "%.4f", total > 0 ? static_cast<double>(allocs) / total : 0.0);
+#endif
+    printf("IPC_BENCH commands=%.0f ns_per_command=%.1f allocs_per_command=%s checksum=%llu\n",
+           total, total > 0 ? static_cast<double>(elapsedNs) / total : 0.0, allocText,
+           static_cast<unsigned long long>(checksum));
+    // SET_SENS 的参数：整个词须是有限数，其余按 INVALID PARAMETER 处理
+    struct SensCase {
+        const char* line;
+        bool hasArg;
+        double value;
+    };
+    static const SensCase kSensCases[] = {
+        {"SET_SENS 1.25", true, 1.25},   {"SET_SENS +0.5", true, 0.5},    {"SET_SENS 2e1", true, 20.0},
+        {"SET_SENS nan", false, 0.0},    {"SET_SENS NaN", false, 0.0},    {"SET_SENS inf", false, 0.0},
+        {"SET_SENS -infinity", false, 0.0}, {"SET_SENS 1e", false, 0.0}, {"SET_SENS 1.5x", false, 0.0},
+        {"SET_SENS 1e999", false, 0.0},  {"SET_SENS", false, 0.0},      {"\xEF\xBB\xBFSET_SENS 1.25", true, 1.25},
+    };
+    bool parseOk = true;
+    for (const SensCase& c : kSensCases) {
+        IpcCommand parsed;
+        const bool ok = ParseIpcCommandLine(c.line, parsed) && parsed.kind == CMD_SET_SENS &&
+                        parsed.hasArg == c.hasArg && (!c.hasArg || parsed.value == c.value);
+        if (!ok) printf("IPC_PARSE FAIL \"%s\"\n", c.line);
+        parseOk = parseOk && ok;
+    }
+    printf("IPC_PARSE %s set_sens_cases=%zu\n", parseOk ? "ok" : "FAIL", sizeof(kSensCases) / sizeof(kSensCases[0]));
+
+    // 解码每轮是整段脚本，轮数按比例缩小
+    const bool decodeOk = BenchIpcDecoder(iterations / 100 + 1);
+    return (parseOk && decodeOk) ? 0 : 1;
+}
+
+void ProcessIpcCommands() {
+    if (!g_ipcMode.load()) return;
+
+    std::queue<IpcCommand> local;
+    {
+        std::lock_guard<std::mutex> lock(g_cmdMutex);
+        std::swap(local, g_cmdQueue);
+    }
+
+    while (!local.empty()) {
+        HandleIpcCommand(local.front());
+        local.pop();
+    }
+}
+
+// 检查注册设备后把灵敏度目标（当前触发器快照）填进 request，由应用线程写入并运行 writer.exe
+bool PrepareSensitivityApply(double multiplier, SettingsApplyRequest& request, std::string& errorMsg) {
+    if (g_registeredDevice.load() == NULL) {
+        errorMsg = "no mouse registered";
+        return false;
+    }
+    if (RegisteredHardwareId().empty()) {
+        errorMsg = "hardware id not available";
+        return false;
+    }
+
+    request.target = APPLY_SENSITIVITY;
+    request.mappings = CollectSensMappings(multiplier);
+    return true;
+}
+
+void HandleIpcCommand(const IpcCommand& command) {
+    if (command.kind == CMD_PING) {
+        QueueEvent(EVENT_PONG);
+        return;
+    }
+
+    if (command.kind == CMD_QUIT) {
+        QueueEvent(EVENT_EXITING);
+        FlushEvents();
+        FailsafeCleanup();
+        QueueEvent(EVENT_EXITED);
+        FlushEvents();
+        g_running.store(false);
+        return;
+    }
+
+    if (command.kind == CMD_RESET) {
+        PerformFullReset();
+        return;
+    }
+
+    if (command.kind == CMD_STATS) {
+        ReportLatencyStats();
+        return;
+    }
+
+    if (command.kind == CMD_POWER) {
+        if (command.hasArg && command.on) {
+            g_powerEnabled.store(true);
+            UpdateMouseHookDemand();
+            QueueEvent(EVENT_POWER_ON);
+
+            // POWER_APPLIED 由应用线程在写入生效后发出
+            SettingsApplyRequest request;
+            request.reportPower = 1;
+            if (!RegisteredHardwareId().empty()) {
+                std::string err;
+                if (!PrepareSensitivityApply(g_currentSensitivity.load(), request, err)) {
+                    QueueNotifyError(err.c_str());
+                }
+            } else {
+                QueueNotifyError("NO MOUSE REGISTERED");
+            }
+            SubmitSettingsApply(std::move(request));
+            return;
+        }
+
+        if (command.hasArg && !command.on) {
+            g_powerEnabled.store(false);
+            g_featureEnabled.store(false);
+            SendLockCommand(LOCK_CMD_DISABLE);
+            UpdateMouseHookDemand();
+            QueueEvent(EVENT_POWER_OFF);
+            QueueEvent(EVENT_FEATURE_OFF);
+
+            SettingsApplyRequest request;
+            request.target = APPLY_DEFAULT;
+            request.reportPower = 0;
+            SubmitSettingsApply(std::move(request));
+            return;
+        }
+
+        QueueNotifyError("INVALID PARAMETER");
+        return;
+    }
+
+    if (command.kind == CMD_FEATURE) {
+        if (command.hasArg && command.on) {
+            if (!g_powerEnabled.load()) {
+                QueueNotifyError("POWER OFF");
+                return;
+            }
+            g_featureEnabled.store(true);
+            UpdateMouseHookDemand();
+            QueueEvent(EVENT_FEATURE_ON);
+            return;
+        }
+
+        if (command.hasArg && !command.on) {
+            g_featureEnabled.store(false);
+            SendLockCommand(LOCK_CMD_DISABLE);
+            UpdateMouseHookDemand();
+            QueueEvent(EVENT_FEATURE_OFF);
+            return;
+        }
+
+        QueueNotifyError("INVALID PARAMETER");
+        return;
+    }
+
+    if (command.kind == CMD_SET_SENS) {
+        double value = command.value;
+        if (!command.hasArg) {
+            QueueNotifyError("INVALID PARAMETER");
+            return;
+        }
+
+        // NaN 比较恒为 false，会穿过下面的范围限制
+        if (!std::isfinite(value)) {
+            QueueNotifyError("INVALID PARAMETER");
+            return;
+        }
+        if (value < 0.001) value = 0.001;
+        if (value > 100.0) value = 100.0;
+        g_currentSensitivity.store(value);
+
+        // 拖动滑块时连续到来：应用线程只应用最新的一个，SENS_APPLIED 在它生效后发出。
+        // 没开启或没注册时不改配置，排在此前的请求之后确认即可
+        SettingsApplyRequest request;
+        request.reportSens = true;
+        request.sensValue = value;
+        if (g_powerEnabled.load() && !RegisteredHardwareId().empty()) {
+            std::string err;
+            if (!PrepareSensitivityApply(value, request, err)) {
+                QueueNotifyError(err.c_str());
+            }
+        }
+        SubmitSettingsApply(std::move(request));
+        return;
+    }
+
+    QueueNotifyError("UNKNOWN COMMAND");
+}
+
+// ========== 状态机辅助函数 ==========
+
+// 判断其他鼠标的移动是否超过死区（用于过滤抖动）
+bool IsOtherMouseMovementSignificant(LONG dx, LONG dy) {
+    return (std::abs(dx) + std::abs(dy)) >= DEADZONE_THRESHOLD;
+}
+
+// 获取冷却期时长（使用系统双击时间）
+uint64_t GetCooldownDurationUs() {
+    DWORD cooldown = GetDoubleClickTime();
+    if (cooldown == 0) cooldown = 500;
+    return static_cast<uint64_t>(cooldown) * 1000;
+}
+
+// ========== 设备角色表 ==========
+// 句柄 → 角色的开放寻址表（线性探测），每包一次查找。不删除槽位：设备拔出或失去角色时改为 UNKNOWN，
+// 该句柄的下一个包到达时重新归类（见 ClassifyDevice），新句柄可复用这些槽。写者之间由 g_deviceRolesMutex 互斥，读者（输入线程）无锁：先写 info 再发布 key。
+
+struct DeviceRoleInfo {
+    DeviceRole role;
+    uint8_t trigger;  // role == TRIGGER 时的触发器序号
+};
+
+struct DeviceRoleSlot {
+    std::atomic<HANDLE> device{nullptr};
+    std::atomic<uint16_t> info{DEVICE_ROLE_OBSERVER};  // role | trigger << 8
+};
+
+const size_t kDeviceRoleSlots = 64;  // 2 的幂；设备数远小于此，探测链很短
+DeviceRoleSlot g_deviceRoles[kDeviceRoleSlots];
+std::mutex g_deviceRolesMutex;
+
+static inline size_t DeviceRoleHash(HANDLE device) {
+    uint64_t x = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(device));
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    return static_cast<size_t>(x) & (kDeviceRoleSlots - 1);
+}
+
+static inline DeviceRoleInfo LookupDeviceRole(HANDLE device) {
+    size_t i = DeviceRoleHash(device);
+    for (size_t probe = 0; probe < kDeviceRoleSlots; ++probe) {
+        const HANDLE key = g_deviceRoles[i].device.load(std::memory_order_acquire);
+        if (key == device) {
+            const uint16_t info = g_deviceRoles[i].info.load(std::memory_order_relaxed);
+            return {static_cast<DeviceRole>(info & 0xFF), static_cast<uint8_t>(info >> 8)};
+        }
+        if (key == nullptr) break;
+        i = (i + 1) & (kDeviceRoleSlots - 1);
+    }
+    return {DEVICE_ROLE_UNKNOWN, 0};
+}
+
+// 调用方持有 g_deviceRolesMutex。新句柄优先复用探测链上 UNKNOWN 的槽（拔出设备留下的），
+// 原地换 key 不会打断其他句柄的探测链。表满时返回 false
+static bool SetDeviceRoleLocked(HANDLE device, DeviceRole role, unsigned trigger) {
+    if (!device) return false;
+    const uint16_t info = static_cast<uint16_t>(role | (trigger << 8));
+    DeviceRoleSlot* reuse = nullptr;
+    size_t i = DeviceRoleHash(device);
+    for (size_t probe = 0; probe < kDeviceRoleSlots; ++probe) {
+        DeviceRoleSlot& slot = g_deviceRoles[i];
+        const HANDLE key = slot.device.load(std::memory_order_relaxed);
+        if (key == device) {
+            slot.info.store(info, std::memory_order_relaxed);
+            return true;
+        }
+        if (key == nullptr) {
+            if (!reuse) reuse = &slot;
+            break;
+        }
+        if (!reuse && (slot.info.load(std::memory_order_relaxed) & 0xFF) == DEVICE_ROLE_UNKNOWN) reuse = &slot;
+        i = (i + 1) & (kDeviceRoleSlots - 1);
+    }
+    if (!reuse) return false;
+    reuse->info.store(info, std::memory_order_relaxed);
+    reuse->device.store(device, std::memory_order_release);
+    return true;
+}
+
+static bool SetDeviceRole(HANDLE device, DeviceRole role, unsigned trigger = 0) {
+    std::lock_guard<std::mutex> lock(g_deviceRolesMutex);
+    return SetDeviceRoleLocked(device, role, trigger);
+}
+
+// 更换注册鼠标（0 号触发器）；旧设备下一个包到达时重新归类
+static void SetRegisteredDevice(HANDLE device) {
+    std::lock_guard<std::mutex> lock(g_deviceRolesMutex);
+    const HANDLE old = g_registeredDevice.exchange(device);
+    if (old && old != device) SetDeviceRoleLocked(old, DEVICE_ROLE_UNKNOWN, 0);
+    if (device) SetDeviceRoleLocked(device, DEVICE_ROLE_TRIGGER, 0);
+}
+
+static unsigned ActiveTriggerCount() {
+    return 1 + static_cast<unsigned>(g_extraTriggers.size());
+}
+
+// ========== 锁定状态机 ==========
+// 状态机只有一个写者：输入线程（所有者）。每个触发器一台状态机，触发器/观察者的移动在逐包处理中直接分派；
+// 主循环的定时到期与功能开关、重置通过 SendLockCommand 投递给所有者，在批次之间处理，作用于所有触发器。
+// 左键由各触发器共享：第一个按下者按下，最后一个释放者抬起。
+// 对外只发布两个值：g_blockingMouse（任一触发器非 IDLE）与 g_lockDeadlineUs（LOCKED 触发器中最早的截止时刻）。
+
+enum LockEvent : uint8_t {
+    LOCK_EV_MOVE,          // 触发器移动
+    LOCK_EV_MOVE_COOLING,  // 冷却期内的触发器移动（IDLE 下由 MOVE 改判）
+    LOCK_EV_OTHER_MOVE,    // 观察者超过死区的移动
+    LOCK_EV_STOP_TIMEOUT,  // 触发器停止超过 STOP_TO_UNLOCK_US
+    LOCK_EV_DISABLE,
+    LOCK_EV_RESET,
+    LOCK_EV_COUNT
+};
+
+enum LockAction : uint8_t {
+    LOCK_ACT_PRESS = 1 << 0,     // 按下左键（FIRING ON）
+    LOCK_ACT_RELEASE = 1 << 1,   // 抬起左键（FIRING OFF）
+    LOCK_ACT_TOUCH = 1 << 2,     // 记录触发器最后移动时刻
+    LOCK_ACT_COOLDOWN = 1 << 3,  // 开始冷却期
+    LOCK_ACT_CLEAR = 1 << 4,     // 清除冷却期与移动记录
+};
+
+struct LockTransition {
+    LockState next;
+    uint8_t actions;
+};
+
+constexpr uint8_t kLockReleaseActions = LOCK_ACT_RELEASE | LOCK_ACT_COOLDOWN;
+constexpr uint8_t kLockResetActions = LOCK_ACT_RELEASE | LOCK_ACT_CLEAR;
+
+// [当前状态][事件] → 下一状态 + 动作
+constexpr LockTransition kLockTransitions[3][LOCK_EV_COUNT] = {
+    // IDLE
+    {{LockState::LOCKED, LOCK_ACT_PRESS | LOCK_ACT_TOUCH},
+     {LockState::IDLE, 0},
+     {LockState::IDLE, 0},
+     {LockState::IDLE, 0},
+     {LockState::IDLE, kLockReleaseActions},
+     {LockState::IDLE, kLockResetActions}},
+    // LOCKED
+    {{LockState::LOCKED, LOCK_ACT_TOUCH},
+     {LockState::LOCKED, LOCK_ACT_TOUCH},
+     {LockState::LOCKED, 0},
+     {LockState::UNLOCKABLE, 0},
+     {LockState::IDLE, kLockReleaseActions},
+     {LockState::IDLE, kLockResetActions}},
+    // UNLOCKABLE：触发器再动回到 LOCKED，观察者移动触发释放
+    {{LockState::LOCKED, LOCK_ACT_TOUCH},
+     {LockState::LOCKED, LOCK_ACT_TOUCH},
+     {LockState::IDLE, kLockReleaseActions},
+     {LockState::UNLOCKABLE, 0},
+     {LockState::IDLE, kLockReleaseActions},
+     {LockState::IDLE, kLockResetActions}},
+};
+
+static_assert(kLockTransitions[static_cast<int>(LockState::IDLE)][LOCK_EV_MOVE_COOLING].actions == 0,
+              "no press during cooldown");
+
+// 逐包读写的状态放在同一缓存行，只由所有者访问
+struct alignas(64) LockHotState {
+    LockState state = LockState::IDLE;
+    bool mouseDown = false;        // 该触发器是否持有左键
+    uint64_t lastMoveUs = 0;       // 触发器最后移动时刻（ClockNowUs）
+    uint64_t cooldownUntilUs = 0;  // 冷却期结束时刻（0 = 无冷却）
+    uint64_t cooldownUs = 0;       // 冷却时长，首次释放时取系统双击时间
+    uint64_t transitions = 0;      // 状态变化次数
+};
+
+struct LockTriggerSet {
+    LockHotState triggers[kMaxTriggers];
+    unsigned count = 1;          // 参与分派的触发器数（1 + --trigger 个数）
+    unsigned activeCount = 0;    // 非 IDLE 的触发器数
+    unsigned buttonHolders = 0;  // 持有左键的触发器数
+};
+
+LockTriggerSet g_lock;
+
+// LOCKED 触发器中最早的 UNLOCK 截止时刻（0 = 无）
+static inline uint64_t EarliestLockDeadline() {
+    uint64_t deadline = 0;
+    for (unsigned i = 0; i < g_lock.count; ++i) {
+        const LockHotState& lock = g_lock.triggers[i];
+        if (lock.state != LockState::LOCKED) continue;
+        const uint64_t d = lock.lastMoveUs + STOP_TO_UNLOCK_US;
+        if (deadline == 0 || d < deadline) deadline = d;
+    }
+    return deadline;
+}
+
+void DispatchLockEvent(unsigned trigger, LockEvent ev, uint64_t nowUs) {
+    LockHotState& lock = g_lock.triggers[trigger];
+    if (ev == LOCK_EV_MOVE && lock.state == LockState::IDLE && nowUs < lock.cooldownUntilUs) {
+        ev = LOCK_EV_MOVE_COOLING;
+    }
+
+    const LockState prev = lock.state;
+    const LockTransition t = kLockTransitions[static_cast<int>(prev)][ev];
+    if (t.actions & LOCK_ACT_TOUCH) {
+        lock.lastMoveUs = nowUs;
+        if (t.next == prev) {
+            // LOCKED 下持续移动：只推迟截止时刻
+            g_lockDeadlineUs.store(g_lock.count == 1 ? nowUs + STOP_TO_UNLOCK_US : EarliestLockDeadline(),
+                                   std::memory_order_relaxed);
+            return;
+        }
+    } else if (t.actions == 0 && t.next == prev) {
+        return;
+    }
+
+    if ((t.actions & LOCK_ACT_PRESS) && !lock.mouseDown) {
+        lock.mouseDown = true;
+        if (g_lock.buttonHolders++ == 0) {
+            MouseLeftDown();
+            QueueEvent(EVENT_FIRING_ON);
+        }
+    }
+    if ((t.actions & LOCK_ACT_RELEASE) && lock.mouseDown) {
+        lock.mouseDown = false;
+        if (--g_lock.buttonHolders == 0) {
+            MouseLeftUp();
+            QueueEvent(EVENT_FIRING_OFF);
+        }
+    }
+    if (t.actions & LOCK_ACT_COOLDOWN) {
+        if (lock.cooldownUs == 0) lock.cooldownUs = GetCooldownDurationUs();
+        lock.cooldownUntilUs = nowUs + lock.cooldownUs;
+    }
+    if (t.actions & LOCK_ACT_CLEAR) {
+        lock.cooldownUntilUs = 0;
+        lock.lastMoveUs = 0;
+    }
+
+    lock.state = t.next;
+    g_lockDeadlineUs.store(EarliestLockDeadline(), std::memory_order_relaxed);
+    if (t.next != prev) {
+        ++lock.transitions;
+        if (prev == LockState::IDLE) ++g_lock.activeCount;
+        if (t.next == LockState::IDLE) --g_lock.activeCount;
+        g_blockingMouse.store(g_lock.activeCount != 0, std::memory_order_relaxed);
+        if (t.next == LockState::LOCKED) {
+            WakeMainLoop();  // 登记 UNLOCK 截止时间
+        }
+    }
+}
+
+// 观察者移动、关闭与重置作用于所有触发器
+static void DispatchLockEventAll(LockEvent ev, uint64_t nowUs) {
+    for (unsigned i = 0; i < g_lock.count; ++i) DispatchLockEvent(i, ev, nowUs);
+}
+
+// 状态机的到期转换：LOCKED → UNLOCKABLE（最后一次移动后 STOP_TO_UNLOCK_US）。冷却结束不需要定时，
+// 由 MOVE 的改判隐式处理。所有者调用：实时运行时由主循环的 TIMER 命令触发，虚拟时钟下由回放线程
+// 在每批之前调用。返回下一个到期时刻（0 = 无）
+uint64_t AdvanceLockTimers(uint64_t nowUs) {
+    if (g_registrationMode.load(std::memory_order_relaxed)) return 0;
+    for (unsigned i = 0; i < g_lock.count; ++i) {
+        const LockHotState& lock = g_lock.triggers[i];
+        if (lock.state == LockState::LOCKED && nowUs >= lock.lastMoveUs + STOP_TO_UNLOCK_US) {
+            DispatchLockEvent(i, LOCK_EV_STOP_TIMEOUT, nowUs);
+        }
+    }
+    return EarliestLockDeadline();
+}
+
+// 清空所有触发器的状态（基准用；冷却时长保留）
+static void ResetLockTriggers(unsigned count, uint64_t cooldownUs) {
+    g_lock = LockTriggerSet();
+    g_lock.count = count;
+    for (unsigned i = 0; i < count; ++i) g_lock.triggers[i].cooldownUs = cooldownUs;
+    g_blockingMouse.store(false);
+    g_lockDeadlineUs.store(0);
+}
+
+static void ApplyLockCommand(LockCommand cmd, uint64_t nowUs) {
+    switch (cmd) {
+    case LOCK_CMD_TIMER:
+        // 投递后触发器又动过：截止时刻已推迟，让主循环重新登记
+        if (AdvanceLockTimers(nowUs) != 0) WakeMainLoop();
+        break;
+    case LOCK_CMD_DISABLE:
+        DispatchLockEventAll(LOCK_EV_DISABLE, nowUs);
+        break;
+    case LOCK_CMD_RESET:
+        DispatchLockEventAll(LOCK_EV_RESET, nowUs);
+        break;
+    }
+}
+
+// 命令收件箱：owner 非空时命令排队并唤醒输入源，否则（输入线程未运行）调用方持锁直接执行
+struct LockInbox {
+    std::mutex mutex;
+    std::condition_variable done;
+    std::vector<LockCommand> commands;
+    std::vector<LockCommand> draining;  // 仅所有者使用
+    uint64_t posted = 0;
+    uint64_t processed = 0;
+    InputSource* owner = nullptr;
+    std::atomic<bool> pending{false};
+};
+
+LockInbox g_lockInbox;
+
+// 把命令交给状态机所有者，并最多等待 timeoutMs 直到处理完（0 = 不等）。返回 false 表示超时
+bool SendLockCommand(LockCommand cmd, DWORD timeoutMs) {
+    LockInbox& inbox = g_lockInbox;
+    std::unique_lock<std::mutex> lock(inbox.mutex);
+    if (!inbox.owner) {
+        ApplyLockCommand(cmd, ClockNowUs());
+        return true;
+    }
+
+    inbox.commands.push_back(cmd);
+    const uint64_t seq = ++inbox.posted;
+    inbox.pending.store(true, std::memory_order_release);
+    WakeInputSource(inbox.owner);
+    if (timeoutMs == 0) return true;
+    return inbox.done.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                               [&] { return inbox.processed >= seq; });
+}
+
+// 所有者在批次之间调用
+void ProcessLockInbox() {
+    LockInbox& inbox = g_lockInbox;
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(inbox.mutex);
+        inbox.pending.store(false, std::memory_order_relaxed);
+        if (inbox.commands.empty()) return;
+        inbox.draining.swap(inbox.commands);
+        seq = inbox.posted;
+    }
+
+    const uint64_t nowUs = ClockNowUs();
+    for (LockCommand cmd : inbox.draining) ApplyLockCommand(cmd, nowUs);
+    inbox.draining.clear();
+
+    {
+        std::lock_guard<std::mutex> lock(inbox.mutex);
+        inbox.processed = seq;
+    }
+    inbox.done.notify_all();
+}
+
+// 输入线程开始/结束运行输入源时调用；结束时执行剩余命令，之后的命令由调用方直接执行
+static void BeginLockOwnership(InputSource* source) {
+    std::lock_guard<std::mutex> lock(g_lockInbox.mutex);
+    g_lockInbox.owner = source;
+}
+
+static void EndLockOwnership() {
+    LockInbox& inbox = g_lockInbox;
+    {
+        std::lock_guard<std::mutex> lock(inbox.mutex);
+        inbox.owner = nullptr;
+        inbox.pending.store(false, std::memory_order_relaxed);
+        const uint64_t nowUs = ClockNowUs();
+        for (LockCommand cmd : inbox.commands) ApplyLockCommand(cmd, nowUs);
+        inbox.commands.clear();
+        inbox.processed = inbox.posted;
+    }
+    inbox.done.notify_all();
+}
+
+// ----- 状态机性质检查与基准（--lock-bench） -----
+
+// 参考模型：与表驱动实现无关的直白写法
+struct LockReferenceModel {
+    LockState state = LockState::IDLE;
+    bool mouseDown = false;
+    uint64_t lastMoveUs = 0;
+    uint64_t cooldownUntilUs = 0;
+
+    void Release(uint64_t nowUs, uint64_t cooldownUs) {
+        mouseDown = false;
+        state = LockState::IDLE;
+        cooldownUntilUs = nowUs + cooldownUs;
+    }
+
+    void Apply(LockEvent ev, uint64_t nowUs, uint64_t cooldownUs) {
+        switch (ev) {
+        case LOCK_EV_MOVE:
+            if (state == LockState::IDLE) {
+                if (nowUs >= cooldownUntilUs) {
+                    mouseDown = true;
+                    state = LockState::LOCKED;
+                    lastMoveUs = nowUs;
+                }
+            } else {
+                lastMoveUs = nowUs;
+                state = LockState::LOCKED;
+            }
+            break;
+        case LOCK_EV_OTHER_MOVE:
+            if (state == LockState::UNLOCKABLE) Release(nowUs, cooldownUs);
+            break;
+        case LOCK_EV_STOP_TIMEOUT:
+            if (state == LockState::LOCKED && nowUs >= lastMoveUs + STOP_TO_UNLOCK_US) {
+                state = LockState::UNLOCKABLE;
+            }
+            break;
+        case LOCK_EV_DISABLE:
+            Release(nowUs, cooldownUs);
+            break;
+        case LOCK_EV_RESET:
+            mouseDown = false;
+            state = LockState::IDLE;
+            cooldownUntilUs = 0;
+            lastMoveUs = 0;
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+const unsigned kLockBenchTriggers = 2;
+
+static uint64_t LockBenchRandom(uint64_t& x) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+// 随机事件：移动为主，时间步长覆盖停止阈值与冷却期两侧；移动随机落在某个触发器上
+static LockEvent NextLockBenchEvent(uint64_t& rng, uint64_t& nowUs, unsigned& trigger) {
+    const uint64_t r = LockBenchRandom(rng);
+    nowUs += (r >> 32) % (STOP_TO_UNLOCK_US * 3);
+    trigger = static_cast<unsigned>((r >> 16) % kLockBenchTriggers);
+    const unsigned pick = static_cast<unsigned>(r % 100);
+    if (pick < 55) return LOCK_EV_MOVE;
+    if (pick < 75) return LOCK_EV_OTHER_MOVE;
+    if (pick < 96) return LOCK_EV_STOP_TIMEOUT;
+    if (pick < 99) return LOCK_EV_DISABLE;
+    return LOCK_EV_RESET;
+}
+
+static void DispatchLockBenchEvent(LockEvent ev, unsigned trigger, uint64_t nowUs) {
+    if (ev == LOCK_EV_STOP_TIMEOUT) {
+        AdvanceLockTimers(nowUs);
+    } else if (ev == LOCK_EV_MOVE) {
+        DispatchLockEvent(trigger, ev, nowUs);
+    } else {
+        DispatchLockEventAll(ev, nowUs);
+    }
+}
+
+static int RunLockBench(long events) {
+    // 不注入、不发事件；到期转换需要非注册模式
+    g_injectOutput.store(false);
+    g_registrationMode.store(false);
+    const uint64_t cooldownUs = GetCooldownDurationUs();
+    ResetLockTriggers(kLockBenchTriggers, cooldownUs);
+
+    // 性质检查：每个触发器逐步与各自的参考模型比对，并检查共享左键与发布值和状态一致
+    LockReferenceModel models[kLockBenchTriggers];
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    uint64_t nowUs = VirtualClock::kEpochUs;
+    long mismatches = 0;
+    for (long n = 0; n < events; ++n) {
+        unsigned trigger = 0;
+        const LockEvent ev = NextLockBenchEvent(rng, nowUs, trigger);
+        const LockHotState& moved = g_lock.triggers[trigger];
+        const bool wasCooling = models[trigger].state == LockState::IDLE && nowUs < models[trigger].cooldownUntilUs;
+        const bool wasDown = moved.mouseDown;
+        DispatchLockBenchEvent(ev, trigger, nowUs);
+        for (unsigned i = 0; i < kLockBenchTriggers; ++i) {
+            if (ev != LOCK_EV_MOVE || i == trigger) models[i].Apply(ev, nowUs, cooldownUs);
+        }
+
+        bool ok = !(ev == LOCK_EV_MOVE && wasCooling && !wasDown && moved.mouseDown);
+        unsigned active = 0, holders = 0;
+        uint64_t expectedDeadline = 0;
+        for (unsigned i = 0; i < kLockBenchTriggers; ++i) {
+            const LockHotState& lock = g_lock.triggers[i];
+            const LockReferenceModel& model = models[i];
+            const bool idle = lock.state == LockState::IDLE;
+            ok = ok && lock.state == model.state &&
+                 lock.mouseDown == model.mouseDown &&
+                 lock.cooldownUntilUs == model.cooldownUntilUs &&
+                 lock.lastMoveUs == model.lastMoveUs &&
+                 lock.mouseDown == !idle;
+            if (!idle) ++active;
+            if (lock.mouseDown) ++holders;
+            if (lock.state == LockState::LOCKED) {
+                const uint64_t d = lock.lastMoveUs + STOP_TO_UNLOCK_US;
+                if (expectedDeadline == 0 || d < expectedDeadline) expectedDeadline = d;
+            }
+        }
+        ok = ok && g_lock.buttonHolders == holders &&
+             g_blockingMouse.load() == (active != 0) &&
+             g_lockDeadlineUs.load() == expectedDeadline;
+        if (!ok && mismatches++ == 0) {
+            printf("LOCK_BENCH mismatch at event %ld (ev=%d trigger=%u t=%llu): state %d/%d down %d/%d holders %u/%u\n",
+                   n, static_cast<int>(ev), trigger, static_cast<unsigned long long>(nowUs),
+                   static_cast<int>(moved.state), static_cast<int>(models[trigger].state),
+                   moved.mouseDown ? 1 : 0, models[trigger].mouseDown ? 1 : 0,
+                   g_lock.buttonHolders, holders);
+        }
+    }
+
+    // 吞吐：预生成的事件序列循环分派
+    const size_t kScript = 4096;
+    static LockEvent script[kScript];
+    static uint8_t scriptTriggers[kScript];
+    static uint64_t steps[kScript];
+    for (size_t i = 0; i < kScript; ++i) {
+        uint64_t t = 0;
+        unsigned trigger = 0;
+        script[i] = NextLockBenchEvent(rng, t, trigger);
+        scriptTriggers[i] = static_cast<uint8_t>(trigger);
+        steps[i] = t;
+    }
+    ResetLockTriggers(kLockBenchTriggers, cooldownUs);
+    nowUs = VirtualClock::kEpochUs;
+    const uint64_t start = StatsNowTicks();
+    for (long n = 0; n < events; ++n) {
+        const size_t i = static_cast<size_t>(n) & (kScript - 1);
+        nowUs += steps[i];
+        DispatchLockBenchEvent(script[i], scriptTriggers[i], nowUs);
+    }
+    const uint64_t elapsedNs = TicksToNs(StatsNowTicks() - start);
+
+    uint64_t transitions = 0;
+    for (unsigned i = 0; i < kLockBenchTriggers; ++i) transitions += g_lock.triggers[i].transitions;
+    const double total = static_cast<double>(events);
+    const double seconds = static_cast<double>(elapsedNs) / 1e9;
+    printf("LOCK_BENCH events=%.0f triggers=%u ns_per_event=%.2f events_per_sec=%.0f transitions=%llu mismatches=%ld\n",
+           total, kLockBenchTriggers, total > 0 ? static_cast<double>(elapsedNs) / total : 0.0,
+           seconds > 0 ? total / seconds : 0.0,
+           static_cast<unsigned long long>(transitions), mismatches);
+    return mismatches == 0 ? 0 : 1;
+}
+
+// 安全清理：确保程序退出时不会留下按住的左键
+void FailsafeCleanup() {
+    static std::atomic<bool> s_cleanupRan{false};
+    if (s_cleanupRan.exchange(true)) {
+        return;
+    }
+
+    // Ensure the auto-click feature is fully disabled before restoring sensitivity.
+    g_featureEnabled.store(false);
+    g_powerEnabled.store(false);
+    if (!SendLockCommand(LOCK_CMD_DISABLE)) {
+        // 输入线程没有及时处理：直接抬起左键、停止阻止（多一次抬起无副作用）
+        MouseLeftUp();
+        g_blockingMouse.store(false);
+    }
+    UninstallMouseHook();
+
+    // 回放不会改动 settings.json，无需恢复
+    if (g_replayMode.load()) return;
+
+    // 退出时恢复鼠标灵敏度：清理 settings.json 中的设备映射并应用。取代尚未完成的请求，
+    // 最多等一次 writer.exe 的全部超时与重试，卡住也不会拖住退出
+    SettingsApplyRequest request;
+    request.target = APPLY_DEFAULT;
+    request.origin = APPLY_FROM_EXIT;
+    SubmitSettingsApply(std::move(request));
+    WaitSettingsApplyIdle(SettingsApplyBudgetMs());
+}
+
+// 双击 Caps Lock 触发的完整重置：
+// - 恢复灵敏度为 1.0（如有已注册设备则同步 settings.json 并尝试 writer.exe 应用）
+// - 关闭自动按左键功能并释放按键
+// - 取消注册设备，回到注册模式
+void PerformFullReset() {
+    const bool ipc = g_ipcMode.load();
+
+    if (!ipc) {
+        printf("\n[RESET] Full reset triggered (Caps Lock double-press)\n");
+        fflush(stdout);
+    }
+
+    if (ipc) {
+        g_powerEnabled.store(false);
+    }
+
+    // 关闭自动按键功能并确保释放，同时清除冷却期与移动记录
+    g_featureEnabled.store(false);
+    SendLockCommand(LOCK_CMD_RESET);
+    UpdateMouseHookDemand();
+
+    // 恢复灵敏为 1.0（程序内状态）
+    g_currentSensitivity.store(1.0);
+
+    // IPC 模式：先切回注册/SCAN 状态并立即发 EVT，避免 reset 的耗时操作阻塞首次进度上报
+    if (ipc) {
+        // 取消注册并回到注册模式
+        SetRegisteredDevice(NULL);
+        g_pendingDevice.store(NULL);
+        g_registrationMode.store(true);
+        g_pendingDevicePath[0] = L'\0';
+        g_registeredDevicePath[0] = L'\0';
+        SetRegisteredHardwareId(std::string());
+        ClearLastRegisteredHardwareId();
+
+        // 重置统计相关状态
+        g_otherMouseActive.store(false);
+        g_extraInfoValid.store(false);
+        g_moveCount = 0;
+        g_lastRawX = 0;
+        g_lastRawY = 0;
+
+        g_scanResetGeneration.fetch_add(1);
+
+        QueueEventValue(EVENT_SCAN_PROGRESS, 0.0);
+        QueueEvent(EVENT_RESET);
+        QueueEvent(EVENT_POWER_OFF);
+        QueueEvent(EVENT_FEATURE_OFF);
+        FlushEvents();
+    }
+
+    // 清理 settings.json 中映射到 sens_registered_mouse 的设备，避免残留映射影响其他鼠标；
+    // 交给应用线程，IPC 模式下 SENS_APPLIED 1.0 在清理生效后发出
+    {
+        SettingsApplyRequest request;
+        request.target = APPLY_DEFAULT;
+        request.origin = APPLY_FROM_RESET;
+        request.reportSens = true;
+        request.sensValue = 1.0;
+        SubmitSettingsApply(std::move(request));
+    }
+
+    if (!ipc) {
+        // 取消注册并回到注册模式
+        SetRegisteredDevice(NULL);
+        g_pendingDevice.store(NULL);
+        g_registrationMode.store(true);
+        g_pendingDevicePath[0] = L'\0';
+        g_registeredDevicePath[0] = L'\0';
+        SetRegisteredHardwareId(std::string());
+        ClearLastRegisteredHardwareId();
+
+        // 重置统计相关状态
+        g_otherMouseActive.store(false);
+        g_extraInfoValid.store(false);
+        g_moveCount = 0;
+        g_lastRawX = 0;
+        g_lastRawY = 0;
+
+        g_scanResetGeneration.fetch_add(1);
+        QueueEventValue(EVENT_SCAN_PROGRESS, 0.0);
+        QueueEventValue(EVENT_SENS_APPLIED, 1.0);
+        QueueEvent(EVENT_RESET);
+        QueueEvent(EVENT_POWER_OFF);
+        QueueEvent(EVENT_FEATURE_OFF);
+
+        printf("[REGISTER] Move the mouse you want to register...\n\n");
+        fflush(stdout);
+    }
+}
+
+// ========== 低级鼠标钩子 ==========
+// 钩子装在专用线程上，该线程只跑消息循环：输入线程在批处理或事件写出中卡住时不会拖慢全系统鼠标
+// （回调超过 LowLevelHooksTimeout 时系统会跳过甚至移除钩子）。钩子只在 POWER 与 FEATURE 都开、
+// 可能需要阻止移动时安装，其余时间卸载，系统鼠标事件不再经过本进程。
+
+std::atomic<uint64_t> g_hookNearTimeouts(0);  // 排队超过 kHookNearTimeoutMs 的回调次数
+std::atomic<DWORD> g_hookMaxLagMs(0);          // 其中最大的排队时间
+std::atomic<bool> g_hookDisabled(false);       // 退出清理后不再安装
+
+#ifdef _WIN32
+const UINT WM_HOOK_UPDATE = WM_APP + 2;        // 主线程 → 钩子线程：按当前开关安装/卸载，lParam 为请求序号
+const DWORD kHookNearTimeoutMs = 100;          // LowLevelHooksTimeout 通常为数百毫秒
+const DWORD kHookApplyWaitMs = 100;            // 主线程等钩子线程处理请求的上限
+
+// 安装结果归谁上报由 waitingSeq 决定：钩子线程处理完请求后把等于该序号的 waitingSeq 清零（CAS），
+// 成功说明主线程还在等，由它上报；主线程等待超时时同样以 CAS 清零放弃，之后钩子线程自己上报。
+// 两边只有一方能清零，超时请求的结果既不会丢，也不会被下一次等待误认成自己的
+struct MouseHookThread {
+    std::thread thread;
+    std::atomic<DWORD> threadId{0};
+    HANDLE applied = NULL;                     // 结果交给等待方时置位（可能残留旧信号，以 waitingSeq 为准）
+    DWORD requestSeq = 0;                      // 主线程给每个 WM_HOOK_UPDATE 编的序号，跳过 0
+    std::atomic<DWORD> waitingSeq{0};          // 主线程正在等的序号，0 = 没有在等
+    std::atomic<DWORD> installError{0};        // 交给等待方的那次请求的安装错误码
+};
+
+MouseHookThread g_hookThread;
+
+// 钩子线程上调用
+static void RecordHookLag(DWORD lagMs) {
+    g_hookNearTimeouts.fetch_add(1, std::memory_order_relaxed);
+    if (lagMs > g_hookMaxLagMs.load(std::memory_order_relaxed)) {
+        g_hookMaxLagMs.store(lagMs, std::memory_order_relaxed);
+    }
+}
+
+// 低级鼠标钩子回调：阻止物理鼠标移动，放行注入事件
+LRESULT CALLBACK LowLevelMouseProc(int nCode, WPARAM wParam, LPARAM lParam) {
+    if (nCode < 0) {
+        return CallNextHookEx(NULL, nCode, wParam, lParam);
+    }
+
+    ScopedLatency timing(STAGE_HOOK);
+    const MSLLHOOKSTRUCT* info = reinterpret_cast<const MSLLHOOKSTRUCT*>(lParam);
+    if (!info) {
+        return CallNextHookEx(NULL, nCode, wParam, lParam);
+    }
+
+    // 事件产生到回调执行的排队时间（毫秒节拍）
+    const DWORD lagMs = GetTickCount() - info->time;
+    if (lagMs >= kHookNearTimeoutMs && lagMs < 60000) {
+        RecordHookLag(lagMs);
+    }
+
+    // 只处理鼠标移动事件
+    if (wParam != WM_MOUSEMOVE) {
+        return CallNextHookEx(NULL, nCode, wParam, lParam);
+    }
+
+    // 如果没有启用阻止，直接放行
+    if (!g_blockingMouse.load(std::memory_order_relaxed)) {
+        return CallNextHookEx(NULL, nCode, wParam, lParam);
+    }
+
+    // 放行注入的事件（包括我们的 SendInput/SetCursorPos）
+    if (info->flags & LLMHF_INJECTED) {
+        return CallNextHookEx(NULL, nCode, wParam, lParam);
+    }
+
+    // 阻止物理鼠标的移动
+    return 1;
+}
+
+static void ReportMouseHookError(DWORD error) {
+    if (g_ipcMode.load()) {
+        QueueNotifyError("MOUSE HOOK FAILED");
+    } else {
+        printf("[WARN] Failed to install mouse hook: %lu (feature will work without blocking)\n", error);
+    }
+}
+
+// 按当前开关安装/卸载（钩子线程上调用）。seq 为请求序号，线程启动时的一次为 0
+static void ApplyMouseHookDemand(DWORD seq) {
+    const bool want = !g_hookDisabled.load() &&
+                      ((g_powerEnabled.load() && g_featureEnabled.load()) || g_blockingMouse.load());
+    DWORD error = 0;
+    if (want && g_mouseHook == NULL) {
+        g_mouseHook = SetWindowsHookEx(WH_MOUSE_LL, LowLevelMouseProc, GetModuleHandle(NULL), 0);
+        if (!g_mouseHook) error = GetLastError();
+    } else if (!want && g_mouseHook != NULL) {
+        UnhookWindowsHookEx(g_mouseHook);
+        g_mouseHook = NULL;
+    }
+
+    g_hookThread.installError.store(error);
+    DWORD expected = seq;
+    if (seq != 0 && g_hookThread.waitingSeq.compare_exchange_strong(expected, 0)) {
+        SetEvent(g_hookThread.applied);
+        return;
+    }
+    // 没有人在等这个请求（启动时，或主线程已超时放弃）：由本线程经事件通道上报
+    if (error != 0) ReportMouseHookError(error);
+}
+
+static void MouseHookThreadMain() {
+    // 回调在本线程上执行，提高优先级让它总能及时运行
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+    MSG msg;
+    PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE);  // 建立线程消息队列
+    g_hookThread.threadId.store(GetCurrentThreadId());
+    ApplyMouseHookDemand(0);
+
+    while (GetMessage(&msg, NULL, 0, 0) > 0) {
+        if (msg.message == WM_HOOK_UPDATE) {
+            ApplyMouseHookDemand(static_cast<DWORD>(msg.lParam));
+            continue;
+        }
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+
+    if (g_mouseHook) {
+        UnhookWindowsHookEx(g_mouseHook);
+        g_mouseHook = NULL;
+    }
+}
+
+// 启动钩子线程（输入源打开时调用）；钩子本身由 UpdateMouseHookDemand 按需安装
+bool StartMouseHookThread() {
+    if (g_hookThread.thread.joinable()) return true;
+    g_hookThread.applied = CreateEventA(NULL, FALSE, FALSE, NULL);
+    try {
+        g_hookThread.thread = std::thread(MouseHookThreadMain);
+    } catch (const std::system_error&) {
+        return false;
+    }
+    return true;
+}
+
+void StopMouseHookThread() {
+    if (!g_hookThread.thread.joinable()) return;
+    while (g_hookThread.threadId.load() == 0) Sleep(1);
+    PostThreadMessage(g_hookThread.threadId.load(), WM_QUIT, 0, 0);
+    g_hookThread.thread.join();
+    g_hookThread.threadId.store(0);
+    if (g_hookThread.applied) CloseHandle(g_hookThread.applied);
+    g_hookThread.applied = NULL;
+}
+
+// POWER/FEATURE 变化后调用（主线程）：通知钩子线程并等它装好/卸掉，安装失败时上报。
+// 最多等 kHookApplyWaitMs；超时后这次请求的结果由钩子线程自己上报
+void UpdateMouseHookDemand() {
+    const DWORD threadId = g_hookThread.threadId.load();
+    if (threadId == 0) return;
+    DWORD seq = ++g_hookThread.requestSeq;
+    if (seq == 0) seq = ++g_hookThread.requestSeq;
+    g_hookThread.waitingSeq.store(seq);
+    if (!PostThreadMessage(threadId, WM_HOOK_UPDATE, 0, static_cast<LPARAM>(seq))) {
+        g_hookThread.waitingSeq.store(0);
+        return;
+    }
+
+    const DWORD start = GetTickCount();
+    while (g_hookThread.waitingSeq.load() == seq) {
+        const DWORD waited = GetTickCount() - start;
+        if (waited >= kHookApplyWaitMs) {
+            DWORD expected = seq;
+            if (g_hookThread.waitingSeq.compare_exchange_strong(expected, 0)) return;
+            break;  // 钩子线程恰好处理完，结果归本线程
+        }
+        WaitForSingleObject(g_hookThread.applied, kHookApplyWaitMs - waited);
+    }
+
+    const DWORD error = g_hookThread.installError.load();
+    if (error != 0) ReportMouseHookError(error);
+}
+#else
+// Linux 构建不拦截其他鼠标
+bool StartMouseHookThread() { return false; }
+void StopMouseHookThread() {}
+void UpdateMouseHookDemand() {}
+#endif
+
+// 退出清理：卸载钩子且不再安装
+void UninstallMouseHook() {
+    g_hookDisabled.store(true);
+    UpdateMouseHookDemand();
+}
+
+// 钩子回调排队接近超时的情况（主循环统计截止时间到期时调用，有新增才上报）
+static void ReportHookLag() {
+    static uint64_t s_lastReported = 0;
+    const uint64_t nearTimeouts = g_hookNearTimeouts.load(std::memory_order_relaxed);
+    if (nearTimeouts == s_lastReported) return;
+    s_lastReported = nearTimeouts;
+
+    const DWORD maxLagMs = g_hookMaxLagMs.exchange(0, std::memory_order_relaxed);
+    if (g_ipcMode.load()) {
+        QueueEventValues(EVENT_HOOK_LAG, nullptr, {static_cast<double>(nearTimeouts), static_cast<double>(maxLagMs)});
+    } else {
+        printf("\n[WARN] Mouse hook callback delayed %lu ms (%llu near-timeout callbacks)\n",
+               static_cast<unsigned long>(maxLagMs), static_cast<unsigned long long>(nearTimeouts));
+    }
+}
+
+// 解码 ExtraInformation 获取原始移动量
+// rawaccel 驱动将原始 X,Y 编码为: 低16位=X, 高16位=Y
+void DecodeExtraInfo(ULONG extraInfo, short* rawX, short* rawY) {
+    *rawX = (short)(extraInfo & 0xFFFF);
+    *rawY = (short)((extraInfo >> 16) & 0xFFFF);
+}
+
+// 设置控制台光标可见性
+void SetCursorVisible(bool visible) {
+#ifdef _WIN32
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (hConsole == INVALID_HANDLE_VALUE) return;
+
+    CONSOLE_CURSOR_INFO cursorInfo;
+    if (GetConsoleCursorInfo(hConsole, &cursorInfo)) {
+        cursorInfo.bVisible = visible;
+        SetConsoleCursorInfo(hConsole, &cursorInfo);
+    }
+#else
+    if (!isatty(STDOUT_FILENO)) return;
+    fputs(visible ? "\033[?25h" : "\033[?25l", stdout);
+    fflush(stdout);
+#endif
+}
+
+// 控制台单键输入（CLI 模式）
+#ifdef _WIN32
+bool ConsoleKeyAvailable() { return _kbhit() != 0; }
+int ConsoleReadKey() { return _getch(); }
+void ConsoleSetRawKeys(bool enable) { (void)enable; }
+
+// 控制台句柄只要缓冲区里还有记录就保持有信号，而 _kbhit() 只认按键按下，也不取走记录：
+// 等待前把 _kbhit() 不认的记录（松键、焦点、鼠标、窗口大小）取掉，否则等待立即返回、主循环空转。
+// 返回 true 表示有按键待读，调用方不应等待
+static bool DiscardConsoleNonKeyInput(HANDLE console) {
+    INPUT_RECORD record;
+    DWORD count = 0;
+    while (!_kbhit()) {
+        if (!PeekConsoleInputA(console, &record, 1, &count) || count == 0) return false;
+        if (!ReadConsoleInputA(console, &record, 1, &count)) return false;
+    }
+    return true;
+}
+#else
+static termios g_savedTermios;
+static bool g_rawKeysActive = false;
+
+bool ConsoleKeyAvailable() {
+    pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+int ConsoleReadKey() {
+    unsigned char ch = 0;
+    return read(STDIN_FILENO, &ch, 1) == 1 ? ch : 0;
+}
+
+// 关闭行缓冲和回显，使按键无需回车即可读取
+void ConsoleSetRawKeys(bool enable) {
+    if (!isatty(STDIN_FILENO)) return;
+    if (enable && !g_rawKeysActive) {
+        if (tcgetattr(STDIN_FILENO, &g_savedTermios) != 0) return;
+        termios raw = g_savedTermios;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        g_rawKeysActive = true;
+    } else if (!enable && g_rawKeysActive) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &g_savedTermios);
+        g_rawKeysActive = false;
+    }
+}
+#endif
+
+// 程序自身的完整路径；失败时返回空串
+std::string GetExecutablePath() {
+    char modulePath[MAX_PATH] = {0};
+#ifdef _WIN32
+    if (!GetModuleFileNameA(NULL, modulePath, MAX_PATH)) {
+        return std::string();
+    }
+#else
+    ssize_t len = readlink("/proc/self/exe", modulePath, sizeof(modulePath) - 1);
+    if (len <= 0) {
+        return std::string();
+    }
+    modulePath[len] = '\0';
+#endif
+    return std::string(modulePath);
+}
+
+// 程序所在目录（带结尾分隔符）；失败时返回空串
+std::string GetExecutableDir() {
+    std::string path = GetExecutablePath();
+    size_t slash = path.find_last_of("\\/");
+    return (slash == std::string::npos) ? std::string() : path.substr(0, slash + 1);
+}
+
+#ifndef _WIN32
+// ========== evdev 设备表 ==========
+// Linux 下的"设备句柄"取设备节点的 st_rdev（普通文件取 inode），同一会话内稳定；
+// 路径与硬件ID在枚举/打开时登记，供 GetDeviceHidPath / DevicePathToHardwareId 查询。
+struct EvdevDeviceInfo {
+    HANDLE handle;
+    std::string path;
+    std::string hardwareId;
+};
+
+std::mutex g_evdevDevicesMutex;
+std::vector<EvdevDeviceInfo> g_evdevDevices;
+
+static bool EvdevTestBit(const unsigned long* bits, unsigned bit) {
+    const unsigned kBitsPerLong = sizeof(unsigned long) * 8;
+    return (bits[bit / kBitsPerLong] >> (bit % kBitsPerLong)) & 1UL;
+}
+
+// 设备是否上报相对 X/Y 移动（即鼠标类设备）
+static bool EvdevIsRelativeMouse(int fd) {
+    unsigned long relBits[(REL_MAX + 1 + sizeof(unsigned long) * 8 - 1) / (sizeof(unsigned long) * 8)] = {0};
+    if (ioctl(fd, EVIOCGBIT(EV_REL, sizeof(relBits)), relBits) < 0) return false;
+    return EvdevTestBit(relBits, REL_X) && EvdevTestBit(relBits, REL_Y);
+}
+
+// 硬件ID 与 Windows 版保持同一格式：HID\VID_xxxx&PID_xxxx；普通文件（回放用的假设备）为 FILE\<文件名>
+static std::string EvdevHardwareId(int fd, const std::string& path) {
+    input_id id = {};
+    if (fd >= 0 && ioctl(fd, EVIOCGID, &id) == 0) {
+        char buf[64] = {0};
+        snprintf(buf, sizeof(buf), "HID\\VID_%04X&PID_%04X", id.vendor, id.product);
+        return buf;
+    }
+    size_t slash = path.find_last_of('/');
+    return "FILE\\" + (slash == std::string::npos ? path : path.substr(slash + 1));
+}
+
+// 登记设备并返回句柄；fd 可为 -1（此时临时打开读取硬件ID）
+static HANDLE RegisterEvdevDevice(const std::string& path, int fd) {
+    struct stat st = {};
+    if (stat(path.c_str(), &st) != 0) return nullptr;
+    const uint64_t key = S_ISCHR(st.st_mode) ? static_cast<uint64_t>(st.st_rdev) : static_cast<uint64_t>(st.st_ino);
+    HANDLE handle = reinterpret_cast<HANDLE>(static_cast<uintptr_t>(key + 1));
+
+    std::lock_guard<std::mutex> lock(g_evdevDevicesMutex);
+    for (const EvdevDeviceInfo& info : g_evdevDevices) {
+        if (info.handle == handle) return handle;
+    }
+
+    int probeFd = fd;
+    if (probeFd < 0) probeFd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    EvdevDeviceInfo info;
+    info.handle = handle;
+    info.path = path;
+    info.hardwareId = EvdevHardwareId(probeFd, path);
+    if (fd < 0 && probeFd >= 0) close(probeFd);
+
+    g_evdevDevices.push_back(info);
+    return handle;
+}
+
+// 枚举 /dev/input/event* 中的鼠标类设备
+static std::vector<std::string> EnumerateEvdevMice() {
+    std::vector<std::string> paths;
+    DIR* dir = opendir("/dev/input");
+    if (!dir) return paths;
+
+    while (dirent* entry = readdir(dir)) {
+        if (strncmp(entry->d_name, "event", 5) != 0) continue;
+        std::string path = std::string("/dev/input/") + entry->d_name;
+        int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) continue;
+        if (EvdevIsRelativeMouse(fd)) {
+            RegisterEvdevDevice(path, fd);
+            paths.push_back(path);
+        }
+        close(fd);
+    }
+    closedir(dir);
+    return paths;
+}
+#endif
+
+// 获取设备的 HID 路径
+void GetDeviceHidPath(HANDLE device, wchar_t* path, size_t pathSize) {
+    path[0] = L'\0';
+#ifdef _WIN32
+    UINT size = 0;
+
+    // 首先获取需要的缓冲区大小
+    GetRawInputDeviceInfoW(device, RIDI_DEVICENAME, NULL, &size);
+    if (size == 0 || size > pathSize) return;
+
+    // 获取设备名称（HID 路径）
+    GetRawInputDeviceInfoW(device, RIDI_DEVICENAME, path, &size);
+#else
+    std::lock_guard<std::mutex> lock(g_evdevDevicesMutex);
+    for (const EvdevDeviceInfo& info : g_evdevDevices) {
+        if (info.handle != device) continue;
+        if (info.path.size() + 1 > pathSize) return;
+        for (size_t i = 0; i < info.path.size(); ++i) {
+            path[i] = static_cast<wchar_t>(static_cast<unsigned char>(info.path[i]));
+        }
+        path[info.path.size()] = L'\0';
+        return;
+    }
+#endif
+}
+
+// ========== 灵敏度调整相关函数 ==========
+
+// 宽字符转ANSI
+std::string WideToAnsi(const std::wstring& ws) {
+    if (ws.empty()) return std::string();
+#ifndef _WIN32
+    std::string narrow;
+    narrow.reserve(ws.size());
+    for (wchar_t c : ws) {
+        narrow.push_back(c < 0x80 ? static_cast<char>(c) : '?');
+    }
+    return narrow;
+#else
+    int required = WideCharToMultiByte(CP_ACP, 0, ws.c_str(), -1, NULL, 0, NULL, NULL);
+    if (required <= 0) return std::string();
+    std::string result(static_cast<size_t>(required) - 1, '\0');
+    WideCharToMultiByte(CP_ACP, 0, ws.c_str(), -1, &result[0], required, NULL, NULL);
+    return result;
+#endif
+}
+
+// 将 RawInput 的设备路径转换为 RawAccel 驱动使用的硬件ID格式
+// 输入: \\?\HID#VID_1532&PID_0067&MI_00#8&12345678&0&0000#{...GUID...}
+// 输出: HID\VID_1532&PID_0067&MI_00
+std::string DevicePathToHardwareId(const wchar_t* devicePath) {
+    if (!devicePath || devicePath[0] == L'\0') return std::string();
+
+    std::wstring path(devicePath);
+
+#ifndef _WIN32
+    // evdev 设备路径（/dev/input/eventN）不含硬件ID，从设备表查询
+    {
+        const std::string narrow = WideToAnsi(path);
+        std::lock_guard<std::mutex> lock(g_evdevDevicesMutex);
+        for (const EvdevDeviceInfo& info : g_evdevDevices) {
+            if (info.path == narrow) return info.hardwareId;
+        }
+        return std::string();
+    }
+#endif
+
+    // 跳过 \\?\ 或 \\??\ 前缀
+    const std::wstring prefixWin32 = L"\\\\?\\";
+    const std::wstring prefixNt = L"\\\\??\\";
+    size_t start = 0;
     if (path.compare(0, prefixWin32.size(), prefixWin32) == 0) {
         start = prefixWin32.size();
     } else if (path.compare(0, prefixNt.size(), prefixNt) == 0) {
         start = prefixNt.size();
     }
 
-    // 找到第一个 # (VID_...&PID_...&MI_... 之前的分隔符)
-    size_t firstHash = path.find(L'#', start);
-    if (firstHash == std::wstring::npos) return std::string();
+    // 找到第一个 # (VID_...&PID_...&MI_... 之前的分隔符)
+    size_t firstHash = path.find(L'#', start);
+    if (firstHash == std::wstring::npos) return std::string();
+
+    // 找到第二个 # (实例ID之前的分隔符)
+    size_t secondHash = path.find(L'#', firstHash + 1);
+    if (secondHash == std::wstring::npos) return std::string();
+
+    // 提取 HID#VID_...&PID_...&MI_... 部分
+    std::wstring segment = path.substr(start, secondHash - start);
+
+    // 将第一个 # 替换为 \ (HID#... -> HID\...)
+    for (size_t i = 0; i < segment.size(); ++i) {
+        if (segment[i] == L'#') {
+            segment[i] = L'\\';
+            break;
+        }
+    }
+
+    return WideToAnsi(segment);
+}
+
+// ========== 设备信息缓存 ==========
+// 句柄 → HID 路径与硬件ID。每个句柄只查询一次 GetRawInputDeviceInfoW 并做一次宽字符转换；
+// 设备拔出时（WM_INPUT_DEVICE_CHANGE / evdev ENODEV）失效，句柄被系统复用时会重新查询。
+
+struct DeviceInfoEntry {
+    HANDLE device;
+    std::wstring path;
+    std::string hardwareId;
+};
+
+std::mutex g_deviceInfoMutex;
+std::vector<DeviceInfoEntry> g_deviceInfoCache;
+
+static DeviceInfoEntry LookupDeviceInfo(HANDLE device) {
+    {
+        std::lock_guard<std::mutex> lock(g_deviceInfoMutex);
+        for (const DeviceInfoEntry& entry : g_deviceInfoCache) {
+            if (entry.device == device) return entry;
+        }
+    }
+
+    // 查询放在锁外：GetRawInputDeviceInfoW 是一次系统调用
+    wchar_t path[512] = {0};
+    GetDeviceHidPath(device, path, sizeof(path) / sizeof(wchar_t));
+    DeviceInfoEntry entry = {device, path, DevicePathToHardwareId(path)};
+
+    std::lock_guard<std::mutex> lock(g_deviceInfoMutex);
+    for (const DeviceInfoEntry& existing : g_deviceInfoCache) {
+        if (existing.device == device) return existing;
+    }
+    g_deviceInfoCache.push_back(entry);
+    return entry;
+}
+
+static void InvalidateDeviceInfo(HANDLE device) {
+    std::lock_guard<std::mutex> lock(g_deviceInfoMutex);
+    for (size_t i = 0; i < g_deviceInfoCache.size(); ++i) {
+        if (g_deviceInfoCache[i].device != device) continue;
+        g_deviceInfoCache[i] = g_deviceInfoCache.back();
+        g_deviceInfoCache.pop_back();
+        return;
+    }
+}
+
+std::string CachedHardwareId(HANDLE device) {
+    return LookupDeviceInfo(device).hardwareId;
+}
+
+void CachedDevicePath(HANDLE device, wchar_t* path, size_t pathSize) {
+    const std::wstring cached = LookupDeviceInfo(device).path;
+    path[0] = L'\0';
+    if (cached.size() + 1 > pathSize) return;
+    std::copy(cached.c_str(), cached.c_str() + cached.size() + 1, path);
+}
+
+// 按硬件ID 归类新句柄并登记角色：注册鼠标重新插入后换到新句柄，--trigger / --ignore 设备同理。
+// 输入线程在该句柄的第一个包上调用（Win32 也在设备到达通知里提前调用）
+static DeviceRoleInfo ClassifyDevice(HANDLE device) {
+    DeviceRoleInfo role = {DEVICE_ROLE_OBSERVER, 0};
+    // 回放的句柄来自录制文件，不查询系统
+    const std::string id = g_replayMode.load() ? std::string() : CachedHardwareId(device);
+    if (!id.empty()) {
+        if (!g_registrationMode.load() && id == RegisteredHardwareId()) {
+            const HANDLE old = g_registeredDevice.load();
+            SetRegisteredDevice(device);
+            if (old != device && !g_ipcMode.load()) {
+                printf("\n[DEVICE] Registered mouse reconnected: 0x%p\n", device);
+                fflush(stdout);
+            }
+            return {DEVICE_ROLE_TRIGGER, 0};
+        }
+        for (size_t i = 0; i < g_extraTriggers.size(); ++i) {
+            if (g_extraTriggers[i].hardwareId == id) role = {DEVICE_ROLE_TRIGGER, static_cast<uint8_t>(i + 1)};
+        }
+        for (const ConfiguredDevice& ignored : g_ignoredDevices) {
+            if (ignored.hardwareId == id) role = {DEVICE_ROLE_IGNORED, 0};
+        }
+    }
+    SetDeviceRole(device, role.role, role.trigger);
+    return role;
+}
+
+// 设备拔出：丢弃缓存，松开它作为触发器持有的锁定，句柄留待重新归类（输入线程调用）
+static void ForgetDevice(HANDLE device) {
+    const DeviceRoleInfo role = LookupDeviceRole(device);
+    if (role.role == DEVICE_ROLE_TRIGGER) {
+        DispatchLockEvent(role.trigger, LOCK_EV_DISABLE, ClockNowUs());
+    }
+    if (role.role != DEVICE_ROLE_UNKNOWN) SetDeviceRole(device, DEVICE_ROLE_UNKNOWN);
+    InvalidateDeviceInfo(device);
+}
+
+// 读取文件内容：按文件大小一次分配、一次读入
+bool ReadFileContent(const char* path, std::string& content) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) return false;
+    const std::streamoff size = file.tellg();
+    if (size < 0) return false;
+    content.resize(static_cast<size_t>(size));
+    file.seekg(0);
+    return size == 0 || static_cast<bool>(file.read(&content[0], size));
+}
+
+// 写入文件内容
+bool WriteFileContent(const char* path, const std::string& content) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) return false;
+    file << content;
+    return true;
+}
+
+// 原子替换：写同目录下的临时文件并刷到磁盘，再改名覆盖。中途崩溃或断电时，
+// 原文件要么完整保留、要么已是完整的新内容，rawaccel 不会读到半个 settings.json
+bool WriteFileAtomic(const std::string& path, const std::string& content) {
+    const std::string tmpPath = path + ".tmp";
+#ifdef _WIN32
+    HANDLE file = CreateFileA(tmpPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    DWORD written = 0;
+    bool ok = WriteFile(file, content.data(), static_cast<DWORD>(content.size()), &written, NULL) &&
+              written == content.size();
+    ok = ok && FlushFileBuffers(file);
+    CloseHandle(file);
+    ok = ok && MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    if (!ok) DeleteFileA(tmpPath.c_str());
+    return ok;
+#else
+    const int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) fchmod(fd, st.st_mode & 07777);  // 保留原文件权限
+
+    bool ok = true;
+    for (size_t done = 0; ok && done < content.size();) {
+        const ssize_t n = write(fd, content.data() + done, content.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) done += static_cast<size_t>(n);
+    }
+    ok = (fsync(fd) == 0) && ok;
+    ok = (close(fd) == 0) && ok;
+    ok = ok && rename(tmpPath.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    // 改名本身也要落盘
+    const size_t slash = path.find_last_of('/');
+    const std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+    const int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return true;
+#endif
+}
+
+// 去除字符串首尾空白
+std::string TrimString(const std::string& s) {
+    size_t start = 0;
+    while (start < s.size() && std::isspace(static_cast<unsigned char>(s[start]))) start++;
+    size_t end = s.size();
+    while (end > start && std::isspace(static_cast<unsigned char>(s[end - 1]))) end--;
+    return s.substr(start, end - start);
+}
+
+bool SaveLastRegisteredHardwareId(const std::string& hardwareId) {
+    if (hardwareId.empty() || g_statePath.empty()) return false;
+    if (g_replayMode.load()) return false;  // 回放的设备句柄来自录制时的会话，不持久化
+    return WriteFileAtomic(g_statePath, hardwareId + "\n");
+}
+
+bool LoadLastRegisteredHardwareId(std::string& hardwareId) {
+    if (g_statePath.empty()) return false;
+    std::string content;
+    if (!ReadFileContent(g_statePath.c_str(), content)) return false;
+    hardwareId = TrimString(content);
+    return !hardwareId.empty();
+}
+
+void ClearLastRegisteredHardwareId() {
+    if (g_statePath.empty()) return;
+    DeleteFileA(g_statePath.c_str());
+}
+
+// 枚举当前系统中的输入设备句柄
+static bool EnumerateInputDevices(std::vector<HANDLE>& devices) {
+    devices.clear();
+#ifdef _WIN32
+    UINT count = 0;
+    if (GetRawInputDeviceList(NULL, &count, sizeof(RAWINPUTDEVICELIST)) != 0 || count == 0) {
+        return false;
+    }
+
+    std::vector<RAWINPUTDEVICELIST> list(static_cast<size_t>(count));
+    UINT got = GetRawInputDeviceList(list.data(), &count, sizeof(RAWINPUTDEVICELIST));
+    if (got == static_cast<UINT>(-1)) {
+        return false;
+    }
+
+    for (UINT i = 0; i < got; ++i) {
+        devices.push_back(list[i].hDevice);
+    }
+#else
+    for (const std::string& path : EnumerateEvdevMice()) {
+        devices.push_back(RegisterEvdevDevice(path, -1));
+    }
+#endif
+    return !devices.empty();
+}
+
+bool TryRestoreLastRegisteredMouse() {
+    std::string hardwareId;
+    if (!LoadLastRegisteredHardwareId(hardwareId)) return false;
+
+    std::vector<HANDLE> devices;
+    if (!EnumerateInputDevices(devices)) {
+        return false;
+    }
+
+    for (HANDLE device : devices) {
+        if (!device) continue;
+
+        std::string id = CachedHardwareId(device);
+        if (id.empty()) continue;
+        if (id != hardwareId) continue;
+
+        SetRegisteredDevice(device);
+        CachedDevicePath(device, g_registeredDevicePath, sizeof(g_registeredDevicePath) / sizeof(wchar_t));
+        SetRegisteredHardwareId(id);
+        g_registrationMode.store(false);
+        return true;
+    }
+
+    return false;
+}
+
+// 启动时归类当前所有设备（同时预热设备信息缓存），检查 --trigger 设备是否都已连接
+static void ResolveConfiguredDevices() {
+    std::vector<HANDLE> devices;
+    EnumerateInputDevices(devices);
+
+    std::vector<bool> triggerFound(g_extraTriggers.size(), false);
+    for (HANDLE device : devices) {
+        if (!device) continue;
+        const DeviceRoleInfo role = ClassifyDevice(device);
+        if (role.role == DEVICE_ROLE_TRIGGER && role.trigger > 0) triggerFound[role.trigger - 1] = true;
+    }
+
+    for (size_t i = 0; i < g_extraTriggers.size(); ++i) {
+        if (triggerFound[i]) continue;
+        if (g_ipcMode.load()) {
+            QueueNotifyError("TRIGGER NOT FOUND");
+        } else {
+            printf("[WARN] Trigger device not connected: %s\n", g_extraTriggers[i].hardwareId.c_str());
+        }
+    }
+}
+
+// --trigger 参数：<hwid>[=<灵敏度>]
+static bool ParseTriggerArg(const char* arg, ConfiguredDevice& out) {
+    std::string value = arg ? arg : "";
+    const size_t eq = value.rfind('=');
+    out.sensitivity = 1.0;
+    if (eq != std::string::npos) {
+        char* end = nullptr;
+        const std::string sens = value.substr(eq + 1);
+        out.sensitivity = std::strtod(sens.c_str(), &end);
+        if (sens.empty() || *end != '\0' || !(out.sensitivity >= 0.001 && out.sensitivity <= 100.0)) return false;
+        value.resize(eq);
+    }
+    out.hardwareId = value;
+    return !value.empty();
+}
+
+// ========== settings.json 结构索引 ==========
+// 单遍扫描整份文本，按文档顺序为每个值记录字节范围（对象成员另记录键），字符串内的括号、引号
+// 与转义不会被当成结构字符。编辑不直接改文本，而是登记成拼接（替换区间 + 新文本），最后按偏移
+// 一次写进新缓冲区，拼接之外的字节（缩进、换行、用户自己的格式）原样保留。
+
+enum JsonValueKind : uint8_t { JSON_OBJECT, JSON_ARRAY, JSON_STRING, JSON_NUMBER, JSON_LITERAL };
+
+struct JsonNode {
+    uint32_t start;        // 值的第一个字节
+    uint32_t end;          // 值之后的第一个字节
+    uint32_t keyStart;     // 对象成员：键的内容（不含引号，保持转义形式）
+    uint32_t keyEnd;
+    int32_t parent;        // 根为 -1
+    int32_t nextSibling;   // 同一容器内的下一个值，没有为 -1
+    JsonValueKind kind;
+};
+
+struct JsonIndex {
+    std::vector<JsonNode> nodes;  // 先序：容器的第一个子值紧跟在容器之后
+
+    int32_t FirstChild(int32_t node) const {
+        const int32_t next = node + 1;
+        return (next < static_cast<int32_t>(nodes.size()) && nodes[next].parent == node) ? next : -1;
+    }
+    // 对象中第一个键为 key 的成员
+    int32_t Member(std::string_view text, int32_t object, std::string_view key) const {
+        if (object < 0 || nodes[object].kind != JSON_OBJECT) return -1;
+        for (int32_t c = FirstChild(object); c >= 0; c = nodes[c].nextSibling) {
+            const JsonNode& n = nodes[c];
+            if (text.substr(n.keyStart, n.keyEnd - n.keyStart) == key) return c;
+        }
+        return -1;
+    }
+    std::string_view Value(std::string_view text, int32_t node) const {
+        return text.substr(nodes[node].start, nodes[node].end - nodes[node].start);
+    }
+    // 字符串值的内容（不含引号，保持转义形式）
+    std::string_view StringContent(std::string_view text, int32_t node) const {
+        if (node < 0 || nodes[node].kind != JSON_STRING) return std::string_view();
+        return text.substr(nodes[node].start + 1, nodes[node].end - nodes[node].start - 2);
+    }
+};
+
+static bool IsJsonSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// 从 pos 起找下一个 '"' 或 '\\'，找不到返回 n。字符串占 settings.json 的大部分字节，一次比较 16 个
+static size_t FindJsonQuoteOrEscape(const char* p, size_t pos, size_t n) {
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i escape = _mm_set1_epi8('\\');
+    for (; pos + 16 <= n; pos += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + pos));
+        const unsigned mask = static_cast<unsigned>(
+            _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, escape))));
+        if (mask != 0) {
+#ifdef _MSC_VER
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+            return pos + bit;
+#else
+            return pos + static_cast<size_t>(__builtin_ctz(mask));
+#endif
+        }
+    }
+#endif
+    while (pos < n && p[pos] != '"' && p[pos] != '\\') ++pos;
+    return pos;
+}
+
+// p[pos] 为开引号；返回闭引号之后的位置，未闭合返回 0
+static size_t SkipJsonString(const char* p, size_t pos, size_t n) {
+    ++pos;
+    while (true) {
+        pos = FindJsonQuoteOrEscape(p, pos, n);
+        if (pos >= n) return 0;
+        if (p[pos] == '"') return pos + 1;
+        pos += 2;  // 跳过转义字符及其后一个字节
+    }
+}
+
+// 单遍建立索引；文本不是合法的 JSON 结构时返回 false
+bool BuildJsonIndex(std::string_view text, JsonIndex& index) {
+    std::vector<JsonNode>& nodes = index.nodes;
+    nodes.clear();
+    if (text.size() >= UINT32_MAX) return false;
+
+    const char* p = text.data();
+    const size_t n = text.size();
+    size_t i = 0;
+    if (n >= 3 && static_cast<unsigned char>(p[0]) == 0xEF &&
+        static_cast<unsigned char>(p[1]) == 0xBB && static_cast<unsigned char>(p[2]) == 0xBF) {
+        i = 3;  // UTF-8 BOM
+    }
+
+    std::vector<int32_t> open;       // 尚未闭合的容器
+    std::vector<int32_t> lastChild;  // 每层最近的一个子值，用于串起 nextSibling；[0] 为顶层
+    lastChild.push_back(-1);
+    uint32_t keyStart = 0, keyEnd = 0;
+
+    auto skipSpace = [&]() { while (i < n && IsJsonSpace(p[i])) ++i; };
+    auto addNode = [&](JsonValueKind kind, size_t start) -> int32_t {
+        const int32_t id = static_cast<int32_t>(nodes.size());
+        nodes.push_back({static_cast<uint32_t>(start), 0, keyStart, keyEnd,
+                         open.empty() ? -1 : open.back(), -1, kind});
+        if (lastChild.back() >= 0) nodes[lastChild.back()].nextSibling = id;
+        lastChild.back() = id;
+        keyStart = keyEnd = 0;
+        return id;
+    };
+    // 对象内读取 "键":，成功后 i 指向值
+    auto readKey = [&]() -> bool {
+        skipSpace();
+        if (i >= n || p[i] != '"') return false;
+        const size_t close = SkipJsonString(p, i, n);
+        if (close == 0) return false;
+        keyStart = static_cast<uint32_t>(i + 1);
+        keyEnd = static_cast<uint32_t>(close - 1);
+        i = close;
+        skipSpace();
+        if (i >= n || p[i] != ':') return false;
+        ++i;
+        return true;
+    };
+
+    bool expectValue = true;
+    while (true) {
+        skipSpace();
+        if (expectValue) {
+            if (i >= n) return false;
+            const char c = p[i];
+            if (c == '{' || c == '[') {
+                const int32_t id = addNode(c == '{' ? JSON_OBJECT : JSON_ARRAY, i);
+                open.push_back(id);
+                lastChild.push_back(-1);
+                ++i;
+                skipSpace();
+                if (i < n && p[i] == (c == '{' ? '}' : ']')) {
+                    expectValue = false;  // 空容器，交给下面的闭合分支
+                    continue;
+                }
+                if (c == '{' && !readKey()) return false;
+                continue;
+            }
+            if (c == '"') {
+                const size_t close = SkipJsonString(p, i, n);
+                if (close == 0) return false;
+                nodes[addNode(JSON_STRING, i)].end = static_cast<uint32_t>(close);
+                i = close;
+            } else if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n') {
+                const size_t start = i;
+                while (i < n && !IsJsonSpace(p[i]) && p[i] != ',' && p[i] != '}' && p[i] != ']') ++i;
+                const JsonValueKind kind = (c == 't' || c == 'f' || c == 'n') ? JSON_LITERAL : JSON_NUMBER;
+                nodes[addNode(kind, start)].end = static_cast<uint32_t>(i);
+            } else {
+                return false;
+            }
+            expectValue = false;
+            continue;
+        }
+
+        // 一个值结束：逗号、闭合当前容器，或顶层值结束
+        if (open.empty()) return i == n;
+        if (i >= n) return false;
+        JsonNode& container = nodes[open.back()];
+        const char close = container.kind == JSON_OBJECT ? '}' : ']';
+        if (p[i] == ',') {
+            ++i;
+            if (container.kind == JSON_OBJECT && !readKey()) return false;
+            expectValue = true;
+        } else if (p[i] == close) {
+            container.end = static_cast<uint32_t>(++i);
+            open.pop_back();
+            lastChild.pop_back();
+        } else {
+            return false;
+        }
+    }
+}
+
+// 把 [start, end) 替换为 text；同一次编辑中的拼接互不重叠，插入（start == end）可与以它为起点的替换并存
+struct JsonSplice {
+    size_t start;
+    size_t end;
+    std::string text;
+};
+
+// 按起点（同起点时插入在前、其余保持登记顺序）一次写入 out；重叠的拼接丢弃
+void ApplyJsonSplices(std::string_view text, std::vector<JsonSplice>& splices, std::string& out) {
+    std::stable_sort(splices.begin(), splices.end(), [](const JsonSplice& a, const JsonSplice& b) {
+        if (a.start != b.start) return a.start < b.start;
+        return (a.start == a.end) && (b.start != b.end);
+    });
+
+    size_t size = text.size();
+    for (const JsonSplice& s : splices) size = size - (s.end - s.start) + s.text.size();
+    out.clear();
+    out.reserve(size);
+
+    size_t cursor = 0;
+    for (const JsonSplice& s : splices) {
+        if (s.start < cursor || s.end < s.start || s.end > text.size()) continue;
+        out.append(text.data() + cursor, s.start - cursor);
+        out.append(s.text);
+        cursor = s.end;
+    }
+    out.append(text.data() + cursor, text.size() - cursor);
+}
+
+// 与 RawAccel 写出的格式一致：一位小数
+static std::string FormatJsonDpi(double value) {
+    std::ostringstream ss;
+    ss.setf(std::ios::fixed);
+    ss.precision(1);
+    ss << value;
+    return ss.str();
+}
+
+// ========== settings.json 内存模型 ==========
+// 文件只在首次使用或被其他程序改动后读入并建立结构索引；编辑先登记为拼接，提交时一次写入新缓冲区、
+// 重建索引后原子写出。目录监视线程发现文件戳（大小、修改时间）与我们最后一次读写时不同，
+// 才让模型在下次使用时重新读入。内容哈希与版本号（generation）用来跳过没有变化的写出与 writer.exe。
+
+struct SettingsFileStamp {
+    uint64_t size = 0;
+    uint64_t mtime = 0;
+    bool exists = false;
+
+    bool operator==(const SettingsFileStamp& other) const {
+        return size == other.size && mtime == other.mtime && exists == other.exists;
+    }
+    bool operator!=(const SettingsFileStamp& other) const { return !(*this == other); }
+};
+
+// profiles / devices 数组中的一个对象
+struct SettingsEntry {
+    std::string key;      // profile：name；device：id（保持 JSON 转义形式）
+    std::string profile;  // 仅 device：映射到的 profile
+    int32_t node;         // 对象在 JsonIndex 中的下标
+    int32_t dpi;          // 仅 profile："Output DPI" 的值，没有为 -1
+};
+
+// 一次编辑中登记的改动，全部基于编辑开始时的文本
+struct SettingsEdit {
+    std::vector<JsonSplice> splices;                                // 已有值的替换
+    std::vector<std::pair<std::string, std::string>> newProfiles;  // name → 对象文本，追加到 profiles 末尾
+    std::vector<std::pair<std::string, std::string>> newDevices;   // 转义后的 id → 对象文本，追加到 devices 末尾
+    std::vector<uint8_t> removedDevices;                            // 与 SettingsModel::devices 一一对应
+
+    void Clear(size_t deviceCount) {
+        splices.clear();
+        newProfiles.clear();
+        newDevices.clear();
+        removedDevices.assign(deviceCount, 0);
+    }
+    // 同一区间再次替换时覆盖先前登记的文本
+    void Replace(size_t start, size_t end, const std::string& text) {
+        for (JsonSplice& s : splices) {
+            if (s.start == start && s.end == end) {
+                s.text = text;
+                return;
+            }
+        }
+        splices.push_back({start, end, text});
+    }
+};
+
+struct SettingsModel {
+    std::string text;
+    std::string path;
+    bool loaded = false;
+    JsonIndex index;
+    int32_t profilesNode = -1;             // 根对象的 "profiles" / "devices" 数组，没有为 -1
+    int32_t devicesNode = -1;
+    std::vector<SettingsEntry> profiles;   // 文件顺序
+    std::vector<SettingsEntry> devices;
+    // 与 JsonIndex 一同重建的查找表（下标指向 profiles / devices）。不另设 arena：文本是一块缓冲区，
+    // 节点与条目放在重建时清空复用的 vector 里，容量在多次读入之间保留
+    std::unordered_map<std::string, size_t> profileByName;  // 同名时为最后一个
+    std::unordered_map<std::string, size_t> deviceById;     // 同 id 时为第一个，其余经 nextSameId 串起
+    std::vector<int32_t> nextSameId;                         // 文件顺序中下一个同 id 设备，没有为 -1
+    std::vector<size_t> sensDevices;                         // profile 为 sens_registered_mouse* 的设备
+    SettingsEdit edit;                     // 尚未提交的改动
+    SettingsFileStamp stamp;               // 最近一次读入/写出后的文件戳
+    uint64_t loads = 0;                    // 读入次数（首次 + 外部改动）
+    uint64_t diskHash = 0;                 // 磁盘上内容（最近一次读入/写出）的哈希
+    uint64_t generation = 0;               // 内容每变化一次加一
+    uint64_t writerGeneration = 0;         // writer.exe 最近一次成功应用的版本，0 = 本进程还没运行过
+};
+
+SettingsModel g_settingsModel;  // 受 g_settingsMutex 保护
+
+// 8 字节一步的乘法-异或哈希，只用于判断内容是否变化
+static uint64_t HashSettingsText(std::string_view text) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ text.size();
+    size_t i = 0;
+    for (; i + 8 <= text.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, text.data() + i, 8);
+        h = (h ^ word) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    for (; i < text.size(); ++i) {
+        h = (h ^ static_cast<unsigned char>(text[i])) * 0x100000001B3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+static bool QuerySettingsFileStamp(const std::string& path, SettingsFileStamp& stamp) {
+    stamp = SettingsFileStamp();
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) return false;
+    stamp.size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    stamp.mtime = (static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) |
+                  data.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    stamp.size = static_cast<uint64_t>(st.st_size);
+    stamp.mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ULL +
+                  static_cast<uint64_t>(st.st_mtim.tv_nsec);
+#endif
+    stamp.exists = true;
+    return true;
+}
+
+// 根对象中名为 key 的数组，及其中每个对象的 keyField（devices 另取 profile）
+static int32_t IndexSettingsArray(SettingsModel& m, const char* arrayKey, const char* keyField,
+                                  std::vector<SettingsEntry>& entries) {
+    entries.clear();
+    const JsonIndex& index = m.index;
+    const int32_t array = index.Member(m.text, 0, arrayKey);
+    if (array < 0 || index.nodes[array].kind != JSON_ARRAY) return -1;
+
+    const bool isDevices = std::strcmp(keyField, "id") == 0;
+    for (int32_t obj = index.FirstChild(array); obj >= 0; obj = index.nodes[obj].nextSibling) {
+        if (index.nodes[obj].kind != JSON_OBJECT) continue;
+        SettingsEntry entry{std::string(index.StringContent(m.text, index.Member(m.text, obj, keyField))),
+                            std::string(), obj, -1};
+        if (isDevices) {
+            entry.profile = std::string(index.StringContent(m.text, index.Member(m.text, obj, "profile")));
+        } else {
+            const int32_t dpi = index.Member(m.text, obj, "Output DPI");
+            if (dpi >= 0 && index.nodes[dpi].kind == JSON_NUMBER) entry.dpi = dpi;
+        }
+        entries.push_back(std::move(entry));
+    }
+    return array;
+}
+
+static bool ReindexSettingsModel(SettingsModel& m) {
+    if (!BuildJsonIndex(m.text, m.index) || m.index.nodes.empty() || m.index.nodes[0].kind != JSON_OBJECT) {
+        return false;
+    }
+    m.profilesNode = IndexSettingsArray(m, "profiles", "name", m.profiles);
+    m.devicesNode = IndexSettingsArray(m, "devices", "id", m.devices);
+
+    m.profileByName.clear();
+    for (size_t i = 0; i < m.profiles.size(); ++i) m.profileByName[m.profiles[i].key] = i;
+
+    m.deviceById.clear();
+    m.sensDevices.clear();
+    m.nextSameId.assign(m.devices.size(), -1);
+    const size_t prefixLen = std::strlen(SENS_PROFILE_NAME);
+    // 倒序登记：同 id 的设备每次换成更靠前的一个，链表因此按文件顺序
+    for (size_t i = m.devices.size(); i-- > 0;) {
+        auto inserted = m.deviceById.emplace(m.devices[i].key, i);
+        if (!inserted.second) {
+            m.nextSameId[i] = static_cast<int32_t>(inserted.first->second);
+            inserted.first->second = i;
+        }
+    }
+    for (size_t i = 0; i < m.devices.size(); ++i) {
+        if (m.devices[i].profile.compare(0, prefixLen, SENS_PROFILE_NAME) == 0) m.sensDevices.push_back(i);
+    }
+    m.edit.Clear(m.devices.size());
+    return true;
+}
+
+// 调用方持有 g_settingsMutex。首次使用或文件被外部改动后重新读入；读取或解析失败返回 nullptr。
+// 上一次未提交（中途失败）的改动在这里丢弃
+SettingsModel* AcquireSettingsModel() {
+    SettingsModel& m = g_settingsModel;
+    if (m.loaded && m.path == g_settingsPath) {
+        m.edit.Clear(m.devices.size());
+        return &m;
+    }
+
+    m.loaded = false;
+    if (!ReadFileContent(g_settingsPath.c_str(), m.text)) return nullptr;
+    if (!ReindexSettingsModel(m)) return nullptr;
+    QuerySettingsFileStamp(g_settingsPath, m.stamp);
+
+    // 被外部改动后重新读入：内容确实不同才算新版本（只是被 touch 过则沿用）
+    const uint64_t hash = HashSettingsText(m.text);
+    if (m.generation == 0 || hash != m.diskHash || m.path != g_settingsPath) {
+        m.generation++;
+        g_settingsCounters.generation.store(m.generation);
+    }
+    m.diskHash = hash;
+    m.path = g_settingsPath;
+    m.loaded = true;
+    m.loads++;
+    return &m;
+}
+
+// 把新对象与删除登记成数组上的拼接：连续被删的一段连同分隔符一起去掉，新对象接在最后一个保留的对象之后
+static void PlanSettingsArrayEdits(SettingsModel& m) {
+    SettingsEdit& e = m.edit;
+    const std::vector<JsonNode>& nodes = m.index.nodes;
+
+    if (!e.newProfiles.empty() && !m.profiles.empty()) {
+        std::string insertion;
+        for (const auto& profile : e.newProfiles) insertion += ",\n    " + profile.second;
+        const size_t pos = nodes[m.profiles.back().node].end;
+        e.splices.push_back({pos, pos, insertion});
+    }
+
+    if (m.devicesNode < 0) return;
+    const JsonNode& array = nodes[m.devicesNode];
+    int32_t lastKept = -1;
+    for (size_t i = 0; i < m.devices.size();) {
+        if (!e.removedDevices[i]) {
+            lastKept = static_cast<int32_t>(i++);
+            continue;
+        }
+        size_t j = i;
+        while (j < m.devices.size() && e.removedDevices[j]) ++j;
+        if (lastKept >= 0) {
+            // 前面有保留的对象：从它之后删到这一段的最后一个对象（含前置逗号）
+            e.splices.push_back({nodes[m.devices[lastKept].node].end, nodes[m.devices[j - 1].node].end, std::string()});
+        } else if (j < m.devices.size()) {
+            // 数组开头的一段：删到下一个保留对象之前（含后置逗号），保留它原来的缩进
+            e.splices.push_back({nodes[m.devices[i].node].start, nodes[m.devices[j].node].start, std::string()});
+        } else {
+            e.splices.push_back({array.start + 1u, array.end - 1u, std::string()});  // 全部删除
+        }
+        i = j;
+    }
+
+    if (e.newDevices.empty()) return;
+    std::string insertion;
+    if (lastKept >= 0) {
+        for (const auto& device : e.newDevices) insertion += ",\n    " + device.second;
+        const size_t pos = nodes[m.devices[lastKept].node].end;
+        e.splices.push_back({pos, pos, insertion});
+    } else {
+        for (size_t i = 0; i < e.newDevices.size(); ++i) {
+            insertion += (i == 0 ? "\n    " : ",\n    ") + e.newDevices[i].second;
+        }
+        insertion += "\n  ";
+        e.splices.push_back({array.start + 1u, array.start + 1u, insertion});
+    }
+}
+
+// 把登记的改动一次写入新缓冲区并重建索引（不写文件）；changed 返回文本是否有变化
+bool ApplySettingsEdit(SettingsModel& m, bool& changed) {
+    PlanSettingsArrayEdits(m);
+
+    // 替换成相同文本的拼接（同一灵敏度再设一次）不算改动
+    std::vector<JsonSplice>& splices = m.edit.splices;
+    splices.erase(std::remove_if(splices.begin(), splices.end(), [&](const JsonSplice& sp) {
+                      return std::string_view(m.text).substr(sp.start, sp.end - sp.start) == sp.text;
+                  }),
+                  splices.end());
+    changed = !splices.empty();
+    if (!changed) return true;
+
+    std::string next;
+    ApplyJsonSplices(m.text, m.edit.splices, next);
+    m.text.swap(next);
+    if (!ReindexSettingsModel(m)) {
+        m.loaded = false;
+        return false;
+    }
+    return true;
+}
+
+// 调用方持有 g_settingsMutex。内容与磁盘上相同时不写；失败时丢弃模型，下次从文件重新读入
+bool CommitSettingsModel(SettingsModel& m) {
+    bool changed = false;
+    if (!ApplySettingsEdit(m, changed)) {
+        m.loaded = false;
+        return false;
+    }
+    const uint64_t hash = changed ? HashSettingsText(m.text) : m.diskHash;
+    if (hash == m.diskHash) {
+        g_settingsCounters.writesSkipped.fetch_add(1);
+        return true;
+    }
+
+    if (!WriteFileAtomic(m.path, m.text)) {
+        m.loaded = false;
+        return false;
+    }
+    QuerySettingsFileStamp(m.path, m.stamp);
+    m.diskHash = hash;
+    m.generation++;
+    g_settingsCounters.writes.fetch_add(1);
+    g_settingsCounters.generation.store(m.generation);
+    return true;
+}
+
+// 调用方持有 g_settingsMutex。writer.exe 已成功应用过当前版本时返回 false（计入跳过）；
+// 本进程第一次总要运行（驱动里是什么配置未知），模型不可用时也照常运行。
+// generation 为这次要应用的版本，模型不可用时为 0
+bool SettingsWriterNeeded(uint64_t& generation) {
+    SettingsModel& m = g_settingsModel;
+    const bool known = m.loaded && m.path == g_settingsPath;
+    generation = known ? m.generation : 0;
+    if (known && m.writerGeneration == m.generation) {
+        g_settingsCounters.writerRunsSkipped.fetch_add(1);
+        return false;
+    }
+    return true;
+}
+
+// 调用方持有 g_settingsMutex。writer.exe 运行期间不持锁，版本号单调递增，期间文件又变过也不会误记
+void NoteSettingsWriterApplied(uint64_t generation) {
+    if (generation != 0) g_settingsModel.writerGeneration = generation;
+}
+
+// 监视线程：文件戳与模型记录的不同，说明是其他程序改的
+static void NoteSettingsFileChanged() {
+    std::lock_guard<std::mutex> lock(g_settingsMutex);
+    SettingsModel& m = g_settingsModel;
+    if (!m.loaded) return;
+    SettingsFileStamp now;
+    QuerySettingsFileStamp(m.path, now);
+    if (now != m.stamp) m.loaded = false;
+}
+
+// ----- 目录监视（Windows: ReadDirectoryChangesW；Linux: inotify） -----
+// 监视 settings.json 所在目录（编辑器常以"写临时文件再改名"的方式保存），只关心同名文件。
+
+struct SettingsWatcher {
+    std::thread thread;
+    std::string dir;
+    std::string name;
+#ifdef _WIN32
+    HANDLE stopEvent = NULL;
+#else
+    int wakeFd = -1;
+#endif
+};
+
+SettingsWatcher g_settingsWatcher;
+
+static bool SameFileName(const std::string& a, const std::string& b) {
+#ifdef _WIN32
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (AsciiUpper(a[i]) != AsciiUpper(b[i])) return false;
+    }
+    return true;
+#else
+    return a == b;
+#endif
+}
+
+#ifdef _WIN32
+static void SettingsWatcherMain() {
+    SettingsWatcher& w = g_settingsWatcher;
+    HANDLE dir = CreateFileA(w.dir.c_str(), FILE_LIST_DIRECTORY,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                             OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (dir == INVALID_HANDLE_VALUE) return;
+
+    OVERLAPPED ov = {};
+    ov.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    alignas(DWORD) char buffer[4096];
+    const DWORD filter = FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE;
+
+    while (ov.hEvent) {
+        ResetEvent(ov.hEvent);
+        if (!ReadDirectoryChangesW(dir, buffer, sizeof(buffer), FALSE, filter, NULL, &ov, NULL)) break;
+
+        HANDLE handles[2] = {ov.hEvent, w.stopEvent};
+        DWORD bytes = 0;
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+            CancelIo(dir);
+            GetOverlappedResult(dir, &ov, &bytes, TRUE);
+            break;
+        }
+        if (!GetOverlappedResult(dir, &ov, &bytes, FALSE)) break;
+
+        // bytes == 0：缓冲区溢出，事件丢失，按有改动处理
+        bool touched = (bytes == 0);
+        for (DWORD offset = 0; bytes != 0;) {
+            const FILE_NOTIFY_INFORMATION* info =
+                reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(buffer + offset);
+            const std::wstring changed(info->FileName, info->FileNameLength / sizeof(wchar_t));
+            if (SameFileName(WideToAnsi(changed), w.name)) touched = true;
+            if (info->NextEntryOffset == 0) break;
+            offset += info->NextEntryOffset;
+        }
+        if (touched) NoteSettingsFileChanged();
+    }
+
+    if (ov.hEvent) CloseHandle(ov.hEvent);
+    CloseHandle(dir);
+}
+#else
+static void SettingsWatcherMain() {
+    SettingsWatcher& w = g_settingsWatcher;
+    const int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return;
+    if (inotify_add_watch(fd, w.dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+        close(fd);
+        return;
+    }
+
+    alignas(struct inotify_event) char buffer[4096];
+    pollfd fds[2] = {{fd, POLLIN, 0}, {w.wakeFd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;
+
+        bool touched = false;
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t offset = 0; offset < n;) {
+                const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+                if (ev->mask & IN_Q_OVERFLOW) touched = true;
+                if (ev->len > 0 && SameFileName(ev->name, w.name)) touched = true;
+                offset += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        if (touched) NoteSettingsFileChanged();
+    }
+    close(fd);
+}
+#endif
+
+// 主线程调用；失败时不监视，模型退化为只在本进程写入后保持有效
+void StartSettingsWatcher() {
+    SettingsWatcher& w = g_settingsWatcher;
+    if (w.thread.joinable() || g_settingsPath.empty()) return;
+
+    const size_t slash = g_settingsPath.find_last_of("\\/");
+    w.dir = (slash == std::string::npos) ? "." : g_settingsPath.substr(0, slash + 1);
+    w.name = (slash == std::string::npos) ? g_settingsPath : g_settingsPath.substr(slash + 1);
+#ifdef _WIN32
+    w.stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!w.stopEvent) return;
+#else
+    w.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w.wakeFd < 0) return;
+#endif
+    try {
+        w.thread = std::thread(SettingsWatcherMain);
+    } catch (const std::system_error&) {
+    }
+}
+
+void StopSettingsWatcher() {
+    SettingsWatcher& w = g_settingsWatcher;
+#ifdef _WIN32
+    if (w.stopEvent) SetEvent(w.stopEvent);
+    if (w.thread.joinable()) w.thread.join();
+    if (w.stopEvent) CloseHandle(w.stopEvent);
+    w.stopEvent = NULL;
+#else
+    if (w.wakeFd >= 0) {
+        const uint64_t one = 1;
+        ssize_t ignored = write(w.wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+    if (w.thread.joinable()) w.thread.join();
+    if (w.wakeFd >= 0) close(w.wakeFd);
+    w.wakeFd = -1;
+#endif
+}
+
+static bool TryLoadSensitivityFromSettings(double& outMultiplier) {
+    if (g_settingsPath.empty()) return false;
+
+    std::lock_guard<std::mutex> lock(g_settingsMutex);
+
+    SettingsModel* model = AcquireSettingsModel();
+    if (!model) return false;
+
+    for (const SettingsEntry& entry : model->profiles) {
+        if (entry.key != SENS_PROFILE_NAME) continue;
+        if (entry.dpi < 0) return false;
+
+        char* endPtr = nullptr;
+        const char* number = model->text.c_str() + model->index.nodes[entry.dpi].start;
+        errno = 0;
+        const double outputDpi = std::strtod(number, &endPtr);
+        if (endPtr == number || errno != 0) return false;
+
+        double multiplier = outputDpi / 1000.0;
+        if (multiplier < 0.001) multiplier = 0.001;
+        if (multiplier > 100.0) multiplier = 100.0;
+
+        outMultiplier = multiplier;
+        return true;
+    }
+
+    return false;
+}
+
+// 以第一个profile为模板，复制出名为 profileName、Output DPI 为 dpiText 的新profile文本
+static bool CopySensProfileTemplate(const SettingsModel& model, const std::string& profileName,
+                                    const std::string& dpiText, std::string& out, std::string& errorMsg) {
+    if (model.profiles.empty()) {
+        errorMsg = "no profile template found";
+        return false;
+    }
+    const SettingsEntry& first = model.profiles.front();
+    if (first.dpi < 0) {
+        errorMsg = "failed to set Output DPI in new profile";
+        return false;
+    }
+
+    // 在模板文本上替换name与Output DPI（偏移相对模板起点）
+    const JsonIndex& index = model.index;
+    const uint32_t base = index.nodes[first.node].start;
+    std::vector<JsonSplice> splices;
+    const int32_t name = index.Member(model.text, first.node, "name");
+    if (name >= 0 && index.nodes[name].kind == JSON_STRING) {
+        splices.push_back({index.nodes[name].start + 1u - base, index.nodes[name].end - 1u - base, profileName});
+    }
+    splices.push_back({index.nodes[first.dpi].start - base, index.nodes[first.dpi].end - base, dpiText});
+    ApplyJsonSplices(index.Value(model.text, first.node), splices, out);
+    return true;
+}
+
+// 复制profile并修改Output DPI
+bool CreateOrUpdateSensProfile(SettingsModel& model, const std::string& profileName, double outputDpi, std::string& errorMsg) {
+    if (model.profilesNode < 0) {
+        errorMsg = "profiles array not found";
+        return false;
+    }
+    const std::string dpiText = FormatJsonDpi(outputDpi);
+
+    // 本次编辑中刚复制出的profile，重新生成登记的文本
+    for (auto& pending : model.edit.newProfiles) {
+        if (pending.first == profileName) {
+            return CopySensProfileTemplate(model, profileName, dpiText, pending.second, errorMsg);
+        }
+    }
+
+    // 同名 profile 有多个时更新最后一个
+    auto found = model.profileByName.find(profileName);
+    if (found != model.profileByName.end()) {
+        // 更新已存在的profile
+        const SettingsEntry& existing = model.profiles[found->second];
+        if (existing.dpi < 0) {
+            errorMsg = "failed to update Output DPI in existing profile";
+            return false;
+        }
+        const JsonNode& dpi = model.index.nodes[existing.dpi];
+        model.edit.Replace(dpi.start, dpi.end, dpiText);
+        return true;
+    }
+
+    // 创建新的profile
+    std::string newProfile;
+    if (!CopySensProfileTemplate(model, profileName, dpiText, newProfile, errorMsg)) return false;
+    model.edit.newProfiles.emplace_back(profileName, std::move(newProfile));
+    return true;
+}
+
+// 硬件 ID 写入 settings.json 前转义反斜杠
+static std::string EscapeJsonBackslashes(const std::string& s) {
+    std::string escaped;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '\\') {
+            escaped += "\\\\";
+        } else {
+            escaped += s[i];
+        }
+    }
+    return escaped;
+}
+
+// 删除 devices 数组中映射到 sens_registered_mouse*（各触发器的 profile）的旧设备：
+// - 删除 id 不在 keepHardwareIds 中的设备；keepHardwareIds 为空时全部删除；
+// - 同一保留设备存在重复条目时，仅保留第一个。
+bool RemoveOldSensDeviceMappings(SettingsModel& model, const std::vector<std::string>& keepHardwareIds) {
+    if (model.devicesNode < 0) {
+        // 没有 devices 数组，视为无需清理
+        return true;
+    }
+
+    // 转义保留的 id 以匹配 settings.json 中的 id 字段（反斜杠在 JSON 中被转义为 \\\\）
+    std::vector<std::string> escapedKeepIds;
+    for (const std::string& id : keepHardwareIds) {
+        if (!id.empty()) escapedKeepIds.push_back(EscapeJsonBackslashes(id));
+    }
+    std::vector<bool> kept(escapedKeepIds.size(), false);
+
+    for (size_t i : model.sensDevices) {
+        const SettingsEntry& device = model.devices[i];
+        if (model.edit.removedDevices[i]) continue;
+
+        bool shouldRemove = true;
+        for (size_t k = 0; k < escapedKeepIds.size(); ++k) {
+            if (device.key != escapedKeepIds[k]) continue;
+            // 同一设备的重复条目，仅保留第一个
+            shouldRemove = kept[k];
+            kept[k] = true;
+            break;
+        }
+        if (shouldRemove) model.edit.removedDevices[i] = 1;
+    }
+
+    return true;
+}
+
+// 在devices数组中添加或更新设备映射（旧映射由调用方先用 RemoveOldSensDeviceMappings 统一清理）
+bool AddOrUpdateDeviceMapping(SettingsModel& model, const SensDeviceMapping& mapping, std::string& errorMsg) {
+    if (model.devicesNode < 0) {
+        errorMsg = "devices array not found";
+        return false;
+    }
+
+    // 先转义反斜杠用于JSON匹配和写入
+    std::string escapedId = EscapeJsonBackslashes(mapping.hardwareId);
+
+    // 构建设备配置JSON
+    std::string deviceJson =
+        "{\n"
+        "      \"name\": \"" + mapping.deviceName + "\",\n"
+        "      \"profile\": \"" + mapping.profileName + "\",\n"
+        "      \"id\": \"" + escapedId + "\",\n"
+        "      \"config\": {\n"
+        "        \"disable\": false,\n"
+        "        \"setExtraInfo\": true,\n"
+        "        \"Use constant time interval based on polling rate\": false,\n"
+        "        \"DPI (normalizes input speed unit: counts/ms -> in/s)\": 0,\n"
+        "        \"Polling rate Hz (keep at 0 for automatic adjustment)\": 0\n"
+        "      }\n"
+        "    }";
+
+    // JSON中的反斜杠已被转义，使用escapedId查找；已登记删除的设备不算，取同 id 中第一个未删除的
+    auto found = model.deviceById.find(escapedId);
+    for (int32_t i = found != model.deviceById.end() ? static_cast<int32_t>(found->second) : -1; i >= 0;
+         i = model.nextSameId[i]) {
+        if (model.edit.removedDevices[i]) continue;
+        // 替换现有设备配置
+        const JsonNode& node = model.index.nodes[model.devices[i].node];
+        model.edit.Replace(node.start, node.end, deviceJson);
+        return true;
+    }
+
+    for (auto& pending : model.edit.newDevices) {
+        if (pending.first != escapedId) continue;
+        pending.second = deviceJson;
+        return true;
+    }
+    model.edit.newDevices.emplace_back(escapedId, deviceJson);
+    return true;
+}
+
+// 注册鼠标用 sens_registered_mouse，--trigger 设备依次用 sens_registered_mouse_2、_3 ...
+std::vector<SensDeviceMapping> CollectSensMappings(double registeredSensitivity) {
+    std::vector<SensDeviceMapping> mappings;
+    const std::string registeredId = RegisteredHardwareId();
+    if (!registeredId.empty()) {
+        mappings.push_back({registeredId, SENS_PROFILE_NAME, "Registered Mouse", registeredSensitivity});
+    }
+    for (size_t i = 0; i < g_extraTriggers.size(); ++i) {
+        const std::string n = std::to_string(i + 2);
+        mappings.push_back({g_extraTriggers[i].hardwareId, std::string(SENS_PROFILE_NAME) + "_" + n,
+                            "Trigger Mouse " + n, g_extraTriggers[i].sensitivity});
+    }
+    return mappings;
+}
+
+// 清理旧映射时要保留的设备：注册鼠标与 --trigger 设备
+std::vector<std::string> SensMappedHardwareIds(const std::string& registeredHardwareId) {
+    std::vector<std::string> ids;
+    if (!registeredHardwareId.empty()) ids.push_back(registeredHardwareId);
+    for (const ConfiguredDevice& trigger : g_extraTriggers) ids.push_back(trigger.hardwareId);
+    return ids;
+}
+
+// 在模型上登记所有触发器的改动：各自的 profile 与设备映射，并清掉不再属于任何触发器的旧映射
+static bool EditSettingsForDevices(SettingsModel& model, const std::vector<SensDeviceMapping>& mappings, std::string& errorMsg) {
+    std::vector<std::string> keepIds;
+    for (const SensDeviceMapping& mapping : mappings) {
+        // 限制灵敏度范围
+        double clamped = mapping.sensitivity;
+        if (!std::isfinite(clamped)) {
+            errorMsg = "invalid sensitivity";
+            return false;
+        }
+        if (clamped < 0.001) clamped = 0.001;
+        if (clamped > 100.0) clamped = 100.0;
+
+        // 创建或更新灵敏度profile (Output DPI = 灵敏度 * 1000)
+        if (!CreateOrUpdateSensProfile(model, mapping.profileName, clamped * 1000.0, errorMsg)) {
+            return false;
+        }
+        keepIds.push_back(mapping.hardwareId);
+    }
+
+    // 先清理旧映射，避免多个设备共享同一 profile 导致"调一个全都变"
+    if (!RemoveOldSensDeviceMappings(model, keepIds)) {
+        errorMsg = "failed to remove old sens_registered_mouse device mappings";
+        return false;
+    }
+
+    // 添加或更新设备映射
+    for (const SensDeviceMapping& mapping : mappings) {
+        if (!AddOrUpdateDeviceMapping(model, mapping, errorMsg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 一次编辑更新所有触发器并写出（调用方持有 g_settingsMutex）
+bool UpdateSettingsForDevices(const std::vector<SensDeviceMapping>& mappings, std::string& errorMsg) {
+    ScopedLatency timing(STAGE_SETTINGS);
+    SettingsModel* model = AcquireSettingsModel();
+    if (!model) {
+        errorMsg = "failed to read settings.json";
+        return false;
+    }
+
+    if (!EditSettingsForDevices(*model, mappings, errorMsg)) {
+        return false;
+    }
+
+    // 写回文件
+    if (!CommitSettingsModel(*model)) {
+        errorMsg = "failed to write settings.json";
+        return false;
+    }
+
+    return true;
+}
+
+// ----- settings.json 基准（--settings-bench） -----
+
+// 生成含 n 个 profile、n 个设备的 settings.json（名字里带括号、引号与转义），比较建索引、
+// 一次灵敏度变更（改两个 profile、清掉旧映射、加两个映射）与不改动时原样输出的耗时
+static int RunSettingsBench(long count) {
+    std::string profile;
+    {
+        SettingsModel seed;
+        ReadFileContent(g_settingsPath.c_str(), seed.text);
+        if (ReindexSettingsModel(seed) && !seed.profiles.empty()) {
+            profile = std::string(seed.index.Value(seed.text, seed.profiles.front().node));
+        }
+    }
+    if (profile.empty()) {
+        profile = "{\n      \"name\": \"Default\",\n      \"Output DPI\": 1000,\n"
+                  "      \"X curve\": { \"Mode\": \"off\", \"Gain\": true, \"Acceleration\": 0.0 }\n    }";
+    }
+
+    SettingsModel model;
+    model.text = "{\n  \"profiles\": [\n    ";
+    for (long i = 0; i < count; ++i) {
+        std::string p = profile;
+        const size_t name = p.find("\"Default\"");
+        if (name != std::string::npos) {
+            p.replace(name, 9, "\"Profile {" + std::to_string(i) + "} \\\"[x]\\\"\"");
+        }
+        model.text += (i == 0 ? "" : ",\n    ") + p;
+    }
+    model.text += "\n  ],\n  \"devices\": [\n    ";
+    for (long i = 0; i < count; ++i) {
+        const bool sens = (i % 50) == 0;  // 一部分是本程序留下的旧映射
+        model.text += std::string(i == 0 ? "" : ",\n    ") +
+                      "{\n      \"name\": \"Mouse {" + std::to_string(i) + "}\",\n"
+                      "      \"profile\": \"" + (sens ? std::string(SENS_PROFILE_NAME) : "Profile {" + std::to_string(i) + "} \\\"[x]\\\"") + "\",\n"
+                      "      \"id\": \"HID\\\\VID_" + std::to_string(1000 + i) + "&PID_0001\",\n"
+                      "      \"config\": { \"disable\": false, \"setExtraInfo\": true }\n    }";
+    }
+    model.text += "\n  ]\n}\n";
+    const std::string original = model.text;
+
+    const int rounds = 20;
+    uint64_t indexNs = 0;
+    for (int r = 0; r < rounds; ++r) {
+        const uint64_t start = StatsNowTicks();
+        if (!ReindexSettingsModel(model)) {
+            printf("[ERROR] settings bench: index failed\n");
+            return 1;
+        }
+        indexNs += TicksToNs(StatsNowTicks() - start);
+    }
+    const bool indexedAll = model.profiles.size() == static_cast<size_t>(count) &&
+                            model.devices.size() == static_cast<size_t>(count);
+
+    // 不登记任何改动：原样输出
+    model.edit.Clear(model.devices.size());
+    bool changed = false;
+    ApplySettingsEdit(model, changed);
+    const bool identity = !changed && model.text == original;
+
+    const std::vector<SensDeviceMapping> mappings = {
+        {"HID\\VID_1005&PID_0001", SENS_PROFILE_NAME, "Registered Mouse", 1.5},
+        {"HID\\VID_9999&PID_0001", std::string(SENS_PROFILE_NAME) + "_2", "Trigger Mouse 2", 2.0},
+    };
+    uint64_t editNs = 0;
+    size_t bytes = 0;
+    for (int r = 0; r < rounds; ++r) {
+        model.text = original;
+        ReindexSettingsModel(model);
+        std::string err;
+        const uint64_t start = StatsNowTicks();
+        if (!EditSettingsForDevices(model, mappings, err) || !ApplySettingsEdit(model, changed)) {
+            printf("[ERROR] settings bench: %s\n", err.c_str());
+            return 1;
+        }
+        editNs += TicksToNs(StatsNowTicks() - start);
+        bytes = model.text.size();
+    }
+    size_t sensDevices = 0;
+    for (const SettingsEntry& d : model.devices) {
+        if (d.profile.compare(0, std::strlen(SENS_PROFILE_NAME), SENS_PROFILE_NAME) == 0) sensDevices++;
+    }
+    const bool edited = model.profiles.size() == static_cast<size_t>(count) + mappings.size() && sensDevices == mappings.size();
+
+    const double mb = static_cast<double>(original.size()) / (1024.0 * 1024.0);
+    const double indexMs = static_cast<double>(indexNs) / rounds / 1e6;
+    printf("SETTINGS_BENCH profiles=%ld devices=%ld bytes=%zu index_ms=%.3f index_mb_s=%.0f edit_ms=%.3f out_bytes=%zu identity=%d ok=%d\n",
+           count, count, original.size(), indexMs, indexMs > 0 ? mb / (indexMs / 1000.0) : 0.0,
+           static_cast<double>(editNs) / rounds / 1e6, bytes, identity ? 1 : 0, (indexedAll && edited) ? 1 : 0);
+    return (identity && indexedAll && edited) ? 0 : 1;
+}
+
+// ========== writer 后端 ==========
+// writer.exe 是 .NET 程序（加载 wrapper.dll / Newtonsoft.Json），每次改动都启动它时，进程启动占了应用耗时的大头。
+// 后端接口把"让驱动应用 settings"与具体做法分开：默认每次启动 writer.exe；--writer-helper 改用常驻 helper，
+// 经管道收发请求，崩溃或无应答时重启，起不来时退回每次启动。
+//
+// helper 协议（文本行；helper 以 "<helper> --writer-serve" 启动，stdin 收请求，stdout 回应答）：
+//   启动完成                                  → READY
+//   PING                                      → PONG（健康检查）
+//   APPLY <settings 路径>                     → OK | ERR <原因>
+//   APPLY_CONTENT <字节数>\n<settings 全文>   → OK | ERR <原因>
+//   QUIT                                      → 退出
+//
+// 真正的 helper（常驻的 writer，加载一次 wrapper.dll 后反复应用）须做到：
+//   - 收到 APPLY / APPLY_CONTENT 时把 settings 应用到驱动，效果与 "writer.exe <路径>" 相同，应用完成后才应答；
+//   - APPLY_CONTENT 行之后紧跟恰好 <字节数> 字节的 UTF-8 全文（不另加换行），读满后再解析；
+//     本程序在模型可用时发全文（与刚写出的 settings.json 相同），否则发路径；
+//   - 每个请求只回一行，按请求顺序；stdout 上不输出别的内容，行尾 \n（\r\n 也接受）；
+//   - 在 --writer-timeout 内应答，否则会被结束并重启；stdin 关闭或收到 QUIT 时退出。
+// 本程序的 --writer-serve 只是替身（只校验 JSON），不能当 helper 用。
+
+class WriterBackend {
+public:
+    virtual ~WriterBackend() {}
+    // 让驱动应用 settings；content 非空时随请求发送全文（后端不必再读文件）。最多等待 g_writerTimeoutMs
+    virtual bool Apply(const std::string& settingsPath, const std::string* content) = 0;
+    virtual void Shutdown() {}
+};
+
+// 启动 program args...，最多等待 timeoutMs，超时即结束它；退出码为 0 才算成功
+static bool RunProcessAndWait(const std::string& program, const std::vector<std::string>& args, DWORD timeoutMs) {
+#ifndef _WIN32
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(program.c_str()));
+    for (const std::string& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    pid_t pid = 0;
+    if (posix_spawn(&pid, program.c_str(), NULL, NULL, argv.data(), environ) != 0) {
+        return false;
+    }
+
+    int status = 0;
+#ifdef SYS_pidfd_open
+    // pidfd（Linux 5.3+）可以限时等子进程退出，不必轮询；不可用时退回每 5 毫秒查询一次
+    const int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    if (pidfd >= 0) {
+        pollfd pfd = {pidfd, POLLIN, 0};
+        int ready;
+        do {
+            ready = poll(&pfd, 1, static_cast<int>(timeoutMs));
+        } while (ready < 0 && errno == EINTR);
+        close(pidfd);
+        if (ready > 0 && waitpid(pid, &status, 0) == pid) {
+            return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        timeoutMs = 0;
+    }
+#endif
+    for (DWORD waited = 0; waited < timeoutMs; waited += 5) {
+        pid_t done = waitpid(pid, &status, WNOHANG);
+        if (done == pid) {
+            return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        if (done < 0) return false;
+        Sleep(5);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return false;
+#else
+    // 构建命令行: "program" "arg" ...
+    std::string cmdLine = "\"" + program + "\"";
+    for (const std::string& arg : args) cmdLine += " \"" + arg + "\"";
+
+    STARTUPINFOA si = {};
+    si.cb = sizeof(si);
+    PROCESS_INFORMATION pi = {};
+
+    // 创建进程
+    if (!CreateProcessA(NULL, const_cast<char*>(cmdLine.c_str()),
+                        NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi)) {
+        return false;
+    }
+
+    // 等待进程完成，超时则结束它，免得卡住的 writer.exe 与重试或下一次应用并存
+    DWORD exitCode = 1;
+    if (WaitForSingleObject(pi.hProcess, timeoutMs) == WAIT_OBJECT_0) {
+        GetExitCodeProcess(pi.hProcess, &exitCode);
+    } else {
+        TerminateProcess(pi.hProcess, 1);
+        WaitForSingleObject(pi.hProcess, 1000);
+    }
+
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+
+    return exitCode == 0;
+#endif
+}
+
+// 每次改动启动一个进程：program [prefixArgs...] <settings 路径>（writer.exe 的用法）
+class SpawnWriterBackend : public WriterBackend {
+public:
+    SpawnWriterBackend(std::string program, std::vector<std::string> prefixArgs)
+        : program_(std::move(program)), prefixArgs_(std::move(prefixArgs)) {}
+
+    bool Apply(const std::string& settingsPath, const std::string*) override {
+        std::vector<std::string> args = prefixArgs_;
+        args.push_back(settingsPath);
+        return RunProcessAndWait(program_, args, g_writerTimeoutMs);
+    }
+
+private:
+    std::string program_;
+    std::vector<std::string> prefixArgs_;
+};
+
+const DWORD kWriterHelperPingIdleMs = 5000;     // 空闲超过这么久，下一个请求前先 PING
+const DWORD kWriterHelperPingTimeoutMs = 1000;
+const DWORD kWriterHelperRetryMs = 30000;       // 启动失败后这段时间内直接走回退，不反复尝试
+
+// 常驻 helper。只由一个线程使用（应用线程，或基准的主线程）；使用方负责调用 Shutdown
+class HelperWriterBackend : public WriterBackend {
+public:
+    HelperWriterBackend(std::string program, SpawnWriterBackend fallback)
+        : program_(std::move(program)), fallback_(std::move(fallback)) {}
+
+    bool Apply(const std::string& settingsPath, const std::string* content) override {
+        std::string request;
+        if (content) {
+            request = "APPLY_CONTENT " + std::to_string(content->size()) + "\n";
+            request += *content;
+        } else {
+            request = "APPLY " + settingsPath + "\n";
+        }
+
+        // 管道断开（helper 崩溃）时重启后再发一次；超时不重发，交给 --writer-retries
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            if (!EnsureRunning()) break;
+            std::string reply;
+            const HelperIo io = Exchange(request, reply, g_writerTimeoutMs);
+            if (io == HELPER_IO_OK && (reply == "OK" || reply.compare(0, 4, "ERR ") == 0)) return reply == "OK";
+            Kill();
+            if (io == HELPER_IO_TIMEOUT) return false;
+        }
+
+        g_settingsCounters.writerFallbacks.fetch_add(1);
+        return fallback_.Apply(settingsPath, content);
+    }
+
+    void Shutdown() override {
+        if (!Running()) return;
+        if (WriteAll("QUIT\n", 5, kWriterHelperPingTimeoutMs) == HELPER_IO_OK && WaitExit(kWriterHelperPingTimeoutMs)) {
+            CloseHandles();
+            return;
+        }
+        Kill();
+    }
+
+    // 结束 helper 进程（超时、协议错乱；基准中模拟崩溃）
+    void Kill() {
+#ifdef _WIN32
+        if (process_) {
+            TerminateProcess(process_, 1);
+            WaitForSingleObject(process_, 1000);
+        }
+#else
+        if (pid_ > 0) {
+            int status = 0;
+            kill(pid_, SIGKILL);
+            waitpid(pid_, &status, 0);
+            pid_ = -1;
+        }
+#endif
+        CloseHandles();
+    }
+
+private:
+    enum HelperIo { HELPER_IO_OK, HELPER_IO_BROKEN, HELPER_IO_TIMEOUT };
+
+    bool EnsureRunning() {
+        if (Running()) {
+            if (TicksToNs(StatsNowTicks() - lastReplyTicks_) < kWriterHelperPingIdleMs * 1000000ULL) return true;
+            std::string reply;
+            if (Exchange("PING\n", reply, kWriterHelperPingTimeoutMs) == HELPER_IO_OK && reply == "PONG") return true;
+            Kill();  // 无应答：当作崩溃，重启
+        }
+        if (failedAtTicks_ != 0 && TicksToNs(StatsNowTicks() - failedAtTicks_) < kWriterHelperRetryMs * 1000000ULL) {
+            return false;
+        }
+        if (Start()) {
+            failedAtTicks_ = 0;
+            return true;
+        }
+        failedAtTicks_ = StatsNowTicks();
+        return false;
+    }
+
+    // 启动 helper 并等它报 READY（.NET 程序启动可能较慢，按 writer 超时等待）
+    bool Start() {
+        buffer_.clear();
+#ifdef _WIN32
+        // 双向命名管道：本端重叠 I/O 以便限时读写，另一端交给 helper 作为 stdin/stdout
+        static std::atomic<unsigned> s_pipeSerial{0};
+        char name[96];
+        snprintf(name, sizeof(name), "\\\\.\\pipe\\mouse_monitor_writer_%lu_%u",
+                 static_cast<unsigned long>(GetCurrentProcessId()), s_pipeSerial.fetch_add(1));
+        pipe_ = CreateNamedPipeA(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                 PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 64 * 1024, 64 * 1024, 0, NULL);
+        if (pipe_ == INVALID_HANDLE_VALUE) return false;
+        ioEvent_ = CreateEventA(NULL, TRUE, FALSE, NULL);
+        SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, TRUE};
+        HANDLE child = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, &sa, OPEN_EXISTING, 0, NULL);
+        if (!ioEvent_ || child == INVALID_HANDLE_VALUE) {
+            if (child != INVALID_HANDLE_VALUE) CloseHandle(child);
+            CloseHandles();
+            return false;
+        }
+
+        std::string cmdLine = "\"" + program_ + "\" --writer-serve";
+        STARTUPINFOA si = {};
+        si.cb = sizeof(si);
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = child;
+        si.hStdOutput = child;
+        si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+        PROCESS_INFORMATION pi = {};
+        const BOOL created = CreateProcessA(NULL, const_cast<char*>(cmdLine.c_str()), NULL, NULL, TRUE,
+                                            CREATE_NO_WINDOW, NULL, NULL, &si, &pi);
+        CloseHandle(child);
+        if (!created) {
+            CloseHandles();
+            return false;
+        }
+        CloseHandle(pi.hThread);
+        process_ = pi.hProcess;
+#else
+        int toChild[2], fromChild[2];
+        if (pipe2(toChild, O_CLOEXEC) != 0) return false;
+        if (pipe2(fromChild, O_CLOEXEC) != 0) {
+            close(toChild[0]);
+            close(toChild[1]);
+            return false;
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, toChild[0], STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, fromChild[1], STDOUT_FILENO);
+        char* const args[] = {const_cast<char*>(program_.c_str()), const_cast<char*>("--writer-serve"), nullptr};
+        const int rc = posix_spawn(&pid_, program_.c_str(), &actions, NULL, args, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(toChild[0]);
+        close(fromChild[1]);
+        toHelper_ = toChild[1];
+        fromHelper_ = fromChild[0];
+        if (rc != 0) {
+            pid_ = -1;
+            CloseHandles();
+            return false;
+        }
+        fcntl(toHelper_, F_SETFL, fcntl(toHelper_, F_GETFL) | O_NONBLOCK);
+        fcntl(fromHelper_, F_SETFL, fcntl(fromHelper_, F_GETFL) | O_NONBLOCK);
+#endif
+        std::string ready;
+        const uint64_t startTicks = StatsNowTicks();
+        if (ReadLine(ready, startTicks, g_writerTimeoutMs) != HELPER_IO_OK || ready != "READY") {
+            Kill();
+            return false;
+        }
+        lastReplyTicks_ = StatsNowTicks();
+        g_settingsCounters.helperStarts.fetch_add(1);
+        return true;
+    }
+
+    bool Running() {
+#ifdef _WIN32
+        if (!process_) return false;
+        if (WaitForSingleObject(process_, 0) == WAIT_TIMEOUT) return true;
+#else
+        if (pid_ <= 0) return false;
+        int status = 0;
+        if (waitpid(pid_, &status, WNOHANG) == 0) return true;
+        pid_ = -1;
+#endif
+        CloseHandles();  // 已经退出（崩溃）
+        return false;
+    }
+
+    bool WaitExit(DWORD timeoutMs) {
+#ifdef _WIN32
+        return WaitForSingleObject(process_, timeoutMs) == WAIT_OBJECT_0;
+#else
+        int status = 0;
+        for (DWORD waited = 0; waited < timeoutMs; waited += 5) {
+            const pid_t done = waitpid(pid_, &status, WNOHANG);
+            if (done == pid_ || done < 0) {
+                pid_ = -1;
+                return true;
+            }
+            Sleep(5);
+        }
+        return false;
+#endif
+    }
+
+    void CloseHandles() {
+#ifdef _WIN32
+        if (pipe_ != INVALID_HANDLE_VALUE) CloseHandle(pipe_);
+        if (ioEvent_) CloseHandle(ioEvent_);
+        if (process_) CloseHandle(process_);
+        pipe_ = INVALID_HANDLE_VALUE;
+        ioEvent_ = NULL;
+        process_ = NULL;
+#else
+        if (toHelper_ >= 0) close(toHelper_);
+        if (fromHelper_ >= 0) close(fromHelper_);
+        toHelper_ = fromHelper_ = -1;
+#endif
+        buffer_.clear();
+    }
+
+    // 距 startTicks 还剩多少毫秒（0 = 已到期）
+    static DWORD RemainingMs(uint64_t startTicks, DWORD timeoutMs) {
+        const uint64_t elapsedMs = TicksToNs(StatsNowTicks() - startTicks) / 1000000;
+        return elapsedMs >= timeoutMs ? 0 : static_cast<DWORD>(timeoutMs - elapsedMs);
+    }
+
+    HelperIo Exchange(const std::string& request, std::string& reply, DWORD timeoutMs) {
+        const uint64_t start = StatsNowTicks();
+        HelperIo io = WriteAll(request.data(), request.size(), timeoutMs);
+        if (io == HELPER_IO_OK) io = ReadLine(reply, start, timeoutMs);
+        if (io == HELPER_IO_OK) lastReplyTicks_ = StatsNowTicks();
+        return io;
+    }
+
+    HelperIo WriteAll(const char* data, size_t size, DWORD timeoutMs) {
+        const uint64_t start = StatsNowTicks();
+#ifdef _WIN32
+        while (size > 0) {
+            OVERLAPPED ov = {};
+            ov.hEvent = ioEvent_;
+            ResetEvent(ioEvent_);
+            DWORD written = 0;
+            const DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 64 * 1024));
+            if (!WriteFile(pipe_, data, chunk, &written, &ov)) {
+                if (GetLastError() != ERROR_IO_PENDING) return HELPER_IO_BROKEN;
+                if (WaitForSingleObject(ioEvent_, RemainingMs(start, timeoutMs)) != WAIT_OBJECT_0) {
+                    CancelIo(pipe_);
+                    GetOverlappedResult(pipe_, &ov, &written, TRUE);
+                    return HELPER_IO_TIMEOUT;
+                }
+                if (!GetOverlappedResult(pipe_, &ov, &written, FALSE)) return HELPER_IO_BROKEN;
+            }
+            data += written;
+            size -= written;
+        }
+#else
+        // 对端已退出时得到 EPIPE 而不是 SIGPIPE：只在本线程屏蔽，产生的信号随后取走
+        sigset_t pipeSet, oldSet;
+        sigemptyset(&pipeSet);
+        sigaddset(&pipeSet, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+        HelperIo io = HELPER_IO_OK;
+        while (size > 0) {
+            const ssize_t n = write(toHelper_, data, size);
+            if (n > 0) {
+                data += n;
+                size -= static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) {
+                pollfd pfd = {toHelper_, POLLOUT, 0};
+                const DWORD left = RemainingMs(start, timeoutMs);
+                if (left > 0 && poll(&pfd, 1, static_cast<int>(left)) >= 0) continue;
+                io = HELPER_IO_TIMEOUT;
+            } else {
+                io = HELPER_IO_BROKEN;
+            }
+            break;
+        }
+        if (io == HELPER_IO_BROKEN) {
+            const timespec zero = {0, 0};
+            sigtimedwait(&pipeSet, nullptr, &zero);
+        }
+        pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+        return io;
+#endif
+        return HELPER_IO_OK;
+    }
+
+    // 读一行应答（不含换行）；startTicks 起算 timeoutMs
+    HelperIo ReadLine(std::string& line, uint64_t startTicks, DWORD timeoutMs) {
+        char chunk[512];
+        while (true) {
+            const size_t newline = buffer_.find('\n');
+            if (newline != std::string::npos) {
+                line.assign(buffer_, 0, newline);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                buffer_.erase(0, newline + 1);
+                return HELPER_IO_OK;
+            }
+#ifdef _WIN32
+            OVERLAPPED ov = {};
+            ov.hEvent = ioEvent_;
+            ResetEvent(ioEvent_);
+            DWORD got = 0;
+            if (!ReadFile(pipe_, chunk, sizeof(chunk), &got, &ov)) {
+                if (GetLastError() != ERROR_IO_PENDING) return HELPER_IO_BROKEN;
+                if (WaitForSingleObject(ioEvent_, RemainingMs(startTicks, timeoutMs)) != WAIT_OBJECT_0) {
+                    CancelIo(pipe_);
+                    GetOverlappedResult(pipe_, &ov, &got, TRUE);
+                    return HELPER_IO_TIMEOUT;
+                }
+                if (!GetOverlappedResult(pipe_, &ov, &got, FALSE)) return HELPER_IO_BROKEN;
+            }
+            if (got == 0) return HELPER_IO_BROKEN;
+            buffer_.append(chunk, got);
+#else
+            const ssize_t n = read(fromHelper_, chunk, sizeof(chunk));
+            if (n > 0) {
+                buffer_.append(chunk, static_cast<size_t>(n));
+                continue;
+            }
+            if (n == 0) return HELPER_IO_BROKEN;  // helper 退出
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return HELPER_IO_BROKEN;
+            pollfd pfd = {fromHelper_, POLLIN, 0};
+            const DWORD left = RemainingMs(startTicks, timeoutMs);
+            if (left == 0 || poll(&pfd, 1, static_cast<int>(left)) == 0) return HELPER_IO_TIMEOUT;
+#endif
+        }
+    }
+
+    std::string program_;
+    SpawnWriterBackend fallback_;
+    std::string buffer_;            // 已读到、尚未成行的应答
+    uint64_t lastReplyTicks_ = 0;
+    uint64_t failedAtTicks_ = 0;    // 最近一次启动失败的时刻，0 = 没有
+#ifdef _WIN32
+    HANDLE process_ = NULL;
+    HANDLE pipe_ = INVALID_HANDLE_VALUE;
+    HANDLE ioEvent_ = NULL;
+#else
+    pid_t pid_ = -1;
+    int toHelper_ = -1;
+    int fromHelper_ = -1;
+#endif
+};
+
+WriterBackend* g_writerBackend = nullptr;  // 应用线程首次运行 writer 时按配置选定
+
+static WriterBackend* SelectWriterBackend(const std::string& dir) {
+#ifdef _WIN32
+    static SpawnWriterBackend s_spawn(dir + "writer.exe", {});
+#else
+    static SpawnWriterBackend s_spawn(dir + "writer", {});  // Linux：同目录下的 writer（若存在）
+#endif
+    if (g_writerHelperProgram.empty()) return &s_spawn;
+    static HelperWriterBackend s_helper(g_writerHelperProgram, s_spawn);
+    return &s_helper;
+}
+
+// 运行 writer 应用配置（应用线程调用）。content 为已提交的 settings 全文时，常驻 helper 随请求收到它，不必再读文件
+bool RunWriterExe(const std::string* content) {
+    ScopedLatency timing(STAGE_WRITER);
+    // 获取程序所在目录
+    std::string dir = GetExecutableDir();
+    if (dir.empty()) {
+        return false;
+    }
+    std::string settingsPath = g_settingsPath.empty() ? (dir + SETTINGS_FILE) : g_settingsPath;
+
+    if (!g_writerBackend) g_writerBackend = SelectWriterBackend(dir);
+    return g_writerBackend->Apply(settingsPath, content);
+}
+
+// 退出时在应用线程结束后调用：让常驻 helper 退出
+void ShutdownWriterBackend() {
+    if (g_writerBackend) g_writerBackend->Shutdown();
+}
+
+// ----- helper 替身（--writer-serve / --writer-apply） -----
+// 接口与常驻 helper / writer.exe 相同，但只检查 settings 的 JSON 结构（根对象带 profiles 数组）就应答，
+// 不接触驱动：用于在没有 writer.exe 的环境（Linux）里测协议、崩溃重启与往返耗时。
+
+static bool CheckWriterSettings(std::string_view text, std::string& err) {
+    JsonIndex index;
+    if (!BuildJsonIndex(text, index) || index.nodes.empty() || index.nodes[0].kind != JSON_OBJECT) {
+        err = "invalid json";
+        return false;
+    }
+    const int32_t profiles = index.Member(text, 0, "profiles");
+    if (profiles < 0 || index.nodes[profiles].kind != JSON_ARRAY) {
+        err = "no profiles array";
+        return false;
+    }
+    return true;
+}
+
+static int RunWriterApplyOnce(const std::string& path) {
+    std::string text, err;
+    if (!ReadFileContent(path.c_str(), text)) return 2;
+    return CheckWriterSettings(text, err) ? 0 : 1;
+}
+
+static int RunWriterServe() {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    printf("READY\n");
+    fflush(stdout);
+
+    char line[4096];
+    std::string text, err;
+    while (fgets(line, sizeof(line), stdin)) {
+        std::string request(line);
+        while (!request.empty() && (request.back() == '\n' || request.back() == '\r')) request.pop_back();
+
+        bool ok = false;
+        err.clear();
+        if (request == "PING") {
+            printf("PONG\n");
+            fflush(stdout);
+            continue;
+        } else if (request == "QUIT") {
+            break;
+        } else if (request.compare(0, 6, "APPLY ") == 0) {
+            if (ReadFileContent(request.c_str() + 6, text)) {
+                ok = CheckWriterSettings(text, err);
+            } else {
+                err = "cannot read settings";
+            }
+        } else if (request.compare(0, 14, "APPLY_CONTENT ") == 0) {
+            const long size = std::atol(request.c_str() + 14);
+            text.resize(size > 0 ? static_cast<size_t>(size) : 0);
+            if (size < 0 || fread(&text[0], 1, text.size(), stdin) != text.size()) break;
+            ok = CheckWriterSettings(text, err);
+        } else {
+            err = "unknown request";
+        }
+        if (ok) {
+            printf("OK\n");
+        } else {
+            printf("ERR %s\n", err.c_str());
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// ----- writer 后端基准（--writer-bench） -----
+// 本程序的替身模式同时充当每次启动的 writer 与常驻 helper，比较每次改动的应用耗时；
+// 中途结束 helper 进程，确认下一个请求会重启它而不是退回每次启动。
+
+static int RunWriterBench(long count) {
+    std::string content;
+    if (!ReadFileContent(g_settingsPath.c_str(), content)) {
+        printf("[ERROR] writer bench: cannot read %s\n", g_settingsPath.c_str());
+        return 1;
+    }
+    const std::string self = GetExecutablePath();
+    SpawnWriterBackend spawn(self, {"--writer-apply"});
+    HelperWriterBackend helper(self, spawn);
+
+    bool ok = true;
+    auto timeApplies = [&](WriterBackend& backend, const std::string* body, long n) -> double {
+        const uint64_t start = StatsNowTicks();
+        for (long i = 0; i < n; ++i) ok = backend.Apply(g_settingsPath, body) && ok;
+        return static_cast<double>(TicksToNs(StatsNowTicks() - start)) / 1e6 / static_cast<double>(n);
+    };
+
+    const double spawnMs = timeApplies(spawn, nullptr, count);
+    const double startMs = timeApplies(helper, nullptr, 1);  // 含启动 helper
+    const double pathMs = timeApplies(helper, nullptr, count);
+    const double contentMs = timeApplies(helper, &content, count);
+    helper.Kill();                                           // 模拟崩溃
+    const double restartMs = timeApplies(helper, nullptr, 1);
+    helper.Shutdown();
+
+    const SettingsWriteCounters& c = g_settingsCounters;
+    const bool restarted = c.helperStarts.load() == 2 && c.writerFallbacks.load() == 0;
+    printf("WRITER_BENCH n=%ld bytes=%zu spawn_ms=%.3f helper_start_ms=%.3f helper_path_ms=%.3f helper_content_ms=%.3f "
+           "restart_ms=%.3f speedup=%.1f restarted=%d ok=%d\n",
+           count, content.size(), spawnMs, startMs, pathMs, contentMs, restartMs,
+           pathMs > 0 ? spawnMs / pathMs : 0.0, restarted ? 1 : 0, ok ? 1 : 0);
+    return (ok && restarted) ? 0 : 1;
+}
+
+// ========== settings 应用线程 ==========
+// 改 settings.json 并运行 writer.exe 可能要数秒，放在专用线程上做，主循环（锁定状态机到期、IPC 命令）
+// 不再等它。信箱只存最新的目标：还没开始的请求被新请求直接替换；进行中的请求在运行 writer.exe 与每次
+// 重试前检查是否已被取代，被取代就不再运行，由新目标一并应用。完成事件在改动生效后才发出，
+// 被取代请求尚未发出的事件并入取代它的请求。
+
+struct SettingsApplier {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    SettingsApplyRequest pending;
+    bool hasPending = false;
+    bool busy = false;       // 正在处理取出的请求
+    bool stopping = false;
+};
+
+SettingsApplier g_settingsApplier;
+
+enum SettingsApplyStatus { APPLY_OK, APPLY_FAILED, APPLY_WRITER_FAILED, APPLY_SUPERSEDED };
+
+// 较早请求尚未发出的完成事件并入较新的请求（较新的请求已有同类事件时以它为准）
+static void MergeApplyReports(const SettingsApplyRequest& older, SettingsApplyRequest& newer) {
+    if (!newer.reportSens && older.reportSens) {
+        newer.reportSens = true;
+        newer.sensValue = older.sensValue;
+    }
+    if (newer.reportPower < 0) newer.reportPower = older.reportPower;
+}
+
+// 调用方持有 a.mutex
+static bool ApplyRequestSuperseded(const SettingsApplier& a) {
+    return a.hasPending && a.pending.target != APPLY_NOTHING;
+}
+
+static bool SettingsApplySuperseded() {
+    SettingsApplier& a = g_settingsApplier;
+    std::lock_guard<std::mutex> lock(a.mutex);
+    return ApplyRequestSuperseded(a);
+}
+
+static SettingsApplyStatus RunSettingsApply(const SettingsApplyRequest& request, std::string& errorMsg) {
+    if (request.target == APPLY_NOTHING) return APPLY_OK;
+    if (g_settingsPath.empty()) {
+        errorMsg = "settings path not set";
+        return APPLY_FAILED;
+    }
+
+    uint64_t generation = 0;
+    std::string content;  // 常驻 helper 用：模型可用时随请求发送的全文，与刚写出的文件相同
+    {
+        std::lock_guard<std::mutex> lock(g_settingsMutex);
+        if (request.target == APPLY_SENSITIVITY) {
+            if (!UpdateSettingsForDevices(request.mappings, errorMsg)) return APPLY_FAILED;
+        } else {
+            SettingsModel* model = AcquireSettingsModel();
+            if (!model) {
+                errorMsg = "failed to read settings.json";
+                return APPLY_FAILED;
+            }
+            if (!RemoveOldSensDeviceMappings(*model, {})) {
+                errorMsg = "failed to clear device mappings";
+                return APPLY_FAILED;
+            }
+            if (!CommitSettingsModel(*model)) {
+                errorMsg = "failed to write settings.json";
+                return APPLY_FAILED;
+            }
+        }
+        if (!SettingsWriterNeeded(generation)) return APPLY_OK;
+        if (generation != 0 && !g_writerHelperProgram.empty()) content = g_settingsModel.text;
+    }
+
+    // writer.exe 运行期间不持 g_settingsMutex：主线程上的注册清理等短操作不必等它
+    for (unsigned attempt = 0;; ++attempt) {
+        if (SettingsApplySuperseded()) return APPLY_SUPERSEDED;
+        g_settingsCounters.writerRuns.fetch_add(1);
+        if (RunWriterExe(content.empty() ? nullptr : &content)) break;
+        if (attempt >= g_writerRetries) {
+            errorMsg = "writer.exe failed";
+            return APPLY_WRITER_FAILED;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(g_settingsMutex);
+    NoteSettingsWriterApplied(generation);
+    return APPLY_OK;
+}
+
+static void ReportSettingsApply(const SettingsApplyRequest& request, SettingsApplyStatus status,
+                                const std::string& errorMsg) {
+    if (g_ipcMode.load()) {
+        if (status != APPLY_OK) QueueNotifyError(errorMsg.c_str());
+        if (request.reportPower >= 0) QueueEvent(request.reportPower ? EVENT_POWER_APPLIED_ON : EVENT_POWER_APPLIED_OFF);
+        if (request.reportSens && status == APPLY_OK) QueueEventValue(EVENT_SENS_APPLIED, request.sensValue);
+        return;
+    }
+
+    switch (request.origin) {
+    case APPLY_FROM_CONSOLE:
+        if (status == APPLY_OK) {
+            g_currentSensitivity.store(request.sensValue);
+            printf("[SENS] Configuration applied successfully! (%.3fx)\n", request.sensValue);
+            printf("[SENS] New sensitivity: %.3fx (Output DPI: %.1f)\n", request.sensValue, request.sensValue * 1000.0);
+        } else if (status == APPLY_WRITER_FAILED) {
+            printf("[WARN] writer.exe may have failed. Check if RawAccel is running.\n");
+        } else {
+            printf("[ERROR] Failed to update settings: %s\n", errorMsg.c_str());
+        }
+        break;
+    case APPLY_FROM_RESET:
+        if (status == APPLY_OK) {
+            printf("[RESET] Cleared device mappings for profile: %s\n", SENS_PROFILE_NAME);
+        } else if (status == APPLY_WRITER_FAILED) {
+            printf("[RESET] [WARN] writer.exe may have failed. Check if RawAccel is running.\n");
+        } else {
+            printf("[RESET] [WARN] Failed to clear device mappings: %s\n", errorMsg.c_str());
+        }
+        break;
+    case APPLY_FROM_EXIT:
+        if (status == APPLY_OK || status == APPLY_WRITER_FAILED) {
+            printf("\n[EXIT] Restored mouse sensitivity (cleared device mappings)\n");
+        }
+        break;
+    case APPLY_FROM_IPC:
+        break;
+    }
+    fflush(stdout);
+}
+
+static void SettingsApplierMain() {
+    SettingsApplier& a = g_settingsApplier;
+    std::unique_lock<std::mutex> lock(a.mutex);
+    while (true) {
+        a.cv.wait(lock, [&] { return a.hasPending || a.stopping; });
+        if (!a.hasPending) break;
+        SettingsApplyRequest request = std::move(a.pending);
+        a.hasPending = false;
+        a.busy = true;
+        lock.unlock();
+
+        std::string errorMsg;
+        const SettingsApplyStatus status = RunSettingsApply(request, errorMsg);
+
+        lock.lock();
+        if (status == APPLY_SUPERSEDED) {
+            MergeApplyReports(request, a.pending);
+            g_settingsCounters.applySuperseded.fetch_add(1);
+        } else {
+            // 先发完成事件再标记空闲：等待空闲的一方（退出）之后的事件不会排到它前面
+            lock.unlock();
+            ReportSettingsApply(request, status, errorMsg);
+            lock.lock();
+        }
+        a.busy = false;
+        a.cv.notify_all();
+    }
+}
+
+// 提交新的目标，替换尚未开始的请求；线程在第一次提交时启动，启动失败时在调用线程上同步处理
+void SubmitSettingsApply(SettingsApplyRequest request) {
+    SettingsApplier& a = g_settingsApplier;
+    {
+        std::lock_guard<std::mutex> lock(a.mutex);
+        if (!a.stopping) {
+            if (!a.thread.joinable()) {
+                try {
+                    a.thread = std::thread(SettingsApplierMain);
+                } catch (const std::system_error&) {
+                }
+            }
+            if (a.thread.joinable()) {
+                if (a.hasPending) {
+                    if (request.target == APPLY_NOTHING) {
+                        // 不改配置的确认不取代排队中的目标，只把事件交给它
+                        MergeApplyReports(a.pending, request);
+                        request.target = a.pending.target;
+                        request.origin = a.pending.origin;
+                        request.mappings = std::move(a.pending.mappings);
+                    } else {
+                        MergeApplyReports(a.pending, request);
+                        g_settingsCounters.applySuperseded.fetch_add(1);
+                    }
+                }
+                a.pending = std::move(request);
+                a.hasPending = true;
+                a.cv.notify_all();
+                return;
+            }
+        }
+    }
+
+    std::string errorMsg;
+    const SettingsApplyStatus status = RunSettingsApply(request, errorMsg);
+    ReportSettingsApply(request, status, errorMsg);
+}
+
+// 等待信箱清空且当前请求处理完；超时返回 false
+bool WaitSettingsApplyIdle(DWORD timeoutMs) {
+    SettingsApplier& a = g_settingsApplier;
+    std::unique_lock<std::mutex> lock(a.mutex);
+    if (!a.thread.joinable()) return true;
+    return a.cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return !a.hasPending && !a.busy; });
+}
+
+// 一次应用最长耗时：writer.exe 的全部尝试加上读写 settings.json 的余量
+DWORD SettingsApplyBudgetMs() {
+    return g_writerTimeoutMs * (g_writerRetries + 1) + 2000;
+}
+
+// 退出时调用（在 FailsafeCleanup 之后）。线程没能在预算内结束（writer.exe 卡住）就分离，不拖住退出；
+// 正常结束时再让常驻 writer helper 退出
+void StopSettingsApplier() {
+    SettingsApplier& a = g_settingsApplier;
+    bool idle;
+    {
+        std::unique_lock<std::mutex> lock(a.mutex);
+        if (!a.thread.joinable()) return;
+        a.stopping = true;
+        a.cv.notify_all();
+        idle = a.cv.wait_for(lock, std::chrono::milliseconds(SettingsApplyBudgetMs()),
+                             [&] { return !a.hasPending && !a.busy; });
+    }
+    if (idle) {
+        a.thread.join();
+        ShutdownWriterBackend();
+    } else {
+        a.thread.detach();
+    }
+}
+
+// 处理灵敏度输入
+void HandleSensitivityInput() {
+    if (g_registeredDevice.load() == NULL) {
+        printf("\n[WARN] No mouse registered. Please register a mouse first.\n");
+        return;
+    }
+
+    const std::string registeredId = RegisteredHardwareId();
+    if (registeredId.empty()) {
+        printf("\n[WARN] Hardware ID not available for registered device.\n");
+        return;
+    }
+
+    SetCursorVisible(true);
+    printf("\n============================================\n");
+    printf("[SENS] Current sensitivity: %.3fx\n", g_currentSensitivity.load());
+    printf("[SENS] Enter new multiplier (0.001 - 100), or 'r' to reset to 1.0\n");
+    printf("[SENS] Input: ");
+    fflush(stdout);
+
+    // 读取用户输入
+    char inputBuf[64] = {0};
+    ConsoleSetRawKeys(false);
+    const bool gotInput = fgets(inputBuf, sizeof(inputBuf), stdin) != NULL;
+    ConsoleSetRawKeys(true);
+    if (!gotInput) {
+        SetCursorVisible(false);
+        printf("[SENS] Input cancelled.\n");
+        return;
+    }
+
+    std::string input = TrimString(std::string(inputBuf));
+    SetCursorVisible(false);
+
+    if (input.empty()) {
+        printf("[SENS] Input cancelled.\n");
+        return;
+    }
+
+    double multiplier = 1.0;
 
-    // 找到第二个 # (实例ID之前的分隔符)
-    size_t secondHash = path.find(L'#', firstHash + 1);
-    if (secondHash == std::wstring::npos) return std::string();
+    if (input == "r" || input == "R") {
+        multiplier = 1.0;
+        printf("[SENS] Resetting to 1.0x\n");
+    } else {
+        errno = 0;
+        char* endPtr = NULL;
+        multiplier = strtod(input.c_str(), &endPtr);
 
-    // 提取 HID#VID_...&PID_...&MI_... 部分
-    std::wstring segment = path.substr(start, secondHash - start);
+        if (endPtr == input.c_str() || *endPtr != '\0' || errno == ERANGE) {
+            printf("[ERROR] Invalid input: %s\n", input.c_str());
+            return;
+        }
 
-    // 将第一个 # 替换为 \ (HID#... -> HID\...)
-    for (size_t i = 0; i < segment.size(); ++i) {
-        if (segment[i] == L'#') {
-            segment[i] = L'\\';
-            break;
+        if (multiplier < 0.001 || multiplier > 100.0) {
+            printf("[WARN] Value clamped to valid range (0.001 - 100)\n");
+            if (multiplier < 0.001) multiplier = 0.001;
+            if (multiplier > 100.0) multiplier = 100.0;
         }
     }
 
-    return WideToAnsi(segment);
-}
+    printf("[SENS] Applying %.3fx sensitivity for device: %s\n", multiplier, registeredId.c_str());
 
-// 读取文件内容
-bool ReadFileContent(const char* path, std::string& content) {
-    std::ifstream file(path, std::ios::binary);
-    if (!file.is_open()) return false;
-    std::ostringstream ss;
-    ss << file.rdbuf();
-    content = ss.str();
-    return true;
+    SettingsApplyRequest request;
+    request.origin = APPLY_FROM_CONSOLE;
+    request.sensValue = multiplier;
+    std::string errorMsg;
+    if (!PrepareSensitivityApply(multiplier, request, errorMsg)) {
+        printf("[ERROR] Failed to update settings: %s\n", errorMsg.c_str());
+        return;
+    }
+    // 当前灵敏度在应用线程确认写入生效后更新（见 ReportSettingsApply），失败或被取代时保持原值
+    printf("[SENS] Running writer.exe to apply configuration in the background...\n");
+    printf("============================================\n\n");
+    SubmitSettingsApply(std::move(request));
 }
 
-// 写入文件内容
-bool WriteFileContent(const char* path, const std::string& content) {
-    std::ofstream file(path, std::ios::binary | std::ios::trunc);
-    if (!file.is_open()) return false;
-    file << content;
-    return true;
+// ========== 原始鼠标包录制/回放 ==========
+
+// 单个鼠标包（从 RAWMOUSE 中取出状态机用到的字段，录制/回放共用）
+struct MousePacket {
+    HANDLE device;
+    LONG dx;
+    LONG dy;
+    ULONG extraInfo;
+    USHORT flags;        // RAWMOUSE::usFlags
+    uint64_t ticks;      // 到达时刻（QPC 计数；Linux 为 CLOCK_MONOTONIC 纳秒）
+};
+
+// 批处理上下文：同一批次内的鼠标包共享时间戳与收尾动作
+struct RawBatchContext {
+    uint64_t nowUs;     // 本批次读取时刻（ClockNowUs）
+    UINT packets;       // 本批次处理的鼠标包数
+    bool liveTicks;     // MousePacket::ticks 是本机当前时基（回放/文件输入为录制时刻，不计到达延迟）
+};
+
+// 录制文件格式（小端，定长记录，可直接内存映射）：
+//   TraceFileHeader | TraceRecord * N
+// 记录数由文件大小推出，进程中途退出时已写入的记录依然可用。
+const char kTraceMagic[8] = {'M', 'M', 'T', 'R', 'A', 'C', 'E', '\0'};
+const uint32_t kTraceVersion = 1;
+
+enum TraceRecordKind : uint16_t {
+    TRACE_KIND_MOUSE = 0,        // 鼠标包
+    TRACE_KIND_REGISTERED = 1,   // 注册设备变更（device = 新注册设备，0 表示回到注册模式）
+};
+
+#pragma pack(push, 1)
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t ticksPerSecond;     // 时间戳频率（QPC）
+    uint64_t startTicks;         // 开始录制时刻
+};
+
+struct TraceRecord {
+    uint64_t device;
+    uint64_t ticks;
+    int32_t dx;
+    int32_t dy;
+    uint32_t extraInfo;
+    uint16_t flags;
+    uint16_t kind;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(TraceFileHeader) == 32, "trace header layout");
+static_assert(sizeof(TraceRecord) == 32, "trace record layout");
+
+// 录制器：仅输入线程写入，按块写文件，避免每包一次 fwrite
+struct TraceRecorder {
+    static const size_t kBufferRecords = 2048;
+
+    FILE* file = nullptr;
+    TraceRecord buffer[kBufferRecords];
+    size_t used = 0;
+    uint64_t written = 0;
+    HANDLE lastRegistered = nullptr;
+};
+
+TraceRecorder g_traceRecorder;
+std::mutex g_traceRecorderMutex;  // 仅保护 open/close，与热路径无竞争
+
+static void FlushTraceRecorder() {
+    TraceRecorder& rec = g_traceRecorder;
+    if (!rec.file || rec.used == 0) return;
+    fwrite(rec.buffer, sizeof(TraceRecord), rec.used, rec.file);
+    rec.written += rec.used;
+    rec.used = 0;
 }
 
-// 去除字符串首尾空白
-std::string TrimString(const std::string& s) {
-    size_t start = 0;
-    while (start < s.size() && std::isspace(static_cast<unsigned char>(s[start]))) start++;
-    size_t end = s.size();
-    while (end > start && std::isspace(static_cast<unsigned char>(s[end - 1]))) end--;
-    return s.substr(start, end - start);
+static void AppendTraceRecord(const TraceRecord& record) {
+    TraceRecorder& rec = g_traceRecorder;
+    rec.buffer[rec.used++] = record;
+    if (rec.used == TraceRecorder::kBufferRecords) {
+        FlushTraceRecorder();
+    }
 }
 
-bool SaveLastRegisteredHardwareId(const std::string& hardwareId) {
-    if (hardwareId.empty() || g_statePath.empty()) return false;
-    return WriteFileContent(g_statePath.c_str(), hardwareId + "\n");
-}
+static bool OpenTraceRecorder(const std::string& path) {
+    std::lock_guard<std::mutex> lock(g_traceRecorderMutex);
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+
+    LARGE_INTEGER freq = {};
+    LARGE_INTEGER now = {};
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+
+    TraceFileHeader header = {};
+    memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+    header.version = kTraceVersion;
+    header.recordSize = sizeof(TraceRecord);
+    header.ticksPerSecond = static_cast<uint64_t>(freq.QuadPart);
+    header.startTicks = static_cast<uint64_t>(now.QuadPart);
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        return false;
+    }
 
-bool LoadLastRegisteredHardwareId(std::string& hardwareId) {
-    if (g_statePath.empty()) return false;
-    std::string content;
-    if (!ReadFileContent(g_statePath.c_str(), content)) return false;
-    hardwareId = TrimString(content);
-    return !hardwareId.empty();
+    g_traceRecorder.file = f;
+    g_traceRecorder.used = 0;
+    g_traceRecorder.written = 0;
+    g_traceRecorder.lastRegistered = nullptr;
+    return true;
 }
 
-void ClearLastRegisteredHardwareId() {
-    if (g_statePath.empty()) return;
-    DeleteFileA(g_statePath.c_str());
+// 输入线程退出后调用
+static uint64_t CloseTraceRecorder() {
+    std::lock_guard<std::mutex> lock(g_traceRecorderMutex);
+    if (!g_traceRecorder.file) return 0;
+    FlushTraceRecorder();
+    fclose(g_traceRecorder.file);
+    g_traceRecorder.file = nullptr;
+    return g_traceRecorder.written;
 }
 
-bool TryRestoreLastRegisteredMouse() {
-    std::string hardwareId;
-    if (!LoadLastRegisteredHardwareId(hardwareId)) return false;
+// 录制一个鼠标包；注册设备发生变化时先写入一条标记记录
+static void RecordMousePacket(const MousePacket& packet) {
+    TraceRecorder& rec = g_traceRecorder;
+    if (!rec.file) return;
+
+    HANDLE registered = g_registrationMode.load() ? nullptr : g_registeredDevice.load();
+    if (registered != rec.lastRegistered) {
+        rec.lastRegistered = registered;
+        TraceRecord marker = {};
+        marker.device = reinterpret_cast<uint64_t>(registered);
+        marker.ticks = packet.ticks;
+        marker.kind = TRACE_KIND_REGISTERED;
+        AppendTraceRecord(marker);
+    }
 
-    UINT count = 0;
-    if (GetRawInputDeviceList(NULL, &count, sizeof(RAWINPUTDEVICELIST)) != 0 || count == 0) {
-        return false;
+    TraceRecord record = {};
+    record.device = reinterpret_cast<uint64_t>(packet.device);
+    record.ticks = packet.ticks;
+    record.dx = static_cast<int32_t>(packet.dx);
+    record.dy = static_cast<int32_t>(packet.dy);
+    record.extraInfo = static_cast<uint32_t>(packet.extraInfo);
+    record.flags = packet.flags;
+    record.kind = TRACE_KIND_MOUSE;
+    AppendTraceRecord(record);
+}
+
+#ifdef _WIN32
+static MousePacket MousePacketFromRaw(HANDLE device, const RAWMOUSE& mouse, uint64_t ticks) {
+    MousePacket packet;
+    packet.device = device;
+    packet.dx = mouse.lLastX;
+    packet.dy = mouse.lLastY;
+    packet.extraInfo = mouse.ulExtraInformation;
+    packet.flags = mouse.usFlags;
+    packet.ticks = ticks;
+    return packet;
+}
+#endif
+
+// ========== 注册扫描 ==========
+// 每设备一个定长累加槽，线性查找（设备很少）。领先设备的累计量达到 minCounts 且占全部扫描移动的
+// confidence 以上即判定；总量达到 kScanThreshold 时退回原来的规则，取累计最多的设备。
+
+const float kScanThreshold = 2000.0f;
+const size_t kScanSlots = 8;  // 超出的设备只计入总量（拉低领先者占比，不会被误判为赢家）
+
+struct ScanConfig {
+    float minCounts;
+    float confidence;  // 0 = 只用 kScanThreshold
+};
+
+struct ScanEngine {
+    struct Slot {
+        HANDLE device;
+        float counts;
+    };
+    Slot slots[kScanSlots] = {};
+    size_t used = 0;
+    float total = 0.0f;
+    size_t leader = 0;
+    uint64_t startUs = 0;  // 第一个扫描包的时刻
+    uint64_t packets = 0;
+
+    void Reset() { *this = ScanEngine(); }
+
+    // 累加一个包，返回进度 0..1；到 1 时 leader 即赢家
+    float Add(HANDLE device, float delta, uint64_t nowUs, const ScanConfig& config) {
+        if (packets++ == 0) startUs = nowUs;
+        total += delta;
+        size_t i = 0;
+        while (i < used && slots[i].device != device) ++i;
+        if (i == used && used < kScanSlots) {
+            slots[used++] = {device, 0.0f};
+        }
+        if (i < used) {
+            slots[i].counts += delta;
+            if (slots[i].counts > slots[leader].counts) leader = i;
+        }
+        return Progress(config);
     }
 
-    std::vector<RAWINPUTDEVICELIST> list(static_cast<size_t>(count));
-    UINT got = GetRawInputDeviceList(list.data(), &count, sizeof(RAWINPUTDEVICELIST));
-    if (got == static_cast<UINT>(-1)) {
-        return false;
+    float Progress(const ScanConfig& config) const {
+        float progress = total / kScanThreshold;
+        if (used > 0 && config.confidence > 0.0f) {
+            const float lead = slots[leader].counts;
+            const float early = std::min(lead / config.minCounts, lead / (config.confidence * total));
+            progress = std::max(progress, early);
+        }
+        return progress > 1.0f ? 1.0f : progress;
     }
 
-    for (UINT i = 0; i < got; ++i) {
-        HANDLE device = list[i].hDevice;
-        if (!device) continue;
+    HANDLE Winner() const { return used > 0 ? slots[leader].device : nullptr; }
+    float LeaderShare() const { return total > 0.0f && used > 0 ? slots[leader].counts / total : 0.0f; }
+};
 
-        wchar_t path[512] = {0};
-        GetDeviceHidPath(device, path, sizeof(path) / sizeof(wchar_t));
-        if (path[0] == L'\0') continue;
+static ScanConfig CurrentScanConfig() {
+    return {g_scanMinCounts, g_scanConfidence};
+}
 
-        std::string id = DevicePathToHardwareId(path);
-        if (id.empty()) continue;
-        if (id != hardwareId) continue;
+// 处理单个鼠标包：注册扫描 / 其他鼠标检测 / LockState 状态机
+static void ProcessMousePacket(const MousePacket& packet, RawBatchContext& ctx) {
+    const HANDLE deviceHandle = packet.device;
+    bool isRegistrationMode = g_registrationMode.load();
 
-        g_registeredDevice.store(device);
-        wcscpy_s(g_registeredDevicePath, path);
-        g_registeredHardwareId = id;
-        g_registrationMode.store(false);
-        return true;
+    // 新句柄（首次出现或重新插入）在第一个包上按硬件ID 归类
+    DeviceRoleInfo role = LookupDeviceRole(deviceHandle);
+    if (role.role == DEVICE_ROLE_UNKNOWN) {
+        role = ClassifyDevice(deviceHandle);
     }
 
-    return false;
-}
+    // 注册模式：检测移动的鼠标并显示设备信息
+    if (isRegistrationMode) {
+        bool hasMovement = (packet.dx != 0 || packet.dy != 0);
+        bool isRelative = !(packet.flags & MOUSE_MOVE_ABSOLUTE);
+        if (!hasMovement || !isRelative) {
+            return;
+        }
+        // 噪声设备与已配置的触发器不参与注册
+        if (role.role != DEVICE_ROLE_OBSERVER) {
+            return;
+        }
 
-// Normalize stdin lines in IPC mode:
-// - PowerShell may pipe UTF-16LE/BE strings to native executables.
-// - Some tools may include UTF-8 BOM.
-std::string NormalizeIpcLine(const std::string& line) {
-    std::string s = line;
+        if (g_ipcMode.load()) {
+            const LONG dx = packet.dx;
+            const LONG dy = packet.dy;
+            const float delta = static_cast<float>(std::abs(dx) + std::abs(dy));
+            if (delta <= 0.0f) {
+                return;
+            }
 
-    // Strip UTF-8 BOM if present.
-    if (s.size() >= 3 &&
-        static_cast<unsigned char>(s[0]) == 0xEF &&
-        static_cast<unsigned char>(s[1]) == 0xBB &&
-        static_cast<unsigned char>(s[2]) == 0xBF) {
-        s = s.substr(3);
-    }
+            // 扫描状态只由输入线程访问；主线程重置时只递增代数
+            static ScanEngine s_scan;
+            static uint32_t s_scanGeneration = 0;
+            static HANDLE s_lastEmitDevice = nullptr;
+            static uint64_t s_lastEmitUs = 0;
+            const uint32_t generation = g_scanResetGeneration.load(std::memory_order_relaxed);
+            if (generation != s_scanGeneration) {
+                s_scanGeneration = generation;
+                s_scan.Reset();
+                s_lastEmitDevice = nullptr;
+                s_lastEmitUs = 0;
+            }
 
-    const bool hasUtf16Bom =
-        s.size() >= 2 &&
-        ((static_cast<unsigned char>(s[0]) == 0xFF && static_cast<unsigned char>(s[1]) == 0xFE) ||
-         (static_cast<unsigned char>(s[0]) == 0xFE && static_cast<unsigned char>(s[1]) == 0xFF));
+            const uint64_t kScanEmitIntervalUs = 10000;
+            const uint64_t now = ctx.nowUs;
+            const float totalProgress = s_scan.Add(deviceHandle, delta, now, CurrentScanConfig()) * 100.0f;
+            const bool deviceChanged = (s_lastEmitDevice != deviceHandle);
 
-    const bool hasNul = s.find('\0') != std::string::npos;
+            bool shouldEmit = (totalProgress >= 100.0f || s_lastEmitUs == 0 || deviceChanged ||
+                               now >= s_lastEmitUs + kScanEmitIntervalUs);
 
-    if (hasUtf16Bom || hasNul) {
-        bool littleEndian = true;
-        size_t start = 0;
+            // 进度每个包都写入合并槽（只保留最新值），最多每 10ms 请求一次 flush；
+            // 其间的值随下一次 flush（本线程节流到期或主线程输出其它事件时）带出
+            QueueEventValueThrottled(EVENT_SCAN_PROGRESS, totalProgress, shouldEmit);
+            if (shouldEmit) {
+                s_lastEmitUs = now;
+                s_lastEmitDevice = deviceHandle;
+            }
 
-        if (hasUtf16Bom) {
-            littleEndian = (static_cast<unsigned char>(s[0]) == 0xFF);
-            start = 2;
-        } else {
-            // Heuristic: UTF-16LE ASCII tends to have NULs at odd indices; UTF-16BE at even indices.
-            size_t zerosEven = 0;
-            size_t zerosOdd = 0;
-            for (size_t i = 0; i < s.size(); ++i) {
-                if (s[i] == '\0') {
-                    if ((i & 1) == 0) zerosEven++;
-                    else zerosOdd++;
+            if (totalProgress >= 100.0f) {
+                bool expected = true;
+                if (!g_registrationMode.compare_exchange_strong(expected, false)) {
+                    return;
                 }
-            }
-            littleEndian = zerosOdd >= zerosEven;
-        }
 
-        std::string decoded;
-        decoded.reserve(s.size() / 2);
-        for (size_t i = start; i + 1 < s.size(); i += 2) {
-            const unsigned char b0 = static_cast<unsigned char>(s[i]);
-            const unsigned char b1 = static_cast<unsigned char>(s[i + 1]);
-            const unsigned short u = littleEndian ? static_cast<unsigned short>(b0 | (b1 << 8))
-                                                  : static_cast<unsigned short>(b1 | (b0 << 8));
+                const HANDLE winnerDevice = s_scan.Winner();
+                QueueEventValues(EVENT_SCAN_DECIDED, nullptr,
+                                 {static_cast<double>(now - s_scan.startUs) / 1000.0, static_cast<double>(s_scan.packets),
+                                  static_cast<double>(s_scan.used), s_scan.LeaderShare()});
+                s_scan.Reset();
+                SetRegisteredDevice(winnerDevice);
+                CachedDevicePath(winnerDevice, g_registeredDevicePath, sizeof(g_registeredDevicePath)/sizeof(wchar_t));
+                const std::string winnerId = CachedHardwareId(winnerDevice);
+                SetRegisteredHardwareId(winnerId);
+
+                if (!winnerId.empty()) {
+                    RequestSettingsCleanupForRegisteredMouse(winnerId);
+                }
 
-            if (u == 0) continue;
-            if (u <= 0x7F) {
-                decoded.push_back(static_cast<char>(u));
-                continue;
+                if (!winnerId.empty()) {
+                    SaveLastRegisteredHardwareId(winnerId);
+                    QueueEventText(EVENT_REGISTERED, winnerId.c_str());
+                } else {
+                    QueueNotifyError("HWID NOT FOUND");
+                    QueueEventText(EVENT_REGISTERED, "");
+                }
+            }
+        } else {
+            if (deviceHandle != g_pendingDevice.load()) {
+                g_pendingDevice.store(deviceHandle);
+                CachedDevicePath(deviceHandle, g_pendingDevicePath, sizeof(g_pendingDevicePath)/sizeof(wchar_t));
+
+                printf("\r                                                                              \r");
+                printf("[DETECT] Device: 0x%p\n", deviceHandle);
+                if (g_pendingDevicePath[0] != L'\0') {
+                    printf("         Path: %ls\n", g_pendingDevicePath);
+                }
+                printf("         Press Y to register this mouse, N to skip\n");
+                fflush(stdout);
             }
-            if (u == 0xFEFF) continue; // BOM codepoint
-            decoded.push_back('?');
         }
-
-        s.swap(decoded);
+        return;
     }
 
-    // Defensive: strip any remaining NULs.
-    std::string filtered;
-    filtered.reserve(s.size());
-    for (char c : s) {
-        if (c != '\0') filtered.push_back(c);
-    }
-    return filtered;
-}
+    // 正常模式：按角色表分派
+    HANDLE registeredDevice = g_registeredDevice.load(std::memory_order_relaxed);
+    bool isRelative = !(packet.flags & MOUSE_MOVE_ABSOLUTE);
 
-// 在JSON中查找数组的范围 [arrayStart, arrayEnd]
-bool FindJsonArrayRange(const std::string& content, const std::string& key, size_t& arrayStart, size_t& arrayEnd) {
-    std::string token = "\"" + key + "\"";
-    size_t pos = content.find(token);
-    if (pos == std::string::npos) return false;
+    // 其他鼠标（观察者）的移动
+    if (role.role == DEVICE_ROLE_OBSERVER) {
+        if (registeredDevice != NULL && isRelative) {
+            LONG otherX = packet.dx;
+            LONG otherY = packet.dy;
 
-    size_t bracket = content.find('[', pos);
-    if (bracket == std::string::npos) return false;
+            // 记录其他鼠标是否活跃（超过死区）
+            if (IsOtherMouseMovementSignificant(otherX, otherY)) {
+                g_otherMouseActive.store(true, std::memory_order_relaxed);
 
-    int depth = 0;
-    for (size_t i = bracket; i < content.size(); ++i) {
-        if (content[i] == '[') depth++;
-        else if (content[i] == ']') {
-            depth--;
-            if (depth == 0) {
-                arrayStart = bracket;
-                arrayEnd = i;
-                return true;
+                // 在 UNLOCKABLE 状态下，其他鼠标移动触发释放
+                DispatchLockEventAll(LOCK_EV_OTHER_MOVE, ctx.nowUs);
             }
         }
     }
-    return false;
-}
+    // 触发器（注册鼠标与 --trigger 设备）的移动
+    else if (role.role == DEVICE_ROLE_TRIGGER) {
+        if (isRelative) {
+            LONG accelX = packet.dx;
+            LONG accelY = packet.dy;
+
+            // 从 ExtraInformation 解码原始移动量
+            ULONG extraInfo = packet.extraInfo;
+            short rawX = 0, rawY = 0;
+            DecodeExtraInfo(extraInfo, &rawX, &rawY);
+
+            // 更新 extraInfoValid 状态（修复永不重置的 bug）
+            if (extraInfo != 0 && (rawX != 0 || rawY != 0)) {
+                g_extraInfoValid.store(true);
+                g_lastRawX = rawX;
+                g_lastRawY = rawY;
+            } else if (extraInfo == 0) {
+                g_extraInfoValid.store(false);
+            }
+
+            // 判断是否有实际移动
+            bool extraInfoValid = g_extraInfoValid.load();
+            bool hasMoved = extraInfoValid ? (rawX != 0 || rawY != 0) : (accelX != 0 || accelY != 0);
+
+            if (hasMoved) {
+                g_moveCount++;
+                const uint64_t now = ctx.nowUs;
+                bool featureEnabled = g_featureEnabled.load(std::memory_order_relaxed) &&
+                                      g_powerEnabled.load(std::memory_order_relaxed);
+
+                // PERF(P0): 限频控制台输出，避免每包 printf/fflush 造成阻塞和抖动
+                // 预期改进：将控制台 I/O 从 500/1000Hz 降到 10Hz（100ms），显著降低 WM_INPUT 处理时间波动
+                static uint64_t s_lastPrintUs = 0;
+                const uint64_t kPrintIntervalUs = 100000;
+                bool shouldPrint = (s_lastPrintUs == 0) || now >= s_lastPrintUs + kPrintIntervalUs;
+                if (shouldPrint) s_lastPrintUs = now;
+
+                if (shouldPrint && !g_ipcMode.load()) {
+                    // 显示移动信息
+                    const char* stateStr = "IDLE";
+                    const LockState state = g_lock.triggers[role.trigger].state;
+                    if (state == LockState::LOCKED) stateStr = "LOCK";
+                    else if (state == LockState::UNLOCKABLE) stateStr = "UNLK";
+
+                    if (extraInfoValid) {
+                        printf("\r[RAW] X:%+4d Y:%+4d | Accel:(%+4ld,%+4ld) | %s | %s    ",
+                               rawX, rawY, accelX, accelY,
+                               featureEnabled ? "ON " : "OFF", stateStr);
+                    } else {
+                        printf("\r[ACCEL] X:%+4ld Y:%+4ld | %s | %s (no extraInfo)    ",
+                               accelX, accelY,
+                               featureEnabled ? "ON " : "OFF", stateStr);
+                    }
+                    fflush(stdout);
+                }
 
-// 在JSON中查找对象的范围 {objStart, objEnd}
-bool FindNextJsonObject(const std::string& content, size_t searchStart, size_t boundary, size_t& objStart, size_t& objEnd) {
-    size_t brace = content.find('{', searchStart);
-    if (brace == std::string::npos || brace > boundary) return false;
+                // 状态机：IDLE（冷却期外）进入 LOCKED，LOCKED/UNLOCKABLE 保持/回到 LOCKED
+                if (featureEnabled) {
+                    DispatchLockEvent(role.trigger, LOCK_EV_MOVE, now);
 
-    int depth = 0;
-    for (size_t i = brace; i <= boundary && i < content.size(); ++i) {
-        if (content[i] == '{') depth++;
-        else if (content[i] == '}') {
-            depth--;
-            if (depth == 0) {
-                objStart = brace;
-                objEnd = i;
-                return true;
+                    // 手动移动光标（使用加速后的数据）
+                    MoveCursorBy(accelX, accelY, ctx.liveTicks ? packet.ticks : 0);
+                }
             }
         }
     }
-    return false;
 }
 
-// 从JSON对象中提取字符串字段值
-bool ExtractJsonStringField(const std::string& obj, const std::string& field, std::string& value) {
-    std::string key = "\"" + field + "\"";
-    size_t pos = obj.find(key);
-    if (pos == std::string::npos) return false;
-
-    pos = obj.find(':', pos);
-    if (pos == std::string::npos) return false;
-
-    pos = obj.find('"', pos);
-    if (pos == std::string::npos) return false;
-
-    size_t end = obj.find('"', pos + 1);
-    if (end == std::string::npos) return false;
+// 单包入口：录制、计数并统计到达延迟与处理耗时
+static void HandleMousePacket(const MousePacket& packet, RawBatchContext& ctx) {
+    const uint64_t start = StatsNowTicks();
+    if (ctx.liveTicks && packet.ticks <= start) {
+        RecordLatency(STAGE_DECODE, TicksToNs(start - packet.ticks));
+    }
+    ctx.packets++;
+    CountDevicePacket(packet.device);
+    if (g_traceRecorder.file) {
+        RecordMousePacket(packet);
+    }
 
-    value = obj.substr(pos + 1, end - pos - 1);
-    return true;
+    ProcessMousePacket(packet, ctx);
+    RecordLatency(STAGE_STATE, TicksToNs(StatsNowTicks() - start));
 }
 
-// 从JSON对象中提取数字字段值
-bool ExtractJsonNumberField(const std::string& obj, const std::string& field, double& value) {
-    std::string key = "\"" + field + "\"";
-    size_t pos = obj.find(key);
-    if (pos == std::string::npos) return false;
-
-    pos = obj.find(':', pos);
-    if (pos == std::string::npos) return false;
-    pos++;
+// 记录一次批量读取的统计（仅输入线程写入）
+static void RecordRawInputBatch(UINT batchPackets) {
+    if (batchPackets == 0) return;
+    g_rawBatchCount.fetch_add(1, std::memory_order_relaxed);
+    g_rawPacketCount.fetch_add(batchPackets, std::memory_order_relaxed);
+    if (batchPackets > 1) {
+        // 首包之外队列里还有积压
+        g_rawBacklogCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (batchPackets > g_rawMaxBatch.load(std::memory_order_relaxed)) {
+        g_rawMaxBatch.store(batchPackets, std::memory_order_relaxed);
+    }
+}
 
-    while (pos < obj.size() && std::isspace(static_cast<unsigned char>(obj[pos]))) pos++;
+// 一批鼠标包的开始/结束：各输入源读取一批数据后，逐包调用 HandleMousePacket
+static void BeginMouseBatch(RawBatchContext& ctx) {
+    ctx.nowUs = ClockNowUs();
+    ctx.packets = 0;
+    ctx.liveTicks = !g_replayMode.load();
+    g_eventProducer.inMouseBatch = true;
+    g_eventProducer.batchEvents = false;
+    BeginInjectBatch();
+
+    // 其他线程投递的状态机命令在批次之间处理
+    if (g_lockInbox.pending.load(std::memory_order_acquire)) {
+        ProcessLockInbox();
+    }
+}
 
-    size_t end = pos;
-    while (end < obj.size() &&
-           (std::isdigit(static_cast<unsigned char>(obj[end])) ||
-            obj[end] == '-' || obj[end] == '+' ||
-            obj[end] == '.' || obj[end] == 'e' || obj[end] == 'E')) {
-        end++;
+static void EndMouseBatch(RawBatchContext& ctx) {
+    // 本批的光标移动与按键一次送出
+    FlushInjectBatch();
+    RecordRawInputBatch(ctx.packets);
+
+    // 本批入队的事件（SCAN 进度、FIRING 等）直接写出，不等主循环
+    EventProducerState& producer = g_eventProducer;
+    producer.inMouseBatch = false;
+    if (producer.batchEvents) {
+        producer.batchEvents = false;
+        if (!TryFlushEvents()) WakeMainLoop();
     }
 
-    if (end == pos) return false;
+    // 主循环在无输入时停掉了统计定时，有新输入时唤醒它重新登记
+    if (g_housekeepingIdle.load(std::memory_order_relaxed) && g_housekeepingIdle.exchange(false)) {
+        WakeMainLoop();
+    }
+}
 
-    const std::string numberStr = obj.substr(pos, end - pos);
-    char* endPtr = nullptr;
-    errno = 0;
-    const double parsed = std::strtod(numberStr.c_str(), &endPtr);
-    if (endPtr == numberStr.c_str() || errno != 0) return false;
+// 周期性上报输入队列积压情况（主循环统计截止时间到期时调用）
+static void ReportInputBacklog(bool force) {
+    static uint64_t s_lastReportedBacklog = 0;
 
-    value = parsed;
-    return true;
-}
+    const uint64_t backlog = g_rawBacklogCount.load(std::memory_order_relaxed);
+    if (backlog == s_lastReportedBacklog && !force) return;
+    s_lastReportedBacklog = backlog;
 
-// 替换JSON中的数字字段值
-bool ReplaceJsonNumberField(std::string& content, const std::string& field, double value) {
-    std::string key = "\"" + field + "\"";
-    size_t pos = content.find(key);
-    if (pos == std::string::npos) return false;
+    const uint64_t batches = g_rawBatchCount.load(std::memory_order_relaxed);
+    const uint64_t packets = g_rawPacketCount.load(std::memory_order_relaxed);
+    const unsigned maxBatch = g_rawMaxBatch.load(std::memory_order_relaxed);
 
-    pos = content.find(':', pos);
-    if (pos == std::string::npos) return false;
-    pos++;
+    if (g_ipcMode.load()) {
+        QueueEventValues(EVENT_INPUT_BACKLOG, nullptr,
+                         {static_cast<double>(backlog), static_cast<double>(maxBatch),
+                          static_cast<double>(batches), static_cast<double>(packets)});
+    } else if (force) {
+        printf("\n[STATS] Raw input: %llu packets in %llu batches, backlog %llu times, max batch %u\n",
+               static_cast<unsigned long long>(packets),
+               static_cast<unsigned long long>(batches),
+               static_cast<unsigned long long>(backlog), maxBatch);
+    }
+}
 
-    // 跳过空白
-    while (pos < content.size() && std::isspace(static_cast<unsigned char>(content[pos]))) pos++;
+// 启动阶段的错误上报（IPC 模式下同时标记离线）
+static void ReportInputSourceError(const char* ipcError, const std::string& detail) {
+    if (g_ipcMode.load()) {
+        QueueEventText(EVENT_NOTIFY, "FS:OFFLINE");
+        QueueNotifyError(ipcError);
+    } else {
+        printf("[ERROR] %s\n", detail.c_str());
+    }
+}
 
-    // 找到数字的结束位置
-    size_t end = pos;
-    while (end < content.size() &&
-           (std::isdigit(static_cast<unsigned char>(content[end])) ||
-            content[end] == '-' || content[end] == '+' ||
-            content[end] == '.' || content[end] == 'e' || content[end] == 'E')) {
-        end++;
+// ========== 输入线程调度 ==========
+
+// 输入线程调度配置（--sched / --cpu / --mlock）
+// Windows：MMCSS "Games"/"Pro Audio" 任务，或提升线程优先级；
+// Linux：SCHED_FIFO 或 nice 值。
+enum class SchedProfile { DEFAULT, GAMES, PRO_AUDIO, FIFO, NICE };
+
+struct SchedConfig {
+    SchedProfile profile = SchedProfile::DEFAULT;
+    int priority = 0;          // FIFO 优先级（1-99）或 nice 值（-20..19）
+    int cpu = -1;              // 绑定到的 CPU 编号，-1 表示不绑定
+    bool lockMemory = false;   // 锁定内存，避免热路径缺页
+};
+
+SchedConfig g_schedConfig;
+
+// 解析 --sched 参数：default | games | proaudio | fifo[:prio] | nice[:value]
+static bool ParseSchedProfile(const std::string& spec, SchedConfig& config) {
+    std::string name = spec;
+    std::string value;
+    size_t colon = spec.find(':');
+    if (colon != std::string::npos) {
+        name = spec.substr(0, colon);
+        value = spec.substr(colon + 1);
     }
 
-    // 格式化新的数字值
-    std::ostringstream ss;
-    ss.setf(std::ios::fixed);
-    ss.precision(1);
-    ss << value;
+    if (name == "default") {
+        config.profile = SchedProfile::DEFAULT;
+    } else if (name == "games") {
+        config.profile = SchedProfile::GAMES;
+    } else if (name == "proaudio") {
+        config.profile = SchedProfile::PRO_AUDIO;
+    } else if (name == "fifo") {
+        config.profile = SchedProfile::FIFO;
+        config.priority = 50;
+    } else if (name == "nice") {
+        config.profile = SchedProfile::NICE;
+        config.priority = -10;
+    } else {
+        return false;
+    }
 
-    content.replace(pos, end - pos, ss.str());
+    if (!value.empty()) {
+        char* endPtr = nullptr;
+        long parsed = std::strtol(value.c_str(), &endPtr, 10);
+        if (endPtr == value.c_str() || *endPtr != '\0') return false;
+        config.priority = static_cast<int>(parsed);
+    }
     return true;
 }
 
-static bool TryLoadSensitivityFromSettings(double& outMultiplier) {
-    if (g_settingsPath.empty()) return false;
-
-    std::lock_guard<std::mutex> lock(g_settingsMutex);
+static const char* SchedProfileName(SchedProfile profile) {
+    switch (profile) {
+        case SchedProfile::GAMES: return "games";
+        case SchedProfile::PRO_AUDIO: return "proaudio";
+        case SchedProfile::FIFO: return "fifo";
+        case SchedProfile::NICE: return "nice";
+        default: return "default";
+    }
+}
 
-    std::string content;
-    if (!ReadFileContent(g_settingsPath.c_str(), content)) return false;
+#ifdef _WIN32
+// avrt.dll 按需加载，避免对构建脚本增加链接依赖
+typedef HANDLE (WINAPI* AvSetMmThreadCharacteristicsAFn)(LPCSTR, LPDWORD);
+typedef BOOL (WINAPI* AvRevertMmThreadCharacteristicsFn)(HANDLE);
+
+static HANDLE JoinMmcssTask(const char* taskName) {
+    HMODULE avrt = LoadLibraryA("avrt.dll");
+    if (!avrt) return NULL;
+    AvSetMmThreadCharacteristicsAFn setFn = reinterpret_cast<AvSetMmThreadCharacteristicsAFn>(
+        GetProcAddress(avrt, "AvSetMmThreadCharacteristicsA"));
+    if (!setFn) return NULL;
+    DWORD taskIndex = 0;
+    return setFn(taskName, &taskIndex);
+}
 
-    size_t arrStart = 0, arrEnd = 0;
-    if (!FindJsonArrayRange(content, "profiles", arrStart, arrEnd)) return false;
+static void LeaveMmcssTask(HANDLE task) {
+    if (!task) return;
+    HMODULE avrt = GetModuleHandleA("avrt.dll");
+    if (!avrt) return;
+    AvRevertMmThreadCharacteristicsFn revertFn = reinterpret_cast<AvRevertMmThreadCharacteristicsFn>(
+        GetProcAddress(avrt, "AvRevertMmThreadCharacteristics"));
+    if (revertFn) revertFn(task);
+}
 
-    size_t search = arrStart;
-    while (true) {
-        size_t objStart = 0, objEnd = 0;
-        if (!FindNextJsonObject(content, search, arrEnd, objStart, objEnd)) break;
+HANDLE g_mmcssTask = NULL;
+#endif
+
+// 在当前线程上应用调度配置；失败项写入 errorMsg（部分生效时仍返回 false）
+static bool ApplyThreadScheduling(const SchedConfig& config, std::string& errorMsg) {
+    bool ok = true;
+#ifdef _WIN32
+    switch (config.profile) {
+        case SchedProfile::GAMES:
+        case SchedProfile::PRO_AUDIO:
+            g_mmcssTask = JoinMmcssTask(config.profile == SchedProfile::GAMES ? "Games" : "Pro Audio");
+            if (!g_mmcssTask) {
+                errorMsg += "mmcss failed;";
+                ok = false;
+            }
+            break;
+        case SchedProfile::FIFO:
+            if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+                errorMsg += "thread priority failed;";
+                ok = false;
+            }
+            break;
+        case SchedProfile::NICE:
+            if (!SetThreadPriority(GetCurrentThread(),
+                                   config.priority < 0 ? THREAD_PRIORITY_HIGHEST : THREAD_PRIORITY_ABOVE_NORMAL)) {
+                errorMsg += "thread priority failed;";
+                ok = false;
+            }
+            break;
+        default:
+            break;
+    }
 
-        std::string obj = content.substr(objStart, objEnd - objStart + 1);
-        std::string name;
-        if (!ExtractJsonStringField(obj, "name", name) || name != SENS_PROFILE_NAME) {
-            search = objEnd + 1;
-            continue;
+    if (config.cpu >= 0 && config.cpu < static_cast<int>(sizeof(DWORD_PTR) * 8)) {
+        if (!SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << config.cpu)) {
+            errorMsg += "affinity failed;";
+            ok = false;
         }
+    }
 
-        double outputDpi = 0.0;
-        if (!ExtractJsonNumberField(obj, "Output DPI", outputDpi)) return false;
+    if (config.lockMemory) {
+        // 提高最小工作集，热路径的页面不会被换出
+        if (!SetProcessWorkingSetSize(GetCurrentProcess(), 32 * 1024 * 1024, 128 * 1024 * 1024)) {
+            errorMsg += "working set failed;";
+            ok = false;
+        }
+    }
+#else
+    // games/proaudio 在 Linux 上对应不同档位的 SCHED_FIFO
+    int fifoPriority = 0;
+    if (config.profile == SchedProfile::GAMES) fifoPriority = 10;
+    else if (config.profile == SchedProfile::PRO_AUDIO) fifoPriority = 60;
+    else if (config.profile == SchedProfile::FIFO) fifoPriority = config.priority;
+
+    if (fifoPriority > 0) {
+        sched_param param = {};
+        param.sched_priority = fifoPriority;
+        int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (rc != 0) {
+            errorMsg += std::string("SCHED_FIFO failed: ") + strerror(rc) + ";";
+            ok = false;
+        }
+    } else if (config.profile == SchedProfile::NICE) {
+        // Linux 上 nice 值按线程生效
+        if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), config.priority) != 0) {
+            errorMsg += std::string("setpriority failed: ") + strerror(errno) + ";";
+            ok = false;
+        }
+    }
 
-        double multiplier = outputDpi / 1000.0;
-        if (multiplier < 0.001) multiplier = 0.001;
-        if (multiplier > 100.0) multiplier = 100.0;
+    if (config.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(config.cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rc != 0) {
+            errorMsg += std::string("affinity failed: ") + strerror(rc) + ";";
+            ok = false;
+        }
+    }
 
-        outMultiplier = multiplier;
-        return true;
+    if (config.lockMemory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+            errorMsg += std::string("mlockall failed: ") + strerror(errno) + ";";
+            ok = false;
+        }
     }
+#endif
+    return ok;
+}
 
-    return false;
+static void RevertThreadScheduling() {
+#ifdef _WIN32
+    LeaveMmcssTask(g_mmcssTask);
+    g_mmcssTask = NULL;
+#endif
 }
 
-// 复制profile并修改Output DPI
-bool CreateOrUpdateSensProfile(std::string& content, double outputDpi, std::string& errorMsg) {
-    size_t arrStart, arrEnd;
-    if (!FindJsonArrayRange(content, "profiles", arrStart, arrEnd)) {
-        errorMsg = "profiles array not found";
-        return false;
-    }
+// ----- 调度效果测量（--sched-probe） -----
 
-    // 遍历所有profile，查找模板和是否已存在目标profile
-    size_t search = arrStart;
-    std::string templateProfile;
-    bool profileExists = false;
-    size_t existingProfileStart = 0, existingProfileEnd = 0;
+// 高精度绝对时刻睡眠（纳秒，单调时钟）
+static uint64_t ProbeNowNs() {
+    return TicksToNs(StatsNowTicks());
+}
 
-    while (true) {
-        size_t objStart, objEnd;
-        if (!FindNextJsonObject(content, search, arrEnd, objStart, objEnd)) break;
+#ifdef _WIN32
+static void ProbeSleepUntil(HANDLE timer, uint64_t deadlineNs) {
+    const uint64_t now = ProbeNowNs();
+    if (deadlineNs <= now) return;
+    LARGE_INTEGER due;
+    due.QuadPart = -static_cast<LONGLONG>((deadlineNs - now) / 100);  // 相对时间，100ns 单位
+    if (timer && SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE)) {
+        WaitForSingleObject(timer, INFINITE);
+    } else {
+        Sleep(static_cast<DWORD>((deadlineNs - now) / 1000000));
+    }
+}
+#endif
+
+// 以 1ms 周期睡眠唤醒，记录实际唤醒时刻相对期望时刻的延迟（微秒）
+static void RunWakeupProbe(const SchedConfig& config, double seconds, std::vector<double>& latenciesUs, std::string& errorMsg) {
+    ApplyThreadScheduling(config, errorMsg);
+
+#ifdef _WIN32
+    HANDLE timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+#endif
+    const uint64_t periodNs = 1000000;
+    const size_t iterations = static_cast<size_t>(seconds * 1000.0);
+    latenciesUs.clear();
+    latenciesUs.reserve(iterations);
+
+    uint64_t deadline = ProbeNowNs() + periodNs;
+    for (size_t i = 0; i < iterations; ++i) {
+#ifdef _WIN32
+        ProbeSleepUntil(timer, deadline);
+#else
+        timespec ts;
+        ts.tv_sec = static_cast<time_t>(deadline / 1000000000ull);
+        ts.tv_nsec = static_cast<long>(deadline % 1000000000ull);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+#endif
+        const uint64_t woke = ProbeNowNs();
+        latenciesUs.push_back(woke > deadline ? static_cast<double>(woke - deadline) / 1000.0 : 0.0);
+        deadline += periodNs;
+        if (woke > deadline) deadline = woke + periodNs;
+    }
 
-        std::string obj = content.substr(objStart, objEnd - objStart + 1);
-        std::string name;
-        ExtractJsonStringField(obj, "name", name);
+#ifdef _WIN32
+    if (timer) CloseHandle(timer);
+#endif
+    RevertThreadScheduling();
+}
 
-        if (name == SENS_PROFILE_NAME) {
-            profileExists = true;
-            existingProfileStart = objStart;
-            existingProfileEnd = objEnd;
-        }
+static double Percentile(std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t idx = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[idx < sorted.size() ? idx : sorted.size() - 1];
+}
 
-        // 使用第一个profile作为模板
-        if (templateProfile.empty()) {
-            templateProfile = obj;
-        }
+// 在满载（每个 CPU 一个忙等线程）下分别用默认调度和配置的调度跑唤醒测量，对比尾延迟
+static int RunSchedProbe(double seconds) {
+    std::atomic<bool> loadRunning(true);
+    std::vector<std::thread> loadThreads;
+    unsigned cpus = std::thread::hardware_concurrency();
+    if (cpus == 0) cpus = 1;
+    for (unsigned i = 0; i < cpus; ++i) {
+        loadThreads.emplace_back([&loadRunning]() {
+            volatile uint64_t sink = 0;
+            while (loadRunning.load(std::memory_order_relaxed)) sink = sink + 1;
+        });
+    }
 
-        search = objEnd + 1;
+    printf("[SCHED] Wake-up latency, 1ms period, %.1fs per run, %u busy threads\n", seconds, cpus);
+    printf("[SCHED] %-10s %10s %10s %10s %10s\n", "profile", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+
+    const SchedConfig baseline;
+    const SchedConfig* configs[2] = {&baseline, &g_schedConfig};
+    for (int run = 0; run < 2; ++run) {
+        std::vector<double> latencies;
+        std::string err;
+        std::thread probe([&]() { RunWakeupProbe(*configs[run], seconds, latencies, err); });
+        probe.join();
+
+        std::sort(latencies.begin(), latencies.end());
+        printf("[SCHED] %-10s %10.1f %10.1f %10.1f %10.1f%s%s\n",
+               SchedProfileName(configs[run]->profile),
+               Percentile(latencies, 0.50), Percentile(latencies, 0.99),
+               Percentile(latencies, 0.999), latencies.empty() ? 0.0 : latencies.back(),
+               err.empty() ? "" : "  ! ", err.c_str());
     }
 
-    if (profileExists) {
-        // 更新已存在的profile
-        std::string existingObj = content.substr(existingProfileStart, existingProfileEnd - existingProfileStart + 1);
-        if (!ReplaceJsonNumberField(existingObj, "Output DPI", outputDpi)) {
-            errorMsg = "failed to update Output DPI in existing profile";
-            return false;
-        }
-        content.replace(existingProfileStart, existingProfileEnd - existingProfileStart + 1, existingObj);
-    } else {
-        // 创建新的profile
-        if (templateProfile.empty()) {
-            errorMsg = "no profile template found";
-            return false;
-        }
+    loadRunning.store(false);
+    for (std::thread& t : loadThreads) t.join();
+    return 0;
+}
 
-        std::string newProfile = templateProfile;
+// ========== 输入源 ==========
+
+// 输入源：把平台的原始鼠标输入按批送入 HandleMousePacket。
+// Open/Run/Close 都在输入线程上调用；Stop/Wake 可由其他线程调用，使 Run 尽快返回/处理状态机命令。
+class InputSource {
+public:
+    virtual ~InputSource() {}
+    virtual bool Open() = 0;     // 失败时自行上报错误
+    virtual void Run() = 0;      // 阻塞直到 Stop() 或输入结束
+    virtual void Stop() = 0;
+    virtual void Close() = 0;
+    virtual void Wake() {}       // 让 Run 尽快调用 ProcessLockInbox（默认：下一批时处理）
+};
+
+void WakeInputSource(InputSource* source) {
+    source->Wake();
+}
 
-        // 替换name字段
-        std::string oldName;
-        ExtractJsonStringField(newProfile, "name", oldName);
-        size_t namePos = newProfile.find("\"name\"");
-        if (namePos != std::string::npos) {
-            size_t valueStart = newProfile.find('"', namePos + 6);
-            size_t valueEnd = newProfile.find('"', valueStart + 1);
-            if (valueStart != std::string::npos && valueEnd != std::string::npos) {
-                newProfile.replace(valueStart + 1, valueEnd - valueStart - 1, SENS_PROFILE_NAME);
-            }
-        }
+// ----- 回放输入源（所有平台） -----
+
+// 只读内存映射的录制文件
+struct MappedTraceFile {
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+    const BYTE* data = nullptr;
+    size_t size = 0;
+};
+
+static void UnmapTraceFile(MappedTraceFile& trace) {
+#ifdef _WIN32
+    if (trace.data) UnmapViewOfFile(trace.data);
+    if (trace.mapping) CloseHandle(trace.mapping);
+    if (trace.file != INVALID_HANDLE_VALUE) CloseHandle(trace.file);
+#else
+    if (trace.data) munmap(const_cast<BYTE*>(trace.data), trace.size);
+    if (trace.fd >= 0) close(trace.fd);
+#endif
+    trace = MappedTraceFile();
+}
 
-        // 替换Output DPI
-        if (!ReplaceJsonNumberField(newProfile, "Output DPI", outputDpi)) {
-            errorMsg = "failed to set Output DPI in new profile";
-            return false;
-        }
+static bool MapTraceFile(const std::string& path, MappedTraceFile& trace, std::string& errorMsg) {
+#ifdef _WIN32
+    trace.file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (trace.file == INVALID_HANDLE_VALUE) {
+        errorMsg = "failed to open trace file";
+        return false;
+    }
 
-        // 插入新profile
-        std::string insertion = ",\n    " + newProfile;
+    LARGE_INTEGER fileSize = {};
+    if (!GetFileSizeEx(trace.file, &fileSize) ||
+        fileSize.QuadPart < static_cast<LONGLONG>(sizeof(TraceFileHeader))) {
+        errorMsg = "trace file too small";
+        UnmapTraceFile(trace);
+        return false;
+    }
+    trace.size = static_cast<size_t>(fileSize.QuadPart);
 
-        // 需要重新计算arrEnd，因为content可能已经被修改
-        if (!FindJsonArrayRange(content, "profiles", arrStart, arrEnd)) {
-            errorMsg = "profiles array not found after modification";
-            return false;
-        }
+    trace.mapping = CreateFileMappingA(trace.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (trace.mapping) {
+        trace.data = static_cast<const BYTE*>(MapViewOfFile(trace.mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+#else
+    trace.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (trace.fd < 0) {
+        errorMsg = "failed to open trace file";
+        return false;
+    }
 
-        // 找到最后一个}的位置
-        size_t insertPos = content.rfind('}', arrEnd);
-        if (insertPos != std::string::npos && insertPos > arrStart) {
-            content.insert(insertPos + 1, insertion);
-        }
+    struct stat st = {};
+    if (fstat(trace.fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(TraceFileHeader))) {
+        errorMsg = "trace file too small";
+        UnmapTraceFile(trace);
+        return false;
     }
+    trace.size = static_cast<size_t>(st.st_size);
 
-    return true;
-}
+    void* mapped = mmap(NULL, trace.size, PROT_READ, MAP_PRIVATE, trace.fd, 0);
+    if (mapped != MAP_FAILED) {
+        trace.data = static_cast<const BYTE*>(mapped);
+        madvise(mapped, trace.size, MADV_SEQUENTIAL);
+    }
+#endif
+    if (!trace.data) {
+        errorMsg = "failed to map trace file";
+        UnmapTraceFile(trace);
+        return false;
+    }
 
-// 删除 devices 数组中映射到 sens_registered_mouse 的旧设备：
-// - 若 currentHardwareId 非空：删除所有 profile==sens_registered_mouse 且 id!=currentHardwareId 的设备；
-//   同时若存在重复 currentHardwareId 条目，仅保留第一个。
-// - 若 currentHardwareId 为空：删除所有 profile==sens_registered_mouse 的设备。
-bool RemoveOldSensDeviceMappings(std::string& content, const std::string& currentHardwareId) {
-    size_t arrStart = 0, arrEnd = 0;
-    if (!FindJsonArrayRange(content, "devices", arrStart, arrEnd)) {
-        // 没有 devices 数组，视为无需清理
-        return true;
+    const TraceFileHeader* header = reinterpret_cast<const TraceFileHeader*>(trace.data);
+    if (memcmp(header->magic, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+        header->version != kTraceVersion ||
+        header->recordSize != sizeof(TraceRecord) ||
+        header->ticksPerSecond == 0) {
+        errorMsg = "unsupported trace format";
+        UnmapTraceFile(trace);
+        return false;
     }
+    return true;
+}
 
-    // 转义 currentHardwareId 以匹配 settings.json 中的 id 字段（反斜杠在 JSON 中被转义为 \\\\）
-    std::string escapedCurrentId;
-    if (!currentHardwareId.empty()) {
-        for (size_t i = 0; i < currentHardwareId.size(); ++i) {
-            if (currentHardwareId[i] == '\\') {
-                escapedCurrentId += "\\\\";
-            } else {
-                escapedCurrentId += currentHardwareId[i];
-            }
-        }
+// 回放中的注册设备标记
+static void ApplyReplayRegistration(uint64_t device) {
+    if (device == 0) {
+        SetRegisteredDevice(NULL);
+        g_registrationMode.store(true);
+        return;
     }
+    SetRegisteredDevice(reinterpret_cast<HANDLE>(device));
+    g_registrationMode.store(false);
+}
 
-    struct EraseRange { size_t start; size_t end; };
-    std::vector<EraseRange> removals;
+// 按原始时间间隔等待到 traceOffsetTicks（录制时钟）对应的回放时刻
+static uint64_t TraceTicksToUs(uint64_t ticks, uint64_t ticksPerSecond) {
+    if (ticksPerSecond == 0) return 0;
+    return (ticks / ticksPerSecond) * 1000000ull + (ticks % ticksPerSecond) * 1000000ull / ticksPerSecond;
+}
 
-    bool keptCurrent = false;
-    size_t search = arrStart;
-    while (true) {
-        size_t objStart = 0, objEnd = 0;
-        if (!FindNextJsonObject(content, search, arrEnd, objStart, objEnd)) break;
+static void WaitForTraceTime(uint64_t traceOffsetTicks, uint64_t traceFreq,
+                             LONGLONG wallStart, LONGLONG wallFreq) {
+    const double offsetSec = static_cast<double>(traceOffsetTicks) / static_cast<double>(traceFreq);
+    const LONGLONG target = wallStart + static_cast<LONGLONG>(offsetSec * static_cast<double>(wallFreq));
+    const LONGLONG kSpinTicks = wallFreq / 500;  // 最后 2ms 自旋，避免 Sleep 粒度误差
 
-        std::string obj = content.substr(objStart, objEnd - objStart + 1);
-        std::string profile;
-        if (!ExtractJsonStringField(obj, "profile", profile) || profile != SENS_PROFILE_NAME) {
-            search = objEnd + 1;
-            continue;
+    while (g_running.load()) {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        const LONGLONG remaining = target - now.QuadPart;
+        if (remaining <= 0) return;
+        if (remaining > kSpinTicks) {
+            Sleep(1);
+            ProcessLockInbox();
         }
+    }
+}
 
-        std::string devId;
-        ExtractJsonStringField(obj, "id", devId);
-
-        bool shouldRemove = false;
-        if (currentHardwareId.empty()) {
-            shouldRemove = true;
-        } else if (devId != escapedCurrentId) {
-            shouldRemove = true;
-        } else {
-            // devId == escapedCurrentId
-            if (keptCurrent) {
-                // 同一设备的重复条目，仅保留第一个
-                shouldRemove = true;
-            } else {
-                keptCurrent = true;
-            }
+// 回放：把录制的鼠标包按原批次送入 HandleMousePacket，结束后退出进程
+class TraceReplaySource : public InputSource {
+public:
+    bool Open() override {
+        std::string err;
+        if (!MapTraceFile(g_replayPath, trace_, err)) {
+            ReportInputSourceError(err.c_str(), "Replay: " + err + " (" + g_replayPath + ")");
+            return false;
         }
+        if (!g_ipcMode.load()) {
+            printf("[REPLAY] %s: %llu records (%s)\n", g_replayPath.c_str(),
+                   static_cast<unsigned long long>(RecordCount()),
+                   g_replayRealtime ? "original timing" : "as fast as possible");
+            fflush(stdout);
+        }
+        return true;
+    }
 
-        if (shouldRemove) {
-            size_t removeStart = objStart;
-            size_t removeEnd = objEnd;
-
-            // 优先吞掉"前置逗号 + 空白"，否则吞掉"后置逗号 + 空白"
-            while (removeStart > (arrStart + 1) &&
-                   std::isspace(static_cast<unsigned char>(content[removeStart - 1]))) {
-                removeStart--;
+    void Run() override {
+        const TraceFileHeader* header = reinterpret_cast<const TraceFileHeader*>(trace_.data);
+        const TraceRecord* records = reinterpret_cast<const TraceRecord*>(trace_.data + sizeof(TraceFileHeader));
+        const size_t count = RecordCount();
+        const uint64_t firstTicks = count > 0 ? records[0].ticks : header->startTicks;
+
+        LARGE_INTEGER wallFreq, wallStart, wallEnd;
+        QueryPerformanceFrequency(&wallFreq);
+        QueryPerformanceCounter(&wallStart);
+
+        uint64_t packets = 0;
+        size_t i = 0;
+        while (i < count && g_running.load()) {
+            // 录制时同一批次的包共享时间戳，回放时也按批送入
+            const uint64_t batchTicks = records[i].ticks;
+            if (g_replayRealtime) {
+                WaitForTraceTime(batchTicks - firstTicks, header->ticksPerSecond,
+                                 wallStart.QuadPart, wallFreq.QuadPart);
+            } else if (UsingVirtualClock()) {
+                // 模拟时间推进到本批录制时刻，先触发其间到期的状态转换
+                g_virtualClock.AdvanceTo(VirtualClock::kEpochUs +
+                                         TraceTicksToUs(batchTicks - firstTicks, header->ticksPerSecond));
+                AdvanceLockTimers(ClockNowUs());
             }
 
-            if (removeStart > (arrStart + 1) && content[removeStart - 1] == ',') {
-                removeStart--; // 吞掉前置逗号
-                while (removeStart > (arrStart + 1) &&
-                       std::isspace(static_cast<unsigned char>(content[removeStart - 1]))) {
-                    removeStart--;
-                }
-            } else {
-                size_t pos = removeEnd + 1;
-                while (pos < content.size() &&
-                       std::isspace(static_cast<unsigned char>(content[pos]))) {
-                    pos++;
-                }
-                if (pos < content.size() && pos <= arrEnd && content[pos] == ',') {
-                    removeEnd = pos; // 吞掉后置逗号
-                    size_t pos2 = removeEnd + 1;
-                    while (pos2 < content.size() &&
-                           std::isspace(static_cast<unsigned char>(content[pos2]))) {
-                        pos2++;
-                    }
-                    if (pos2 > removeEnd + 1) {
-                        removeEnd = pos2 - 1; // 也吞掉逗号后的空白，避免留下多余空行/缩进
-                    }
+            RawBatchContext ctx;
+            BeginMouseBatch(ctx);
+            for (; i < count && records[i].ticks == batchTicks; ++i) {
+                const TraceRecord& record = records[i];
+                if (record.kind == TRACE_KIND_REGISTERED) {
+                    ApplyReplayRegistration(record.device);
+                    continue;
                 }
+                if (record.kind != TRACE_KIND_MOUSE) continue;
+
+                MousePacket packet;
+                packet.device = reinterpret_cast<HANDLE>(record.device);
+                packet.dx = record.dx;
+                packet.dy = record.dy;
+                packet.extraInfo = record.extraInfo;
+                packet.flags = record.flags;
+                packet.ticks = record.ticks;
+                HandleMousePacket(packet, ctx);
             }
-
-            removals.push_back({removeStart, removeEnd});
+            packets += ctx.packets;
+            EndMouseBatch(ctx);
         }
 
-        search = objEnd + 1;
-    }
+        QueryPerformanceCounter(&wallEnd);
+        const double seconds = static_cast<double>(wallEnd.QuadPart - wallStart.QuadPart) /
+                               static_cast<double>(wallFreq.QuadPart);
+        const double rate = seconds > 0.0 ? static_cast<double>(packets) / seconds : 0.0;
 
-    for (auto it = removals.rbegin(); it != removals.rend(); ++it) {
-        if (it->end >= it->start && it->end < content.size()) {
-            content.erase(it->start, it->end - it->start + 1);
+        if (g_ipcMode.load()) {
+            QueueEventValues(EVENT_REPLAY_DONE, nullptr, {static_cast<double>(packets), seconds, rate});
+        } else {
+            printf("\n[REPLAY] Done: %llu packets in %.3f s (%.0f packets/s)\n",
+                   static_cast<unsigned long long>(packets), seconds, rate);
+            fflush(stdout);
         }
+
+        // 回放结束即退出
+        g_running.store(false);
+        WakeMainLoop();
     }
 
-    return true;
-}
+    void Stop() override {}
 
-// 在devices数组中添加或更新设备映射
-bool AddOrUpdateDeviceMapping(std::string& content, const std::string& hardwareId, std::string& errorMsg) {
-    // 先清理旧映射，避免多个设备共享同一 sens_registered_mouse profile 导致"调一个全都变"
-    if (!RemoveOldSensDeviceMappings(content, hardwareId)) {
-        errorMsg = "failed to remove old sens_registered_mouse device mappings";
-        return false;
+    void Close() override {
+        UnmapTraceFile(trace_);
     }
-    size_t arrStart, arrEnd;
-    if (!FindJsonArrayRange(content, "devices", arrStart, arrEnd)) {
-        errorMsg = "devices array not found";
-        return false;
+
+private:
+    size_t RecordCount() const {
+        return (trace_.size - sizeof(TraceFileHeader)) / sizeof(TraceRecord);
     }
 
-    // 先转义反斜杠用于JSON匹配和写入
-    std::string escapedId;
-    for (size_t i = 0; i < hardwareId.size(); ++i) {
-        if (hardwareId[i] == '\\') {
-            escapedId += "\\\\";
-        } else {
-            escapedId += hardwareId[i];
+    MappedTraceFile trace_;
+};
+
+// ----- 注册扫描基准（--scan-bench） -----
+
+// 用录制的包对比两种判定规则的注册耗时：从文件开头及每个“回到注册模式”标记开始扫描，
+// 按录制时间戳计算从第一个扫描包到判定的时长
+static int RunScanBench(const std::string& path) {
+    MappedTraceFile trace;
+    std::string err;
+    if (!MapTraceFile(path, trace, err)) {
+        printf("[ERROR] %s: %s\n", err.c_str(), path.c_str());
+        return 1;
+    }
+    const TraceFileHeader* header = reinterpret_cast<const TraceFileHeader*>(trace.data);
+    const TraceRecord* records = reinterpret_cast<const TraceRecord*>(trace.data + sizeof(TraceFileHeader));
+    const size_t count = (trace.size - sizeof(TraceFileHeader)) / sizeof(TraceRecord);
+
+    struct Rule {
+        const char* name;
+        ScanConfig config;
+    };
+    const Rule rules[] = {
+        {"threshold", {g_scanMinCounts, 0.0f}},
+        {"confidence", CurrentScanConfig()},
+    };
+
+    for (const Rule& rule : rules) {
+        ScanEngine scan;
+        bool scanning = true;
+        unsigned segment = 0;
+        uint64_t startTicks = 0;
+        auto report = [&](bool decided, uint64_t endTicks) {
+            printf("SCAN_BENCH rule=%s segment=%u decided=%d ms=%.1f packets=%llu devices=%zu winner=0x%llx share=%.2f\n",
+                   rule.name, segment, decided ? 1 : 0,
+                   static_cast<double>(TraceTicksToUs(endTicks - startTicks, header->ticksPerSecond)) / 1000.0,
+                   static_cast<unsigned long long>(scan.packets), scan.used,
+                   decided ? static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(scan.Winner())) : 0ull,
+                   scan.LeaderShare());
+        };
+
+        for (size_t i = 0; i < count; ++i) {
+            const TraceRecord& record = records[i];
+            if (record.kind == TRACE_KIND_REGISTERED) {
+                if (record.device != 0 || scanning) continue;
+                scan.Reset();
+                scanning = true;
+                ++segment;
+                continue;
+            }
+            if (!scanning || record.kind != TRACE_KIND_MOUSE || (record.flags & MOUSE_MOVE_ABSOLUTE)) continue;
+
+            const float delta = static_cast<float>(std::abs(record.dx) + std::abs(record.dy));
+            if (delta <= 0.0f) continue;
+            if (scan.packets == 0) startTicks = record.ticks;
+            if (scan.Add(reinterpret_cast<HANDLE>(static_cast<uintptr_t>(record.device)), delta, 0, rule.config) >= 1.0f) {
+                report(true, record.ticks);
+                scanning = false;
+            }
+        }
+        if (scanning && scan.packets > 0) {
+            report(false, records[count - 1].ticks);
         }
     }
 
-    // 检查devices数组是否为空
-    std::string arrContent = content.substr(arrStart, arrEnd - arrStart + 1);
-    bool isEmpty = (arrContent.find('{') == std::string::npos);
+    UnmapTraceFile(trace);
+    return 0;
+}
 
-    // 遍历现有设备，检查是否已存在
-    size_t search = arrStart;
-    bool deviceExists = false;
-    size_t existingDevStart = 0, existingDevEnd = 0;
-    size_t lastObjEnd = 0;
+#ifdef _WIN32
+// ----- Win32 Raw Input 输入源 -----
+
+// 读取当前高精度计数（与 MousePacket::ticks 同一时基）
+static uint64_t ReadPacketTicks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return static_cast<uint64_t>(now.QuadPart);
+}
 
-    while (!isEmpty) {
-        size_t objStart, objEnd;
-        if (!FindNextJsonObject(content, search, arrEnd, objStart, objEnd)) break;
-        lastObjEnd = objEnd;
+// WOW64 下 GetRawInputBuffer 返回的 RAWINPUT 在 header 之后多 8 字节填充
+static size_t RawInputBufferDataPadding() {
+#ifdef _WIN64
+    return 0;
+#else
+    static const size_t s_padding = []() -> size_t {
+        BOOL wow64 = FALSE;
+        return (IsWow64Process(GetCurrentProcess(), &wow64) && wow64) ? 8 : 0;
+    }();
+    return s_padding;
+#endif
+}
 
-        std::string obj = content.substr(objStart, objEnd - objStart + 1);
-        std::string devId;
-        ExtractJsonStringField(obj, "id", devId);
+// PERF(P0): 首个 WM_INPUT 到达后用 GetRawInputBuffer 一次性取走队列中剩余的鼠标包，
+// 整批跑注册扫描/其他鼠标检测/状态机，避免 4-8kHz 下每包一次消息分发 + 一次内核调用
+static void DrainRawInputBuffer(RawBatchContext& ctx, uint64_t ticks) {
+    const size_t kRawBatchBytes = 16 * 1024;
+    alignas(16) static BYTE s_rawBatchBuffer[kRawBatchBytes];
+    const size_t padding = RawInputBufferDataPadding();
 
-        // JSON中的反斜杠已被转义，使用escapedId比较
-        if (devId == escapedId) {
-            deviceExists = true;
-            existingDevStart = objStart;
-            existingDevEnd = objEnd;
+    while (true) {
+        UINT cb = static_cast<UINT>(kRawBatchBytes);
+        UINT count = GetRawInputBuffer(reinterpret_cast<PRAWINPUT>(s_rawBatchBuffer), &cb, sizeof(RAWINPUTHEADER));
+        if (count == 0 || count == static_cast<UINT>(-1)) {
             break;
         }
 
-        search = objEnd + 1;
+        PRAWINPUT raw = reinterpret_cast<PRAWINPUT>(s_rawBatchBuffer);
+        for (UINT i = 0; i < count; ++i) {
+            if (raw->header.dwType == RIM_TYPEMOUSE) {
+                const RAWMOUSE* mouse = reinterpret_cast<const RAWMOUSE*>(
+                    reinterpret_cast<const BYTE*>(&raw->data) + padding);
+                HandleMousePacket(MousePacketFromRaw(raw->header.hDevice, *mouse, ticks), ctx);
+            }
+            raw = NEXTRAWINPUTBLOCK(raw);
+        }
     }
+}
 
-    // 构建设备配置JSON
-    std::string deviceJson =
-        "{\n"
-        "      \"name\": \"Registered Mouse\",\n"
-        "      \"profile\": \"" + std::string(SENS_PROFILE_NAME) + "\",\n"
-        "      \"id\": \"" + escapedId + "\",\n"
-        "      \"config\": {\n"
-        "        \"disable\": false,\n"
-        "        \"setExtraInfo\": true,\n"
-        "        \"Use constant time interval based on polling rate\": false,\n"
-        "        \"DPI (normalizes input speed unit: counts/ms -> in/s)\": 0,\n"
-        "        \"Polling rate Hz (keep at 0 for automatic adjustment)\": 0\n"
-        "      }\n"
-        "    }";
+// Win32RawInputSource::Wake 投递的消息
+const UINT WM_LOCK_INBOX = WM_APP + 1;
 
-    if (deviceExists) {
-        // 替换现有设备配置
-        content.replace(existingDevStart, existingDevEnd - existingDevStart + 1, deviceJson);
-    } else {
-        // 需要重新获取数组范围
-        if (!FindJsonArrayRange(content, "devices", arrStart, arrEnd)) {
-            errorMsg = "devices array not found";
-            return false;
+// 窗口过程 - 处理 WM_INPUT 消息
+LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+    if (msg == WM_INPUT) {
+        // PERF(P0): 消除每包 new/delete（高频 WM_INPUT 下会引入堆锁竞争/抖动）
+        // 预期改进：1000Hz 输入下显著降低 jitter，减少 CPU/堆分配开销峰值
+        thread_local std::vector<BYTE> buffer;
+        if (buffer.size() < sizeof(RAWINPUT)) {
+            buffer.resize(sizeof(RAWINPUT));
         }
 
-        if (isEmpty) {
-            // 数组为空，直接插入
-            std::string insertion = "\n    " + deviceJson + "\n  ";
-            content.insert(arrStart + 1, insertion);
-        } else {
-            // 数组非空，在最后一个对象后插入
-            // 重新查找最后一个对象
-            search = arrStart;
-            lastObjEnd = 0;
-            while (true) {
-                size_t objStart, objEnd;
-                if (!FindNextJsonObject(content, search, arrEnd, objStart, objEnd)) break;
-                lastObjEnd = objEnd;
-                search = objEnd + 1;
-            }
+        RawBatchContext ctx;
+        BeginMouseBatch(ctx);
+        const uint64_t ticks = ReadPacketTicks();
 
-            if (lastObjEnd > 0) {
-                std::string insertion = ",\n    " + deviceJson;
-                content.insert(lastObjEnd + 1, insertion);
-            }
+        // 当前消息自身的数据只能通过 GetRawInputData 读取
+        UINT size = static_cast<UINT>(buffer.size());
+        UINT copied = GetRawInputData((HRAWINPUT)lParam, RID_INPUT, buffer.data(), &size, sizeof(RAWINPUTHEADER));
+        if (copied == static_cast<UINT>(-1) && GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+            buffer.resize(size);
+            copied = GetRawInputData((HRAWINPUT)lParam, RID_INPUT, buffer.data(), &size, sizeof(RAWINPUTHEADER));
         }
-    }
-
-    return true;
-}
-
-// 更新settings.json为指定设备设置灵敏度
-bool UpdateSettingsForDevice(const std::string& hardwareId, double sensitivity, std::string& errorMsg) {
-    std::string content;
-    if (!ReadFileContent(g_settingsPath.c_str(), content)) {
-        errorMsg = "failed to read settings.json";
-        return false;
-    }
 
-    // 限制灵敏度范围
-    double clamped = sensitivity;
-    if (clamped < 0.001) clamped = 0.001;
-    if (clamped > 100.0) clamped = 100.0;
-
-    // 计算Output DPI (灵敏度 * 1000)
-    double outputDpi = clamped * 1000.0;
+        if (copied == size && size > 0) {
+            RAWINPUT* raw = reinterpret_cast<RAWINPUT*>(buffer.data());
+            if (raw->header.dwType == RIM_TYPEMOUSE) {
+                HandleMousePacket(MousePacketFromRaw(raw->header.hDevice, raw->data.mouse, ticks), ctx);
+            }
+        }
 
-    // 创建或更新灵敏度profile
-    if (!CreateOrUpdateSensProfile(content, outputDpi, errorMsg)) {
-        return false;
+        // 批量模式：继续取走队列中已排队的包
+        if (g_rawBatchEnabled.load()) {
+            DrainRawInputBuffer(ctx, ticks);
+        }
+        EndMouseBatch(ctx);
+        return 0;
     }
 
-    // 添加或更新设备映射
-    if (!AddOrUpdateDeviceMapping(content, hardwareId, errorMsg)) {
-        return false;
+    if (msg == WM_LOCK_INBOX) {
+        ProcessLockInbox();
+        return 0;
     }
 
-    // 写回文件
-    if (!WriteFileContent(g_settingsPath.c_str(), content)) {
-        errorMsg = "failed to write settings.json";
-        return false;
+    // RIDEV_DEVNOTIFY：插入时立即归类（注册鼠标重新插入即换到新句柄），拔出时丢弃缓存并松开其锁定
+    if (msg == WM_INPUT_DEVICE_CHANGE) {
+        const HANDLE device = reinterpret_cast<HANDLE>(lParam);
+        if (wParam == GIDC_ARRIVAL) {
+            ClassifyDevice(device);
+        } else if (wParam == GIDC_REMOVAL) {
+            ForgetDevice(device);
+        }
+        return 0;
     }
 
-    return true;
+    return DefWindowProc(hwnd, msg, wParam, lParam);
 }
 
-// 运行writer.exe应用配置
-bool RunWriterExe() {
-    char modulePath[MAX_PATH] = {0};
-    if (!GetModuleFileNameA(NULL, modulePath, MAX_PATH)) {
-        return false;
-    }
-
-    // 获取程序所在目录
-    std::string path(modulePath);
-    size_t slash = path.find_last_of("\\/");
-    std::string dir = (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
-    std::string writerPath = dir + "writer.exe";
-    std::string settingsPath = g_settingsPath.empty() ? (dir + SETTINGS_FILE) : g_settingsPath;
-
-    // 构建命令行: writer.exe <settings file path>
-    std::string cmdLine = "\"" + writerPath + "\" \"" + settingsPath + "\"";
-
-    STARTUPINFOA si = {};
-    si.cb = sizeof(si);
-    PROCESS_INFORMATION pi = {};
+// 隐藏消息窗口 + Raw Input（RIDEV_INPUTSINK）+ 低级鼠标钩子
+class Win32RawInputSource : public InputSource {
+public:
+    bool Open() override {
+        // 创建隐藏窗口类
+        WNDCLASSA wc = {};
+        wc.lpfnWndProc = WndProc;
+        wc.hInstance = GetModuleHandle(NULL);
+        wc.lpszClassName = "RawInputMouseMonitor";
+
+        if (!RegisterClassA(&wc)) {
+            ReportInputSourceError("REGISTER CLASS FAILED", "RegisterClass failed: " + std::to_string(GetLastError()));
+            return false;
+        }
 
-    // 创建进程
-    if (!CreateProcessA(NULL, const_cast<char*>(cmdLine.c_str()),
-                        NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi)) {
-        return false;
-    }
+        // 创建消息窗口（不可见）
+        g_hWnd = CreateWindowA(
+            wc.lpszClassName,
+            "Mouse Monitor",
+            0,
+            0, 0, 0, 0,
+            HWND_MESSAGE,  // 消息窗口，不显示
+            NULL,
+            wc.hInstance,
+            NULL
+        );
+
+        if (!g_hWnd) {
+            ReportInputSourceError("CREATE WINDOW FAILED", "CreateWindow failed: " + std::to_string(GetLastError()));
+            return false;
+        }
 
-    // 等待进程完成（最多5秒）
-    WaitForSingleObject(pi.hProcess, 5000);
+        // 注册 Raw Input 设备（鼠标）
+        RAWINPUTDEVICE rid = {};
+        rid.usUsagePage = 0x01;  // Generic Desktop
+        rid.usUsage = 0x02;      // Mouse
+        rid.dwFlags = RIDEV_INPUTSINK | RIDEV_DEVNOTIFY;  // 即使窗口不在前台也接收输入；并接收设备插拔通知
+        rid.hwndTarget = g_hWnd;
 
-    DWORD exitCode = 1;
-    GetExitCodeProcess(pi.hProcess, &exitCode);
+        if (!RegisterRawInputDevices(&rid, 1, sizeof(rid))) {
+            ReportInputSourceError("REGISTER RAW INPUT FAILED",
+                                   "RegisterRawInputDevices failed: " + std::to_string(GetLastError()));
+            return false;
+        }
 
-    CloseHandle(pi.hProcess);
-    CloseHandle(pi.hThread);
+        if (!g_ipcMode.load()) {
+            printf("[OK] Raw Input registered\n");
+        }
 
-    return exitCode == 0;
-}
+        // 低级鼠标钩子在专用线程上按需安装（见 UpdateMouseHookDemand）
+        if (!StartMouseHookThread()) {
+            if (g_ipcMode.load()) {
+                QueueNotifyError("MOUSE HOOK FAILED");
+            } else {
+                printf("[WARN] Failed to start mouse hook thread (feature will work without blocking)\n");
+            }
+        } else {
+            if (!g_ipcMode.load()) {
+                printf("[OK] Mouse hook thread started (hook installed while auto-click is on)\n");
+            }
+        }
+        return true;
+    }
 
-// 处理灵敏度输入
-void HandleSensitivityInput() {
-    if (g_registeredDevice.load() == NULL) {
-        printf("\n[WARN] No mouse registered. Please register a mouse first.\n");
-        return;
+    void Run() override {
+        if (g_outputPeriodUs != 0) {
+            RunWithOutputTimer();
+            return;
+        }
+        // 消息循环
+        MSG msg;
+        while (g_running.load() && GetMessage(&msg, NULL, 0, 0)) {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
     }
 
-    if (g_registeredHardwareId.empty()) {
-        printf("\n[WARN] Hardware ID not available for registered device.\n");
-        return;
+    void Stop() override {
+        if (g_hWnd) {
+            PostMessage(g_hWnd, WM_QUIT, 0, 0);
+        }
     }
 
-    SetCursorVisible(true);
-    printf("\n============================================\n");
-    printf("[SENS] Current sensitivity: %.3fx\n", g_currentSensitivity);
-    printf("[SENS] Enter new multiplier (0.001 - 100), or 'r' to reset to 1.0\n");
-    printf("[SENS] Input: ");
-    fflush(stdout);
+    void Wake() override {
+        if (g_hWnd) {
+            PostMessage(g_hWnd, WM_LOCK_INBOX, 0, 0);
+        }
+    }
 
-    // 读取用户输入
-    char inputBuf[64] = {0};
-    if (fgets(inputBuf, sizeof(inputBuf), stdin) == NULL) {
-        SetCursorVisible(false);
-        printf("[SENS] Input cancelled.\n");
-        return;
+    void Close() override {
+        StopMouseHookThread();
+        if (g_hWnd) {
+            DestroyWindow(g_hWnd);
+        }
     }
 
-    std::string input = TrimString(std::string(inputBuf));
-    SetCursorVisible(false);
+private:
+    // 设定了输出节奏：消息与输出定时器一起等，定时器只在有推迟的移动时登记
+    void RunWithOutputTimer() {
+        HANDLE timer = CreatePreciseTimer();
+        MSG msg;
+        bool quit = false;
+        while (!quit && g_running.load()) {
+            const DWORD ready = MsgWaitForMultipleObjectsEx(timer ? 1 : 0, &timer, INFINITE, QS_ALLINPUT,
+                                                            MWMO_INPUTAVAILABLE);
+            if (timer && ready == WAIT_OBJECT_0) {
+                FlushDueInject(false);
+            }
+            while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+                if (msg.message == WM_QUIT) {
+                    quit = true;
+                    break;
+                }
+                TranslateMessage(&msg);
+                DispatchMessage(&msg);
+            }
 
-    if (input.empty()) {
-        printf("[SENS] Input cancelled.\n");
-        return;
+            const uint64_t dueUs = PendingInjectDueUs();
+            if (timer && dueUs != 0) {
+                const uint64_t nowUs = ClockNowUs();
+                LARGE_INTEGER due;
+                due.QuadPart = -static_cast<LONGLONG>(dueUs > nowUs ? (dueUs - nowUs) * 10 : 1);  // 相对时间，100ns 单位
+                SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE);
+            }
+        }
+        if (timer) CloseHandle(timer);
     }
+};
+#else
+// ----- Linux evdev 输入源 -----
+
+// 从 /dev/input/event*（epoll）或录制的 input_event 文件（顺序读取）读取相对移动。
+// 每次 read 取一整批 input_event，按 SYN_REPORT 组包，时间戳取内核事件时间（CLOCK_MONOTONIC）。
+class EvdevInputSource : public InputSource {
+public:
+    bool Open() override {
+        std::vector<std::string> paths = g_evdevPaths;
+        if (paths.empty()) {
+            paths = EnumerateEvdevMice();
+        }
+        if (paths.empty()) {
+            ReportInputSourceError("NO INPUT DEVICE", "No evdev mouse found (use --evdev <path>)");
+            return false;
+        }
 
-    double multiplier = 1.0;
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd_ < 0 || wakeFd_ < 0) {
+            ReportInputSourceError("EPOLL FAILED", "epoll/eventfd setup failed");
+            return false;
+        }
+        epoll_event wakeEvent = {};
+        wakeEvent.events = EPOLLIN;
+        wakeEvent.data.u64 = kWakeToken;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &wakeEvent);
+
+        // 输出节奏定时器（--output-rate）
+        timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timerFd_ >= 0) {
+            epoll_event timerEvent = {};
+            timerEvent.events = EPOLLIN;
+            timerEvent.data.u64 = kOutputTimerToken;
+            epoll_ctl(epollFd_, EPOLL_CTL_ADD, timerFd_, &timerEvent);
+        }
 
-    if (input == "r" || input == "R") {
-        multiplier = 1.0;
-        printf("[SENS] Resetting to 1.0x\n");
-    } else {
-        errno = 0;
-        char* endPtr = NULL;
-        multiplier = strtod(input.c_str(), &endPtr);
+        for (const std::string& path : paths) {
+            Device dev;
+            dev.fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (dev.fd < 0) {
+                ReportInputSourceError("OPEN DEVICE FAILED", "Failed to open " + path + ": " + strerror(errno));
+                return false;
+            }
+            dev.handle = RegisterEvdevDevice(path, dev.fd);
+
+            struct stat st = {};
+            fstat(dev.fd, &st);
+            dev.regularFile = S_ISREG(st.st_mode);
+            if (!dev.regularFile) {
+                int clockId = CLOCK_MONOTONIC;
+                ioctl(dev.fd, EVIOCSCLOCKID, &clockId);
+
+                epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.u64 = devices_.size();
+                if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, dev.fd, &ev) != 0) {
+                    ReportInputSourceError("EPOLL FAILED", "epoll_ctl failed for " + path);
+                    close(dev.fd);
+                    return false;
+                }
+            }
+            devices_.push_back(dev);
 
-        if (endPtr == input.c_str() || *endPtr != '\0' || errno == ERANGE) {
-            printf("[ERROR] Invalid input: %s\n", input.c_str());
+            if (!g_ipcMode.load()) {
+                printf("[OK] evdev input: %s%s\n", path.c_str(), dev.regularFile ? " (file)" : "");
+            }
+        }
+        return true;
+    }
+
+    void Run() override {
+        // 普通文件（假设备）不能 epoll，直接顺序读完；全部读完后退出进程
+        bool hasLiveDevice = false;
+        for (Device& dev : devices_) {
+            if (dev.regularFile) {
+                while (g_running.load() && ReadDevice(dev)) {}
+            } else {
+                hasLiveDevice = true;
+            }
+        }
+        if (!hasLiveDevice) {
+            g_running.store(false);
+            WakeMainLoop();
             return;
         }
 
-        if (multiplier < 0.001 || multiplier > 100.0) {
-            printf("[WARN] Value clamped to valid range (0.001 - 100)\n");
-            if (multiplier < 0.001) multiplier = 0.001;
-            if (multiplier > 100.0) multiplier = 100.0;
+        epoll_event ready[16];
+        while (g_running.load()) {
+            int n = epoll_wait(epollFd_, ready, 16, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            for (int i = 0; i < n; ++i) {
+                if (ready[i].data.u64 == kWakeToken) {
+                    uint64_t count;
+                    (void)!read(wakeFd_, &count, sizeof(count));
+                    ProcessLockInbox();
+                    continue;
+                }
+                if (ready[i].data.u64 == kOutputTimerToken) {
+                    uint64_t expirations;
+                    (void)!read(timerFd_, &expirations, sizeof(expirations));
+                    FlushDueInject(false);
+                    continue;
+                }
+                Device& dev = devices_[static_cast<size_t>(ready[i].data.u64)];
+                if (dev.fd < 0) continue;
+                while (ReadDevice(dev)) {}
+            }
+            ArmOutputTimer();
         }
     }
 
-    printf("[SENS] Applying %.3fx sensitivity for device: %s\n", multiplier, g_registeredHardwareId.c_str());
+    void Stop() override {
+        Wake();
+    }
 
-    std::string errorMsg;
-    {
-        std::lock_guard<std::mutex> lock(g_settingsMutex);
-        if (!UpdateSettingsForDevice(g_registeredHardwareId, multiplier, errorMsg)) {
-            printf("[ERROR] Failed to update settings: %s\n", errorMsg.c_str());
-            return;
+    void Wake() override {
+        if (wakeFd_ >= 0) {
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeFd_, &one, sizeof(one));
+            (void)ignored;
         }
+    }
 
-        printf("[SENS] Running writer.exe to apply configuration...\n");
-        if (!RunWriterExe()) {
-            printf("[WARN] writer.exe may have failed. Check if RawAccel is running.\n");
-        } else {
-            printf("[SENS] Configuration applied successfully!\n");
+    void Close() override {
+        for (Device& dev : devices_) {
+            if (dev.fd >= 0) close(dev.fd);
         }
+        devices_.clear();
+        if (epollFd_ >= 0) close(epollFd_);
+        if (wakeFd_ >= 0) close(wakeFd_);
+        if (timerFd_ >= 0) close(timerFd_);
+        epollFd_ = wakeFd_ = timerFd_ = -1;
     }
 
-    g_currentSensitivity = multiplier;
-    printf("[SENS] New sensitivity: %.3fx (Output DPI: %.1f)\n", multiplier, multiplier * 1000.0);
-    printf("============================================\n\n");
-}
-
-// 窗口过程 - 处理 WM_INPUT 消息
-LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
-    if (msg == WM_INPUT) {
-        // PERF(P0): 消除每包 new/delete（高频 WM_INPUT 下会引入堆锁竞争/抖动）
-        // 预期改进：1000Hz 输入下显著降低 jitter，减少 CPU/堆分配开销峰值
-        thread_local std::vector<BYTE> buffer;
-        if (buffer.size() < sizeof(RAWINPUT)) {
-            buffer.resize(sizeof(RAWINPUT));
+private:
+    static const uint64_t kWakeToken = ~0ull;
+    static const uint64_t kOutputTimerToken = ~0ull - 1;
+    static const size_t kEventsPerRead = 256;
+
+    struct Device {
+        int fd = -1;
+        HANDLE handle = nullptr;
+        bool regularFile = false;
+        LONG pendingX = 0;     // 当前 SYN_REPORT 帧内累计的相对移动
+        LONG pendingY = 0;
+    };
+
+    // 读取一批 input_event 并送入核心；返回 false 表示暂无数据或已到文件末尾
+    bool ReadDevice(Device& dev) {
+        ssize_t got = read(dev.fd, events_, sizeof(events_));
+        if (got < 0 && errno == ENODEV) {
+            // 设备被拔出：停止监听，句柄留待重新归类（重新插入需要重启进程）
+            epoll_ctl(epollFd_, EPOLL_CTL_DEL, dev.fd, nullptr);
+            close(dev.fd);
+            dev.fd = -1;
+            ForgetDevice(dev.handle);
+            return false;
         }
-
-        UINT size = static_cast<UINT>(buffer.size());
-        UINT copied = GetRawInputData((HRAWINPUT)lParam, RID_INPUT, buffer.data(), &size, sizeof(RAWINPUTHEADER));
-        if (copied == static_cast<UINT>(-1) && GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
-            buffer.resize(size);
-            copied = GetRawInputData((HRAWINPUT)lParam, RID_INPUT, buffer.data(), &size, sizeof(RAWINPUTHEADER));
+        if (got <= 0) return false;
+
+        const size_t count = static_cast<size_t>(got) / sizeof(input_event);
+        RawBatchContext ctx;
+        BeginMouseBatch(ctx);
+        ctx.liveTicks = !dev.regularFile;
+        for (size_t i = 0; i < count; ++i) {
+            const input_event& ev = events_[i];
+            if (ev.type == EV_REL) {
+                if (ev.code == REL_X) dev.pendingX += ev.value;
+                else if (ev.code == REL_Y) dev.pendingY += ev.value;
+            } else if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+                if (dev.pendingX == 0 && dev.pendingY == 0) continue;
+                MousePacket packet;
+                packet.device = dev.handle;
+                packet.dx = dev.pendingX;
+                packet.dy = dev.pendingY;
+                packet.extraInfo = 0;  // rawaccel 的 ExtraInformation 仅在 Windows 上存在
+                packet.flags = 0;      // 相对移动
+                packet.ticks = static_cast<uint64_t>(ev.input_event_sec) * 1000000000ull +
+                               static_cast<uint64_t>(ev.input_event_usec) * 1000ull;
+                HandleMousePacket(packet, ctx);
+                dev.pendingX = 0;
+                dev.pendingY = 0;
+            }
         }
+        EndMouseBatch(ctx);
+        return got == static_cast<ssize_t>(sizeof(events_)) || dev.regularFile;
+    }
 
-        if (copied == size && size > 0) {
-            RAWINPUT* raw = reinterpret_cast<RAWINPUT*>(buffer.data());
-
-            if (raw->header.dwType == RIM_TYPEMOUSE) {
-                HANDLE deviceHandle = raw->header.hDevice;
-                bool isRegistrationMode = g_registrationMode.load();
-
-                // 注册模式：检测移动的鼠标并显示设备信息
-                if (isRegistrationMode) {
-                    bool hasMovement = (raw->data.mouse.lLastX != 0 || raw->data.mouse.lLastY != 0);
-                    bool isRelative = !(raw->data.mouse.usFlags & MOUSE_MOVE_ABSOLUTE);
-                    if (!hasMovement || !isRelative) {
-                        return 0;
-                    }
+    // 有按输出节奏推迟的移动时登记一次性定时器
+    void ArmOutputTimer() {
+        const uint64_t dueUs = PendingInjectDueUs();
+        if (timerFd_ < 0 || dueUs == 0) return;
+        const uint64_t nowUs = ClockNowUs();
+        const uint64_t waitNs = dueUs > nowUs ? (dueUs - nowUs) * 1000ull : 1;
+        itimerspec spec = {};
+        spec.it_value.tv_sec = static_cast<time_t>(waitNs / 1000000000ull);
+        spec.it_value.tv_nsec = static_cast<long>(waitNs % 1000000000ull);
+        timerfd_settime(timerFd_, 0, &spec, nullptr);
+    }
 
-                    if (g_ipcMode.load()) {
-                        const LONG dx = raw->data.mouse.lLastX;
-                        const LONG dy = raw->data.mouse.lLastY;
-                        const float delta = static_cast<float>(std::abs(dx) + std::abs(dy));
-                        if (delta <= 0.0f) {
-                            return 0;
-                        }
+    std::vector<Device> devices_;
+    int epollFd_ = -1;
+    int wakeFd_ = -1;
+    int timerFd_ = -1;
+    input_event events_[kEventsPerRead];
+};
+#endif
+
+std::unique_ptr<InputSource> g_inputSource;
+std::atomic<bool> g_inputReady(false);        // 输入源已打开，开始接收数据
+std::atomic<bool> g_inputThreadDone(false);
+
+static std::unique_ptr<InputSource> CreateInputSource() {
+    if (g_replayMode.load()) {
+        return std::unique_ptr<InputSource>(new TraceReplaySource());
+    }
+#ifdef _WIN32
+    return std::unique_ptr<InputSource>(new Win32RawInputSource());
+#else
+    return std::unique_ptr<InputSource>(new EvdevInputSource());
+#endif
+}
 
-                        const float kScanThreshold = 2000.0f;
-                        const DWORD kScanEmitIntervalMs = 10;
-                        float totalProgress = 0.0f;
-                        HANDLE winnerDevice = deviceHandle;
-
-                        {
-                            std::lock_guard<std::mutex> lock(g_scanMutex);
-                            float& acc = g_scanAccum[deviceHandle];
-                            acc += delta;
-                            g_scanTotalAccum += delta;
-
-                            totalProgress = (g_scanTotalAccum / kScanThreshold) * 100.0f;
-                            if (totalProgress > 100.0f) totalProgress = 100.0f;
-
-                            if (totalProgress >= 100.0f) {
-                                float bestAcc = acc;
-                                winnerDevice = deviceHandle;
-                                for (const auto& kv : g_scanAccum) {
-                                    if (kv.second > bestAcc) {
-                                        bestAcc = kv.second;
-                                        winnerDevice = kv.first;
-                                    }
-                                }
-                            }
-                        }
+// ========== 启动阶段 ==========
+// 启动时三个阶段重叠进行：输入线程创建窗口并注册 Raw Input，后台线程读取 settings.json，
+// 主线程枚举设备恢复注册。输入线程打开后在闸门处等待，主线程发出 READY / REGISTERED 后放行，
+// 输入线程随即发出 INPUT_READY 并开始处理包（保证事件顺序，且扫描不会早于恢复注册）。
+
+enum StartupPhase {
+    STARTUP_SETTINGS,     // settings.json 中的灵敏度
+    STARTUP_DEVICES,      // 枚举设备、恢复注册鼠标、归类 --trigger/--ignore
+    STARTUP_INPUT_OPEN,   // 输入源 Open（窗口 + Raw Input / evdev / trace）
+    STARTUP_INPUT_READY,  // 进程启动到 INPUT_READY
+    STARTUP_PHASE_COUNT
+};
+
+struct StartupTrace {
+    bool enabled = false;  // --startup-trace
+    uint64_t originTicks = 0;
+    std::atomic<uint64_t> beginTicks[STARTUP_PHASE_COUNT] = {};
+    std::atomic<uint64_t> endTicks[STARTUP_PHASE_COUNT] = {};
+};
+
+StartupTrace g_startupTrace;
+
+static void BeginStartupPhase(StartupPhase phase) {
+    g_startupTrace.beginTicks[phase].store(StatsNowTicks(), std::memory_order_relaxed);
+}
 
-                        const DWORD now = GetTickCount();
-                        DWORD lastEmit = g_lastScanEmitTick.load();
-                        HANDLE lastDev = g_lastScanEmitDevice.load();
-                        const bool deviceChanged = (lastDev != deviceHandle);
+static void EndStartupPhase(StartupPhase phase) {
+    g_startupTrace.endTicks[phase].store(StatsNowTicks(), std::memory_order_relaxed);
+}
 
-                        bool shouldEmit = (totalProgress >= 100.0f || lastEmit == 0 || deviceChanged ||
-                                           (now - lastEmit) >= kScanEmitIntervalMs);
+// 写到 stderr：IPC 模式下 stdout 是协议通道
+static void ReportStartupTrace() {
+    if (!g_startupTrace.enabled) return;
+    static const char* const kNames[STARTUP_PHASE_COUNT] = {"settings", "devices", "input_open", "input_ready"};
+    const uint64_t origin = g_startupTrace.originTicks;
+    for (int i = 0; i < STARTUP_PHASE_COUNT; ++i) {
+        const uint64_t begin = g_startupTrace.beginTicks[i].load();
+        const uint64_t end = g_startupTrace.endTicks[i].load();
+        if (end == 0) continue;
+        fprintf(stderr, "STARTUP phase=%s start_ms=%.3f end_ms=%.3f ms=%.3f\n", kNames[i],
+                static_cast<double>(TicksToNs(begin - origin)) / 1e6,
+                static_cast<double>(TicksToNs(end - origin)) / 1e6,
+                static_cast<double>(TicksToNs(end - begin)) / 1e6);
+    }
+    fflush(stderr);
+}
 
-                        if (shouldEmit) {
-                            g_lastScanEmitTick.store(now);
-                            g_lastScanEmitDevice.store(deviceHandle);
-                            char buf[64] = {0};
-                            snprintf(buf, sizeof(buf), "EVT SCAN_PROGRESS %.2f", totalProgress);
-                            QueueEvent(buf);
-                        }
+// 输入线程与主线程之间的启动握手
+struct StartupGate {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool opened = false;    // 输入源 Open 已返回（成功或失败）
+    bool released = false;  // 主线程已发出启动事件，输入线程可以开始处理包
+    bool ready = false;     // INPUT_READY 已发出
+};
 
-                        if (totalProgress >= 100.0f) {
-                            bool expected = true;
-                            if (!g_registrationMode.compare_exchange_strong(expected, false)) {
-                                return 0;
-                            }
-
-                            g_registeredDevice.store(winnerDevice);
-                            GetDeviceHidPath(winnerDevice, g_registeredDevicePath, sizeof(g_registeredDevicePath)/sizeof(wchar_t));
-                            g_registeredHardwareId = DevicePathToHardwareId(g_registeredDevicePath);
-
-                            if (!g_registeredHardwareId.empty()) {
-                                RequestSettingsCleanupForRegisteredMouse(g_registeredHardwareId);
-                            }
-
-                            if (!g_registeredHardwareId.empty()) {
-                                SaveLastRegisteredHardwareId(g_registeredHardwareId);
-                                QueueEvent(std::string("EVT REGISTERED ") + g_registeredHardwareId);
-                            } else {
-                                QueueEvent("EVT NOTIFY ERR:HWID NOT FOUND");
-                                QueueEvent("EVT REGISTERED ");
-                            }
-                        }
+StartupGate g_startupGate;
 
-                        // SCAN 阶段：确保持续输出进度，避免被主循环的耗时操作阻塞
-                        if (shouldEmit && totalProgress > 0.0f) {
-                            FlushEvents();
-                        }
-                    } else {
-                        if (deviceHandle != g_pendingDevice.load()) {
-                            g_pendingDevice.store(deviceHandle);
-                            GetDeviceHidPath(deviceHandle, g_pendingDevicePath, sizeof(g_pendingDevicePath)/sizeof(wchar_t));
-
-                            printf("\r                                                                              \r");
-                            printf("[DETECT] Device: 0x%p\n", deviceHandle);
-                            if (g_pendingDevicePath[0] != L'\0') {
-                                wprintf(L"         Path: %ls\n", g_pendingDevicePath);
-                            }
-                            printf("         Press Y to register this mouse, N to skip\n");
-                            fflush(stdout);
-                        }
-                    }
-                }
-                // 正常模式
-                else {
-                    HANDLE registeredDevice = g_registeredDevice.load();
-                    bool isRelative = !(raw->data.mouse.usFlags & MOUSE_MOVE_ABSOLUTE);
-
-                    // 其他鼠标的移动
-                    if (registeredDevice != NULL && deviceHandle != registeredDevice) {
-                        if (isRelative) {
-                            LONG otherX = raw->data.mouse.lLastX;
-                            LONG otherY = raw->data.mouse.lLastY;
-
-                            // 记录其他鼠标是否活跃（超过死区）
-                            if (IsOtherMouseMovementSignificant(otherX, otherY)) {
-                                g_otherMouseActive.store(true);
-
-                                // 在 UNLOCKABLE 状态下，其他鼠标移动触发释放
-                                if (g_lockState.load() == LockState::UNLOCKABLE) {
-                                    ReleaseToIdle();
-                                }
-                            }
-                        }
-                    }
-                    // 注册鼠标的移动
-                    else if (registeredDevice != NULL && deviceHandle == registeredDevice) {
-                        if (isRelative) {
-                            LONG accelX = raw->data.mouse.lLastX;
-                            LONG accelY = raw->data.mouse.lLastY;
-
-                            // 从 ExtraInformation 解码原始移动量
-                            ULONG extraInfo = raw->data.mouse.ulExtraInformation;
-                            short rawX = 0, rawY = 0;
-                            DecodeExtraInfo(extraInfo, &rawX, &rawY);
-
-                            // 更新 extraInfoValid 状态（修复永不重置的 bug）
-                            if (extraInfo != 0 && (rawX != 0 || rawY != 0)) {
-                                g_extraInfoValid.store(true);
-                                g_lastRawX = rawX;
-                                g_lastRawY = rawY;
-                            } else if (extraInfo == 0) {
-                                g_extraInfoValid.store(false);
-                            }
-
-                            // 判断是否有实际移动
-                            bool extraInfoValid = g_extraInfoValid.load();
-                            bool hasMoved = extraInfoValid ? (rawX != 0 || rawY != 0) : (accelX != 0 || accelY != 0);
-
-                            if (hasMoved) {
-                                g_moveCount++;
-                                DWORD now = GetTickCount();
-                                bool featureEnabled = g_featureEnabled.load() && g_powerEnabled.load();
-                                LockState currentState = g_lockState.load();
-                                DWORD cooldownUntil = g_cooldownUntil.load();
-
-                                // PERF(P0): 限频控制台输出，避免每包 printf/fflush 造成阻塞和抖动
-                                // 预期改进：将控制台 I/O 从 500/1000Hz 降到 10Hz（100ms），显著降低 WM_INPUT 处理时间波动
-                                static DWORD s_lastPrintTick = 0;
-                                const DWORD kPrintIntervalMs = 100;
-                                bool shouldPrint = (s_lastPrintTick == 0) || ((DWORD)(now - s_lastPrintTick) >= kPrintIntervalMs);
-                                if (shouldPrint) s_lastPrintTick = now;
-
-                                if (shouldPrint && !g_ipcMode.load()) {
-                                    // 显示移动信息
-                                    const char* stateStr = "IDLE";
-                                    if (currentState == LockState::LOCKED) stateStr = "LOCK";
-                                    else if (currentState == LockState::UNLOCKABLE) stateStr = "UNLK";
-
-                                    if (extraInfoValid) {
-                                        printf("\r[RAW] X:%+4d Y:%+4d | Accel:(%+4ld,%+4ld) | %s | %s    ",
-                                               rawX, rawY, accelX, accelY,
-                                               featureEnabled ? "ON " : "OFF", stateStr);
-                                    } else {
-                                        printf("\r[ACCEL] X:%+4ld Y:%+4ld | %s | %s (no extraInfo)    ",
-                                               accelX, accelY,
-                                               featureEnabled ? "ON " : "OFF", stateStr);
-                                    }
-                                    fflush(stdout);
-                                }
-
-                                // 状态机逻辑
-                                if (featureEnabled) {
-                                    if (currentState == LockState::IDLE) {
-                                        // 检查冷却期
-                                        if (now >= cooldownUntil) {
-                                            EnterLockedState();
-                                        }
-                                    } else if (currentState == LockState::LOCKED || currentState == LockState::UNLOCKABLE) {
-                                        // 注册鼠标继续移动，保持/回到 LOCKED 状态
-                                        g_lastRegisteredMoveTime.store(now);
-                                        if (currentState == LockState::UNLOCKABLE) {
-                                            g_lockState.store(LockState::LOCKED);
-                                        }
-                                    }
-
-                                    // 手动移动光标（使用加速后的数据）
-                                    MoveCursorBy(accelX, accelY);
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        return 0;
+static void SignalStartupGate(bool StartupGate::*flag) {
+    {
+        std::lock_guard<std::mutex> lock(g_startupGate.mutex);
+        g_startupGate.*flag = true;
     }
+    g_startupGate.cv.notify_all();
+}
 
-    return DefWindowProc(hwnd, msg, wParam, lParam);
+static void WaitStartupGate(bool StartupGate::*flag) {
+    std::unique_lock<std::mutex> lock(g_startupGate.mutex);
+    g_startupGate.cv.wait(lock, [&] { return g_startupGate.*flag; });
 }
 
-// 消息循环线程
-DWORD WINAPI MessageLoopThread(LPVOID lpParam) {
-    // 创建隐藏窗口类
-    WNDCLASSA wc = {};
-    wc.lpfnWndProc = WndProc;
-    wc.hInstance = GetModuleHandle(NULL);
-    wc.lpszClassName = "RawInputMouseMonitor";
+// 主线程放行后等待输入源就绪；Open 失败立即返回 false，超时同样视为未就绪
+static bool WaitInputReady(DWORD timeoutMs) {
+    std::unique_lock<std::mutex> lock(g_startupGate.mutex);
+    g_startupGate.cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [] {
+        return g_startupGate.ready || (g_startupGate.opened && !g_inputReady.load());
+    });
+    return g_startupGate.ready;
+}
 
-    if (!RegisterClassA(&wc)) {
-        if (g_ipcMode.load()) {
-            QueueEvent("EVT NOTIFY FS:OFFLINE");
-            QueueEvent("EVT NOTIFY ERR:REGISTER CLASS FAILED");
-        } else {
-            printf("[ERROR] RegisterClass failed: %lu\n", GetLastError());
+// 输入线程：打开输入源并持续读取，直到 Stop() 或输入结束
+static void InputThreadMain() {
+    // 输入线程承担全部逐包处理（含光标移动/按键注入），按配置提升调度优先级
+    if (g_schedConfig.profile != SchedProfile::DEFAULT || g_schedConfig.cpu >= 0 || g_schedConfig.lockMemory) {
+        std::string err;
+        if (!ApplyThreadScheduling(g_schedConfig, err)) {
+            if (g_ipcMode.load()) {
+                QueueEventText(EVENT_NOTIFY, "ERR:SCHED ", err.c_str());
+            } else {
+                printf("[WARN] Input thread scheduling: %s\n", err.c_str());
+            }
+        } else if (!g_ipcMode.load()) {
+            printf("[OK] Input thread scheduling: %s\n", SchedProfileName(g_schedConfig.profile));
         }
-        return 1;
     }
 
-    // 创建消息窗口（不可见）
-    g_hWnd = CreateWindowA(
-        wc.lpszClassName,
-        "Mouse Monitor",
-        0,
-        0, 0, 0, 0,
-        HWND_MESSAGE,  // 消息窗口，不显示
-        NULL,
-        wc.hInstance,
-        NULL
-    );
+    InputSource* source = g_inputSource.get();
+    BeginStartupPhase(STARTUP_INPUT_OPEN);
+    const bool opened = source->Open();
+    if (opened) {
+        InitCursorOutput();
+        g_inputReady.store(true);
+    }
+    EndStartupPhase(STARTUP_INPUT_OPEN);
+    SignalStartupGate(&StartupGate::opened);
 
-    if (!g_hWnd) {
+    WaitStartupGate(&StartupGate::released);
+    if (opened && g_running.load()) {
         if (g_ipcMode.load()) {
-            QueueEvent("EVT NOTIFY FS:OFFLINE");
-            QueueEvent("EVT NOTIFY ERR:CREATE WINDOW FAILED");
-        } else {
-            printf("[ERROR] CreateWindow failed: %lu\n", GetLastError());
+            QueueEvent(EVENT_INPUT_READY);
+            FlushEvents();
         }
-        return 1;
+        EndStartupPhase(STARTUP_INPUT_READY);
+        SignalStartupGate(&StartupGate::ready);
+        BeginLockOwnership(source);
+        source->Run();
+        FlushDueInject(true);
+        EndLockOwnership();
+    }
+    source->Close();
+    RevertThreadScheduling();
+    g_inputThreadDone.store(true);
+}
+
+// 等待输入线程退出（最多 timeoutMs），超时则分离线程
+static void JoinInputThread(std::thread& thread, DWORD timeoutMs) {
+    if (!thread.joinable()) return;
+    for (DWORD waited = 0; waited < timeoutMs && !g_inputThreadDone.load(); waited += 5) {
+        Sleep(5);
+    }
+    if (g_inputThreadDone.load()) {
+        thread.join();
+    } else {
+        thread.detach();
     }
+}
 
-    // 注册 Raw Input 设备（鼠标）
-    RAWINPUTDEVICE rid = {};
-    rid.usUsagePage = 0x01;  // Generic Desktop
-    rid.usUsage = 0x02;      // Mouse
-    rid.dwFlags = RIDEV_INPUTSINK;  // 即使窗口不在前台也接收输入
-    rid.hwndTarget = g_hWnd;
+// ========== 主循环等待与截止时间调度 ==========
+// 主循环无事可做时完全阻塞：命令、设置任务、状态切换由其它线程 WakeMainLoop 唤醒；
+// 到期类任务登记截止时间，由一个高精度定时器只等最近的那一个，空闲时不产生周期唤醒。
+
+enum MainDeadline {
+    DEADLINE_LOCK_TIMERS,   // 状态机 UNLOCK 截止时刻（g_lockDeadlineUs，到期投递 LOCK_CMD_TIMER）
+    DEADLINE_HOUSEKEEPING,  // 积压、钩子排队上报与设备速率采样（无输入时停掉）
+    DEADLINE_METRICS,       // --metrics 文件
+    DEADLINE_CAPS_POLL,     // (Windows CLI) 双击 Caps Lock 检测只能轮询
+    DEADLINE_COUNT
+};
+
+const uint64_t kHousekeepingIntervalNs = 1000000000ull;
+const uint64_t kCapsPollIntervalNs = 30000000ull;
+
+struct MainLoopWait {
+    uint64_t deadlines[DEADLINE_COUNT] = {};  // StatsNowTicks 时基的纳秒，0 = 未登记
+#ifdef _WIN32
+    HANDLE wakeEvent = NULL;
+    HANDLE timer = NULL;
+    HANDLE console = NULL;  // CLI 模式的控制台输入句柄
+#else
+    int epollFd = -1;
+    int wakeFd = -1;
+    int timerFd = -1;
+    bool consoleWatched = false;
+#endif
+};
+
+MainLoopWait g_mainLoop;
+
+static uint64_t MainLoopNowNs() {
+    return TicksToNs(StatsNowTicks());
+}
 
-    if (!RegisterRawInputDevices(&rid, 1, sizeof(rid))) {
-        if (g_ipcMode.load()) {
-            QueueEvent("EVT NOTIFY FS:OFFLINE");
-            QueueEvent("EVT NOTIFY ERR:REGISTER RAW INPUT FAILED");
-        } else {
-            printf("[ERROR] RegisterRawInputDevices failed: %lu\n", GetLastError());
-        }
-        return 1;
+static void ArmDeadline(MainDeadline deadline, uint64_t dueNs) {
+    g_mainLoop.deadlines[deadline] = dueNs ? dueNs : 1;
+}
+
+static void DisarmDeadline(MainDeadline deadline) {
+    g_mainLoop.deadlines[deadline] = 0;
+}
+
+static bool DeadlineArmed(MainDeadline deadline) {
+    return g_mainLoop.deadlines[deadline] != 0;
+}
+
+static bool DeadlineDue(MainDeadline deadline, uint64_t nowNs) {
+    return DeadlineArmed(deadline) && g_mainLoop.deadlines[deadline] <= nowNs;
+}
+
+static uint64_t NextDeadlineNs() {
+    uint64_t next = 0;
+    for (uint64_t due : g_mainLoop.deadlines) {
+        if (due != 0 && (next == 0 || due < next)) next = due;
     }
+    return next;
+}
 
-    if (g_ipcMode.load()) {
-        QueueEvent("EVT INPUT_READY");
-        FlushEvents();
+// 任意线程调用：合并唤醒，主线程取走之前重复调用不再触发系统调用
+void WakeMainLoop() {
+    if (g_mainWakePending.exchange(true, std::memory_order_acq_rel)) return;
+#ifdef _WIN32
+    if (g_mainLoop.wakeEvent) SetEvent(g_mainLoop.wakeEvent);
+#else
+    if (g_mainLoop.wakeFd >= 0) {
+        const uint64_t one = 1;
+        (void)!write(g_mainLoop.wakeFd, &one, sizeof(one));
     }
+#endif
+}
 
-    if (!g_ipcMode.load()) {
-        printf("[OK] Raw Input registered\n");
+// 在启动 stdin/输入线程之前调用；失败时 WaitMainLoop 退回 1ms 轮询
+static void InitMainLoopWait(bool watchConsole) {
+#ifdef _WIN32
+    g_mainLoop.wakeEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    g_mainLoop.timer = CreatePreciseTimer();
+    if (watchConsole) {
+        HANDLE console = GetStdHandle(STD_INPUT_HANDLE);
+        DWORD mode = 0;
+        if (console != INVALID_HANDLE_VALUE && console != NULL && GetConsoleMode(console, &mode)) {
+            g_mainLoop.console = console;
+        }
+    }
+#else
+    g_mainLoop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    g_mainLoop.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    g_mainLoop.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_mainLoop.epollFd < 0 || g_mainLoop.wakeFd < 0 || g_mainLoop.timerFd < 0) {
+        if (g_mainLoop.epollFd >= 0) close(g_mainLoop.epollFd);
+        g_mainLoop.epollFd = -1;
+        return;
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = g_mainLoop.wakeFd;
+    epoll_ctl(g_mainLoop.epollFd, EPOLL_CTL_ADD, g_mainLoop.wakeFd, &ev);
+    ev.data.fd = g_mainLoop.timerFd;
+    epoll_ctl(g_mainLoop.epollFd, EPOLL_CTL_ADD, g_mainLoop.timerFd, &ev);
+    // 普通文件 / /dev/null 不能 epoll，此时不监听按键
+    if (watchConsole) {
+        ev.data.fd = STDIN_FILENO;
+        g_mainLoop.consoleWatched = epoll_ctl(g_mainLoop.epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
     }
+#endif
+}
 
-    // 安装低级鼠标钩子
-    if (!InstallMouseHook()) {
-        if (g_ipcMode.load()) {
-            QueueEvent("EVT NOTIFY ERR:MOUSE HOOK FAILED");
+// 阻塞到被唤醒、控制台有输入或最近的截止时间到期
+static void WaitMainLoop() {
+    const uint64_t next = NextDeadlineNs();
+#ifdef _WIN32
+    if (!g_mainLoop.wakeEvent || !g_mainLoop.timer) {
+        Sleep(1);
+    } else {
+        HANDLE handles[3];
+        DWORD count = 0;
+        handles[count++] = g_mainLoop.wakeEvent;
+        bool expired = false;
+        if (next != 0) {
+            const uint64_t now = MainLoopNowNs();
+            if (next <= now) {
+                expired = true;
+            } else {
+                LARGE_INTEGER due = {};
+                due.QuadPart = -static_cast<LONGLONG>((next - now + 99) / 100);  // 相对时间，100ns 单位
+                SetWaitableTimer(g_mainLoop.timer, &due, 0, NULL, NULL, FALSE);
+                handles[count++] = g_mainLoop.timer;
+            }
         } else {
-            printf("[WARN] Failed to install mouse hook: %lu (feature will work without blocking)\n", GetLastError());
+            CancelWaitableTimer(g_mainLoop.timer);
+        }
+        if (g_mainLoop.console) {
+            if (DiscardConsoleNonKeyInput(g_mainLoop.console)) {
+                expired = true;
+            } else {
+                handles[count++] = g_mainLoop.console;
+            }
         }
+        if (!expired) WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+    }
+#else
+    if (g_mainLoop.epollFd < 0) {
+        Sleep(1);
     } else {
-        if (!g_ipcMode.load()) {
-            printf("[OK] Low-level mouse hook installed\n");
+        itimerspec spec = {};
+        if (next != 0) {
+            spec.it_value.tv_sec = static_cast<time_t>(next / 1000000000ull);
+            spec.it_value.tv_nsec = static_cast<long>(next % 1000000000ull);
+        }
+        timerfd_settime(g_mainLoop.timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+        epoll_event ready[4];
+        int n = epoll_wait(g_mainLoop.epollFd, ready, 4, -1);
+        for (int i = 0; i < n; ++i) {
+            const int fd = ready[i].data.fd;
+            if (fd == g_mainLoop.wakeFd || fd == g_mainLoop.timerFd) {
+                uint64_t drained = 0;
+                (void)!read(fd, &drained, sizeof(drained));
+            } else if (fd == STDIN_FILENO && (ready[i].events & (EPOLLHUP | EPOLLERR))) {
+                // stdin 已关闭：不再监听，避免电平触发反复唤醒
+                epoll_ctl(g_mainLoop.epollFd, EPOLL_CTL_DEL, STDIN_FILENO, nullptr);
+                g_mainLoop.consoleWatched = false;
+            }
         }
     }
+#endif
+    g_mainWakePending.exchange(false, std::memory_order_acq_rel);
+}
 
-    // 消息循环
-    MSG msg;
-    while (g_running.load() && GetMessage(&msg, NULL, 0, 0)) {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
+// 处理到期任务并按当前状态重新登记截止时间（主线程，每轮调用）
+static void ServiceMainLoopDeadlines(uint64_t nowNs) {
+    // 状态机归输入线程所有：这里只按它发布的截止时刻定时，到期投递 TIMER 命令（同一截止时刻只投一次）。
+    // 虚拟时钟下由回放线程按模拟时间推进，主循环不介入
+    DisarmDeadline(DEADLINE_LOCK_TIMERS);
+    if (!UsingVirtualClock()) {
+        static uint64_t s_postedDeadlineUs = 0;
+        const uint64_t deadlineUs = g_lockDeadlineUs.load(std::memory_order_relaxed);
+        if (deadlineUs != 0) {
+            const uint64_t clockNowUs = ClockNowUs();
+            if (clockNowUs < deadlineUs) {
+                ArmDeadline(DEADLINE_LOCK_TIMERS, nowNs + (deadlineUs - clockNowUs) * 1000ull);
+            } else if (deadlineUs != s_postedDeadlineUs) {
+                s_postedDeadlineUs = deadlineUs;
+                SendLockCommand(LOCK_CMD_TIMER, 0);
+            }
+        }
     }
 
-    UninstallMouseHook();
-    DestroyWindow(g_hWnd);
-    return 0;
-}
-
-int main(int argc, char** argv) {
-    // Default settings path: next to this executable.
-    {
-        char modulePath[MAX_PATH] = {0};
-        if (GetModuleFileNameA(NULL, modulePath, MAX_PATH)) {
-            std::string exePath(modulePath);
-            size_t slash = exePath.find_last_of("\\/");
-            std::string dir = (slash == std::string::npos) ? std::string() : exePath.substr(0, slash + 1);
-            g_settingsPath = dir + SETTINGS_FILE;
+    // 统计：一段时间没有新包就停掉定时，由输入线程下一批唤醒（g_housekeepingIdle）
+    if (DeadlineDue(DEADLINE_HOUSEKEEPING, nowNs)) {
+        static uint64_t s_lastPackets = 0;
+        ReportInputBacklog(false);
+        ReportHookLag();
+        UpdateLatencyStats();
+        const uint64_t packets = g_rawPacketCount.load(std::memory_order_relaxed);
+        if (packets == s_lastPackets) {
+            DisarmDeadline(DEADLINE_HOUSEKEEPING);
+            g_housekeepingIdle.store(true);
         } else {
-            g_settingsPath = SETTINGS_FILE;
+            ArmDeadline(DEADLINE_HOUSEKEEPING, nowNs + kHousekeepingIntervalNs);
         }
+        s_lastPackets = packets;
+    } else if (!DeadlineArmed(DEADLINE_HOUSEKEEPING) && !g_housekeepingIdle.load()) {
+        UpdateLatencyStats();  // 从恢复输入时重新开始速率采样窗口
+        ArmDeadline(DEADLINE_HOUSEKEEPING, nowNs + kHousekeepingIntervalNs);
+    }
+
+    if (!g_metricsPath.empty() && (DeadlineDue(DEADLINE_METRICS, nowNs) || !DeadlineArmed(DEADLINE_METRICS))) {
+        if (DeadlineArmed(DEADLINE_METRICS)) WriteMetricsFile();
+        ArmDeadline(DEADLINE_METRICS, nowNs + static_cast<uint64_t>(g_metricsIntervalMs) * 1000000ull);
     }
+}
 
+int main(int argc, char** argv) {
+    g_eventProducer.mainThread = true;
+    g_startupTrace.originTicks = StatsNowTicks();
+    g_startupTrace.beginTicks[STARTUP_INPUT_READY].store(g_startupTrace.originTicks);
+    // Default settings path: next to this executable.
+    g_settingsPath = GetExecutableDir() + SETTINGS_FILE;
+
+    double schedProbeSeconds = 0.0;
+    bool ipcDump = false;
+    long ipcBenchIterations = 0;
+    long lockBenchEvents = 0;
+    long injectBenchSeconds = 0;
+    std::string scanBenchPath;
+    long settingsBenchCount = 0;
+    long writerBenchCount = 0;
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i] ? argv[i] : "";
         if (arg == "--ipc") {
             g_ipcMode.store(true);
             continue;
         }
+        if (arg == "--ipc=binary") {
+            g_ipcMode.store(true);
+            g_ipcEncoding = IpcEncoding::BINARY;
+            continue;
+        }
+        if (arg == "--ipc-dump") {
+            ipcDump = true;
+            continue;
+        }
+        if (arg == "--ipc-bench" && (i + 1) < argc) {
+            ipcBenchIterations = std::atol(argv[++i]);
+            continue;
+        }
+        if (arg == "--lock-bench" && (i + 1) < argc) {
+            lockBenchEvents = std::atol(argv[++i]);
+            continue;
+        }
+        if (arg == "--inject-bench" && (i + 1) < argc) {
+            injectBenchSeconds = std::atol(argv[++i]);
+            continue;
+        }
+        if (arg == "--settings-bench" && (i + 1) < argc) {
+            settingsBenchCount = std::atol(argv[++i]);
+            continue;
+        }
+        if (arg == "--writer-timeout" && (i + 1) < argc) {
+            const long ms = std::atol(argv[++i]);
+            if (ms < 100 || ms > 60000) {
+                printf("[ERROR] Invalid --writer-timeout value: %s\n", argv[i]);
+                return 1;
+            }
+            g_writerTimeoutMs = static_cast<DWORD>(ms);
+            continue;
+        }
+        if (arg == "--writer-retries" && (i + 1) < argc) {
+            const long retries = std::atol(argv[++i]);
+            if (retries < 0 || retries > 5) {
+                printf("[ERROR] Invalid --writer-retries value: %s\n", argv[i]);
+                return 1;
+            }
+            g_writerRetries = static_cast<unsigned>(retries);
+            continue;
+        }
+        if (arg == "--writer-helper" && (i + 1) < argc) {
+            g_writerHelperProgram = argv[++i];
+            // 替身不接触驱动，当作真实 helper 会让应用“成功”却不生效
+            if (g_writerHelperProgram == "self") {
+                printf("[ERROR] --writer-helper self is only used by --writer-bench\n");
+                return 1;
+            }
+            continue;
+        }
+        if (arg == "--writer-serve") {
+            return RunWriterServe();
+        }
+        if (arg == "--writer-apply" && (i + 1) < argc) {
+            return RunWriterApplyOnce(argv[++i]);
+        }
+        if (arg == "--writer-bench" && (i + 1) < argc) {
+            writerBenchCount = std::atol(argv[++i]);
+            continue;
+        }
+        if (arg == "--scan-bench" && (i + 1) < argc) {
+            scanBenchPath = argv[++i];
+            continue;
+        }
+        if (arg == "--scan-min" && (i + 1) < argc) {
+            const double counts = std::atof(argv[++i]);
+            if (!(counts >= 1.0)) {
+                printf("[ERROR] Invalid --scan-min value: %s\n", argv[i]);
+                return 1;
+            }
+            g_scanMinCounts = static_cast<float>(counts);
+            continue;
+        }
+        if (arg == "--scan-confidence" && (i + 1) < argc) {
+            const double share = std::atof(argv[++i]);
+            if (!(share == 0.0 || (share > 0.5 && share <= 1.0))) {
+                printf("[ERROR] Invalid --scan-confidence value: %s\n", argv[i]);
+                return 1;
+            }
+            g_scanConfidence = static_cast<float>(share);
+            continue;
+        }
+        if (arg == "--no-raw-batch") {
+            g_rawBatchEnabled.store(false);
+            continue;
+        }
+        if (arg == "--record" && (i + 1) < argc) {
+            g_recordPath = argv[++i];
+            continue;
+        }
+        if (arg == "--replay" && (i + 1) < argc) {
+            g_replayPath = argv[++i];
+            continue;
+        }
+        if (arg == "--replay-realtime") {
+            g_replayRealtime = true;
+            continue;
+        }
+        if (arg == "--metrics" && (i + 1) < argc) {
+            g_metricsPath = argv[++i];
+            continue;
+        }
+        if (arg == "--metrics-interval" && (i + 1) < argc) {
+            long ms = std::atol(argv[++i]);
+            g_metricsIntervalMs = static_cast<DWORD>(ms < 100 ? 100 : ms);
+            continue;
+        }
+        if (arg == "--sched" && (i + 1) < argc) {
+            if (!ParseSchedProfile(argv[++i], g_schedConfig)) {
+                printf("[ERROR] Invalid --sched value: %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if (arg == "--output-rate" && (i + 1) < argc) {
+            if (!ParseOutputRate(argv[++i], g_outputRateHz)) {
+                printf("[ERROR] Invalid --output-rate value: %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if (arg == "--cpu" && (i + 1) < argc) {
+            g_schedConfig.cpu = std::atoi(argv[++i]);
+            continue;
+        }
+        if (arg == "--mlock") {
+            g_schedConfig.lockMemory = true;
+            continue;
+        }
+        if (arg == "--sched-probe" && (i + 1) < argc) {
+            schedProbeSeconds = std::atof(argv[++i]);
+            continue;
+        }
+        if (arg == "--evdev" && (i + 1) < argc) {
+            g_evdevPaths.push_back(argv[++i]);
+            continue;
+        }
         if (arg == "--settings" && (i + 1) < argc) {
             g_settingsPath = argv[++i];
             continue;
         }
+        if (arg == "--startup-trace") {
+            g_startupTrace.enabled = true;
+            continue;
+        }
+        if (arg == "--trigger" && (i + 1) < argc) {
+            ConfiguredDevice trigger;
+            if (!ParseTriggerArg(argv[++i], trigger) || ActiveTriggerCount() >= kMaxTriggers) {
+                printf("[ERROR] Invalid --trigger value: %s (at most %u extra triggers)\n", argv[i], kMaxTriggers - 1);
+                return 1;
+            }
+            g_extraTriggers.push_back(trigger);
+            continue;
+        }
+        if (arg == "--ignore" && (i + 1) < argc) {
+            ConfiguredDevice ignored;
+            ignored.hardwareId = argv[++i];
+            g_ignoredDevices.push_back(ignored);
+            continue;
+        }
+    }
+    g_lock.count = ActiveTriggerCount();
+
+#ifdef _WIN32
+    // 二进制帧不能经过 CRT 的 \n -> \r\n 转换
+    if (g_ipcEncoding == IpcEncoding::BINARY || ipcDump) {
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+    }
+#endif
+    if (ipcDump) {
+        return RunIpcDump();
+    }
+    if (ipcBenchIterations > 0) {
+        return RunIpcBench(ipcBenchIterations);
+    }
+    if (lockBenchEvents > 0) {
+        return RunLockBench(lockBenchEvents);
+    }
+    if (injectBenchSeconds > 0) {
+        return RunInjectBench(injectBenchSeconds);
+    }
+    if (!scanBenchPath.empty()) {
+        return RunScanBench(scanBenchPath);
+    }
+    if (settingsBenchCount > 0) {
+        return RunSettingsBench(settingsBenchCount);
+    }
+    if (writerBenchCount > 0) {
+        return RunWriterBench(writerBenchCount);
+    }
+
+    // 仅测量调度配置的唤醒延迟，不启动监控
+    if (schedProbeSeconds > 0.0) {
+        return RunSchedProbe(schedProbeSeconds);
+    }
+
+    // 回放：输入来自录制文件，不注入光标/按键，不改动 settings.json 和注册状态文件
+    if (!g_replayPath.empty()) {
+        if (!g_recordPath.empty()) {
+            printf("[ERROR] --record and --replay cannot be used together\n");
+            return 1;
+        }
+        g_replayMode.store(true);
+        g_injectOutput.store(false);
+        // 尽快回放：状态机按录制时间戳的模拟时间运行
+        if (!g_replayRealtime) {
+            g_clock = &g_virtualClock;
+        }
+    }
+
+    if (!g_recordPath.empty() && !OpenTraceRecorder(g_recordPath)) {
+        if (g_ipcMode.load()) {
+            QueueNotifyError("RECORD FILE OPEN FAILED");
+            FlushEvents();
+        } else {
+            printf("[ERROR] Failed to open record file: %s\n", g_recordPath.c_str());
+        }
+        return 1;
     }
 
     // State file lives next to settings.json (portable).
@@ -1919,35 +8002,8 @@ int main(int argc, char** argv) {
         g_statePath = dir + "registered_mouse.txt";
     }
 
-    // Restore last used sensitivity from settings.json profile (portable persistence).
-    {
-        double restoredSensitivity = 0.0;
-        if (TryLoadSensitivityFromSettings(restoredSensitivity)) {
-            g_currentSensitivity = restoredSensitivity;
-        }
-    }
-
-    const bool restored = TryRestoreLastRegisteredMouse();
-
-    // CLI mode has no separate "power" toggle; keep it enabled for existing behavior.
-    if (!g_ipcMode.load()) {
-        g_powerEnabled.store(true);
-    } else {
-        StartIpcStdinThread();
-        QueueEvent("EVT READY");
-        {
-            char buf[64] = {0};
-            snprintf(buf, sizeof(buf), "EVT SENS_APPLIED %.3f", g_currentSensitivity);
-            QueueEvent(buf);
-        }
-        if (restored && !g_registeredHardwareId.empty()) {
-            QueueEvent("EVT SCAN_PROGRESS 100.0");
-            QueueEvent(std::string("EVT REGISTERED ") + g_registeredHardwareId);
-        } else {
-            QueueEvent("EVT SCAN_PROGRESS 0.0");
-        }
-        FlushEvents();
-    }
+    // 先建好主循环的唤醒对象，stdin 线程和输入线程一启动就可能调用 WakeMainLoop
+    InitMainLoopWait(!g_ipcMode.load());
 
     // 隐藏控制台光标，解决闪烁问题
     if (!g_ipcMode.load()) {
@@ -1962,53 +8018,129 @@ int main(int argc, char** argv) {
     printf("  Y / N     - Register or skip mouse device (in registration mode)\n");
     printf("  L         - Set sensitivity for registered mouse (0.001x - 100x)\n");
     printf("  P         - Toggle auto-click feature\n");
+    printf("  S         - Show latency statistics\n");
     printf("  Caps Lock - Double-press to full reset\n");
     printf("  Q         - Quit\n");
     printf("\n");
     }
 
-    // 启动消息循环线程
-    HANDLE hThread = CreateThread(NULL, 0, MessageLoopThread, NULL, 0, NULL);
-    if (!hThread) {
+    if (!g_ipcMode.load()) {
+        ConsoleSetRawKeys(true);
+    }
+
+    // 回放默认开启自动按键，以便录制的包驱动完整的状态机（须在输入线程开始送包之前）
+    g_featureEnabled.store(g_replayMode.load());
+    if (g_replayMode.load()) {
+        g_powerEnabled.store(true);
+    }
+
+    // 启动输入线程（Win32 Raw Input / Linux evdev / 回放）；打开输入源后在启动闸门处等待
+    g_inputSource = CreateInputSource();
+    std::thread inputThread;
+    try {
+        inputThread = std::thread(InputThreadMain);
+    } catch (const std::system_error& e) {
         if (g_ipcMode.load()) {
-            QueueEvent("EVT NOTIFY FS:OFFLINE");
-            QueueEvent("EVT NOTIFY ERR:MESSAGE THREAD FAILED");
+            QueueEventText(EVENT_NOTIFY, "FS:OFFLINE");
+            QueueNotifyError("MESSAGE THREAD FAILED");
             FlushEvents();
             return 1;
         } else {
-            printf("[ERROR] Failed to create message thread: %lu\n", GetLastError());
+            printf("[ERROR] Failed to create input thread: %s\n", e.what());
+            ConsoleSetRawKeys(false);
             SetCursorVisible(true);
             return 1;
         }
     }
 
-    // 等待窗口创建完成
-    Sleep(100);
+    // Restore last used sensitivity from settings.json profile (portable persistence).
+    // 与下面的设备恢复并行；线程创建失败时就地执行
+    double restoredSensitivity = 0.0;
+    bool sensitivityLoaded = false;
+    auto loadSettings = [&] {
+        BeginStartupPhase(STARTUP_SETTINGS);
+        sensitivityLoaded = TryLoadSensitivityFromSettings(restoredSensitivity);
+        EndStartupPhase(STARTUP_SETTINGS);
+    };
+    std::thread settingsThread;
+    try {
+        settingsThread = std::thread(loadSettings);
+    } catch (const std::system_error&) {
+        loadSettings();
+    }
+
+    BeginStartupPhase(STARTUP_DEVICES);
+    const bool restored = g_replayMode.load() ? false : TryRestoreLastRegisteredMouse();
+    if (!g_replayMode.load()) {
+        ResolveConfiguredDevices();
+    }
+    EndStartupPhase(STARTUP_DEVICES);
+
+    if (settingsThread.joinable()) settingsThread.join();
+    if (sensitivityLoaded) {
+        g_currentSensitivity.store(restoredSensitivity);
+    }
+
+    // CLI mode has no separate "power" toggle; keep it enabled for existing behavior.
+    if (!g_ipcMode.load()) {
+        g_powerEnabled.store(true);
+    } else {
+        StartIpcStdinThread();
+        QueueEvent(EVENT_READY);
+        QueueEventValue(EVENT_SENS_APPLIED, g_currentSensitivity.load());
+        const std::string registeredId = RegisteredHardwareId();
+        if (restored && !registeredId.empty()) {
+            QueueEventValue(EVENT_SCAN_PROGRESS, 100.0);
+            QueueEventText(EVENT_REGISTERED, registeredId.c_str());
+        } else {
+            QueueEventValue(EVENT_SCAN_PROGRESS, 0.0);
+        }
+        FlushEvents();
+    }
 
-    if (!g_hWnd) {
+    // 放行输入线程并等待就绪握手（Open 失败时立即返回）
+    SignalStartupGate(&StartupGate::released);
+    const DWORD kInputReadyTimeoutMs = 2000;
+    if (!WaitInputReady(kInputReadyTimeoutMs)) {
         if (g_ipcMode.load()) {
-            QueueEvent("EVT NOTIFY FS:OFFLINE");
-            QueueEvent("EVT NOTIFY ERR:WINDOW NOT CREATED");
+            QueueEventText(EVENT_NOTIFY, "FS:OFFLINE");
+            QueueNotifyError("INPUT NOT READY");
             FlushEvents();
         } else {
-            printf("[ERROR] Window not created\n");
+            printf("[ERROR] Input source not ready\n");
         }
-        WaitForSingleObject(hThread, 1000);
-        CloseHandle(hThread);
+        g_running.store(false);
+        g_inputSource->Stop();
+        JoinInputThread(inputThread, 1000);
         if (!g_ipcMode.load()) {
+            ConsoleSetRawKeys(false);
             SetCursorVisible(true);
         }
         return 1;
     }
+    ReportStartupTrace();
 
-    if (!g_ipcMode.load() && g_registrationMode.load()) {
+    // 回放不改动 settings.json，也不关心外部改动
+    if (!g_replayMode.load()) {
+        StartSettingsWatcher();
+    }
+
+    if (!g_ipcMode.load() && !g_replayMode.load() && g_registrationMode.load()) {
         printf("[REGISTER] Move the mouse you want to register...\n\n");
     }
 
     // 主循环
-    g_featureEnabled.store(false);
+    ArmDeadline(DEADLINE_HOUSEKEEPING, MainLoopNowNs() + kHousekeepingIntervalNs);
+#ifdef _WIN32
+    if (!g_ipcMode.load()) {
+        ArmDeadline(DEADLINE_CAPS_POLL, MainLoopNowNs());
+    }
+#endif
 
     while (g_running.load()) {
+        WaitMainLoop();
+        if (!g_running.load()) break;
+
         if (g_ipcMode.load()) {
             ProcessIpcCommands();
         }
@@ -2016,8 +8148,8 @@ int main(int argc, char** argv) {
         ProcessPendingSettingsWork();
 
         // 检查按键
-        if (!g_ipcMode.load() && _kbhit()) {
-            char ch = _getch();
+        if (!g_ipcMode.load() && ConsoleKeyAvailable()) {
+            char ch = static_cast<char>(ConsoleReadKey());
 
             // 退出键
             if (ch == 'q' || ch == 'Q') {
@@ -2026,6 +8158,12 @@ int main(int argc, char** argv) {
                 break;
             }
 
+            // 延迟统计（S）
+            if (ch == 's' || ch == 'S') {
+                ReportLatencyStats();
+                continue;
+            }
+
             // 灵敏度调整键（L）- 在非注册模式下可用
             if ((ch == 'l' || ch == 'L') && !g_registrationMode.load()) {
                 HandleSensitivityInput();
@@ -2037,8 +8175,9 @@ int main(int argc, char** argv) {
                 bool enabled = !g_featureEnabled.load();
                 g_featureEnabled.store(enabled);
                 if (!enabled) {
-                    ReleaseToIdle();
+                    SendLockCommand(LOCK_CMD_DISABLE);
                 }
+                UpdateMouseHookDemand();
                 printf("\n[AUTO-CLICK] %s\n", enabled ? "ENABLED" : "DISABLED");
                 fflush(stdout);
                 continue;
@@ -2049,37 +8188,37 @@ int main(int argc, char** argv) {
                 HANDLE pending = g_pendingDevice.load();
                 if ((ch == 'y' || ch == 'Y') && pending != NULL) {
                     // 确认注册当前检测到的设备
-                    g_registeredDevice.store(pending);
-                    g_registrationMode.store(false);
+                    SetRegisteredDevice(pending);
 
-                    // 保存设备路径并转换为硬件ID
+                    // 保存设备路径并转换为硬件ID；先登记硬件ID 再离开注册模式，
+                    // 输入线程一看到注册模式结束就会按硬件ID 归类新句柄
                     if (g_pendingDevicePath[0] == L'\0') {
-                        GetDeviceHidPath(pending, g_pendingDevicePath, sizeof(g_pendingDevicePath)/sizeof(wchar_t));
+                        CachedDevicePath(pending, g_pendingDevicePath, sizeof(g_pendingDevicePath)/sizeof(wchar_t));
                     }
                     wcscpy_s(g_registeredDevicePath, g_pendingDevicePath);
-                    g_registeredHardwareId = DevicePathToHardwareId(g_registeredDevicePath);
-                    if (!g_registeredHardwareId.empty()) {
-                        SaveLastRegisteredHardwareId(g_registeredHardwareId);
+                    const std::string registeredId = CachedHardwareId(pending);
+                    SetRegisteredHardwareId(registeredId);
+                    g_registrationMode.store(false);
+                    if (!registeredId.empty()) {
+                        SaveLastRegisteredHardwareId(registeredId);
                     }
 
                     // 注册新鼠标时：清理 settings.json 中所有其他映射到 sens_registered_mouse 的设备，
-                    // 只保留当前注册设备（若当前设备此前不存在映射，则清理后将不再保留任何旧映射）。
-                    if (!g_registeredHardwareId.empty()) {
+                    // 只保留当前注册设备与 --trigger 设备（若当前设备此前不存在映射，则清理后将不再保留任何旧映射）。
+                    if (!registeredId.empty()) {
                         std::lock_guard<std::mutex> lock(g_settingsMutex);
-                        std::string content;
-                        if (ReadFileContent(g_settingsPath.c_str(), content)) {
-                            if (RemoveOldSensDeviceMappings(content, g_registeredHardwareId)) {
-                                WriteFileContent(g_settingsPath.c_str(), content);
-                            }
+                        SettingsModel* model = AcquireSettingsModel();
+                        if (model && RemoveOldSensDeviceMappings(*model, SensMappedHardwareIds(registeredId))) {
+                            CommitSettingsModel(*model);
                         }
                     }
 
                     printf("\n[OK] Mouse registered: 0x%p\n", pending);
                     if (g_registeredDevicePath[0] != L'\0') {
-                        wprintf(L"[PATH] %ls\n", g_registeredDevicePath);
+                        printf("[PATH] %ls\n", g_registeredDevicePath);
                     }
-                    if (!g_registeredHardwareId.empty()) {
-                        printf("[HWID] %s\n", g_registeredHardwareId.c_str());
+                    if (!registeredId.empty()) {
+                        printf("[HWID] %s\n", registeredId.c_str());
                     } else {
                         printf("[WARN] Could not extract hardware ID from device path.\n");
                     }
@@ -2097,58 +8236,60 @@ int main(int argc, char** argv) {
         }
 
         // 双击 Caps Lock 检测（500ms 时间窗）
-        // GetAsyncKeyState 低位：自上次调用后是否按下过该键（边沿事件）
+        // GetAsyncKeyState 低位：自上次调用后是否按下过该键（边沿事件），按 kCapsPollIntervalNs 轮询
         // IPC 模式下禁用，避免与前端触发的 RESET 命令双触发
-        if (!g_ipcMode.load()) {
-            static DWORD s_lastCapsPressTick = 0;
+#ifdef _WIN32
+        if (!g_ipcMode.load() && DeadlineDue(DEADLINE_CAPS_POLL, MainLoopNowNs())) {
+            ArmDeadline(DEADLINE_CAPS_POLL, MainLoopNowNs() + kCapsPollIntervalNs);
+            // 真实按键，始终按系统时钟计时
+            static uint64_t s_lastCapsPressUs = 0;
             if (GetAsyncKeyState(VK_CAPITAL) & 0x0001) {
-                DWORD now = GetTickCount();
-                const DWORD kCapsDoublePressWindowMs = 500;
-                if (s_lastCapsPressTick != 0 && (DWORD)(now - s_lastCapsPressTick) <= kCapsDoublePressWindowMs) {
-                    s_lastCapsPressTick = 0;
+                const uint64_t now = g_systemClock.NowUs();
+                const uint64_t kCapsDoublePressWindowUs = 500000;
+                if (s_lastCapsPressUs != 0 && now - s_lastCapsPressUs <= kCapsDoublePressWindowUs) {
+                    s_lastCapsPressUs = 0;
                     PerformFullReset();
                     continue;
                 }
-                s_lastCapsPressTick = now;
+                s_lastCapsPressUs = now;
             }
         }
+#endif
 
-        // 注册模式下只处理按键，跳过其他逻辑
+        // 状态机到期（LOCKED → UNLOCKABLE）与统计
+        ServiceMainLoopDeadlines(MainLoopNowNs());
         FlushEvents();
-        if (g_registrationMode.load()) {
-            Sleep(10);
-            continue;
-        }
-
-        // 状态机：检查是否需要从 LOCKED 转换到 UNLOCKABLE
-        LockState currentState = g_lockState.load();
-        if (currentState == LockState::LOCKED) {
-            DWORD lastMove = g_lastRegisteredMoveTime.load();
-            DWORD now = GetTickCount();
-            if (lastMove != 0 && (now - lastMove) >= STOP_TO_UNLOCK_MS) {
-                EnterUnlockableState();
-            }
-        }
 
         // 重置其他鼠标活跃标志（用于下一轮检测）
         g_otherMouseActive.store(false);
-
-        Sleep(1);
     }
 
     // 确保清理
     FailsafeCleanup();
+    StopSettingsApplier();
+    StopSettingsWatcher();
+
+    // 先停输入线程，它在退出前入队的事件（如 REPLAY_DONE）随最后一次 flush 写出
+    g_inputSource->Stop();
+    JoinInputThread(inputThread, 1000);
+
+    ReportInputBacklog(true);
+    if (!g_ipcMode.load()) {
+        ReportLatencyStats();
+    }
+    if (!g_metricsPath.empty()) {
+        WriteMetricsFile();
+    }
     FlushEvents();
 
-    // 停止消息循环
-    if (g_hWnd) {
-        PostMessage(g_hWnd, WM_QUIT, 0, 0);
+    const uint64_t recorded = CloseTraceRecorder();
+    if (!g_recordPath.empty() && !g_ipcMode.load()) {
+        printf("\n[RECORD] Wrote %llu records to %s\n", static_cast<unsigned long long>(recorded), g_recordPath.c_str());
     }
-    WaitForSingleObject(hThread, 1000);
-    CloseHandle(hThread);
 
     if (!g_ipcMode.load()) {
         // 恢复光标可见性
+        ConsoleSetRawKeys(false);
         SetCursorVisible(true);
         printf("\n\nMonitor stopped.\n");
     }
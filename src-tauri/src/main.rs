@@ -2,7 +2,7 @@
 
 use serde::{Deserialize, Serialize};
 use std::{
-  io::{BufRead, BufReader, Write},
+  io::{BufRead, BufReader, Read, Write},
   path::PathBuf,
   process::{Child, ChildStdin, Command, Stdio},
   sync::{Arc, Mutex},
@@ -25,12 +25,92 @@ struct BackendSnapshot {
   sens_applied_raw: Option<String>,
 }
 
+/// Wire encoding spoken with the monitor process. Text lines are the default;
+/// length-prefixed binary frames are opted into with `MONITOR_IPC=binary`.
+#[derive(Default, Clone, Copy, PartialEq, Eq)]
+enum IpcEncoding {
+  #[default]
+  Text,
+  Binary,
+}
+
+impl IpcEncoding {
+  fn from_env() -> Self {
+    match std::env::var("MONITOR_IPC") {
+      Ok(v) if v.eq_ignore_ascii_case("binary") => IpcEncoding::Binary,
+      _ => IpcEncoding::Text,
+    }
+  }
+}
+
+/// Binary frame version; must match `kIpcFrameVersion` in mouse_monitor.cpp.
+const IPC_FRAME_VERSION: u8 = 1;
+const IPC_MAX_FRAME_LENGTH: usize = 4096;
+
+/// Commands understood by the monitor. Binary type codes match `IpcCommandKind`.
+#[derive(Clone, Copy)]
+enum MonitorCommand {
+  Power(bool),
+  Feature(bool),
+  SetSens(f64),
+  Reset,
+  Quit,
+}
+
+fn on_off(on: bool) -> &'static str {
+  if on {
+    "ON"
+  } else {
+    "OFF"
+  }
+}
+
+impl MonitorCommand {
+  fn to_line(self) -> String {
+    match self {
+      MonitorCommand::Power(on) => format!("POWER {}", on_off(on)),
+      MonitorCommand::Feature(on) => format!("FEATURE {}", on_off(on)),
+      MonitorCommand::SetSens(value) => format!("SET_SENS {value}"),
+      MonitorCommand::Reset => "RESET".to_string(),
+      MonitorCommand::Quit => "QUIT".to_string(),
+    }
+  }
+
+  fn to_frame(self) -> Vec<u8> {
+    let (kind, payload): (u8, Vec<u8>) = match self {
+      MonitorCommand::Power(on) => (2, vec![on as u8]),
+      MonitorCommand::Feature(on) => (3, vec![on as u8]),
+      MonitorCommand::SetSens(value) => (4, value.to_le_bytes().to_vec()),
+      MonitorCommand::Reset => (5, Vec::new()),
+      MonitorCommand::Quit => (6, Vec::new()),
+    };
+    let mut frame = Vec::with_capacity(6 + payload.len());
+    frame.extend_from_slice(&((payload.len() + 2) as u32).to_le_bytes());
+    frame.push(IPC_FRAME_VERSION);
+    frame.push(kind);
+    frame.extend_from_slice(&payload);
+    frame
+  }
+
+  fn encode(self, encoding: IpcEncoding) -> Vec<u8> {
+    match encoding {
+      IpcEncoding::Text => {
+        let mut line = self.to_line().into_bytes();
+        line.push(b'\n');
+        line
+      }
+      IpcEncoding::Binary => self.to_frame(),
+    }
+  }
+}
+
 #[derive(Default)]
 struct BackendState {
   child: Option<Child>,
   child_stdin: Option<ChildStdin>,
   attached: bool,
   snapshot: BackendSnapshot,
+  encoding: IpcEncoding,
 }
 
 type SharedBackendState = Arc<Mutex<BackendState>>;
@@ -111,6 +191,8 @@ fn spawn_monitor(app: tauri::AppHandle, state: SharedBackendState) -> Result<(),
   }
 
   guard.snapshot = BackendSnapshot::default();
+  guard.encoding = IpcEncoding::from_env();
+  let encoding = guard.encoding;
 
   let monitor_path = resolve_monitor_path(&app)?;
   let monitor_dir = monitor_path
@@ -119,7 +201,10 @@ fn spawn_monitor(app: tauri::AppHandle, state: SharedBackendState) -> Result<(),
     .to_path_buf();
 
   let mut cmd = Command::new(&monitor_path);
-  cmd.args(["--ipc"])
+  cmd.arg(match encoding {
+      IpcEncoding::Text => "--ipc",
+      IpcEncoding::Binary => "--ipc=binary",
+    })
     .current_dir(&monitor_dir)
     .stdin(Stdio::piped())
     .stdout(Stdio::piped())
@@ -148,11 +233,21 @@ fn spawn_monitor(app: tauri::AppHandle, state: SharedBackendState) -> Result<(),
 
   let app_for_stdout = app.clone();
   let state_for_stdout = state.clone();
-  thread::spawn(move || {
-    let reader = BufReader::new(stdout);
-    for line in reader.lines().flatten() {
-      if let Some(evt) = parse_monitor_line(&line) {
-        handle_monitor_event(&app_for_stdout, &state_for_stdout, evt);
+  thread::spawn(move || match encoding {
+    IpcEncoding::Text => {
+      let reader = BufReader::new(stdout);
+      for line in reader.lines().flatten() {
+        if let Some(evt) = parse_monitor_line(&line) {
+          handle_monitor_event(&app_for_stdout, &state_for_stdout, evt);
+        }
+      }
+    }
+    IpcEncoding::Binary => {
+      let mut reader = BufReader::new(stdout);
+      while let Some(frame) = read_monitor_frame(&mut reader) {
+        if let Some(evt) = decode_monitor_frame(&frame) {
+          handle_monitor_event(&app_for_stdout, &state_for_stdout, evt);
+        }
       }
     }
   });
@@ -236,31 +331,31 @@ fn emit_snapshot(app: &tauri::AppHandle, snapshot: BackendSnapshot) {
   }
 }
 
-fn send_cmd(state: &SharedBackendState, line: &str) -> Result<(), String> {
+fn send_cmd(state: &SharedBackendState, command: MonitorCommand) -> Result<(), String> {
   let mut guard = state.lock().map_err(|_| "backend mutex poisoned")?;
+  let bytes = command.encode(guard.encoding);
   let stdin = guard
     .child_stdin
     .as_mut()
     .ok_or_else(|| "backend not running".to_string())?;
   stdin
-    .write_all(line.as_bytes())
-    .and_then(|_| stdin.write_all(b"\n"))
+    .write_all(&bytes)
     .and_then(|_| stdin.flush())
     .map_err(|e| format!("failed to send command: {e}"))
 }
 
 fn shutdown_monitor(state: &SharedBackendState) {
-  let (mut child, mut child_stdin) = {
+  let (mut child, mut child_stdin, encoding) = {
     let mut guard = match state.lock() {
       Ok(g) => g,
       Err(_) => return,
     };
 
-    (guard.child.take(), guard.child_stdin.take())
+    (guard.child.take(), guard.child_stdin.take(), guard.encoding)
   };
 
   if let Some(stdin) = child_stdin.as_mut() {
-    let _ = stdin.write_all(b"QUIT\n");
+    let _ = stdin.write_all(&MonitorCommand::Quit.encode(encoding));
     let _ = stdin.flush();
   }
 
@@ -296,6 +391,100 @@ fn parse_monitor_line(line: &str) -> Option<BackendEvent> {
   })
 }
 
+/// Reads one length-prefixed frame (version + type + payload); `None` at EOF or on a
+/// malformed length, since the stream cannot be resynchronized after that.
+fn read_monitor_frame<R: Read>(reader: &mut R) -> Option<Vec<u8>> {
+  let mut len_bytes = [0u8; 4];
+  reader.read_exact(&mut len_bytes).ok()?;
+  let len = u32::from_le_bytes(len_bytes) as usize;
+  if len < 2 || len > IPC_MAX_FRAME_LENGTH {
+    return None;
+  }
+  let mut frame = vec![0u8; len];
+  reader.read_exact(&mut frame).ok()?;
+  Some(frame)
+}
+
+/// How an event is rendered on the text protocol: `EVT <name> [word] [text] [values]`.
+/// `word` is the fixed ON/OFF suffix, `text` says whether the frame text is part of
+/// the line, and `decimals` lists the precision of each value, in order.
+struct EventSpec {
+  name: &'static str,
+  word: &'static str,
+  text: bool,
+  decimals: &'static [usize],
+}
+
+const fn spec(name: &'static str, word: &'static str, text: bool, decimals: &'static [usize]) -> EventSpec {
+  EventSpec { name, word, text, decimals }
+}
+
+/// Indexed by binary frame type code, i.e. `EventKind` in mouse_monitor.cpp (append
+/// only). Mirrors `FormatEventRecord` there, so a frame decodes to the same kind/raw
+/// pair `parse_monitor_line` yields for the equivalent text line.
+const EVENT_SPECS: &[EventSpec] = &[
+  spec("READY", "", false, &[]),
+  spec("PONG", "", false, &[]),
+  spec("EXITING", "", false, &[]),
+  spec("EXITED", "", false, &[]),
+  spec("RESET", "", false, &[]),
+  spec("INPUT_READY", "", false, &[]),
+  spec("POWER", "ON", false, &[]),
+  spec("POWER", "OFF", false, &[]),
+  spec("POWER_APPLIED", "ON", false, &[]),
+  spec("POWER_APPLIED", "OFF", false, &[]),
+  spec("FEATURE", "ON", false, &[]),
+  spec("FEATURE", "OFF", false, &[]),
+  spec("FIRING", "ON", false, &[]),
+  spec("FIRING", "OFF", false, &[]),
+  spec("SCAN_PROGRESS", "", false, &[2]),
+  spec("SENS_APPLIED", "", false, &[3]),
+  spec("REGISTERED", "", true, &[]),
+  spec("NOTIFY", "", true, &[]),
+  spec("INPUT_BACKLOG", "", false, &[0, 0, 0, 0]),
+  spec("REPLAY_DONE", "", false, &[0, 6, 0]),
+  spec("STATS", "", true, &[0, 2, 2, 2, 2]),
+  spec("STATS_DEVICE", "", true, &[0, 1]),
+  spec("STATS_END", "", false, &[]),
+  spec("HOOK_LAG", "", false, &[0, 0]),
+  spec("SCAN_DECIDED", "", false, &[1, 0, 0, 2]),
+  spec("STATS_SETTINGS", "", false, &[0, 0, 0, 0, 0]),
+];
+
+/// Decodes an event frame into the same kind/raw pair `parse_monitor_line` yields for
+/// the equivalent text line; `None` for malformed frames and unknown type codes.
+fn decode_monitor_frame(frame: &[u8]) -> Option<BackendEvent> {
+  if frame.len() < 3 || frame[0] != IPC_FRAME_VERSION {
+    return None;
+  }
+  let spec = EVENT_SPECS.get(frame[1] as usize)?;
+  let value_count = frame[2] as usize;
+  let mut offset = 3;
+  let mut values = Vec::with_capacity(value_count);
+  for _ in 0..value_count {
+    let bytes: [u8; 8] = frame.get(offset..offset + 8)?.try_into().ok()?;
+    values.push(f64::from_le_bytes(bytes));
+    offset += 8;
+  }
+  let text_len = u16::from_le_bytes(frame.get(offset..offset + 2)?.try_into().ok()?) as usize;
+  let text = String::from_utf8_lossy(frame.get(offset + 2..offset + 2 + text_len)?).into_owned();
+
+  let mut raw = String::from(spec.word);
+  if spec.text {
+    raw.push(' ');
+    raw.push_str(&text);
+  }
+  for (i, &decimals) in spec.decimals.iter().enumerate() {
+    let value = values.get(i).copied().unwrap_or(0.0);
+    raw.push_str(&format!(" {value:.decimals$}"));
+  }
+
+  Some(BackendEvent {
+    kind: spec.name.to_string(),
+    data: serde_json::json!({ "raw": raw.trim() }),
+  })
+}
+
 #[tauri::command]
 fn ui_load_state(app: tauri::AppHandle) -> Result<UiState, String> {
   let path = resolve_ui_state_path(&app)?;
@@ -335,35 +524,27 @@ fn backend_init(app: tauri::AppHandle, backend: State<'_, SharedBackendState>) -
 
 #[tauri::command]
 fn backend_set_power(backend: State<'_, SharedBackendState>, enabled: bool) -> Result<(), String> {
-  if enabled {
-    send_cmd(backend.inner(), "POWER ON")
-  } else {
-    send_cmd(backend.inner(), "POWER OFF")
-  }
+  send_cmd(backend.inner(), MonitorCommand::Power(enabled))
 }
 
 #[tauri::command]
 fn backend_set_feature(backend: State<'_, SharedBackendState>, enabled: bool) -> Result<(), String> {
-  if enabled {
-    send_cmd(backend.inner(), "FEATURE ON")
-  } else {
-    send_cmd(backend.inner(), "FEATURE OFF")
-  }
+  send_cmd(backend.inner(), MonitorCommand::Feature(enabled))
 }
 
 #[tauri::command]
 fn backend_set_sensitivity(backend: State<'_, SharedBackendState>, value: f64) -> Result<(), String> {
-  send_cmd(backend.inner(), &format!("SET_SENS {value}"))
+  send_cmd(backend.inner(), MonitorCommand::SetSens(value))
 }
 
 #[tauri::command]
 fn backend_full_reset(backend: State<'_, SharedBackendState>) -> Result<(), String> {
-  send_cmd(backend.inner(), "RESET")
+  send_cmd(backend.inner(), MonitorCommand::Reset)
 }
 
 #[tauri::command]
 fn backend_quit(backend: State<'_, SharedBackendState>) -> Result<(), String> {
-  send_cmd(backend.inner(), "QUIT")
+  send_cmd(backend.inner(), MonitorCommand::Quit)
 }
 
 fn main() {
@@ -393,3 +574,69 @@ fn main() {
     .run(tauri::generate_context!())
     .expect("error while running tauri application");
 }
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  fn event_frame(code: u8, values: &[f64], text: &str) -> Vec<u8> {
+    let mut frame = vec![IPC_FRAME_VERSION, code, values.len() as u8];
+    for value in values {
+      frame.extend_from_slice(&value.to_le_bytes());
+    }
+    frame.extend_from_slice(&(text.len() as u16).to_le_bytes());
+    frame.extend_from_slice(text.as_bytes());
+    frame
+  }
+
+  /// Every `EventKind` code with sample values and the line `FormatEventRecord` in
+  /// mouse_monitor.cpp prints for it; the frame must decode to what the line parses to.
+  #[test]
+  fn binary_frames_decode_like_text_lines() {
+    let cases: &[(u8, &[f64], &str, &str)] = &[
+      (0, &[], "", "EVT READY"),
+      (1, &[], "", "EVT PONG"),
+      (2, &[], "", "EVT EXITING"),
+      (3, &[], "", "EVT EXITED"),
+      (4, &[], "", "EVT RESET"),
+      (5, &[], "", "EVT INPUT_READY"),
+      (6, &[], "", "EVT POWER ON"),
+      (7, &[], "", "EVT POWER OFF"),
+      (8, &[], "", "EVT POWER_APPLIED ON"),
+      (9, &[], "", "EVT POWER_APPLIED OFF"),
+      (10, &[], "", "EVT FEATURE ON"),
+      (11, &[], "", "EVT FEATURE OFF"),
+      (12, &[], "", "EVT FIRING ON"),
+      (13, &[], "", "EVT FIRING OFF"),
+      (14, &[37.5], "", "EVT SCAN_PROGRESS 37.50"),
+      (15, &[1.25], "", "EVT SENS_APPLIED 1.250"),
+      (16, &[], "HID\\VID_046D&PID_C08B", "EVT REGISTERED HID\\VID_046D&PID_C08B"),
+      (17, &[], "ERR:writer failed", "EVT NOTIFY ERR:writer failed"),
+      (18, &[3.0, 128.0, 9000.0, 250000.0], "", "EVT INPUT_BACKLOG 3 128 9000 250000"),
+      (19, &[1000.0, 0.998877, 1001.2], "", "EVT REPLAY_DONE 1000 0.998877 1001"),
+      (
+        20,
+        &[1200.0, 12.34, 56.78, 90.12, 345.67],
+        "hook",
+        "EVT STATS hook 1200 12.34 56.78 90.12 345.67",
+      ),
+      (21, &[5000.0, 999.9], "dev1", "EVT STATS_DEVICE dev1 5000 999.9"),
+      (22, &[], "", "EVT STATS_END"),
+      (23, &[2.0, 17.0], "", "EVT HOOK_LAG 2 17"),
+      (24, &[812.3, 640.0, 2.0, 0.97], "", "EVT SCAN_DECIDED 812.3 640 2 0.97"),
+      (25, &[10.0, 4.0, 3.0, 2.0, 7.0], "", "EVT STATS_SETTINGS 10 4 3 2 7"),
+    ];
+    assert_eq!(cases.len(), EVENT_SPECS.len(), "every EventKind needs a case");
+
+    for (i, &(code, values, text, line)) in cases.iter().enumerate() {
+      assert_eq!(code as usize, i);
+      let decoded = decode_monitor_frame(&event_frame(code, values, text))
+        .unwrap_or_else(|| panic!("code {code} did not decode"));
+      let parsed = parse_monitor_line(line).unwrap();
+      assert_eq!(decoded.kind, parsed.kind, "code {code}");
+      assert_eq!(decoded.data, parsed.data, "code {code}");
+    }
+
+    assert!(decode_monitor_frame(&event_frame(EVENT_SPECS.len() as u8, &[], "")).is_none());
+  }
+}